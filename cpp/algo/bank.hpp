@@ -0,0 +1,147 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <stdexcept>
+#include <vector>
+#include "tensor.hpp"
+#include "correlate.hpp"
+#include "pool.hpp"
+
+//--------------
+// Filter banks
+//--------------
+
+/**
+  How the outputs of a filter bank are stored, in a single tensor.
+ */
+enum class BankLayout {
+  Planar,      //!< One volume after the other: shape {n * d0, d1, d2}.
+  Interleaved  //!< All responses of a voxel side by side: shape {d0, d1, d2 * n}.
+};
+
+/**
+  Allocate the output of a bank of n kernels over an input of the given shape.
+ */
+template <typename T>
+Tensor<T> make_bank_output(const Shape &shape, const size_t n, const BankLayout layout) {
+  if (layout == BankLayout::Planar)
+    return Tensor<T>(Shape{n * shape[0], shape[1], shape[2]});
+  return Tensor<T>(Shape{shape[0], shape[1], shape[2] * n});
+}
+
+/**
+  Response to kernel f, out of n, in a bank output.
+ */
+template <typename T>
+TensorView<T> bank_slice(const TensorView<T> &bank, const size_t f, const size_t n,
+                         const BankLayout layout) {
+  if (layout == BankLayout::Planar) {
+    const size_t d0 = bank.dim(0) / n;
+    return bank.slice(0, f * d0, (f + 1) * d0);
+  }
+  return bank.slice(2, f, bank.dim(2), n);
+}
+
+/**
+  Correlate one input with many kernels of the same shape, in a single pass.
+  Each tile of the input is read from memory once: every row of it is
+  correlated with all the kernels while it is still in L1: each kernel one
+  kernel row at a time over a row of accumulators (see fixed_row_acc and
+  sparse_row). Results are the same as correlate() with the fixed path on
+  3x3x3 and 5x5x5 kernels, and with the sparse path otherwise.
+  \param in Input tensor.
+  \param kernels Correlation kernels, all with the same shape.
+  \param outs One output per kernel, same shape as in: any views, e.g. from
+              bank_slice().
+  \param mode How the input is extended beyond its border.
+  \param cval Value of the samples outside the input, in constant mode.
+  \param threads Maximum number of threads (0: one per core).
+ */
+template <typename T>
+void correlate_bank(const TensorView<T> &in, const std::vector<Tensor<T>> &kernels,
+                    const std::vector<TensorView<T>> &outs, const Mode mode = Mode::Constant,
+                    const typename Tensor<T>::value_type cval = T(), const unsigned threads = 0) {
+  if (kernels.empty())
+    return;
+  if (outs.size() != kernels.size())
+    throw std::invalid_argument("correlate_bank: one output per kernel expected");
+  const Shape ks = kernels[0].shape();
+  for (size_t f = 0; f < kernels.size(); f++) {
+    if (kernels[f].shape() != ks)
+      throw std::invalid_argument("correlate_bank: kernels of different shapes");
+    if (outs[f].shape() != in.shape())
+      throw std::invalid_argument("correlate_bank: output shape mismatch");
+  }
+  const Boundary<T> bd(mode, cval, in.shape(), ks);
+  const Region interior = interior_of(in.shape(), ks);
+  const std::vector<Region> tiles = make_tiles(in.shape(), ks, sizeof(T));
+  // Dense 3x3x3 and 5x5x5 kernels go through the unrolled rows of the fixed
+  // path, any other through the tap lists of the sparse one.
+  const size_t fixed = (ks == Shape{3, 3, 3}) ? 3 : (ks == Shape{5, 5, 5}) ? 5 : 0;
+  std::vector<std::vector<Tap<T>>> taps;
+  std::vector<acc_t<T>> weights;
+  for (const Tensor<T> &k : kernels) {
+    taps.push_back(make_taps(k, in.strides()));
+    if (fixed == 3)
+      for (const acc_t<T> w : fixed_weights<3>(k))
+        weights.push_back(w);
+    if (fixed == 5)
+      for (const acc_t<T> w : fixed_weights<5>(k))
+        weights.push_back(w);
+  }
+  const size_t per_kernel = fixed * fixed * fixed;
+
+  parallel_for(tiles.size(), [&](size_t t) {
+    const Region &region = tiles[t];
+    const Region inner = interior.clip(region);
+    const size_t width = inner.empty() ? 0 : inner.hi[2] - inner.lo[2];
+    std::vector<acc_t<T>> acc(width);
+    const auto store = [&](const size_t f, const size_t i, const size_t j, const acc_t<T> *a) {
+      const TensorView<T> &out = outs[f];
+      T *q = &out(i, j, inner.lo[2]);
+      for (size_t x = 0; x < width; x++)
+        q[ptrdiff_t(x) * out.stride2()] = T(a[x]);
+    };
+    for (size_t i = inner.lo[0]; i < inner.hi[0]; i++)
+      for (size_t j = inner.lo[1]; j < inner.hi[1]; j++) {
+        const T *p = &in(i, j, inner.lo[2]);
+        for (size_t f = 0; f < taps.size(); f++) {
+          if (fixed == 3)
+            fixed_row_acc<3>(p, in.stride0(), in.stride1(), in.stride2(), &weights[f * per_kernel],
+                             acc.data(), width);
+          else if (fixed == 5)
+            fixed_row_acc<5>(p, in.stride0(), in.stride1(), in.stride2(), &weights[f * per_kernel],
+                             acc.data(), width);
+          else
+            sparse_row(p, in.stride2(), taps[f], acc.data(), width);
+          store(f, i, j, acc.data());
+        }
+      }
+    for_each_border(region, interior, [&](size_t i, size_t j, size_t l) {
+      for (size_t f = 0; f < taps.size(); f++) {
+        acc_t<T> v = 0;
+        for (const Tap<T> &tap : taps[f])
+          v += acc_t<T>(tap.weight) * acc_t<T>(bd.at(in, ptrdiff_t(i) + tap.di, ptrdiff_t(j) + tap.dj,
+                                                      ptrdiff_t(l) + tap.dk));
+        outs[f](i, j, l) = T(v);
+      }
+    });
+  }, threads);
+}
+
+/**
+  Filter bank into a single tensor, see make_bank_output() for its shape.
+ */
+template <typename T>
+Tensor<T> correlate_bank(const TensorView<T> &in, const std::vector<Tensor<T>> &kernels,
+                         const BankLayout layout, const Mode mode = Mode::Constant,
+                         const typename Tensor<T>::value_type cval = T(), const unsigned threads = 0) {
+  Tensor<T> bank = make_bank_output<T>(in.shape(), kernels.size(), layout);
+  std::vector<TensorView<T>> outs;
+  for (size_t f = 0; f < kernels.size(); f++)
+    outs.push_back(bank_slice<T>(bank, f, kernels.size(), layout));
+  correlate_bank(in, kernels, outs, mode, cval, threads);
+  return bank;
+}
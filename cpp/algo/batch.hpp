@@ -0,0 +1,267 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "tensor.hpp"
+#include "correlate.hpp"
+#include "pool.hpp"
+
+//---------
+// Batches
+//---------
+
+/**
+  Non-owning view of a batch of 3-D volumes of the same shape, that is a 4-D
+  tensor [batch, d0, d1, d2]. Volumes are batch_stride elements apart, and
+  each is strided as a TensorView.
+ */
+template <typename T>
+class BatchView {
+protected:
+  T *m_data = nullptr;
+  size_t m_batch = 0;
+  Shape m_shape = {0, 0, 0};
+  ptrdiff_t m_batch_stride = 0;
+  Strides m_strides = {0, 0, 0};
+
+public:
+  using value_type = T;
+
+  BatchView() = default;
+  BatchView(T *data, const size_t batch, const Shape &shape, const ptrdiff_t batch_stride,
+            const Strides &strides)
+    : m_data(data), m_batch(batch), m_shape(shape), m_batch_stride(batch_stride), m_strides(strides) {}
+
+  //! Packed, row-major view.
+  BatchView(T *data, const size_t batch, const Shape &shape)
+    : BatchView(data, batch, shape, ptrdiff_t(shape[0] * shape[1] * shape[2]),
+                {ptrdiff_t(shape[1] * shape[2]), ptrdiff_t(shape[2]), 1}) {}
+
+  //! Number of volumes.
+  size_t batch() const { return m_batch; }
+
+  //! Shape of each volume.
+  const Shape &shape() const { return m_shape; }
+
+  ptrdiff_t batch_stride() const { return m_batch_stride; }
+  const Strides &strides() const { return m_strides; }
+
+  //! First element of the first volume.
+  T *data() const { return m_data; }
+
+  //! Volume b.
+  TensorView<T> operator[](const size_t b) const {
+    return TensorView<T>(m_data + ptrdiff_t(b) * m_batch_stride, m_shape, m_strides);
+  }
+};
+
+/**
+  Batch of volumes owning its storage: one tensor {batch * d0, d1, d2}, with
+  the volumes one after the other (same layout as a C-contiguous numpy array
+  of shape [batch, d0, d1, d2]).
+ */
+template <typename T>
+class Batch : public BatchView<T> {
+private:
+  Tensor<T> m_storage;
+
+  void bind(const size_t batch, const Shape &shape) {
+    *static_cast<BatchView<T> *>(this) =
+        BatchView<T>(m_storage.data(), batch, shape, ptrdiff_t(shape[0]) * m_storage.stride0(),
+                     m_storage.strides());
+  }
+
+public:
+  Batch() = default;
+
+  /**
+    Allocate a batch, filling all its elements with the same value.
+    \param batch Number of volumes.
+    \param shape Shape of each volume.
+    \param fill Initial value.
+   */
+  Batch(const size_t batch, const Shape &shape, const T fill = T())
+    : m_storage(Shape{batch * shape[0], shape[1], shape[2]}, fill) {
+    bind(batch, shape);
+  }
+
+  Batch(const Batch &other) : m_storage(other.m_storage) { bind(other.batch(), other.shape()); }
+
+  Batch(Batch &&other) noexcept { swap(other); }
+
+  Batch &operator=(Batch other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  void swap(Batch &other) noexcept {
+    std::swap(*static_cast<BatchView<T> *>(this), *static_cast<BatchView<T> *>(&other));
+    m_storage.swap(other.m_storage);
+  }
+
+  //! View of the whole batch.
+  BatchView<T> view() const { return *this; }
+
+  //! All the volumes, stacked along axis 0.
+  const Tensor<T> &storage() const { return m_storage; }
+};
+
+
+//-----------------------
+// Batched correlation
+//-----------------------
+
+/**
+  How a batch is correlated.
+ */
+enum class BatchStrategy {
+  Auto,         //!< Interleaved for volumes up to BATCH_INTERLEAVE_VOXELS, PerVolume above.
+  Interleaved,  //!< Groups of volumes side by side, SIMD lanes across the batch.
+  PerVolume     //!< One correlate() per volume, volumes spread over threads.
+};
+
+/**
+  Volumes correlated together by the interleaved strategy: lanes of its
+  inner loop.
+ */
+const size_t BATCH_LANES = 16;
+
+/**
+  Largest volume, in voxels, the Auto strategy interleaves. Above it, the
+  group buffer no longer fits in cache, while the single volume paths have
+  long enough rows to vectorize and few border voxels (see
+  `bench_tensor batch`).
+ */
+const size_t BATCH_INTERLEAVE_VOXELS = 65536;
+
+/**
+  Interleaved strategy: each group of lanes volumes is copied, halo included,
+  in a buffer where the samples of all of them at the same voxel are side by
+  side: {e0, e1, e2 * lanes}, e = volume + halo. A kernel tap is then a
+  single offset in the buffer for the whole group, and every output row of
+  d2 voxels is one contiguous row of d2 * lanes accumulators, computed by
+  sparse_row() over all SIMD lanes however tiny d2 is. The halo is filled
+  from the boundary tables, so there is no border case left.
+ */
+template <typename T, typename O, typename C>
+void correlate_batch_interleaved(const BatchView<T> &in, const TensorView<T> &k, const BatchView<O> &out,
+                                 const C &cv, const Mode mode, const T cval, const unsigned threads) {
+  const Shape &s = in.shape();
+  const Shape &ks = k.shape();
+  const size_t lanes = std::min(BATCH_LANES, in.batch());
+  const Boundary<T> bd(mode, cval, s, ks);
+  const Shape e = {s[0] + ks[0] - 1, s[1] + ks[1] - 1, s[2] + ks[2] - 1};
+
+  // Input sample of each buffer voxel, as an offset in its volume (-1: cval).
+  std::vector<ptrdiff_t> src;
+  src.reserve(e[0] * e[1] * e[2]);
+  for (size_t a = 0; a < e[0]; a++)
+    for (size_t b = 0; b < e[1]; b++)
+      for (size_t c = 0; c < e[2]; c++) {
+        const ptrdiff_t i = bd(0, ptrdiff_t(a) - ptrdiff_t(bd.before[0]));
+        const ptrdiff_t j = bd(1, ptrdiff_t(b) - ptrdiff_t(bd.before[1]));
+        const ptrdiff_t l = bd(2, ptrdiff_t(c) - ptrdiff_t(bd.before[2]));
+        src.push_back((i < 0 || j < 0 || l < 0) ? -1 : i * in.strides()[0] + j * in.strides()[1] +
+                                                       l * in.strides()[2]);
+      }
+  const std::vector<Tap<T>> taps =
+      make_taps(k, Strides{ptrdiff_t(e[1] * e[2] * lanes), ptrdiff_t(e[2] * lanes), ptrdiff_t(lanes)});
+  const size_t width = s[2] * lanes;
+
+  // Several groups per task, to share the buffers.
+  const size_t groups = (in.batch() + lanes - 1) / lanes;
+  const size_t per_task = std::max<size_t>(1, std::min<size_t>(64, groups / (8 * WorkerPool::instance().size())));
+  parallel_for((groups + per_task - 1) / per_task, [&](size_t task) {
+    Tensor<T> buf(Shape{e[0], e[1], e[2] * lanes});
+    std::vector<acc_t<T>> acc(width);
+    for (size_t g = task * per_task; g < std::min(groups, (task + 1) * per_task); g++) {
+      const size_t first = g * lanes;
+      const size_t used = std::min(lanes, in.batch() - first);
+      T *q = buf.data();
+      for (const ptrdiff_t offset : src) {
+        const T *p = in.data() + ptrdiff_t(first) * in.batch_stride() + offset;
+        for (size_t n = 0; n < used; n++)
+          q[n] = (offset < 0) ? cval : p[ptrdiff_t(n) * in.batch_stride()];
+        q += lanes;
+      }
+      for (size_t i = 0; i < s[0]; i++)
+        for (size_t j = 0; j < s[1]; j++) {
+          sparse_row(&buf(i + bd.before[0], j + bd.before[1], bd.before[2] * lanes), 1, taps, acc.data(),
+                     width);
+          for (size_t n = 0; n < used; n++) {
+            O *r = &out[first + n](i, j, 0);
+            for (size_t x = 0; x < s[2]; x++)
+              r[ptrdiff_t(x) * out.strides()[2]] = cv(acc[x * lanes + n], i, j, x);
+          }
+        }
+    }
+  }, threads);
+}
+
+/**
+  Batched correlation into any output type, see correlate_batch() below.
+ */
+template <typename T, typename O, typename C>
+void correlate_batch_into(const BatchView<T> &in, const TensorView<T> &k, const BatchView<O> &out,
+                          const C &cv, const Mode mode, const T cval, BatchStrategy strategy,
+                          const unsigned threads) {
+  if (out.batch() != in.batch() || out.shape() != in.shape())
+    throw std::invalid_argument("correlate_batch: output shape mismatch");
+  const Shape &s = in.shape();
+  if (in.batch() == 0 || s[0] * s[1] * s[2] == 0)
+    return;
+  if (strategy == BatchStrategy::Auto)
+    strategy = (s[0] * s[1] * s[2] <= BATCH_INTERLEAVE_VOXELS) ? BatchStrategy::Interleaved
+                                                              : BatchStrategy::PerVolume;
+  if (strategy == BatchStrategy::Interleaved) {
+    correlate_batch_interleaved(in, k, out, cv, mode, cval, threads);
+    return;
+  }
+  // Enough volumes for every thread: one volume per task, each single-threaded.
+  // Otherwise volumes one at a time, each on all the threads.
+  const unsigned pool = (threads == 0) ? WorkerPool::instance().size() : threads;
+  if (in.batch() >= pool)
+    parallel_for(in.batch(), [&](size_t b) {
+      correlate_into(in[b], k, out[b], cv, mode, cval, CorrelatePath::Auto, 1);
+    }, threads);
+  else
+    for (size_t b = 0; b < in.batch(); b++)
+      correlate_into(in[b], k, out[b], cv, mode, cval, CorrelatePath::Auto, threads);
+}
+
+/**
+  Correlate every volume of a batch with the same kernel: out[b] is
+  correlate(in[b], k, mode, cval) for every b. Tiny volumes are correlated
+  in groups, vectorized across the batch (BatchStrategy::Interleaved);
+  larger ones go through correlate() one by one, spread over the threads.
+  Results are the same either way, but for the summation order of floating
+  point kernels.
+  \param in Input volumes.
+  \param k Correlation kernel.
+  \param out Output volumes, same batch size and shape as in. Throws
+             std::invalid_argument if not.
+  \param mode How each volume is extended beyond its border.
+  \param cval Value of the samples outside the volumes, in constant mode.
+  \param strategy How to split the work.
+  \param threads Maximum number of threads (0: one per core).
+ */
+template <typename T>
+void correlate_batch(const BatchView<T> &in, const TensorView<T> &k, const BatchView<T> &out,
+                     const Mode mode = Mode::Constant, const typename Tensor<T>::value_type cval = T(),
+                     const BatchStrategy strategy = BatchStrategy::Auto, const unsigned threads = 0) {
+  correlate_batch_into(in, k, out, Cast<T>(), mode, cval, strategy, threads);
+}
+
+template <typename T>
+Batch<T> correlate_batch(const BatchView<T> &in, const TensorView<T> &k, const Mode mode = Mode::Constant,
+                         const typename Tensor<T>::value_type cval = T(),
+                         const BatchStrategy strategy = BatchStrategy::Auto, const unsigned threads = 0) {
+  Batch<T> out(in.batch(), in.shape());
+  correlate_batch(in, k, out, mode, cval, strategy, threads);
+  return out;
+}
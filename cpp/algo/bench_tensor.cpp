@@ -0,0 +1,642 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "tensor.hpp"
+#include "correlate.hpp"
+#include "pool.hpp"
+#include "stream.hpp"
+#include "bank.hpp"
+#include "batch.hpp"
+#include "expr.hpp"
+
+using namespace std;
+
+/**
+  Best wall time of a few runs, in milliseconds.
+ */
+template <typename F>
+static double time_ms(F &&fn, const int reps = 3) {
+  double best = 1e300;
+  for (int r = 0; r < reps; r++) {
+    const auto start = chrono::steady_clock::now();
+    fn();
+    const chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    if (elapsed.count() < best)
+      best = elapsed.count();
+  }
+  return best;
+}
+
+template <typename T>
+static Tensor<T> random_tensor(const Shape &shape, const int lo, const int hi) {
+  mt19937 rng(1);
+  uniform_int_distribution<int> dist(lo, hi);
+  Tensor<T> t(shape);
+  for (size_t i = 0; i < t.size(); i++)
+    t.data()[i] = T(dist(rng));
+  return t;
+}
+
+static void report(const string &name, const CorrelatePath path, const double ms,
+                   const double generic_ms, const size_t voxels) {
+  cout << "  " << left << setw(12) << name << setw(10) << to_string(path)
+       << right << fixed << setprecision(2) << setw(10) << ms << " ms"
+       << setw(10) << voxels / ms / 1e3 << " Mvox/s"
+       << setw(8) << generic_ms / ms << "x" << endl;
+}
+
+/**
+  Generic path against each specialization, on kernels that enable them. The
+  kernel analysis must pick the fastest of them, or one within 10% of it.
+ */
+static void bench_paths(const size_t n) {
+  cout << "Kernel specializations, " << n << "^3 float input" << endl;
+  const Tensor<float> in = random_tensor<float>({n, n, n}, 0, 60);
+  Tensor<float> out(in.shape());
+
+  Tensor<float> cross(3, 3, 3);
+  cross(0, 1, 1) = cross(2, 1, 1) = cross(1, 0, 1) = cross(1, 2, 1) = 1;
+  cross(1, 1, 0) = cross(1, 1, 2) = cross(1, 1, 1) = 1;
+  Tensor<float> gauss(5, 5, 5);
+  const float g[5] = {0.06f, 0.24f, 0.4f, 0.24f, 0.06f};
+  for (size_t i = 0; i < 5; i++)
+    for (size_t j = 0; j < 5; j++)
+      for (size_t l = 0; l < 5; l++)
+        gauss(i, j, l) = g[i] * g[j] * g[l];
+  const struct {
+    string name;
+    Tensor<float> k;
+  } kernels[] = {
+    {"cross3", cross},
+    {"dense3", random_tensor<float>({3, 3, 3}, 1, 9)},
+    {"dense5", random_tensor<float>({5, 5, 5}, 1, 9)},
+    {"box3", Tensor<float>(3, 3, 3, 1.0f / 27)},
+    {"box5", Tensor<float>(5, 5, 5, 1.0f / 125)},
+    {"gauss5", gauss},
+  };
+  for (const auto &kern : kernels) {
+    const KernelInfo<float> info = analyze_kernel(kern.k);
+    const double generic = time_ms([&] { correlate(in, kern.k, out, Mode::Constant, 0, CorrelatePath::Generic); });
+    report(kern.name, CorrelatePath::Generic, generic, generic, in.size());
+    CorrelatePath fastest = CorrelatePath::Generic;
+    double fastest_ms = generic, picked_ms = generic;
+    for (CorrelatePath p : {CorrelatePath::Sparse, CorrelatePath::Box,
+                            CorrelatePath::Separable, CorrelatePath::Fixed}) {
+      if ((p == CorrelatePath::Box && !info.box) ||
+          (p == CorrelatePath::Separable && !info.separable) ||
+          (p == CorrelatePath::Fixed && kern.k.dim(0) != 3 && kern.k.dim(0) != 5))
+        continue;
+      const double ms = time_ms([&] { correlate(in, kern.k, out, Mode::Constant, 0, p); });
+      report(kern.name, p, ms, generic, in.size());
+      if (p == info.best)
+        picked_ms = ms;
+      if (ms < fastest_ms) {
+        fastest = p;
+        fastest_ms = ms;
+      }
+    }
+    cout << "  " << kern.name << ": auto picks " << to_string(info.best) << ", fastest is "
+         << to_string(fastest) << (picked_ms <= 1.1 * fastest_ms ? "" : "  <- mispredicted") << endl;
+  }
+}
+
+/**
+  Strong scaling: same volume, 1 to all cores.
+ */
+static void bench_scaling(const size_t n) {
+  const unsigned cores = WorkerPool::instance().size();
+  cout << "Strong scaling, " << n << "^3 float input, dense 3x3x3 kernel, "
+       << cores << " cores" << endl;
+  const Tensor<float> in = random_tensor<float>({n, n, n}, 0, 60);
+  const Tensor<float> k = random_tensor<float>({3, 3, 3}, 1, 9);
+  Tensor<float> out(in.shape());
+  double base = 0;
+  for (unsigned th = 1; th <= cores; th = (th < cores && 2 * th > cores) ? cores : 2 * th) {
+    const double ms = time_ms([&] { correlate(in, k, out, Mode::Constant, 0, CorrelatePath::Fixed, th); }, 2);
+    if (th == 1)
+      base = ms;
+    cout << "  " << setw(3) << th << " threads " << fixed << setprecision(2) << setw(10)
+         << ms << " ms" << setw(8) << base / ms << "x speedup" << setw(8)
+         << 100 * base / ms / th << "% efficiency" << endl;
+    if (th == cores)
+      break;
+  }
+}
+
+/**
+  Direct against FFT for growing dense kernels: the cost model must pick the
+  faster one, except close to the crossover.
+ */
+static void bench_crossover(const size_t n) {
+  cout << "Direct/FFT crossover, " << n << "^3 float input, dense kernels" << endl;
+  const Tensor<float> in = random_tensor<float>({n, n, n}, 0, 60);
+  Tensor<float> out(in.shape());
+  int agree = 0, total = 0;
+  for (size_t ks = 3; ks <= 21; ks += 2) {
+    const Tensor<float> k = random_tensor<float>({ks, ks, ks}, 1, 9);
+    const KernelInfo<float> info = analyze_kernel(k);
+    const double direct = time_ms([&] { correlate(in, k, out, Mode::Constant, 0, info.best, 1); }, 1);
+    const double fft = time_ms([&] { correlate(in, k, out, Mode::Constant, 0, CorrelatePath::FFT, 1); }, 1);
+    const double est_direct = path_cost(info.best, info, in.shape(), k.shape()) / 1e6;
+    const double est_fft = path_cost(CorrelatePath::FFT, info, in.shape(), k.shape()) / 1e6;
+    const CorrelatePath picked = select_path(info, in.shape(), k.shape());
+    const bool right = (picked == CorrelatePath::FFT) == (fft < direct);
+    agree += right;
+    total++;
+    cout << "  k=" << setw(2) << ks << " " << setw(9) << to_string(info.best) << fixed << setprecision(1)
+         << setw(10) << direct << " ms (est " << setw(8) << est_direct << ")"
+         << "   fft" << setw(10) << fft << " ms (est " << setw(8) << est_fft << ")"
+         << "   model picks " << setw(6) << to_string(picked) << (right ? "" : "  <- mispredicted") << endl;
+    if (direct > 60e3)
+      break;
+  }
+  cout << "  model agrees on " << agree << "/" << total << " kernel sizes" << endl;
+}
+
+/**
+  Run fn in a child process: returns its wall time (ms), and its peak RSS (MB).
+ */
+template <typename F>
+static pair<double, double> run_isolated(F &&fn) {
+  const auto start = chrono::steady_clock::now();
+  const pid_t pid = fork();
+  if (pid == 0) {
+    fn();
+    _exit(0);
+  }
+  int status = 0;
+  struct rusage ru;
+  wait4(pid, &status, 0, &ru);
+  const chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+  return {elapsed.count(), ru.ru_maxrss / 1024.0};
+}
+
+/**
+  Streaming against in-memory correlation, between two volume files.
+ */
+static void bench_stream(const size_t n) {
+  cout << "Out-of-core correlation, " << n << "^3 float volume files, dense 3x3x3 kernel" << endl;
+  const string in_path = "/tmp/bench_tensor_in.vol", out_path = "/tmp/bench_tensor_out.vol";
+  {
+    // Generated plane by plane, not to hold the volume in memory.
+    MappedVolume vol = MappedVolume::create(in_path, DType<float>::code, sizeof(float), {n, n, n});
+    mt19937 rng(1);
+    float *p = vol.data<float>();
+    for (size_t i = 0; i < n; i++) {
+      for (size_t j = 0; j < n * n; j++)
+        p[i * n * n + j] = float(rng() % 61);
+      vol.release(i * n * n * sizeof(float), n * n * sizeof(float));
+    }
+  }
+  const Tensor<float> k = random_tensor<float>({3, 3, 3}, 1, 9);
+  const double mb = double(n) * n * n * sizeof(float) / (1 << 20);
+  const auto mem = run_isolated([&] {
+    const Tensor<float> in = read_volume<float>(in_path);
+    write_volume(out_path, correlate(in, k));
+  });
+  const auto str = run_isolated([&] { correlate_stream(in_path, out_path, k); });
+  cout << "  volume " << fixed << setprecision(1) << mb << " MB" << endl;
+  cout << "  in-memory " << setw(10) << mem.first << " ms" << setw(10) << mb / mem.first * 1e3
+       << " MB/s   peak RSS " << setw(8) << mem.second << " MB" << endl;
+  cout << "  streaming " << setw(10) << str.first << " ms" << setw(10) << mb / str.first * 1e3
+       << " MB/s   peak RSS " << setw(8) << str.second << " MB" << endl;
+  remove(in_path.c_str());
+  remove(out_path.c_str());
+}
+
+/**
+  Same kernel in every boundary mode: only the thin border should differ.
+ */
+static void bench_modes(const size_t n) {
+  cout << "Boundary modes, " << n << "^3 float input" << endl;
+  const Tensor<float> in = random_tensor<float>({n, n, n}, 0, 60);
+  Tensor<float> out(in.shape());
+  const Tensor<float> k3 = random_tensor<float>({3, 3, 3}, 1, 9);
+  const Tensor<float> k5 = random_tensor<float>({5, 5, 5}, 1, 9);
+  for (const Mode mode : {Mode::Constant, Mode::Reflect, Mode::Mirror, Mode::Nearest, Mode::Wrap}) {
+    const double fixed3 = time_ms([&] { correlate(in, k3, out, mode, 0, CorrelatePath::Fixed); });
+    const double sparse5 = time_ms([&] { correlate(in, k5, out, mode, 0, CorrelatePath::Sparse); });
+    const double generic3 = time_ms([&] { correlate(in, k3, out, mode, 0, CorrelatePath::Generic); }, 1);
+    cout << "  " << left << setw(10) << to_string(mode) << right << fixed << setprecision(2)
+         << "  fixed 3^3 " << setw(8) << fixed3 << " ms   taps 5^3 " << setw(8) << sparse5
+         << " ms   generic 3^3 " << setw(8) << generic3 << " ms" << endl;
+  }
+}
+
+/**
+  Filtering pipeline (smooth, edges, box), with and without an arena for its
+  temporaries; then packed against padded rows.
+ */
+static void bench_arena(const size_t n) {
+  cout << "Tensor storage, " << n << "^3 float input, 3-step pipeline x 10" << endl;
+  const Tensor<float> in = random_tensor<float>({n, n, n}, 0, 60);
+  Tensor<float> gauss(3, 3, 3), edges = random_tensor<float>({3, 3, 3}, -4, 4);
+  const float g[3] = {0.25f, 0.5f, 0.25f};
+  for (size_t i = 0; i < 3; i++)
+    for (size_t j = 0; j < 3; j++)
+      for (size_t l = 0; l < 3; l++)
+        gauss(i, j, l) = g[i] * g[j] * g[l];
+  const Tensor<float> box(3, 3, 3, 1.0f / 27);
+  const auto pipeline = [&] {
+    for (int r = 0; r < 10; r++)
+      correlate(correlate(correlate(in, gauss), edges), box);
+  };
+  size_t allocs = aligned_allocations();
+  const double plain = time_ms(pipeline);
+  const size_t plain_allocs = aligned_allocations() - allocs;
+  Arena arena;
+  double pooled;
+  size_t pooled_allocs;
+  {
+    ArenaScope scope(arena);
+    allocs = aligned_allocations();
+    pooled = time_ms(pipeline);
+    pooled_allocs = aligned_allocations() - allocs;
+  }
+  cout << "  " << left << setw(10) << "system" << right << fixed << setprecision(2) << setw(10)
+       << plain << " ms" << setw(8) << plain_allocs << " allocations" << endl;
+  cout << "  " << left << setw(10) << "arena" << right << setw(10) << pooled << " ms" << setw(8)
+       << pooled_allocs << " allocations (" << arena.hits() << " reused)" << endl;
+
+  // Odd row length, so that packed rows are misaligned.
+  const Shape odd = {n, n, n + 3};
+  const Tensor<float> packed = random_tensor<float>(odd, 0, 60);
+  const Tensor<float> padded(packed.view(), Layout::Padded);
+  Tensor<float> out(odd), out_padded(odd, Layout::Padded);
+  const Tensor<float> k = random_tensor<float>({3, 3, 3}, 1, 9);
+  const double t_packed = time_ms([&] { correlate(packed, k, out, Mode::Constant, 0, CorrelatePath::Fixed); });
+  const double t_padded = time_ms([&] { correlate(padded, k, out_padded, Mode::Constant, 0, CorrelatePath::Fixed); });
+  cout << "  fixed 3^3 on " << n << "x" << n << "x" << n + 3 << ": packed " << setw(8) << t_packed
+       << " ms   padded " << setw(8) << t_padded << " ms" << endl;
+}
+
+/**
+  8 and 16-bit data against 32-bit, same values (0-60) and kernels.
+ */
+static void bench_quant(const size_t n) {
+  cout << "Quantized correlation, " << n << "^3 input, values 0-60" << endl;
+  const Tensor<int32_t> in32 = random_tensor<int32_t>({n, n, n}, 0, 60);
+  const Tensor<uint8_t> in8 = random_tensor<uint8_t>({n, n, n}, 0, 60);
+  const Tensor<int16_t> in16 = random_tensor<int16_t>({n, n, n}, 0, 60);
+  Tensor<int32_t> out32(in32.shape());
+  Tensor<int16_t> out16(in32.shape());
+  Tensor<uint8_t> out8(in32.shape());
+  // Back to 8 bits: scaled by 1/16.
+  const Requantize rq{1, 4, 0, true};
+  const struct {
+    string name;
+    CorrelatePath path;
+    Shape shape;
+    int lo, hi;
+  } kernels[] = {
+    {"dense3", CorrelatePath::Fixed, {3, 3, 3}, 1, 9},
+    {"dense5", CorrelatePath::Sparse, {5, 5, 5}, 0, 3},
+    {"box5", CorrelatePath::Box, {5, 5, 5}, 1, 1},
+  };
+  for (const auto &kern : kernels) {
+    const Tensor<int32_t> k32 = random_tensor<int32_t>(kern.shape, kern.lo, kern.hi);
+    const Tensor<uint8_t> k8 = random_tensor<uint8_t>(kern.shape, kern.lo, kern.hi);
+    const Tensor<int16_t> k16 = random_tensor<int16_t>(kern.shape, kern.lo, kern.hi);
+    const CorrelatePath p = kern.path;
+    const double t32 = time_ms([&] { correlate(in32, k32, out32, Mode::Constant, 0, p); });
+    const double t16 = time_ms([&] { correlate(in16, k16, out16, Mode::Constant, 0, p); });
+    const double t8_16 = time_ms([&] { correlate(in8, k8, out16, Requantize(), Mode::Constant, 0, p); });
+    const double t8_8 = time_ms([&] { correlate(in8, k8, out8, rq, Mode::Constant, 0, p); });
+    const struct {
+      const char *name;
+      double ms;
+    } rows[] = {{"i32->i32", t32}, {"i16->i16", t16}, {"u8->i16", t8_16}, {"u8->u8 rq", t8_8}};
+    for (const auto &r : rows)
+      cout << "  " << left << setw(8) << kern.name << setw(10) << to_string(p) << setw(10) << r.name
+           << right << fixed << setprecision(2) << setw(10) << r.ms << " ms" << setw(10)
+           << in32.size() / r.ms / 1e3 << " Mvox/s" << setw(8) << t32 / r.ms << "x" << endl;
+  }
+}
+
+/**
+  Filter bank of dense 3x3x3 kernels against one correlation per kernel.
+ */
+static void bench_bank(const size_t n) {
+  cout << "Filter bank, " << n << "^3 float input, dense 3x3x3 kernels" << endl;
+  const Tensor<float> in = random_tensor<float>({n, n, n}, 0, 60);
+  for (const size_t count : {8, 16, 32}) {
+    vector<Tensor<float>> kernels;
+    for (size_t f = 0; f < count; f++) {
+      Tensor<float> kern = random_tensor<float>({3, 3, 3}, 1, 9);
+      kern(0, 0, 0) = float(f);  // Not all the same kernel.
+      kernels.push_back(kern);
+    }
+    double ms[3];
+    int r = 0;
+    for (const BankLayout layout : {BankLayout::Planar, BankLayout::Planar, BankLayout::Interleaved}) {
+      const Tensor<float> bank = make_bank_output<float>(in.shape(), count, layout);
+      vector<TensorView<float>> outs;
+      for (size_t f = 0; f < count; f++)
+        outs.push_back(bank_slice(bank.view(), f, count, layout));
+      if (r == 0)
+        ms[r++] = time_ms([&] {
+          for (size_t f = 0; f < count; f++)
+            correlate(in, kernels[f], outs[f], Mode::Constant, 0, CorrelatePath::Fixed);
+        }, 2);
+      else
+        ms[r++] = time_ms([&] { correlate_bank(in, kernels, outs); }, 2);
+    }
+    const double single = ms[0], fused = ms[1], inter = ms[2];
+    cout << "  " << setw(2) << count << " kernels: one by one " << fixed << setprecision(2)
+         << setw(9) << single << " ms   bank planar " << setw(9) << fused << " ms ("
+         << setprecision(2) << single / fused << "x)   interleaved " << setw(9) << inter
+         << " ms (" << single / inter << "x)" << endl;
+  }
+}
+
+/**
+  Volumes per second on batches of 5x4x3 volumes (the test_tensor.py input),
+  one correlate() per volume against each batch strategy. Then both
+  strategies on larger volumes, to place BATCH_INTERLEAVE_VOXELS.
+ */
+static void bench_batch() {
+  const Tensor<int> cross = {{{0, 0, 0}, {0, 1, 0}, {0, 0, 0}},
+                             {{0, 1, 0}, {1, 1, 1}, {0, 1, 0}},
+                             {{0, 0, 0}, {0, 1, 0}, {0, 0, 0}}};
+  const Shape small = {5, 4, 3};
+  cout << "Batched correlation, 5x4x3 int volumes, 3x3x3 cross kernel (volumes/s)" << endl;
+  cout << "  " << setw(8) << "batch" << setw(14) << "one by one" << setw(14) << "interleaved"
+       << setw(14) << "per volume" << endl;
+  for (const size_t n : {1, 10, 100, 1000, 10000, 100000}) {
+    Tensor<int> storage = random_tensor<int>({n * small[0], small[1], small[2]}, 0, 60);
+    const BatchView<int> in(storage.data(), n, small);
+    Batch<int> out(n, small);
+    const int reps = int(max<size_t>(2, 20000 / n));
+    const double single = time_ms([&] {
+      for (size_t b = 0; b < n; b++)
+        correlate(in[b], cross, out[b]);
+    }, reps);
+    const double inter = time_ms([&] {
+      correlate_batch(in, cross, out, Mode::Constant, 0, BatchStrategy::Interleaved);
+    }, reps);
+    const double per = time_ms([&] {
+      correlate_batch(in, cross, out, Mode::Constant, 0, BatchStrategy::PerVolume);
+    }, reps);
+    cout << "  " << setw(8) << n << scientific << setprecision(2) << setw(14) << n / single * 1e3
+         << setw(14) << n / inter * 1e3 << setw(14) << n / per * 1e3 << endl;
+  }
+  cout << defaultfloat;
+
+  cout << "Batched correlation, float cubes, dense 3x3x3 kernel, 2^22 voxels in all" << endl;
+  const Tensor<float> kern = random_tensor<float>({3, 3, 3}, 1, 9);
+  for (const size_t d : {4, 8, 16, 32, 48, 64, 96}) {
+    const Shape shape = {d, d, d};
+    const size_t n = max<size_t>(1, (size_t(1) << 22) / (d * d * d));
+    Tensor<float> storage = random_tensor<float>({n * d, d, d}, 0, 60);
+    const BatchView<float> in(storage.data(), n, shape);
+    Batch<float> out(n, shape);
+    const double inter = time_ms([&] {
+      correlate_batch(in, kern, out, Mode::Constant, 0, BatchStrategy::Interleaved);
+    });
+    const double per = time_ms([&] {
+      correlate_batch(in, kern, out, Mode::Constant, 0, BatchStrategy::PerVolume);
+    });
+    cout << "  " << setw(2) << d << "^3 x " << setw(6) << n << ": interleaved " << fixed << setprecision(2)
+         << setw(8) << inter << " ms   per volume " << setw(8) << per << " ms (" << per / inter << "x)"
+         << defaultfloat << endl;
+  }
+}
+
+/**
+  Correlation followed by a 4-operation chain (scale, offset by a tensor,
+  clamp, threshold), one pass per operation against a fused expression. Then
+  the same chain without the correlation.
+ */
+static void bench_expr(const size_t n) {
+  cout << "Expression fusion, " << n << "^3 float input, dense 3x3x3 kernel" << endl;
+  const Tensor<float> in = random_tensor<float>({n, n, n}, 0, 60);
+  const Tensor<float> bias = random_tensor<float>({n, n, n}, -100, 100);
+  const Tensor<float> kern = random_tensor<float>({3, 3, 3}, 1, 9);
+  Tensor<float> out(in.shape()), tmp(in.shape());
+  const double unfused = time_ms([&] {
+    correlate(in, kern, tmp);
+    evaluate(tmp * 0.01f, tmp);
+    evaluate(tmp + bias, tmp);
+    evaluate(clamp(tmp, 0, 50), tmp);
+    evaluate(threshold(tmp, 20.0f), out);
+  });
+  const double fused = time_ms([&] {
+    evaluate(threshold(clamp(correlation(in, kern) * 0.01f + bias, 0, 50), 20.0f), out);
+  });
+  const double correlate_only = time_ms([&] { correlate(in, kern, out); });
+  cout << fixed << setprecision(2) << "  correlate + 4 ops: unfused " << setw(8) << unfused
+       << " ms   fused " << setw(8) << fused << " ms (" << unfused / fused << "x)   correlate alone "
+       << setw(8) << correlate_only << " ms" << endl;
+  const double ops_unfused = time_ms([&] {
+    evaluate(in * 0.01f, tmp);
+    evaluate(tmp + bias, tmp);
+    evaluate(clamp(tmp, 0, 50), tmp);
+    evaluate(threshold(tmp, 20.0f), out);
+  });
+  const double ops_fused = time_ms([&] {
+    evaluate(threshold(clamp(in * 0.01f + bias, 0, 50), 20.0f), out);
+  });
+  cout << "  4 ops alone:       unfused " << setw(8) << ops_unfused << " ms   fused " << setw(8)
+       << ops_fused << " ms (" << ops_unfused / ops_fused << "x)" << defaultfloat << endl;
+}
+
+//--------------------------
+// Performance regressions
+//--------------------------
+
+/**
+  Regression suite: one fixed case per path and feature, single-threaded so
+  that results depend neither on the number of cores nor much on the load.
+  \return Throughput of each case, in output voxels per second.
+ */
+static map<string, double> perf_suite(void) {
+  const size_t n = 96, voxels = n * n * n;
+  Tensor<float> in = random_tensor<float>({n, n, n}, 0, 60);
+  const Tensor<float> dense3 = random_tensor<float>({3, 3, 3}, 1, 9);
+  const Tensor<float> dense9 = random_tensor<float>({9, 9, 9}, 1, 9);
+  const Tensor<float> box5(5, 5, 5, 1.0f / 125);
+  Tensor<float> cross(3, 3, 3), gauss(5, 5, 5);
+  cross(0, 1, 1) = cross(2, 1, 1) = cross(1, 0, 1) = cross(1, 2, 1) = 1;
+  cross(1, 1, 0) = cross(1, 1, 2) = cross(1, 1, 1) = 1;
+  const float g[5] = {0.06f, 0.24f, 0.4f, 0.24f, 0.06f};
+  for (size_t i = 0; i < 5; i++)
+    for (size_t j = 0; j < 5; j++)
+      for (size_t l = 0; l < 5; l++)
+        gauss(i, j, l) = g[i] * g[j] * g[l];
+  Tensor<float> out(in.shape());
+
+  map<string, double> results;
+  // Each sample lasts at least 20 ms, so that short cases are not all noise.
+  const auto run = [&](const string &name, const size_t count, auto &&fn) {
+    const int iters = int(max(1.0, ceil(20 / time_ms(fn, 1))));
+    results[name] = double(count) * iters / time_ms([&] {
+      for (int it = 0; it < iters; it++)
+        fn();
+    }, 5) * 1e3;
+  };
+  const auto path = [&](const string &name, const Tensor<float> &k, const CorrelatePath p,
+                        const Mode mode = Mode::Constant) {
+    run(name, voxels, [&] { correlate(in, k, out, mode, 0, p, 1); });
+  };
+  path("generic_dense3", dense3, CorrelatePath::Generic);
+  path("sparse_cross3", cross, CorrelatePath::Sparse);
+  path("fixed_dense3", dense3, CorrelatePath::Fixed);
+  path("fixed_dense3_reflect", dense3, CorrelatePath::Fixed, Mode::Reflect);
+  path("box5", box5, CorrelatePath::Box);
+  path("separable_gauss5", gauss, CorrelatePath::Separable);
+  path("fft_dense9", dense9, CorrelatePath::FFT);
+
+  const Tensor<uint8_t> in8 = random_tensor<uint8_t>({n, n, n}, 0, 255);
+  const Tensor<uint8_t> k8 = random_tensor<uint8_t>({3, 3, 3}, 0, 15);
+  Tensor<int16_t> out16(in.shape());
+  run("quant_u8_dense3", voxels, [&] {
+    correlate(in8, k8, out16, Requantize{1, 4, 0}, Mode::Constant, 0, CorrelatePath::Auto, 1);
+  });
+
+  vector<Tensor<float>> kernels(8, dense3);
+  const Tensor<float> bank = make_bank_output<float>(in.shape(), kernels.size(), BankLayout::Planar);
+  vector<TensorView<float>> outs;
+  for (size_t f = 0; f < kernels.size(); f++)
+    outs.push_back(bank_slice(bank.view(), f, kernels.size(), BankLayout::Planar));
+  run("bank8_dense3", voxels * kernels.size(), [&] {
+    correlate_bank(in, kernels, outs, Mode::Constant, 0, 1);
+  });
+
+  const Shape small = {8, 8, 8};
+  const size_t batch = voxels / (8 * 8 * 8);
+  const BatchView<float> in_batch(in.data(), batch, small);
+  Batch<float> out_batch(batch, small);
+  run("batch_8cubed_dense3", voxels, [&] {
+    correlate_batch(in_batch, dense3, out_batch, Mode::Constant, 0, BatchStrategy::Interleaved, 1);
+  });
+
+  run("expr_fused_dense3", voxels, [&] {
+    evaluate(threshold(clamp(correlation(in, dense3) * 0.01f + in, 0, 50), 20.0f), out, 1);
+  });
+  return results;
+}
+
+static void write_json(const string &path, const map<string, double> &results) {
+  ofstream f(path);
+  f << "{\n  \"unit\": \"voxels/s\",\n  \"results\": {";
+  const char *sep = "\n";
+  for (const auto &r : results) {
+    f << sep << "    \"" << r.first << "\": " << scientific << setprecision(4) << r.second;
+    sep = ",\n";
+  }
+  f << "\n  }\n}\n";
+  if (!f)
+    throw runtime_error("bench_tensor: cannot write " + path);
+}
+
+/**
+  Results of a file written by write_json(): the "name": number pairs of its
+  "results" object.
+ */
+static map<string, double> read_json(const string &path) {
+  ifstream f(path);
+  if (!f)
+    throw runtime_error("bench_tensor: cannot read " + path);
+  stringstream ss;
+  ss << f.rdbuf();
+  const string s = ss.str();
+  map<string, double> results;
+  size_t p = s.find("\"results\"");
+  if (p == string::npos || (p = s.find('{', p)) == string::npos)
+    throw runtime_error("bench_tensor: no results in " + path);
+  const size_t end = s.find('}', p);
+  while ((p = s.find('"', p + 1)) < end) {
+    const size_t q = s.find('"', p + 1);
+    const size_t colon = s.find(':', q);
+    if (q >= end || colon >= end)
+      throw runtime_error("bench_tensor: malformed " + path);
+    results[s.substr(p + 1, q - p - 1)] = strtod(s.c_str() + colon + 1, NULL);
+    p = s.find_first_of(",}", colon);
+  }
+  return results;
+}
+
+/**
+  Run the regression suite, write its results to out_path, and compare them
+  with a baseline (if any) written the same way.
+  \param threshold Largest tolerated relative drop of throughput, e.g. 0.25.
+  \return false if any case is slower than (1 - threshold) times its
+          baseline, or missing.
+ */
+static bool bench_perf(const string &out_path, const string &baseline_path, const double threshold) {
+  const map<string, double> results = perf_suite();
+  write_json(out_path, results);
+  cout << "Performance regressions, single thread (Mvox/s), results in " << out_path << endl;
+  if (baseline_path.empty()) {
+    for (const auto &r : results)
+      cout << "  " << left << setw(24) << r.first << right << fixed << setprecision(2)
+           << setw(10) << r.second / 1e6 << defaultfloat << endl;
+    return true;
+  }
+  bool ok = true;
+  for (const auto &b : read_json(baseline_path)) {
+    const auto r = results.find(b.first);
+    cout << "  " << left << setw(24) << b.first << right << fixed << setprecision(2) << setw(10)
+         << b.second / 1e6;
+    if (r == results.end()) {
+      cout << "  missing" << endl;
+      ok = false;
+      continue;
+    }
+    const double ratio = r->second / b.second;
+    cout << setw(10) << r->second / 1e6 << setw(8) << ratio << "x"
+         << (ratio < 1 - threshold ? "  REGRESSED" : "") << defaultfloat << endl;
+    ok = ok && ratio >= 1 - threshold;
+  }
+  if (!ok)
+    cout << "Throughput dropped by more than " << threshold * 100 << "% (baseline "
+         << baseline_path << ")" << endl;
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  const string what = (argc > 1) ? argv[1] : "all";
+  // bench_tensor perf OUT.json [BASELINE.json [THRESHOLD]]
+  if (what == "perf")
+    return bench_perf((argc > 2) ? argv[2] : "perf.json", (argc > 3) ? argv[3] : "",
+                      (argc > 4) ? strtod(argv[4], NULL) : 0.25) ? 0 : 1;
+  const size_t n = (argc > 2) ? strtoul(argv[2], NULL, 10) : 128;
+  if (what == "all" || what == "paths")
+    bench_paths(n);
+  if (what == "all" || what == "scaling")
+    bench_scaling(n);
+  if (what == "all" || what == "modes")
+    bench_modes(n);
+  if (what == "all" || what == "crossover")
+    bench_crossover(n);
+  if (what == "all" || what == "stream")
+    bench_stream(n);
+  if (what == "all" || what == "arena")
+    bench_arena(n);
+  if (what == "all" || what == "quant")
+    bench_quant(n);
+  if (what == "all" || what == "bank")
+    bench_bank(n);
+  if (what == "all" || what == "batch")
+    bench_batch();
+  if (what == "all" || what == "expr")
+    bench_expr(n);
+  return 0;
+}
@@ -0,0 +1,123 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include "capi.h"
+#include "tensor.hpp"
+#include "correlate.hpp"
+
+using namespace std;
+
+static_assert(TENSOR_MODE_WRAP == int(Mode::Wrap), "Mode codes out of sync");
+static_assert(TENSOR_PATH_FFT == int(CorrelatePath::FFT), "Path codes out of sync");
+
+static thread_local string last_error;
+
+/**
+  View of a borrowed array, strides converted from bytes to elements.
+ */
+template <typename T>
+static TensorView<T> view_of(const tensor_array &a) {
+  Strides s;
+  for (int i = 0; i < 3; i++) {
+    if (a.strides[i] % int64_t(sizeof(T)) != 0)
+      throw invalid_argument("tensor: stride not a multiple of the element size");
+    s[i] = ptrdiff_t(a.strides[i] / int64_t(sizeof(T)));
+  }
+  return TensorView<T>(static_cast<T *>(a.data), {size_t(a.shape[0]), size_t(a.shape[1]), size_t(a.shape[2])}, s);
+}
+
+/**
+  Call fn with a value of the element type of a dtype code.
+ */
+template <typename F>
+static void with_dtype(const int32_t dtype, F &&fn) {
+  switch (dtype) {
+  case TENSOR_UINT8: fn(uint8_t()); break;
+  case TENSOR_INT8: fn(int8_t()); break;
+  case TENSOR_UINT16: fn(uint16_t()); break;
+  case TENSOR_INT16: fn(int16_t()); break;
+  case TENSOR_INT32: fn(int32_t()); break;
+  case TENSOR_INT64: fn(int64_t()); break;
+  case TENSOR_FLOAT32: fn(float()); break;
+  case TENSOR_FLOAT64: fn(double()); break;
+  default: throw invalid_argument("tensor: unknown dtype");
+  }
+}
+
+/**
+  Run fn, turning exceptions into error codes.
+ */
+template <typename F>
+static int guarded(F &&fn) {
+  try {
+    return fn();
+  }
+  catch (const invalid_argument &e) {
+    last_error = e.what();
+    return TENSOR_EINVAL;
+  }
+  catch (const exception &e) {
+    last_error = e.what();
+    return TENSOR_EFAIL;
+  }
+  catch (...) {
+    last_error = "unknown error";
+    return TENSOR_EFAIL;
+  }
+}
+
+static void check_kernel(const tensor_array *in, const tensor_array *k) {
+  if (!in || !k || !in->data || !k->data)
+    throw invalid_argument("tensor: null array");
+  if (k->dtype != in->dtype)
+    throw invalid_argument("tensor: kernel and input of different dtypes");
+}
+
+extern "C" int tensor_correlate(const tensor_array *in, const tensor_array *k, const tensor_array *out,
+                                const int mode, const double cval, const int path, const unsigned threads) {
+  return guarded([&] {
+    check_kernel(in, k);
+    if (!out || !out->data)
+      throw invalid_argument("tensor: null array");
+    if (out->dtype != in->dtype)
+      throw invalid_argument("tensor: output and input of different dtypes");
+    if (mode < TENSOR_MODE_CONSTANT || mode > TENSOR_MODE_WRAP)
+      throw invalid_argument("tensor: unknown mode");
+    if (path < TENSOR_PATH_AUTO || path > TENSOR_PATH_FFT)
+      throw invalid_argument("tensor: unknown path");
+    with_dtype(in->dtype, [&](auto t) {
+      using T = decltype(t);
+      correlate(view_of<T>(*in), view_of<T>(*k), view_of<T>(*out), Mode(mode), T(cval),
+                CorrelatePath(path), threads);
+    });
+    return TENSOR_OK;
+  });
+}
+
+extern "C" int tensor_auto_path(const tensor_array *in, const tensor_array *k) {
+  return guarded([&] {
+    check_kernel(in, k);
+    int path = TENSOR_PATH_AUTO;
+    with_dtype(in->dtype, [&](auto t) {
+      using T = decltype(t);
+      const TensorView<T> kv = view_of<T>(*k);
+      path = int(select_path(analyze_kernel(kv), view_of<T>(*in).shape(), kv.shape()));
+    });
+    return path;
+  });
+}
+
+extern "C" const char *tensor_path_name(const int path) {
+  if (path < TENSOR_PATH_AUTO || path > TENSOR_PATH_FFT)
+    return nullptr;
+  return to_string(CorrelatePath(path));
+}
+
+extern "C" const char *tensor_error(void) {
+  return last_error.c_str();
+}
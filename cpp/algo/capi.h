@@ -0,0 +1,94 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <stdint.h>
+
+/*
+  Plain C interface to the correlation engine, built as libtensor.so, for
+  ctypes and other foreign function interfaces. Arrays are described in
+  place (pointer, shape and strides, as numpy's): nothing is copied. No
+  exception crosses this interface: functions return an error code, and
+  tensor_error() tells what went wrong.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Element types, same codes as the volume format (see stream.hpp). */
+#define TENSOR_UINT8    1
+#define TENSOR_INT8     2
+#define TENSOR_UINT16   3
+#define TENSOR_INT16    4
+#define TENSOR_INT32    5
+#define TENSOR_INT64    6
+#define TENSOR_FLOAT32  7
+#define TENSOR_FLOAT64  8
+
+/* Boundary modes, see Mode. */
+#define TENSOR_MODE_CONSTANT  0
+#define TENSOR_MODE_REFLECT   1
+#define TENSOR_MODE_MIRROR    2
+#define TENSOR_MODE_NEAREST   3
+#define TENSOR_MODE_WRAP      4
+
+/* Code paths, see CorrelatePath. */
+#define TENSOR_PATH_AUTO       0
+#define TENSOR_PATH_GENERIC    1
+#define TENSOR_PATH_SPARSE     2
+#define TENSOR_PATH_BOX        3
+#define TENSOR_PATH_SEPARABLE  4
+#define TENSOR_PATH_FIXED      5
+#define TENSOR_PATH_FFT        6
+
+/* Return codes. */
+#define TENSOR_OK       0
+#define TENSOR_EINVAL  -1  /* Invalid argument: dtype, shape, stride, mode, path. */
+#define TENSOR_EFAIL   -2  /* Any other failure, e.g. out of memory. */
+
+/**
+  Strided 3-D array, borrowed from the caller.
+ */
+typedef struct {
+  void *data;          /* First element. */
+  int32_t dtype;       /* TENSOR_UINT8, ... */
+  uint64_t shape[3];
+  int64_t strides[3];  /* In bytes, multiples of the element size; may be negative. */
+} tensor_array;
+
+/**
+  Correlate in with k into out, same as scipy.ndimage.correlate(in, k,
+  output=out, mode=mode, cval=cval), see correlate().
+  \param in Input array.
+  \param k Kernel, same dtype as in.
+  \param out Output array, same dtype and shape as in. Must not overlap in.
+  \param mode TENSOR_MODE_*.
+  \param cval Value of the samples outside the input, in constant mode.
+  \param path TENSOR_PATH_*.
+  \param threads Maximum number of threads (0: one per core).
+  \return TENSOR_OK, or a negative error code.
+ */
+int tensor_correlate(const tensor_array *in, const tensor_array *k, const tensor_array *out,
+                     int mode, double cval, int path, unsigned threads);
+
+/**
+  Path TENSOR_PATH_AUTO picks for an input and a kernel.
+  \return TENSOR_PATH_*, or a negative error code.
+ */
+int tensor_auto_path(const tensor_array *in, const tensor_array *k);
+
+/**
+  Name of a path (e.g. "fixed"), NULL if unknown.
+ */
+const char *tensor_path_name(int path);
+
+/**
+  Message of the last error on the calling thread.
+ */
+const char *tensor_error(void);
+
+#ifdef __cplusplus
+}
+#endif
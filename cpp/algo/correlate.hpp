@@ -0,0 +1,982 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "tensor.hpp"
+#include "pool.hpp"
+#include "fft.hpp"
+
+//--------------
+// Accumulators
+//--------------
+
+/**
+  Type used to accumulate products: integers are widened, to avoid overflows.
+  8-bit data accumulate in 32 bits, which is exact for any kernel of up to
+  65793 taps (|w * x| <= 128 * 255), and keeps twice the lanes of 64 bits.
+  Wider integers accumulate in 64 bits: exact for any 16-bit kernel, and for
+  32-bit ones while sum(|w|) * max(|x|) < 2^63.
+ */
+template <typename T, typename Enable = void>
+struct Accumulator {
+  using type = T;
+};
+
+template <typename T>
+struct Accumulator<T, typename std::enable_if<std::is_integral<T>::value && (sizeof(T) > 1)>::type> {
+  using type = int64_t;
+};
+
+template <typename T>
+struct Accumulator<T, typename std::enable_if<std::is_integral<T>::value && sizeof(T) == 1>::type> {
+  using type = int32_t;
+};
+
+template <typename T>
+using acc_t = typename Accumulator<T>::type;
+
+
+//-------------------
+// Output conversion
+//-------------------
+
+// Every path ends each output voxel with an exact accumulator, turned into the
+// output type by a conversion functor: cv(acc, i, j, l), with the index of the
+// voxel, so that element-wise operations can be fused there (see expr.hpp).
+// As long as the result fits the output type, both give the same values as
+// scipy.ndimage.correlate on integer data, which computes in double (exact
+// below 2^53) and truncates.
+
+/**
+  Plain conversion: integers wrap around on overflow, like numpy's astype.
+  scipy's own result is undefined there (C cast from double).
+ */
+template <typename O>
+struct Cast {
+  template <typename A>
+  O operator()(const A acc, size_t, size_t, size_t) const { return O(acc); }
+};
+
+/**
+  Fixed-point requantization of integer results:
+    out = offset + round(acc * multiplier / 2^shift),
+  rounding halves up, then clamped to the output range if saturate is set
+  (otherwise it wraps around). The default is a plain saturating conversion.
+  With multiplier / 2^shift = 1 / sum(|w|), 8-bit data stay in 8 bits.
+ */
+struct Requantize {
+  int32_t multiplier = 1;
+  int shift = 0;
+  int32_t offset = 0;
+  bool saturate = true;
+};
+
+template <typename O>
+struct Requantizer {
+  static_assert(std::is_integral<O>::value, "Requantize: integer output only");
+  Requantize q;
+
+  template <typename A>
+  O operator()(const A acc, size_t, size_t, size_t) const {
+    int64_t v = int64_t(acc) * q.multiplier;
+    if (q.shift > 0)
+      v = (v + (int64_t(1) << (q.shift - 1))) >> q.shift;
+    v += q.offset;
+    if (q.saturate)
+      v = std::min<int64_t>(std::max<int64_t>(v, std::numeric_limits<O>::min()),
+                            std::numeric_limits<O>::max());
+    return O(v);
+  }
+};
+
+
+//-----------------
+// Boundary modes
+//-----------------
+
+/**
+  How the input is extended beyond its border, same as scipy.ndimage modes.
+ */
+enum class Mode {
+  Constant,  //!< k k k k | a b c d | k k k k  (k = cval)
+  Reflect,   //!< d c b a | a b c d | d c b a
+  Mirror,    //!< d c b | a b c d | c b a
+  Nearest,   //!< a a a a | a b c d | d d d d
+  Wrap       //!< a b c d | a b c d | a b c d
+};
+
+const char *to_string(const Mode mode);
+
+/**
+  Map an index, possibly outside [0, n), to the input sample it reads.
+  \return Index in [0, n), or -1 if the sample is cval (constant mode).
+ */
+inline ptrdiff_t extend_index(const ptrdiff_t x, const ptrdiff_t n, const Mode mode) {
+  if (x >= 0 && x < n)
+    return x;
+  switch (mode) {
+  case Mode::Reflect: {
+    ptrdiff_t m = x % (2 * n);
+    if (m < 0)
+      m += 2 * n;
+    return (m < n) ? m : 2 * n - 1 - m;
+  }
+  case Mode::Mirror: {
+    if (n == 1)
+      return 0;
+    ptrdiff_t m = x % (2 * n - 2);
+    if (m < 0)
+      m += 2 * n - 2;
+    return (m < n) ? m : 2 * n - 2 - m;
+  }
+  case Mode::Nearest:
+    return (x < 0) ? 0 : n - 1;
+  case Mode::Wrap: {
+    const ptrdiff_t m = x % n;
+    return (m < 0) ? m + n : m;
+  }
+  default:
+    return -1;
+  }
+}
+
+/**
+  Boundary condition of one correlation: mode, cval, and the extended index
+  of every halo position, per axis, so that border voxels need no arithmetic
+  or branches on the mode.
+ */
+template <typename T>
+struct Boundary {
+  Mode mode;
+  T cval;
+  Shape before;
+  std::array<std::vector<ptrdiff_t>, 3> index;
+
+  Boundary(const Mode mode, const T cval, const Shape &in, const Shape &k)
+    : mode(mode), cval(cval) {
+    for (int a = 0; a < 3; a++) {
+      before[a] = k[a] / 2;
+      const ptrdiff_t after = k[a] - 1 - k[a] / 2;
+      for (ptrdiff_t x = -ptrdiff_t(before[a]); x < ptrdiff_t(in[a]) + after; x++)
+        index[a].push_back(extend_index(x, in[a], mode));
+    }
+  }
+
+  //! Input index read at position x of an axis, -1 for cval.
+  ptrdiff_t operator()(const int axis, const ptrdiff_t x) const {
+    return index[axis][x + before[axis]];
+  }
+
+  //! Sample at (x, y, z), which may lie in the halo.
+  T at(const TensorView<T> &in, const ptrdiff_t x, const ptrdiff_t y, const ptrdiff_t z) const {
+    const ptrdiff_t i = (*this)(0, x), j = (*this)(1, y), l = (*this)(2, z);
+    return (i < 0 || j < 0 || l < 0) ? cval : in(i, j, l);
+  }
+};
+
+
+//-----------------
+// Kernel analysis
+//-----------------
+
+/**
+  Code path used to compute the correlation.
+ */
+enum class CorrelatePath {
+  Auto,       //!< Pick the fastest path, from kernel analysis and cost model.
+  Generic,    //!< Dense, bounds-checked on every tap (reference).
+  Sparse,     //!< Only non-zero taps are visited.
+  Box,        //!< All taps equal: 1-D sums along each axis.
+  Separable,  //!< Rank-1 kernel: three 1-D passes.
+  Fixed,      //!< Dense 3x3x3 or 5x5x5, taps unrolled at compile time.
+  FFT         //!< Product of the transforms: cost independent of the kernel size.
+              //!< In double: integer results are exact only below about 2^53.
+              //!< Auto never picks it for 32- and 64-bit integers.
+};
+
+const char *to_string(const CorrelatePath path);
+
+/**
+  Non-zero kernel tap.
+ */
+template <typename T>
+struct Tap {
+  ptrdiff_t di, dj, dk;  //!< Offset from the output voxel, per axis.
+  ptrdiff_t offset;      //!< Same offset, flattened on the input tensor.
+  T weight;
+};
+
+/**
+  Result of the kernel analysis.
+ */
+template <typename T>
+struct KernelInfo {
+  size_t nnz = 0;                        //!< Number of non-zero taps.
+  bool box = false;                      //!< All taps equal to box_value.
+  T box_value = T();
+  bool separable = false;                //!< k(i, j, l) = f0(i) * f1(j) * f2(l).
+  std::array<std::vector<T>, 3> factors;
+  CorrelatePath best = CorrelatePath::Generic;  //!< Cheapest direct path.
+};
+
+template <typename T>
+inline T gcd_of(const T a, const T b) {
+  if constexpr (std::is_integral<T>::value)
+    return std::gcd(a, b);
+  else
+    return a;
+}
+
+template <typename T>
+double path_cost(const CorrelatePath path, const KernelInfo<T> &info, const Shape &in, const Shape &k);
+
+/**
+  Inspect the kernel, to find the cheapest code path.
+  \param k Correlation kernel.
+  \return Kernel properties, and the cheapest direct (non-FFT) path.
+ */
+template <typename T>
+KernelInfo<T> analyze_kernel(const TensorView<T> &k) {
+  KernelInfo<T> info;
+  const size_t n = k.size();
+  if (n == 0)
+    return info;
+  const T w0 = k(0, 0, 0);
+  info.box = true;
+  T max_abs = T();
+  Shape pivot = {0, 0, 0};
+  for (size_t i = 0; i < k.dim(0); i++)
+    for (size_t j = 0; j < k.dim(1); j++)
+      for (size_t l = 0; l < k.dim(2); l++) {
+        const T w = k(i, j, l);
+        if (w != T())
+          info.nnz++;
+        if (w != w0)
+          info.box = false;
+        if (std::abs(w) > max_abs) {
+          max_abs = std::abs(w);
+          pivot = {i, j, l};
+        }
+      }
+  info.box = info.box && w0 != T();
+  info.box_value = w0;
+
+  // Rank-1 check: take the largest tap as pivot, derive one factor per axis
+  // through it, then verify every tap. Integer factors are the lines through
+  // the pivot divided by their GCD, so the check stays exact.
+  if (info.nnz > 0) {
+    const size_t p = pivot[0], q = pivot[1], r = pivot[2];
+    for (size_t j = 0; j < k.dim(1); j++)
+      info.factors[1].push_back(k(p, j, r));
+    for (size_t l = 0; l < k.dim(2); l++)
+      info.factors[2].push_back(k(p, q, l));
+    for (int a = 1; a < 3; a++) {
+      T g = info.factors[a][a == 1 ? q : r];
+      if (std::is_integral<T>::value)
+        for (const T v : info.factors[a])
+          g = gcd_of(g, v);
+      for (T &v : info.factors[a])
+        v /= g;
+    }
+    // Products in the accumulator type: they may not fit 8-bit kernels.
+    const acc_t<T> div = acc_t<T>(info.factors[1][q]) * info.factors[2][r];
+    for (size_t i = 0; i < k.dim(0); i++)
+      info.factors[0].push_back(T(k(i, q, r) / div));
+    const double tol = std::is_integral<T>::value ? 0.0 : 1e-6 * double(max_abs);
+    info.separable = true;
+    for (size_t i = 0; i < k.dim(0) && info.separable; i++)
+      for (size_t j = 0; j < k.dim(1) && info.separable; j++)
+        for (size_t l = 0; l < k.dim(2) && info.separable; l++) {
+          const acc_t<T> prod = acc_t<T>(info.factors[0][i]) * info.factors[1][j] * info.factors[2][l];
+          info.separable = std::abs(double(prod) - double(k(i, j, l))) <= tol;
+        }
+  }
+
+  // Cheapest path the kernel allows, from the cost model: direct paths cost
+  // the same per voxel whatever the input size. The tap list of the sparse
+  // path always beats the bounds-checked generic path. Ties go to the more
+  // specialized path.
+  const bool fixed = (k.shape() == Shape{3, 3, 3} || k.shape() == Shape{5, 5, 5});
+  const Shape one = {1, 1, 1};
+  info.best = CorrelatePath::Sparse;
+  for (const CorrelatePath p : {CorrelatePath::Fixed, CorrelatePath::Separable, CorrelatePath::Box}) {
+    if ((p == CorrelatePath::Box && !info.box) || (p == CorrelatePath::Separable && !info.separable) ||
+        (p == CorrelatePath::Fixed && !fixed))
+      continue;
+    if (path_cost(p, info, one, k.shape()) <= path_cost(info.best, info, one, k.shape()))
+      info.best = p;
+  }
+  return info;
+}
+
+
+//------------
+// Cost model
+//------------
+
+// Rough cost of each path, in ns per unit of work, measured on 128^3 float
+// inputs with `bench_tensor paths` and `bench_tensor crossover` (one core,
+// -O3). The sparse taps of larger kernels miss the cache more: COST_TAP is
+// averaged over 3^3 to 9^3 kernels, where the crossover with FFT lies.
+const double COST_TAP = 0.6;           //!< Sparse path, per voxel and non-zero tap.
+const double COST_FIXED_TAP = 0.35;    //!< Fixed path, per voxel and tap.
+const double COST_CHECKED_TAP = 2.3;   //!< Generic path, per voxel and tap.
+const double COST_PASS = 3.0;          //!< Separable and box paths, per voxel and 1-D pass.
+const double COST_LINE_TAP = 0.2;      //!< Separable and box paths, per voxel and 1-D tap.
+const double COST_FFT = 4.0;           //!< FFT, per padded voxel and log2 of its size, per transform.
+
+/**
+  Padded size, per axis, used by the FFT path: input plus halo, rounded up to
+  a size the FFT is fast on.
+ */
+inline Shape fft_shape(const Shape &in, const Shape &k) {
+  Shape m;
+  for (int a = 0; a < 3; a++)
+    m[a] = fft_good_size(in[a] + k[a] - 1);
+  return m;
+}
+
+/**
+  Estimated cost of a path, in ns (single thread).
+ */
+template <typename T>
+double path_cost(const CorrelatePath path, const KernelInfo<T> &info, const Shape &in, const Shape &k) {
+  const double voxels = double(in[0]) * in[1] * in[2];
+  switch (path) {
+  case CorrelatePath::Box:
+    // Running sums in integers: two 1-D taps per pass, whatever the size.
+    // Floating-point windows are summed anew, like separable taps.
+    if (std::is_integral<T>::value)
+      return voxels * 3 * (COST_PASS + 2 * COST_LINE_TAP);
+    return voxels * (3 * COST_PASS + COST_LINE_TAP * (k[0] + k[1] + k[2]));
+  case CorrelatePath::Separable:
+    return voxels * (3 * COST_PASS + COST_LINE_TAP * (k[0] + k[1] + k[2]));
+  case CorrelatePath::Sparse:
+    return voxels * COST_TAP * info.nnz;
+  case CorrelatePath::FFT: {
+    const Shape m = fft_shape(in, k);
+    const double padded = double(m[0]) * m[1] * m[2];
+    // Input and kernel forward, one inverse.
+    return 3 * COST_FFT * padded * std::log2(padded);
+  }
+  case CorrelatePath::Fixed:
+    // Integer taps widen to the accumulator: unrolling gains little there.
+    return voxels * (std::is_integral<T>::value ? COST_TAP : COST_FIXED_TAP) * (k[0] * k[1] * k[2]);
+  default:
+    return voxels * COST_CHECKED_TAP * (k[0] * k[1] * k[2]);
+  }
+}
+
+/**
+  Path Auto resolves to, for a given input: the best direct path from the
+  kernel analysis, or FFT if the cost model says it is cheaper. FFT computes
+  in double and rounds: 32- and 64-bit integers, whose sums may go past 2^53,
+  always stay on a direct path, exact.
+ */
+template <typename T>
+CorrelatePath select_path(const KernelInfo<T> &info, const Shape &in, const Shape &k) {
+  if (std::is_integral<T>::value && sizeof(T) > 2)
+    return info.best;
+  if (path_cost(CorrelatePath::FFT, info, in, k) < path_cost(info.best, info, in, k))
+    return CorrelatePath::FFT;
+  return info.best;
+}
+
+
+//------------------
+// Border and taps
+//------------------
+
+/**
+  Output region where every tap falls inside the input.
+ */
+inline Region interior_of(const Shape &in, const Shape &k) {
+  Region r;
+  for (int a = 0; a < 3; a++) {
+    r.lo[a] = std::min(k[a] / 2, in[a]);
+    const size_t after = k[a] - 1 - k[a] / 2;
+    r.hi[a] = std::max(r.lo[a], (in[a] > after) ? in[a] - after : 0);
+  }
+  return r;
+}
+
+/**
+  Call fn(i, j, l) on every voxel of region outside the interior.
+ */
+template <typename F>
+void for_each_border(const Region &region, const Region &interior, F &&fn) {
+  const Region in = interior.clip(region);
+  const bool none = in.empty();
+  for (size_t i = region.lo[0]; i < region.hi[0]; i++) {
+    const bool in_i = !none && i >= in.lo[0] && i < in.hi[0];
+    for (size_t j = region.lo[1]; j < region.hi[1]; j++) {
+      if (in_i && j >= in.lo[1] && j < in.hi[1]) {
+        for (size_t l = region.lo[2]; l < in.lo[2]; l++)
+          fn(i, j, l);
+        for (size_t l = in.hi[2]; l < region.hi[2]; l++)
+          fn(i, j, l);
+      }
+      else {
+        for (size_t l = region.lo[2]; l < region.hi[2]; l++)
+          fn(i, j, l);
+      }
+    }
+  }
+}
+
+/**
+  Split the output in tiles whose input footprint (halo included) fits in
+  about cache_bytes, innermost axis first so rows stay contiguous.
+ */
+inline std::vector<Region> make_tiles(const Shape &shape, const Shape &k, const size_t elem_size,
+                                      const size_t cache_bytes = 256 * 1024) {
+  const size_t budget = std::max<size_t>(1, cache_bytes / elem_size);
+  Shape t;
+  t[2] = std::min<size_t>(shape[2], 512);
+  t[1] = std::min<size_t>(shape[1], std::max<size_t>(1, budget / (4 * (t[2] + k[2] - 1))));
+  const size_t plane = (t[1] + k[1] - 1) * (t[2] + k[2] - 1);
+  t[0] = std::min<size_t>(shape[0], std::max<size_t>(1, budget / plane > k[0] ? budget / plane - k[0] + 1 : 1));
+  std::vector<Region> tiles;
+  for (size_t i = 0; i < shape[0]; i += t[0])
+    for (size_t j = 0; j < shape[1]; j += t[1])
+      for (size_t l = 0; l < shape[2]; l += t[2])
+        tiles.emplace_back(Shape{i, j, l}, Shape{std::min(i + t[0], shape[0]),
+                                                 std::min(j + t[1], shape[1]),
+                                                 std::min(l + t[2], shape[2])});
+  return tiles;
+}
+
+/**
+  Correlation at a single voxel, going through the boundary on every tap.
+ */
+template <typename T>
+acc_t<T> correlate_at(const TensorView<T> &in, const TensorView<T> &k, const Boundary<T> &bd,
+                      const size_t i, const size_t j, const size_t l) {
+  const ptrdiff_t c0 = k.dim(0) / 2, c1 = k.dim(1) / 2, c2 = k.dim(2) / 2;
+  acc_t<T> acc = 0;
+  for (size_t a = 0; a < k.dim(0); a++)
+    for (size_t b = 0; b < k.dim(1); b++)
+      for (size_t c = 0; c < k.dim(2); c++)
+        acc += acc_t<T>(k(a, b, c)) * acc_t<T>(bd.at(in, ptrdiff_t(i + a) - c0,
+                                                     ptrdiff_t(j + b) - c1,
+                                                     ptrdiff_t(l + c) - c2));
+  return acc;
+}
+
+/**
+  Build the list of non-zero taps, with offsets flattened for the given input
+  strides.
+ */
+template <typename T>
+std::vector<Tap<T>> make_taps(const TensorView<T> &k, const Strides &s) {
+  std::vector<Tap<T>> taps;
+  const ptrdiff_t c0 = k.dim(0) / 2, c1 = k.dim(1) / 2, c2 = k.dim(2) / 2;
+  for (size_t a = 0; a < k.dim(0); a++)
+    for (size_t b = 0; b < k.dim(1); b++)
+      for (size_t c = 0; c < k.dim(2); c++) {
+        if (k(a, b, c) == T())
+          continue;
+        Tap<T> t;
+        t.di = ptrdiff_t(a) - c0;
+        t.dj = ptrdiff_t(b) - c1;
+        t.dk = ptrdiff_t(c) - c2;
+        t.offset = t.di * s[0] + t.dj * s[1] + t.dk * s[2];
+        t.weight = k(a, b, c);
+        taps.push_back(t);
+      }
+  return taps;
+}
+
+
+//-------
+// Paths
+//-------
+
+// Paths below compute one region of the output. The neighbourhood of each
+// voxel, halo included, is read in place from the input. Except for the
+// generic one, they split the region in an interior, where every tap is in
+// bounds and no check is done, and a thin border that goes through the
+// boundary tables: the interior runs at the same speed in every mode.
+// Input and output are views, with any strides: each has its own.
+
+/**
+  Dense correlation, checking every tap. Reference implementation.
+ */
+template <typename T, typename O, typename C>
+void correlate_generic(const TensorView<T> &in, const TensorView<T> &k, const TensorView<O> &out,
+                       const C &cv, const Boundary<T> &bd, const Region &region) {
+  for (size_t i = region.lo[0]; i < region.hi[0]; i++)
+    for (size_t j = region.lo[1]; j < region.hi[1]; j++)
+      for (size_t l = region.lo[2]; l < region.hi[2]; l++)
+        out(i, j, l) = cv(correlate_at(in, k, bd, i, j, l), i, j, l);
+}
+
+/**
+  One interior row of the sparse path: a[x] = correlation at p[x * s2], for
+  x in [0, width). On contiguous rows, taps go one at a time over the whole
+  row of accumulators, so that the inner loop runs on all SIMD lanes (the
+  narrower the data, the more lanes). Taps are added in the same order
+  either way.
+ */
+template <typename T>
+inline void sparse_row(const T *p, const ptrdiff_t s2, const std::vector<Tap<T>> &taps,
+                       acc_t<T> *a, const size_t width) {
+  if (s2 == 1) {
+    std::fill(a, a + width, acc_t<T>(0));
+    for (const Tap<T> &t : taps) {
+      const acc_t<T> w = t.weight;
+      const T *src = p + t.offset;
+      for (size_t x = 0; x < width; x++)
+        a[x] += w * acc_t<T>(src[x]);
+    }
+  }
+  else {
+    for (size_t x = 0; x < width; x++, p += s2) {
+      acc_t<T> acc = 0;
+      for (const Tap<T> &t : taps)
+        acc += acc_t<T>(t.weight) * acc_t<T>(p[t.offset]);
+      a[x] = acc;
+    }
+  }
+}
+
+/**
+  Convert a row of accumulators: a[x] into out(i, j, l + x), for x in
+  [0, width). The converter is taken by value: output stores cannot alias a
+  local copy of its parameters, so they are not reloaded on every voxel.
+ */
+template <typename A, typename O, typename C>
+inline void store_row(const A *a, const size_t width, const TensorView<O> &out, const C cv,
+                      const size_t i, const size_t j, const size_t l) {
+  O *q = &out(i, j, l);
+  if (out.stride2() == 1)
+    for (size_t x = 0; x < width; x++)
+      q[x] = cv(a[x], i, j, l + x);
+  else
+    for (size_t x = 0; x < width; x++)
+      q[ptrdiff_t(x) * out.stride2()] = cv(a[x], i, j, l + x);
+}
+
+/**
+  Visit only the non-zero taps.
+ */
+template <typename T, typename O, typename C>
+void correlate_sparse(const TensorView<T> &in, const Shape &ks, const std::vector<Tap<T>> &taps,
+                      const TensorView<O> &out, const C &cv, const Boundary<T> &bd,
+                      const Region &region) {
+  const Region interior = interior_of(in.shape(), ks);
+  const Region inner = interior.clip(region);
+  const size_t width = inner.empty() ? 0 : inner.hi[2] - inner.lo[2];
+  std::vector<acc_t<T>> acc(width);
+  for (size_t i = inner.lo[0]; i < inner.hi[0]; i++)
+    for (size_t j = inner.lo[1]; j < inner.hi[1]; j++) {
+      sparse_row(&in(i, j, inner.lo[2]), in.stride2(), taps, acc.data(), width);
+      store_row(acc.data(), width, out, cv, i, j, inner.lo[2]);
+    }
+  for_each_border(region, interior, [&](size_t i, size_t j, size_t l) {
+    acc_t<T> acc = 0;
+    for (const Tap<T> &t : taps)
+      acc += acc_t<T>(t.weight) * acc_t<T>(bd.at(in, ptrdiff_t(i) + t.di, ptrdiff_t(j) + t.dj,
+                                                  ptrdiff_t(l) + t.dk));
+    out(i, j, l) = cv(acc, i, j, l);
+  });
+}
+
+/**
+  dst[i] = sum of w[t] * src[i + t * step] over the taps, for i < len: one
+  1-D correlation per residue modulo step, all in the same inner loop.
+  Empty weights sum box taps instead.
+ */
+template <typename A>
+inline void correlate_lines(const A *src, A *dst, const size_t len, const size_t step,
+                            const std::vector<A> &w, const size_t taps) {
+  if (w.empty() && std::is_integral<A>::value) {
+    // Exact in integers. In floating point, the rounding errors of a running
+    // sum pile up along the line, so windows are summed anew.
+    for (size_t i = 0; i < std::min(len, step); i++) {
+      A acc = 0;
+      for (size_t t = 0; t < taps; t++)
+        acc += src[i + t * step];
+      dst[i] = acc;
+    }
+    for (size_t i = step; i < len; i++)
+      dst[i] = dst[i - step] + src[i - step + taps * step] - src[i - step];
+    return;
+  }
+  std::fill_n(dst, len, A(0));
+  for (size_t t = 0; t < taps; t++) {
+    const A wt = w.empty() ? A(1) : w[t];
+    const A *s = src + t * step;
+    for (size_t i = 0; i < len; i++)
+      dst[i] += wt * s[i];
+  }
+}
+
+/**
+  1-D correlation along one axis, on blocks of adjacent lines. Lines of axis
+  2 are contiguous, and filtered one by one. Along the other axes, the block
+  is copied with its halo, and filtered a row at a time: the inner loop runs
+  across lines, on contiguous memory. A block is read whole before it is
+  written, so in and out may be the same tensor.
+  \param in Input view.
+  \param out Output view, same shape as in.
+  \param axis Axis to correlate along.
+  \param w Weights, centered at w.size() / 2. Empty to sum box elements,
+           instead.
+  \param mode Boundary mode.
+  \param border Value of the samples outside the input, in constant mode.
+  \param store Output conversion, store(acc, i, j, l).
+  \param threads Maximum number of threads. Blocks are split among them.
+ */
+template <typename I, typename A, typename O, typename S>
+void correlate_axis(const TensorView<I> &in, const TensorView<O> &out, const int axis,
+                    const std::vector<A> &w, const size_t box, const Mode mode,
+                    const A border, const S &store, const unsigned threads) {
+  const Shape &s = in.shape();
+  if (s[0] * s[1] * s[2] == 0)
+    return;
+  // Blocks span axis v, the innermost one but the filtered one, and are
+  // enumerated over axis u.
+  const int v = (axis == 2) ? 1 : 2, u = 3 - axis - v;
+  const ptrdiff_t n = s[axis];
+  const size_t taps = w.empty() ? box : w.size();
+  const ptrdiff_t c = taps / 2;
+  const size_t rows = n + taps;
+  const size_t width = std::min<size_t>(s[v], std::max<size_t>(8, 64 * 1024 / sizeof(A) / rows));
+  const size_t blocks = (s[v] + width - 1) / width;
+  std::vector<ptrdiff_t> ext(rows);
+  for (size_t r = 0; r < rows; r++)
+    ext[r] = extend_index(ptrdiff_t(r) - c, n, mode);
+  parallel_for(s[u] * blocks, [&](size_t b) {
+    const size_t lu = b / blocks, v0 = (b % blocks) * width;
+    const size_t m = std::min(width, s[v] - v0);
+    const I *src = in.data() + lu * in.stride(u) + v0 * in.stride(v);
+    O *dst = out.data() + lu * out.stride(u) + v0 * out.stride(v);
+    const ptrdiff_t is = in.stride(axis), iv = in.stride(v);
+    const ptrdiff_t os = out.stride(axis), ov = out.stride(v);
+    // buf(r, y) = extended sample r - c of line y, stored line after line
+    // along axis 2 (rows rs = 1 apart), row after row otherwise (rs = m), so
+    // inner loops stay contiguous. Windows that straddle two lines only feed
+    // the unused tail of acc.
+    const size_t rs = (axis == 2) ? 1 : m;
+    std::vector<A> buf(rows * m + taps * rs), acc(rows * m);
+    if (axis == 2) {
+      for (size_t y = 0; y < m; y++) {
+        const I *line = src + ptrdiff_t(y) * iv;
+        for (size_t r = 0; r < rows; r++)
+          buf[y * rows + r] = (ext[r] < 0) ? border : A(line[ext[r] * is]);
+      }
+    }
+    else {
+      for (size_t r = 0; r < rows; r++) {
+        if (ext[r] < 0) {
+          std::fill_n(&buf[r * m], m, border);
+          continue;
+        }
+        const I *row = src + ext[r] * is;
+        for (size_t y = 0; y < m; y++)
+          buf[r * m + y] = A(row[ptrdiff_t(y) * iv]);
+      }
+    }
+    correlate_lines(buf.data(), acc.data(), rows * m, rs, w, taps);
+    Shape p;
+    p[u] = lu;
+    if (axis == 2) {
+      for (size_t y = 0; y < m; y++) {
+        p[v] = v0 + y;
+        for (ptrdiff_t x = 0; x < n; x++) {
+          p[axis] = x;
+          dst[x * os + ptrdiff_t(y) * ov] = store(acc[y * rows + x], p[0], p[1], p[2]);
+        }
+      }
+    }
+    else {
+      for (ptrdiff_t x = 0; x < n; x++) {
+        p[axis] = x;
+        for (size_t y = 0; y < m; y++) {
+          p[v] = v0 + y;
+          dst[x * os + ptrdiff_t(y) * ov] = store(acc[x * m + y], p[0], p[1], p[2]);
+        }
+      }
+    }
+  }, threads);
+}
+
+/**
+  Separable (or box) kernel: one 1-D pass per axis, through a single
+  temporary. Axis 2 goes first, then axis 1 in place, then axis 0 straight
+  into the output. Extending the input along one axis commutes with filtering
+  along the others, so every mode is exact.
+  In constant mode, values outside the input are cval for the first pass,
+  then cval times the sum of the previous factors.
+ */
+template <typename T, typename O, typename C>
+void correlate_separable(const TensorView<T> &in, const KernelInfo<T> &info, const Shape &ks,
+                         const TensorView<O> &out, const C &cv, const Mode mode, const T cval,
+                         const unsigned threads) {
+  using A = acc_t<T>;
+  std::array<std::vector<A>, 3> f;
+  A border = A(cval);
+  std::array<A, 3> borders;
+  for (int a = 2; a >= 0; a--) {
+    borders[a] = border;
+    A sum = info.box ? A(ks[a]) : A(0);
+    if (!info.box) {
+      f[a].assign(info.factors[a].begin(), info.factors[a].end());
+      for (A v : f[a])
+        sum += v;
+    }
+    border *= sum;
+  }
+  Tensor<A> tmp(in.shape());
+  correlate_axis(in, tmp.view(), 2, f[2], ks[2], mode, borders[2], Cast<A>(), threads);
+  correlate_axis(tmp.view(), tmp.view(), 1, f[1], ks[1], mode, borders[1], Cast<A>(), threads);
+  const A scale = info.box ? A(info.box_value) : A(1);
+  correlate_axis(tmp.view(), out, 0, f[0], ks[0], mode, borders[0],
+                 [&](const A acc, size_t i, size_t j, size_t l) { return cv(acc * scale, i, j, l); },
+                 threads);
+}
+
+/**
+  Dot product of a KxKxK neighbourhood, with all taps unrolled at compile time.
+ */
+template <size_t K, typename T, size_t... I>
+inline acc_t<T> fixed_dot(const T *p, const ptrdiff_t s0, const ptrdiff_t s1, const ptrdiff_t s2,
+                          const acc_t<T> *w, std::index_sequence<I...>) {
+  constexpr ptrdiff_t c = K / 2;
+  return (acc_t<T>(0) + ... +
+          (w[I] * acc_t<T>(p[(ptrdiff_t(I / (K * K)) - c) * s0 +
+                             (ptrdiff_t(I / K % K) - c) * s1 +
+                             (ptrdiff_t(I % K) - c) * s2])));
+}
+
+/**
+  Dot product of K consecutive samples.
+ */
+template <typename T, size_t... I>
+inline acc_t<T> fixed_row(const T *p, const acc_t<T> *w, std::index_sequence<I...>) {
+  return (acc_t<T>(0) + ... + (w[I] * acc_t<T>(p[I])));
+}
+
+/**
+  Dense KxKxK kernel weights, in the accumulator type.
+ */
+template <size_t K, typename T>
+std::array<acc_t<T>, K * K * K> fixed_weights(const TensorView<T> &k) {
+  if (k.shape() != Shape{K, K, K})
+    throw std::invalid_argument("correlate_fixed: kernel size mismatch");
+  std::array<acc_t<T>, K * K * K> w;
+  for (size_t a = 0; a < K; a++)
+    for (size_t b = 0; b < K; b++)
+      for (size_t c = 0; c < K; c++)
+        w[(a * K + b) * K + c] = k(a, b, c);
+  return w;
+}
+
+/**
+  One interior row of the fixed path, as sparse_row() but on contiguous rows
+  one kernel row (K taps, unrolled) at a time.
+  \param w Weights, from fixed_weights().
+ */
+template <size_t K, typename T>
+inline void fixed_row_acc(const T *p, const ptrdiff_t s0, const ptrdiff_t s1, const ptrdiff_t s2,
+                          const acc_t<T> *w, acc_t<T> *a, const size_t width) {
+  if (s2 == 1) {
+    constexpr ptrdiff_t c = K / 2;
+    std::fill(a, a + width, acc_t<T>(0));
+    for (size_t r = 0; r < K * K; r++) {
+      const T *src = p + (ptrdiff_t(r / K) - c) * s0 + (ptrdiff_t(r % K) - c) * s1 - c;
+      const acc_t<T> *wr = w + r * K;
+      for (size_t x = 0; x < width; x++)
+        a[x] += fixed_row(src + x, wr, std::make_index_sequence<K>());
+    }
+  }
+  else {
+    for (size_t x = 0; x < width; x++, p += s2)
+      a[x] = fixed_dot<K>(p, s0, s1, s2, w, std::make_index_sequence<K * K * K>());
+  }
+}
+
+/**
+  Dense KxKxK kernel: fully unrolled interior, checked border.
+ */
+template <size_t K, typename T, typename O, typename C>
+void correlate_fixed(const TensorView<T> &in, const TensorView<T> &k, const TensorView<O> &out,
+                     const C &cv, const Boundary<T> &bd, const Region &region) {
+  const std::array<acc_t<T>, K * K * K> w = fixed_weights<K>(k);
+  const Region interior = interior_of(in.shape(), k.shape());
+  const Region inner = interior.clip(region);
+  const size_t width = inner.empty() ? 0 : inner.hi[2] - inner.lo[2];
+  std::vector<acc_t<T>> acc(width);
+  for (size_t i = inner.lo[0]; i < inner.hi[0]; i++)
+    for (size_t j = inner.lo[1]; j < inner.hi[1]; j++) {
+      fixed_row_acc<K>(&in(i, j, inner.lo[2]), in.stride0(), in.stride1(), in.stride2(), w.data(),
+                       acc.data(), width);
+      store_row(acc.data(), width, out, cv, i, j, inner.lo[2]);
+    }
+  for_each_border(region, interior, [&](size_t i, size_t j, size_t l) {
+    out(i, j, l) = cv(correlate_at(in, k, bd, i, j, l), i, j, l);
+  });
+}
+
+
+/**
+  Correlation as a product of transforms. The input is padded with its halo,
+  extended as the boundary mode says, so that the circular correlation
+  matches the linear one on the output region. Integers are rounded to the
+  nearest value.
+ */
+template <typename T, typename O, typename C>
+void correlate_fft(const TensorView<T> &in, const TensorView<T> &k, const TensorView<O> &out,
+                   const C &cv, const Boundary<T> &bd, const unsigned threads) {
+  const Shape m = fft_shape(in.shape(), k.shape());
+  const size_t padded = m[0] * m[1] * m[2];
+  const ptrdiff_t c0 = k.dim(0) / 2, c1 = k.dim(1) / 2, c2 = k.dim(2) / 2;
+
+  // P[y] = in[y - c], extended in the halo. K[t] = k[t], zero outside.
+  Tensor<cpx> p(m), kp(m);
+  const ptrdiff_t e0 = in.dim(0) + k.dim(0) - 1, e1 = in.dim(1) + k.dim(1) - 1;
+  const ptrdiff_t e2 = in.dim(2) + k.dim(2) - 1;
+  for (ptrdiff_t i = 0; i < e0; i++)
+    for (ptrdiff_t j = 0; j < e1; j++)
+      for (ptrdiff_t l = 0; l < e2; l++)
+        p(i, j, l) = double(bd.at(in, i - c0, j - c1, l - c2));
+  for (size_t a = 0; a < k.dim(0); a++)
+    for (size_t b = 0; b < k.dim(1); b++)
+      for (size_t c = 0; c < k.dim(2); c++)
+        kp(a, b, c) = double(k(a, b, c));
+
+  // out = P (*) K = ifft(fft(P) * conj(fft(K)))
+  fft3(p.data(), m, false, threads);
+  fft3(kp.data(), m, false, threads);
+  for (size_t i = 0; i < padded; i++)
+    p.data()[i] *= std::conj(kp.data()[i]);
+  fft3(p.data(), m, true, threads);
+
+  const double scale = 1.0 / double(padded);
+  for (size_t i = 0; i < in.dim(0); i++)
+    for (size_t j = 0; j < in.dim(1); j++)
+      for (size_t l = 0; l < in.dim(2); l++) {
+        const double v = p(i, j, l).real() * scale;
+        out(i, j, l) = cv(std::is_integral<T>::value ? acc_t<T>(std::llround(v)) : acc_t<T>(v),
+                          i, j, l);
+      }
+}
+
+
+//--------------
+// Entry points
+//--------------
+
+/**
+  Correlation into any output type, converting each accumulated voxel with cv.
+  See correlate() below.
+ */
+template <typename T, typename O, typename C>
+void correlate_into(const TensorView<T> &in, const TensorView<T> &k, const TensorView<O> &out,
+                    const C &cv, const Mode mode, const T cval, CorrelatePath path,
+                    const unsigned threads) {
+  if (out.shape() != in.shape())
+    throw std::invalid_argument("correlate: output shape mismatch");
+  const KernelInfo<T> info = analyze_kernel(k);
+  if (path == CorrelatePath::Auto)
+    path = select_path(info, in.shape(), k.shape());
+  if (path == CorrelatePath::Box && !info.box)
+    throw std::invalid_argument("correlate: not a box kernel");
+  if (path == CorrelatePath::Separable && !info.separable)
+    throw std::invalid_argument("correlate: kernel is not separable");
+  if (path == CorrelatePath::Fixed && k.shape() != Shape{3, 3, 3} && k.shape() != Shape{5, 5, 5})
+    throw std::invalid_argument("correlate: no fixed-size path for this kernel");
+  if (path == CorrelatePath::Box || path == CorrelatePath::Separable) {
+    correlate_separable(in, info, k.shape(), out, cv, mode, cval, threads);
+    return;
+  }
+  const Boundary<T> bd(mode, cval, in.shape(), k.shape());
+  if (path == CorrelatePath::FFT) {
+    correlate_fft(in, k, out, cv, bd, threads);
+    return;
+  }
+
+  std::vector<Tap<T>> taps;
+  if (path == CorrelatePath::Sparse)
+    taps = make_taps(k, in.strides());
+  const std::vector<Region> tiles = make_tiles(in.shape(), k.shape(), sizeof(T));
+  parallel_for(tiles.size(), [&](size_t t) {
+    switch (path) {
+    case CorrelatePath::Sparse:
+      correlate_sparse(in, k.shape(), taps, out, cv, bd, tiles[t]);
+      break;
+    case CorrelatePath::Fixed:
+      if (k.dim(0) == 3)
+        correlate_fixed<3>(in, k, out, cv, bd, tiles[t]);
+      else
+        correlate_fixed<5>(in, k, out, cv, bd, tiles[t]);
+      break;
+    default:
+      correlate_generic(in, k, out, cv, bd, tiles[t]);
+      break;
+    }
+  }, threads);
+}
+
+/**
+  Multi-dimensional correlation, same as scipy.ndimage.correlate(in, k,
+  mode=mode, cval=cval). The kernel is centered at k.dim(a) / 2. Unlike
+  scipy, the default mode is constant.
+  The output is split in cache-sized tiles, computed on the shared worker
+  pool. Every voxel is computed the same way whatever the number of threads,
+  so results are deterministic.
+  Input, kernel and output can be any view (sub-volume, slice, transposed):
+  strides are followed, nothing is copied.
+  \param in Input tensor.
+  \param k Correlation kernel.
+  \param out Output tensor, same shape as in. Throws std::invalid_argument if not.
+  \param mode How the input is extended beyond its border.
+  \param cval Value of the samples outside the input, in constant mode.
+  \param path Code path to use. Throws std::invalid_argument if the kernel does
+              not support it.
+  \param threads Maximum number of threads (0: one per core).
+ */
+template <typename T>
+void correlate(const TensorView<T> &in, const TensorView<T> &k, const TensorView<T> &out,
+               const Mode mode = Mode::Constant, const typename Tensor<T>::value_type cval = T(),
+               const CorrelatePath path = CorrelatePath::Auto, const unsigned threads = 0) {
+  correlate_into(in, k, out, Cast<T>(), mode, cval, path, threads);
+}
+
+template <typename T>
+Tensor<T> correlate(const TensorView<T> &in, const TensorView<T> &k, const Mode mode = Mode::Constant,
+                    const typename Tensor<T>::value_type cval = T(),
+                    const CorrelatePath path = CorrelatePath::Auto, const unsigned threads = 0) {
+  Tensor<T> out(in.shape());
+  correlate(in, k, out, mode, cval, path, threads);
+  return out;
+}
+
+/**
+  Integer correlation into another integer type, typically 8-bit data into a
+  16-bit output, or back to 8 bits through requantization. Accumulation is
+  exact (see Accumulator), only the final conversion saturates or wraps.
+  \param rq How accumulated values are scaled, offset and clamped.
+  Other parameters as for correlate() above.
+ */
+template <typename T, typename O>
+void correlate(const TensorView<T> &in, const TensorView<T> &k, const TensorView<O> &out,
+               const Requantize &rq, const Mode mode = Mode::Constant,
+               const typename Tensor<T>::value_type cval = T(),
+               const CorrelatePath path = CorrelatePath::Auto, const unsigned threads = 0) {
+  static_assert(std::is_integral<T>::value, "correlate: requantization of integer data only");
+  correlate_into(in, k, out, Requantizer<O>{rq}, mode, cval, path, threads);
+}
@@ -0,0 +1,415 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "tensor.hpp"
+#include "correlate.hpp"
+#include "pool.hpp"
+
+//-------------
+// Expressions
+//-------------
+
+// Arithmetic on tensors (+, -, *, / with tensors or scalars, clamp(),
+// threshold()) and correlation() build expressions: nothing is computed until
+// evaluate(), which runs the whole expression in a single loop, without
+// temporaries. An expression holding a correlation is fused into it: every
+// output voxel goes through the rest of the expression as it leaves its
+// accumulator, e.g.
+//   evaluate(clamp(correlation(a, k) * s + b, lo, hi), out)
+// reads a and b, and writes out, once.
+// Every node converts its result to its value type, so a fused expression
+// gives the same values as evaluating its operations one at a time.
+// Expressions refer to the tensors they are built from, which must outlive
+// them, except for temporary tensors: those are kept by the expression.
+
+/**
+  Base of all expression nodes.
+ */
+struct Expression {};
+
+template <typename X>
+using is_expression = std::is_base_of<Expression, X>;
+
+template <typename T>
+std::true_type is_tensor_test(const TensorView<T> *);
+std::false_type is_tensor_test(...);
+
+//! True for tensors and tensor views.
+template <typename X>
+using is_tensor = decltype(is_tensor_test(std::declval<X *>()));
+
+//! Value passed for the correlation, to expressions that hold none.
+struct NoCorrelation {};
+
+/**
+  Tensor (or view) operand.
+ */
+template <typename T>
+class TensorLeaf : public Expression {
+private:
+  //! Temporary tensor kept alive by the expression, if any.
+  std::shared_ptr<const Tensor<T>> m_owned;
+  TensorView<T> m_view;
+
+public:
+  using value_type = T;
+  static constexpr int correlations = 0;
+  static constexpr bool scalar = false;
+
+  explicit TensorLeaf(const TensorView<T> &view) : m_view(view) {}
+  explicit TensorLeaf(Tensor<T> &&t) : m_owned(std::make_shared<const Tensor<T>>(std::move(t))), m_view(*m_owned) {}
+
+  const Shape &shape() const { return m_view.shape(); }
+  bool unit() const { return m_view.stride2() == 1; }
+
+  template <bool Unit, typename C>
+  T at(const C &, const size_t i, const size_t j, const size_t l) const {
+    if (Unit)
+      return (m_view.data() + ptrdiff_t(i) * m_view.stride0() + ptrdiff_t(j) * m_view.stride1())[l];
+    return m_view(i, j, l);
+  }
+};
+
+/**
+  Scalar operand, in the value type of the other one (promoted to floating
+  point on integers, see ScalarOf).
+ */
+template <typename T>
+class ScalarLeaf : public Expression {
+private:
+  T m_value;
+
+public:
+  using value_type = T;
+  static constexpr int correlations = 0;
+  static constexpr bool scalar = true;
+
+  explicit ScalarLeaf(const T value) : m_value(value) {}
+
+  bool unit() const { return true; }
+
+  template <bool Unit, typename C>
+  T at(const C &, size_t, size_t, size_t) const { return m_value; }
+};
+
+/**
+  Correlation operand, see correlation().
+ */
+template <typename T>
+class Correlation : public Expression {
+public:
+  using value_type = T;
+  static constexpr int correlations = 1;
+  static constexpr bool scalar = false;
+
+  TensorView<T> in;
+  TensorView<T> k;
+  Mode mode;
+  T cval;
+  CorrelatePath path;
+
+  Correlation(const TensorView<T> &in, const TensorView<T> &k, const Mode mode, const T cval,
+              const CorrelatePath path)
+    : in(in), k(k), mode(mode), cval(cval), path(path) {}
+
+  const Shape &shape() const { return in.shape(); }
+  const Correlation &correlation() const { return *this; }
+  bool unit() const { return true; }
+
+  //! The correlation at a voxel is computed by the path, and handed over as c.
+  template <bool Unit>
+  T at(const T c, size_t, size_t, size_t) const { return c; }
+};
+
+/**
+  Element-wise function of one expression: fn(e).
+ */
+template <typename F, typename E>
+class Map : public Expression {
+private:
+  F m_fn;
+  E m_e;
+
+public:
+  using value_type = typename E::value_type;
+  static constexpr int correlations = E::correlations;
+  static constexpr bool scalar = false;
+
+  Map(const F &fn, const E &e) : m_fn(fn), m_e(e) {}
+
+  const Shape &shape() const { return m_e.shape(); }
+  const auto &correlation() const { return m_e.correlation(); }
+  bool unit() const { return m_e.unit(); }
+
+  template <bool Unit, typename C>
+  value_type at(const C &c, const size_t i, const size_t j, const size_t l) const {
+    return value_type(m_fn(m_e.template at<Unit>(c, i, j, l)));
+  }
+};
+
+/**
+  Element-wise function of two expressions: fn(x, y), in their common type.
+ */
+template <typename F, typename L, typename R>
+class Zip : public Expression {
+private:
+  F m_fn;
+  L m_l;
+  R m_r;
+
+public:
+  using value_type = typename std::common_type<typename L::value_type, typename R::value_type>::type;
+  static constexpr int correlations = L::correlations + R::correlations;
+  static constexpr bool scalar = false;
+  static_assert(correlations <= 1, "expression: one correlation at most, evaluate() the others first");
+
+  Zip(const F &fn, const L &l, const R &r) : m_fn(fn), m_l(l), m_r(r) {
+    if constexpr (!L::scalar && !R::scalar)
+      if (l.shape() != r.shape())
+        throw std::invalid_argument("expression: shape mismatch");
+  }
+
+  const Shape &shape() const {
+    if constexpr (L::scalar)
+      return m_r.shape();
+    else
+      return m_l.shape();
+  }
+
+  const auto &correlation() const {
+    if constexpr (L::correlations > 0)
+      return m_l.correlation();
+    else
+      return m_r.correlation();
+  }
+
+  bool unit() const { return m_l.unit() && m_r.unit(); }
+
+  template <bool Unit, typename C>
+  value_type at(const C &c, const size_t i, const size_t j, const size_t l) const {
+    return value_type(m_fn(m_l.template at<Unit>(c, i, j, l), m_r.template at<Unit>(c, i, j, l)));
+  }
+};
+
+
+//-----------
+// Operators
+//-----------
+
+/**
+  Type of a scalar S next to an operand of value type V, as numpy does: V,
+  unless a floating-point scalar meets integers, e.g. 1.0 / 7 stays 1/7
+  instead of becoming 0.
+ */
+template <typename V, typename S>
+using ScalarOf = typename std::conditional<std::is_integral<V>::value && std::is_floating_point<S>::value,
+                                           typename std::common_type<V, S>::type, V>::type;
+
+/**
+  Operand type an expression, a tensor or a scalar turns into. Scalars take
+  the value type V of the other operand, see ScalarOf.
+ */
+template <typename V, typename E>
+typename std::enable_if<is_expression<typename std::decay<E>::type>::value, typename std::decay<E>::type>::type
+to_node(E &&e) {
+  return std::forward<E>(e);
+}
+
+template <typename V, typename T>
+TensorLeaf<T> to_node(const TensorView<T> &view) {
+  return TensorLeaf<T>(view);
+}
+
+template <typename V, typename T>
+TensorLeaf<T> to_node(Tensor<T> &&t) {
+  return TensorLeaf<T>(std::move(t));
+}
+
+template <typename V, typename S>
+typename std::enable_if<std::is_arithmetic<S>::value, ScalarLeaf<ScalarOf<V, S>>>::type to_node(const S s) {
+  return ScalarLeaf<ScalarOf<V, S>>(ScalarOf<V, S>(s));
+}
+
+//! Expressions and tensors: anything with a shape.
+template <typename X>
+using is_operand = std::integral_constant<bool, is_expression<typename std::decay<X>::type>::value ||
+                                                    is_tensor<typename std::decay<X>::type>::value>;
+
+template <typename X, typename Enable = void>
+struct ValueOf {
+  using type = typename std::decay<X>::type;
+};
+
+template <typename X>
+struct ValueOf<X, typename std::enable_if<is_operand<X>::value>::type> {
+  using type = typename std::decay<X>::type::value_type;
+};
+
+//! Binary operator with an operand on either side, the other possibly a scalar.
+template <typename A, typename B>
+using if_binary = typename std::enable_if<
+    (is_operand<A>::value && (is_operand<B>::value || std::is_arithmetic<typename std::decay<B>::type>::value)) ||
+    (std::is_arithmetic<typename std::decay<A>::type>::value && is_operand<B>::value)>::type;
+
+/**
+  Zip two operands; a scalar gets the value type of the other side, or
+  promotes it (see ScalarOf).
+ */
+template <typename F, typename A, typename B>
+auto zip(const F &fn, A &&a, B &&b) {
+  using VA = typename ValueOf<A>::type;
+  using VB = typename ValueOf<B>::type;
+  using V = typename std::conditional<is_operand<A>::value, VA, VB>::type;
+  using W = typename std::conditional<is_operand<B>::value, VB, VA>::type;
+  auto l = to_node<W>(std::forward<A>(a));
+  auto r = to_node<V>(std::forward<B>(b));
+  return Zip<F, decltype(l), decltype(r)>(fn, l, r);
+}
+
+template <typename A, typename B, typename = if_binary<A, B>>
+auto operator+(A &&a, B &&b) {
+  return zip(std::plus<>(), std::forward<A>(a), std::forward<B>(b));
+}
+
+template <typename A, typename B, typename = if_binary<A, B>>
+auto operator-(A &&a, B &&b) {
+  return zip(std::minus<>(), std::forward<A>(a), std::forward<B>(b));
+}
+
+template <typename A, typename B, typename = if_binary<A, B>>
+auto operator*(A &&a, B &&b) {
+  return zip(std::multiplies<>(), std::forward<A>(a), std::forward<B>(b));
+}
+
+template <typename A, typename B, typename = if_binary<A, B>>
+auto operator/(A &&a, B &&b) {
+  return zip(std::divides<>(), std::forward<A>(a), std::forward<B>(b));
+}
+
+template <typename A, typename = typename std::enable_if<is_operand<A>::value>::type>
+auto operator-(A &&a) {
+  auto e = to_node<typename ValueOf<A>::type>(std::forward<A>(a));
+  return Map<std::negate<>, decltype(e)>(std::negate<>(), e);
+}
+
+template <typename T>
+struct ClampOp {
+  T lo, hi;
+  // On values: std::min and std::max select references, which can keep
+  // deep expressions from vectorizing.
+  T operator()(const T x) const {
+    const T y = (x < lo) ? lo : x;
+    return (hi < y) ? hi : y;
+  }
+};
+
+template <typename T>
+struct ThresholdOp {
+  T t, below, above;
+  T operator()(const T x) const { return (x < t) ? below : above; }
+};
+
+/**
+  Clamp every element to [lo, hi].
+ */
+template <typename A, typename S, typename = typename std::enable_if<is_operand<A>::value>::type>
+auto clamp(A &&a, const S lo, const S hi) {
+  using V = typename ValueOf<A>::type;
+  auto e = to_node<V>(std::forward<A>(a));
+  return Map<ClampOp<V>, decltype(e)>(ClampOp<V>{V(lo), V(hi)}, e);
+}
+
+/**
+  Binarize: below where an element is less than t, above elsewhere.
+ */
+template <typename A, typename S, typename = typename std::enable_if<is_operand<A>::value>::type>
+auto threshold(A &&a, const S t, const S below = S(0), const S above = S(1)) {
+  using V = typename ValueOf<A>::type;
+  auto e = to_node<V>(std::forward<A>(a));
+  return Map<ThresholdOp<V>, decltype(e)>(ThresholdOp<V>{V(t), V(below), V(above)}, e);
+}
+
+/**
+  Lazy correlate(): same parameters, but computed only when the expression it
+  belongs to is evaluated, fused with it.
+ */
+template <typename T>
+Correlation<T> correlation(const TensorView<T> &in, const TensorView<T> &k, const Mode mode = Mode::Constant,
+                           const typename Tensor<T>::value_type cval = T(),
+                           const CorrelatePath path = CorrelatePath::Auto) {
+  return Correlation<T>(in, k, mode, cval, path);
+}
+
+
+//------------
+// Evaluation
+//------------
+
+/**
+  Conversion functor running the rest of an expression on each correlated
+  voxel (see correlate_into()).
+ */
+template <typename E, typename O>
+struct Fused {
+  E e;        //!< A copy, so that its scalars are known not to alias the output.
+  bool unit;  //!< All the operands have contiguous rows.
+
+  template <typename A>
+  O operator()(const A acc, const size_t i, const size_t j, const size_t l) const {
+    using T = typename std::decay<decltype(e.correlation())>::type::value_type;
+    const T c = Cast<T>()(acc, i, j, l);
+    return unit ? O(e.template at<true>(c, i, j, l)) : O(e.template at<false>(c, i, j, l));
+  }
+};
+
+/**
+  Evaluate an expression into a tensor of the same shape, converting its
+  values to the output type. The output may be an operand of the expression,
+  but must not overlap the input of its correlation.
+  \param e Expression.
+  \param out Output tensor. Throws std::invalid_argument if its shape differs.
+  \param threads Maximum number of threads (0: one per core).
+ */
+template <typename E, typename O>
+typename std::enable_if<is_expression<E>::value>::type
+evaluate(const E &e, const TensorView<O> &out, const unsigned threads = 0) {
+  if (out.shape() != e.shape())
+    throw std::invalid_argument("evaluate: output shape mismatch");
+  if constexpr (E::correlations > 0) {
+    const auto &c = e.correlation();
+    correlate_into(c.in, c.k, out, Fused<E, O>{e, e.unit()}, c.mode, c.cval, c.path, threads);
+  }
+  else {
+    // Rows of contiguous operands are walked with unit stride, to vectorize.
+    const Shape &s = out.shape();
+    const bool unit = e.unit() && out.stride2() == 1;
+    parallel_for(s[0], [&](size_t i) {
+      for (size_t j = 0; j < s[1]; j++) {
+        if (unit) {
+          O *q = &out(i, j, 0);
+          for (size_t l = 0; l < s[2]; l++)
+            q[l] = O(e.template at<true>(NoCorrelation(), i, j, l));
+        }
+        else {
+          for (size_t l = 0; l < s[2]; l++)
+            out(i, j, l) = O(e.template at<false>(NoCorrelation(), i, j, l));
+        }
+      }
+    }, threads);
+  }
+}
+
+template <typename E>
+Tensor<typename E::value_type> evaluate(const E &e, const unsigned threads = 0) {
+  Tensor<typename E::value_type> out(e.shape());
+  evaluate(e, out.view(), threads);
+  return out;
+}
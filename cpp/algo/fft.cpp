@@ -0,0 +1,195 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <algorithm>
+#include <cmath>
+#include "fft.hpp"
+#include "pool.hpp"
+
+using namespace std;
+
+FFTPlan::FFTPlan(const size_t n) : m_n(n), m_twiddles(n) {
+  for (size_t k = 0; k < n; k++)
+    m_twiddles[k] = polar(1.0, -2.0 * M_PI * double(k) / double(n));
+
+  // Radix 4, 2, 3 and 5 stages first, then whatever prime is left.
+  size_t rest = n;
+  for (size_t p : {4, 2, 3, 5}) {
+    while (rest % p == 0) {
+      rest /= p;
+      m_factors.push_back(p);
+      m_factors.push_back(rest);
+    }
+  }
+  for (size_t p = 7; rest > 1; p += 2) {
+    while (rest % p == 0) {
+      rest /= p;
+      m_factors.push_back(p);
+      m_factors.push_back(rest);
+    }
+  }
+}
+
+// Decimation in time: out[0, n) is the DFT of in[0], in[fstride * in_stride], ...
+void FFTPlan::work(cpx *out, const cpx *in, const size_t fstride, const size_t in_stride,
+                   const size_t *factors) const {
+  const size_t p = factors[0], m = factors[1];
+  if (m == 1) {
+    for (size_t j = 0; j < p; j++)
+      out[j] = in[j * fstride * in_stride];
+  }
+  else {
+    for (size_t j = 0; j < p; j++)
+      work(out + j * m, in + j * fstride * in_stride, fstride * p, in_stride, factors + 2);
+  }
+  butterfly(out, fstride, m, p);
+}
+
+void FFTPlan::butterfly(cpx *out, const size_t fstride, const size_t m, const size_t p) const {
+  const cpx *tw = m_twiddles.data();
+  if (p == 2) {
+    for (size_t k = 0; k < m; k++) {
+      const cpx t = out[k + m] * tw[k * fstride];
+      out[k + m] = out[k] - t;
+      out[k] += t;
+    }
+    return;
+  }
+
+  if (p == 3) {
+    const double epi3 = tw[fstride * m].imag();
+    for (size_t k = 0; k < m; k++) {
+      const cpx s1 = out[k + m] * tw[k * fstride];
+      const cpx s2 = out[k + 2 * m] * tw[2 * k * fstride];
+      const cpx s3 = s1 + s2;
+      const cpx s0 = (s1 - s2) * epi3;
+      const cpx o1 = out[k] - s3 * 0.5;
+      out[k] += s3;
+      out[k + 2 * m] = cpx(o1.real() + s0.imag(), o1.imag() - s0.real());
+      out[k + m] = cpx(o1.real() - s0.imag(), o1.imag() + s0.real());
+    }
+    return;
+  }
+  if (p == 4) {
+    for (size_t k = 0; k < m; k++) {
+      const cpx s0 = out[k + m] * tw[k * fstride];
+      const cpx s1 = out[k + 2 * m] * tw[2 * k * fstride];
+      const cpx s2 = out[k + 3 * m] * tw[3 * k * fstride];
+      const cpx s5 = out[k] - s1;
+      const cpx o0 = out[k] + s1;
+      const cpx s3 = s0 + s2, s4 = s0 - s2;
+      out[k + 2 * m] = o0 - s3;
+      out[k] = o0 + s3;
+      out[k + m] = cpx(s5.real() + s4.imag(), s5.imag() - s4.real());
+      out[k + 3 * m] = cpx(s5.real() - s4.imag(), s5.imag() + s4.real());
+    }
+    return;
+  }
+  if (p == 5) {
+    const cpx ya = tw[fstride * m], yb = tw[2 * fstride * m];
+    for (size_t k = 0; k < m; k++) {
+      const cpx s0 = out[k];
+      const cpx s1 = out[k + m] * tw[k * fstride];
+      const cpx s2 = out[k + 2 * m] * tw[2 * k * fstride];
+      const cpx s3 = out[k + 3 * m] * tw[3 * k * fstride];
+      const cpx s4 = out[k + 4 * m] * tw[4 * k * fstride];
+      const cpx s7 = s1 + s4, s10 = s1 - s4, s8 = s2 + s3, s9 = s2 - s3;
+      out[k] = s0 + s7 + s8;
+      const cpx s5 = s0 + s7 * ya.real() + s8 * yb.real();
+      const cpx s6(s10.imag() * ya.imag() + s9.imag() * yb.imag(),
+                   -s10.real() * ya.imag() - s9.real() * yb.imag());
+      out[k + m] = s5 - s6;
+      out[k + 4 * m] = s5 + s6;
+      const cpx s11 = s0 + s7 * yb.real() + s8 * ya.real();
+      const cpx s12(-s10.imag() * yb.imag() + s9.imag() * ya.imag(),
+                    s10.real() * yb.imag() - s9.real() * ya.imag());
+      out[k + 2 * m] = s11 + s12;
+      out[k + 3 * m] = s11 - s12;
+    }
+    return;
+  }
+
+  // Generic radix-p butterfly.
+  cpx scratch[64];
+  vector<cpx> big;
+  cpx *s = scratch;
+  if (p > 64) {
+    big.resize(p);
+    s = big.data();
+  }
+  for (size_t u = 0; u < m; u++) {
+    for (size_t q = 0; q < p; q++)
+      s[q] = out[u + q * m];
+    for (size_t q1 = 0; q1 < p; q1++) {
+      const size_t k = u + q1 * m;
+      cpx acc = s[0];
+      size_t idx = 0;
+      for (size_t q = 1; q < p; q++) {
+        idx += fstride * k;
+        while (idx >= m_n)
+          idx -= m_n;
+        acc += s[q] * tw[idx];
+      }
+      out[k] = acc;
+    }
+  }
+}
+
+void FFTPlan::forward(const cpx *in, cpx *out, const size_t in_stride) const {
+  if (m_n == 1) {
+    out[0] = in[0];
+    return;
+  }
+  work(out, in, 1, in_stride, m_factors.data());
+}
+
+// ifft(x) = conj(fft(conj(x)))
+void FFTPlan::inverse(const cpx *in, cpx *out, const size_t in_stride) const {
+  vector<cpx> tmp(m_n);
+  for (size_t i = 0; i < m_n; i++)
+    tmp[i] = conj(in[i * in_stride]);
+  forward(tmp.data(), out);
+  for (size_t i = 0; i < m_n; i++)
+    out[i] = conj(out[i]);
+}
+
+size_t fft_good_size(const size_t n) {
+  for (size_t m = max<size_t>(n, 1); ; m++) {
+    size_t r = m;
+    for (size_t p : {2, 3, 5})
+      while (r % p == 0)
+        r /= p;
+    if (r == 1)
+      return m;
+  }
+}
+
+void fft3(cpx *data, const Shape &shape, const bool inverse, const unsigned threads) {
+  const size_t total = shape[0] * shape[1] * shape[2];
+  size_t stride = total;
+  for (int axis = 0; axis < 3; axis++) {
+    const size_t n = shape[axis];
+    stride /= n;
+    if (n == 1)
+      continue;
+    const FFTPlan plan(n);
+    const size_t lines = total / n;
+    const size_t chunk = 64;
+    parallel_for((lines + chunk - 1) / chunk, [&](size_t ch) {
+      vector<cpx> in(n), out(n);
+      for (size_t ln = ch * chunk; ln < min(lines, (ch + 1) * chunk); ln++) {
+        cpx *base = data + (ln / stride) * stride * n + ln % stride;
+        for (size_t x = 0; x < n; x++)
+          in[x] = base[x * stride];
+        // ifft(x) = conj(fft(conj(x)))
+        if (inverse)
+          for (size_t x = 0; x < n; x++)
+            in[x] = conj(in[x]);
+        plan.forward(in.data(), out.data());
+        for (size_t x = 0; x < n; x++)
+          base[x * stride] = inverse ? conj(out[x]) : out[x];
+      }
+    }, threads);
+  }
+}
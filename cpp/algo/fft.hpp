@@ -0,0 +1,61 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <complex>
+#include <cstddef>
+#include <vector>
+#include "tensor.hpp"
+
+using cpx = std::complex<double>;
+
+/**
+  Mixed-radix FFT of a fixed length, whose prime factors are 2, 3 and 5 (any
+  other factor works too, with a slower O(p^2) butterfly).
+ */
+class FFTPlan {
+private:
+  size_t m_n;
+
+  //! Pairs (radix, remaining length), outermost stage first.
+  std::vector<size_t> m_factors;
+
+  //! exp(-2*pi*i*k/n), k in [0, n).
+  std::vector<cpx> m_twiddles;
+
+  void work(cpx *out, const cpx *in, const size_t fstride, const size_t in_stride,
+            const size_t *factors) const;
+  void butterfly(cpx *out, const size_t fstride, const size_t m, const size_t p) const;
+
+public:
+  explicit FFTPlan(const size_t n);
+
+  size_t size() const { return m_n; }
+
+  /**
+    Forward transform, unnormalized.
+    \param in Input sequence, in[0], in[in_stride], ...
+    \param out Output, contiguous. Must not overlap in.
+   */
+  void forward(const cpx *in, cpx *out, const size_t in_stride = 1) const;
+
+  /**
+    Inverse transform, unnormalized (the result is scaled by size()).
+   */
+  void inverse(const cpx *in, cpx *out, const size_t in_stride = 1) const;
+};
+
+/**
+  Smallest length >= n with no prime factor other than 2, 3 and 5.
+ */
+size_t fft_good_size(const size_t n);
+
+/**
+  In-place 3-D FFT of a row-major volume, one axis at a time.
+  \param data Volume, shape[0] * shape[1] * shape[2] elements.
+  \param shape Volume shape.
+  \param inverse Inverse (unnormalized) transform if true.
+  \param threads Maximum number of threads (0: one per core).
+ */
+void fft3(cpx *data, const Shape &shape, const bool inverse, const unsigned threads = 0);
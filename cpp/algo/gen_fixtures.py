@@ -0,0 +1,88 @@
+#
+# Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+# This code is licensed under MIT license (see LICENSE.txt for details)
+#
+# Generate the scipy reference fixtures read by test_tensor, as volume files
+# (see stream.hpp): 64-byte header, padded to 4096 bytes, then raw data.
+# Fixtures are committed: run this only to change or add some, and commit the
+# result. Existing files must come out unchanged.
+#
+import os
+import struct
+import numpy as np
+from scipy import ndimage
+
+OUT_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'fixtures')
+DTYPES = {np.dtype(np.uint8): 1, np.dtype(np.int8): 2, np.dtype(np.uint16): 3,
+          np.dtype(np.int16): 4, np.dtype(np.int32): 5, np.dtype(np.int64): 6,
+          np.dtype(np.float32): 7, np.dtype(np.float64): 8}
+MODES = ['constant', 'reflect', 'mirror', 'nearest', 'wrap']
+CVAL = 2.5
+
+
+def write_volume(name, t):
+    t = np.ascontiguousarray(t)
+    header = struct.pack('<4sIII3QQ16x', b'VOL3', 1, DTYPES[t.dtype], t.itemsize,
+                         *t.shape, 4096)
+    with open(os.path.join(OUT_DIR, name + '.vol'), 'wb') as f:
+        f.write(header.ljust(4096, b'\0'))
+        f.write(t.tobytes())
+
+
+# Same input and kernel as test_tensor.py
+a = np.array([[[29, 54,  3], [54,  7, 49], [47, 59, 28], [23,  6, 47]],
+              [[41, 20,  9], [40, 52, 19], [24, 50, 56], [45, 38,  8]],
+              [[30,  3, 15], [48, 60, 58], [24, 30, 52], [29, 25,  0]],
+              [[17, 12,  0], [45, 37,  6], [33, 17, 28], [45, 60, 19]],
+              [[ 5, 23, 11], [ 0, 10, 49], [ 9, 40, 54], [26, 27, 55]]])
+cross = np.array([[[0, 0, 0], [0, 1, 0], [0, 0, 0]],
+                  [[0, 1, 0], [1, 1, 1], [0, 1, 0]],
+                  [[0, 0, 0], [0, 1, 0], [0, 0, 0]]])
+
+rng = np.random.RandomState(2019)
+inputs = {'a': a.astype(np.float64),
+          'b': rng.randint(0, 61, (7, 6, 9)).astype(np.float64)}
+# Asymmetric kernels, to catch flips; even sizes, to check the origin.
+kernels = {'cross': cross.astype(np.float64),
+           'asym': rng.randint(-4, 5, (3, 3, 3)).astype(np.float64),
+           'even': rng.randint(-4, 5, (2, 4, 3)).astype(np.float64),
+           'big': rng.randint(-2, 3, (5, 5, 5)).astype(np.float64)}
+
+# Every element type, in every mode. Values are small enough for all results
+# to fit the narrowest type (|result| <= 126), so that nothing depends on how
+# an overflow is converted. Signed kernels only for signed types. The outputs
+# of the five modes are stacked along axis 0, in MODES order, one file per
+# input and kernel.
+DTYPE_CVAL = 3
+dtype_rng = np.random.RandomState(2020)
+dtype_input = dtype_rng.randint(0, 8, (7, 6, 9))
+dtype_kernels = {'cross': cross,
+                 'ones': dtype_rng.randint(0, 2, (2, 3, 3)),
+                 'signed': dtype_rng.randint(-1, 2, (3, 2, 3))}
+
+
+def write_dtype_fixtures():
+    for dtype in DTYPES:
+        q = dtype_input.astype(dtype)
+        if dtype.kind == 'f':
+            q = q * dtype.type(0.5)
+        write_volume('q_%s' % dtype.name, q)
+        for kname, k in dtype_kernels.items():
+            if dtype.kind == 'u' and k.min() < 0:
+                continue
+            k = k.astype(dtype)
+            write_volume('%s_%s' % (kname, dtype.name), k)
+            out = [ndimage.correlate(q, k, mode=mode, cval=DTYPE_CVAL) for mode in MODES]
+            write_volume('q_%s_%s' % (kname, dtype.name), np.concatenate(out, axis=0))
+
+
+if __name__ == '__main__':
+    os.makedirs(OUT_DIR, exist_ok=True)
+    for name, t in list(inputs.items()) + list(kernels.items()):
+        write_volume(name, t)
+    for iname, t in inputs.items():
+        for kname, k in kernels.items():
+            for mode in MODES:
+                out = ndimage.correlate(t, k, mode=mode, cval=CVAL)
+                write_volume('%s_%s_%s' % (iname, kname, mode), out)
+    write_dtype_fixtures()
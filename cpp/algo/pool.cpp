@@ -0,0 +1,85 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include "pool.hpp"
+
+using namespace std;
+
+WorkerPool::WorkerPool(const unsigned n_workers) {
+  for (unsigned i = 0; i < n_workers; i++)
+    m_workers.emplace_back(&WorkerPool::worker, this, i);
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    lock_guard<mutex> guard(m_mux);
+    m_stop = true;
+  }
+  m_start_cv.notify_all();
+  for (auto &th : m_workers)
+    th.join();
+}
+
+void WorkerPool::drain() {
+  for (size_t t = m_next++; t < m_n_tasks; t = m_next++)
+    (*m_task)(t);
+}
+
+void WorkerPool::worker(const size_t id) {
+  size_t seen = 0;
+  while (true) {
+    {
+      unique_lock<mutex> lock(m_mux);
+      m_start_cv.wait(lock, [&]{ return m_stop || m_generation != seen; });
+      if (m_stop)
+        return;
+      seen = m_generation;
+      if (id >= m_participants)
+        continue;
+    }
+    drain();
+    lock_guard<mutex> guard(m_mux);
+    if (--m_busy == 0)
+      m_done_cv.notify_one();
+  }
+}
+
+void WorkerPool::run(const size_t n_tasks, const function<void(size_t)> &task, const unsigned threads) {
+  lock_guard<mutex> run_guard(m_run_mux);
+  {
+    lock_guard<mutex> guard(m_mux);
+    m_task = &task;
+    m_n_tasks = n_tasks;
+    m_next = 0;
+    const size_t wanted = (threads == 0) ? size() : threads;
+    m_participants = min(m_workers.size(), min(wanted, n_tasks) - 1);
+    m_busy = m_participants;
+    m_generation++;
+  }
+  m_start_cv.notify_all();
+  drain();
+  unique_lock<mutex> lock(m_mux);
+  m_done_cv.wait(lock, [&]{ return m_busy == 0; });
+  m_task = nullptr;
+}
+
+WorkerPool &WorkerPool::instance() {
+  // hardware_concurrency() is a system call: only once.
+  static WorkerPool pool([] {
+    const unsigned cores = thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 0;
+  }());
+  return pool;
+}
+
+void parallel_for(const size_t n, const function<void(size_t)> &fn, const unsigned threads) {
+  if (n == 0)
+    return;
+  if (n == 1 || threads == 1) {
+    for (size_t i = 0; i < n; i++)
+      fn(i);
+    return;
+  }
+  WorkerPool::instance().run(n, fn, threads);
+}
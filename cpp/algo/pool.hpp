@@ -0,0 +1,72 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+  Fixed set of worker threads, running batches of independent tasks.
+  The calling thread takes part in each batch. Not reentrant: tasks must not
+  call run() themselves.
+ */
+class WorkerPool {
+private:
+  std::vector<std::thread> m_workers;
+
+  //! Serializes concurrent callers of run().
+  std::mutex m_run_mux;
+
+  //! Protects the batch description below.
+  std::mutex m_mux;
+  std::condition_variable m_start_cv;
+  std::condition_variable m_done_cv;
+
+  const std::function<void(size_t)> *m_task = nullptr;
+  size_t m_n_tasks = 0;
+  std::atomic<size_t> m_next{0};
+
+  //! Workers taking part in the current batch, and how many are still busy.
+  size_t m_participants = 0;
+  size_t m_busy = 0;
+
+  //! Incremented on every batch, to wake up workers.
+  size_t m_generation = 0;
+  bool m_stop = false;
+
+  void worker(const size_t id);
+  void drain();
+
+public:
+  explicit WorkerPool(const unsigned n_workers);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  /**
+    Run task(0), ..., task(n_tasks - 1), and wait for all of them.
+    \param n_tasks Number of tasks.
+    \param task Task body.
+    \param threads Maximum number of threads, caller included (0: all).
+   */
+  void run(const size_t n_tasks, const std::function<void(size_t)> &task, const unsigned threads = 0);
+
+  //! Threads available, caller included.
+  unsigned size() const { return unsigned(m_workers.size()) + 1; }
+
+  //! Process-wide pool, one thread per core.
+  static WorkerPool &instance();
+};
+
+/**
+  Run fn(0), ..., fn(n - 1) on the shared pool, inline if there is a single
+  task or a single thread.
+ */
+void parallel_for(const size_t n, const std::function<void(size_t)> &fn, const unsigned threads = 0);
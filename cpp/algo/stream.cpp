@@ -0,0 +1,101 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <utility>
+#include "stream.hpp"
+
+using namespace std;
+
+static runtime_error io_error(const string &what, const string &path) {
+  return runtime_error("MappedVolume: " + what + " " + path + ": " + strerror(errno));
+}
+
+MappedVolume::~MappedVolume() {
+  if (m_map)
+    munmap(m_map, m_map_size);
+  if (m_fd >= 0)
+    close(m_fd);
+}
+
+MappedVolume::MappedVolume(MappedVolume &&other) noexcept {
+  *this = move(other);
+}
+
+MappedVolume &MappedVolume::operator=(MappedVolume &&other) noexcept {
+  swap(m_fd, other.m_fd);
+  swap(m_map, other.m_map);
+  swap(m_map_size, other.m_map_size);
+  swap(m_writable, other.m_writable);
+  return *this;
+}
+
+void MappedVolume::map(const size_t size, const bool writable) {
+  const int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+  void *p = mmap(NULL, size, prot, MAP_SHARED, m_fd, 0);
+  if (p == MAP_FAILED)
+    throw runtime_error(string("MappedVolume: mmap: ") + strerror(errno));
+  m_map = static_cast<uint8_t *>(p);
+  m_map_size = size;
+  m_writable = writable;
+}
+
+MappedVolume MappedVolume::open(const string &path, const bool writable) {
+  MappedVolume vol;
+  vol.m_fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (vol.m_fd < 0)
+    throw io_error("cannot open", path);
+  struct stat st;
+  if (fstat(vol.m_fd, &st) != 0)
+    throw io_error("cannot stat", path);
+  if (size_t(st.st_size) < sizeof(VolumeHeader))
+    throw runtime_error("MappedVolume: truncated header in " + path);
+  vol.map(st.st_size, writable);
+  const VolumeHeader &h = vol.header();
+  if (memcmp(h.magic, "VOL3", 4) != 0 || h.version != VOLUME_VERSION)
+    throw runtime_error("MappedVolume: not a volume file " + path);
+  if (h.data_offset + h.shape[0] * h.shape[1] * h.shape[2] * h.elem_size > size_t(st.st_size))
+    throw runtime_error("MappedVolume: truncated data in " + path);
+  return vol;
+}
+
+MappedVolume MappedVolume::create(const string &path, const uint32_t dtype,
+                                  const uint32_t elem_size, const Shape &shape) {
+  MappedVolume vol;
+  vol.m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (vol.m_fd < 0)
+    throw io_error("cannot create", path);
+  const size_t size = VOLUME_DATA_OFFSET + shape[0] * shape[1] * shape[2] * elem_size;
+  if (ftruncate(vol.m_fd, size) != 0)
+    throw io_error("cannot resize", path);
+  vol.map(size, true);
+  VolumeHeader &h = *reinterpret_cast<VolumeHeader *>(vol.m_map);
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "VOL3", 4);
+  h.version = VOLUME_VERSION;
+  h.dtype = dtype;
+  h.elem_size = elem_size;
+  for (int a = 0; a < 3; a++)
+    h.shape[a] = shape[a];
+  h.data_offset = VOLUME_DATA_OFFSET;
+  return vol;
+}
+
+void MappedVolume::release(const size_t offset, const size_t len) {
+  // Pages are file-backed: dropping one that is still partly in use only
+  // costs a fault to read it back.
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t start = header().data_offset + offset;
+  const size_t lo = start / page * page;
+  const size_t hi = min(m_map_size, (start + len + page - 1) / page * page);
+  if (hi <= lo)
+    return;
+  if (m_writable)
+    msync(m_map + lo, hi - lo, MS_SYNC);
+  madvise(m_map + lo, hi - lo, MADV_DONTNEED);
+}
@@ -0,0 +1,193 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "tensor.hpp"
+#include "correlate.hpp"
+
+//-------------------
+// Raw volume format
+//-------------------
+
+/**
+  Element type codes, stored in the volume header.
+ */
+template <typename T> struct DType;
+template <> struct DType<uint8_t>  { static constexpr uint32_t code = 1; };
+template <> struct DType<int8_t>   { static constexpr uint32_t code = 2; };
+template <> struct DType<uint16_t> { static constexpr uint32_t code = 3; };
+template <> struct DType<int16_t>  { static constexpr uint32_t code = 4; };
+template <> struct DType<int32_t>  { static constexpr uint32_t code = 5; };
+template <> struct DType<int64_t>  { static constexpr uint32_t code = 6; };
+template <> struct DType<float>    { static constexpr uint32_t code = 7; };
+template <> struct DType<double>   { static constexpr uint32_t code = 8; };
+
+/**
+  Volume file header. The data follows, row-major, at data_offset (a multiple
+  of the page size, so that slabs can be mapped and released independently).
+ */
+struct VolumeHeader {
+  char magic[4];          //!< "VOL3"
+  uint32_t version;
+  uint32_t dtype;         //!< DType<T>::code
+  uint32_t elem_size;
+  uint64_t shape[3];
+  uint64_t data_offset;
+  uint8_t reserved[16];
+};
+static_assert(sizeof(VolumeHeader) == 64, "Unexpected volume header size");
+
+const uint32_t VOLUME_VERSION = 1;
+const uint64_t VOLUME_DATA_OFFSET = 4096;
+
+/**
+  Volume file, memory-mapped. Throws std::runtime_error on I/O errors.
+ */
+class MappedVolume {
+private:
+  int m_fd = -1;
+  uint8_t *m_map = nullptr;
+  size_t m_map_size = 0;
+  bool m_writable = false;
+
+  void map(const size_t size, const bool writable);
+
+public:
+  MappedVolume() = default;
+  ~MappedVolume();
+  MappedVolume(MappedVolume &&other) noexcept;
+  MappedVolume &operator=(MappedVolume &&other) noexcept;
+  MappedVolume(const MappedVolume &) = delete;
+  MappedVolume &operator=(const MappedVolume &) = delete;
+
+  //! Map an existing volume.
+  static MappedVolume open(const std::string &path, const bool writable = false);
+
+  //! Create (or truncate) a volume file and map it read-write.
+  static MappedVolume create(const std::string &path, const uint32_t dtype,
+                             const uint32_t elem_size, const Shape &shape);
+
+  const VolumeHeader &header() const { return *reinterpret_cast<const VolumeHeader *>(m_map); }
+  Shape shape() const { return {header().shape[0], header().shape[1], header().shape[2]}; }
+  uint8_t *bytes() { return m_map + header().data_offset; }
+  const uint8_t *bytes() const { return m_map + header().data_offset; }
+
+  /**
+    Typed access to the data. Throws if T does not match the stored type.
+   */
+  template <typename T>
+  T *data() {
+    check<T>();
+    return reinterpret_cast<T *>(bytes());
+  }
+  template <typename T>
+  const T *data() const {
+    check<T>();
+    return reinterpret_cast<const T *>(bytes());
+  }
+
+  template <typename T>
+  void check() const {
+    if (header().dtype != DType<T>::code || header().elem_size != sizeof(T))
+      throw std::runtime_error("MappedVolume: element type mismatch");
+  }
+
+  /**
+    Flush (if writable) and drop from memory the pages of a data byte range,
+    so that resident memory does not grow with the volume.
+   */
+  void release(const size_t offset, const size_t len);
+};
+
+/**
+  Write a tensor to a volume file.
+ */
+template <typename T>
+void write_volume(const std::string &path, const TensorView<T> &t) {
+  MappedVolume vol = MappedVolume::create(path, DType<T>::code, sizeof(T), t.shape());
+  if (t.contiguous())
+    std::memcpy(vol.data<T>(), t.data(), t.size() * sizeof(T));
+  else
+    copy(t, TensorView<T>(vol.data<T>(), t.shape()));
+}
+
+/**
+  Read a whole volume file into memory.
+ */
+template <typename T>
+Tensor<T> read_volume(const std::string &path) {
+  const MappedVolume vol = MappedVolume::open(path);
+  Tensor<T> t(vol.shape());
+  std::memcpy(t.data(), vol.data<T>(), t.size() * sizeof(T));
+  return t;
+}
+
+
+//----------------------
+// Streaming correlation
+//----------------------
+
+/**
+  Out-of-core correlation between two volume files. The input is processed in
+  slabs of planes along the outermost axis: only one slab plus kernel-depth
+  halo planes are resident, and mapped pages are released as soon as they
+  are consumed (input) or written (output). Peak memory does not depend on
+  the volume size.
+  \param in_path Input volume.
+  \param out_path Output volume, created with the same shape and type.
+  \param k Correlation kernel.
+  \param mode How the input is extended beyond its border.
+  \param cval Value of the samples outside the input, in constant mode.
+  \param slab Output planes per slab (0: about 32 MB per slab).
+  \param path Code path used on each slab.
+  \param threads Maximum number of threads (0: one per core).
+ */
+template <typename T>
+void correlate_stream(const std::string &in_path, const std::string &out_path, const Tensor<T> &k,
+                      const Mode mode = Mode::Constant,
+                      const typename Tensor<T>::value_type cval = T(), size_t slab = 0,
+                      const CorrelatePath path = CorrelatePath::Auto, const unsigned threads = 0) {
+  MappedVolume in = MappedVolume::open(in_path);
+  const Shape shape = in.shape();
+  MappedVolume out = MappedVolume::create(out_path, DType<T>::code, sizeof(T), shape);
+  const T *src = in.data<T>();
+  T *dst = out.data<T>();
+
+  const size_t plane = shape[1] * shape[2];
+  const size_t before = k.dim(0) / 2, after = k.dim(0) - 1 - before;
+  if (slab == 0)
+    slab = std::max<size_t>(1, (32u << 20) / std::max<size_t>(1, plane * sizeof(T)));
+  slab = std::min(slab, std::max<size_t>(shape[0], 1));
+
+  // buf holds input planes [i0 - before, i0 + slab + after), extended
+  // outside the volume as the mode says.
+  Tensor<T> buf(slab + before + after, shape[1], shape[2]);
+  Tensor<T> res(buf.shape());
+  size_t released = 0;
+  for (size_t i0 = 0; i0 < shape[0]; i0 += slab) {
+    const size_t n = std::min(slab, shape[0] - i0);
+    for (size_t p = 0; p < buf.dim(0); p++) {
+      const ptrdiff_t x = extend_index(ptrdiff_t(i0 + p) - ptrdiff_t(before), shape[0], mode);
+      T *dp = buf.data() + p * plane;
+      if (x < 0)
+        std::fill(dp, dp + plane, T(cval));
+      else
+        std::memcpy(dp, src + x * plane, plane * sizeof(T));
+    }
+    correlate(buf, k, res, mode, cval, path, threads);
+    std::memcpy(dst + i0 * plane, res.data() + before * plane, n * plane * sizeof(T));
+    out.release(i0 * plane * sizeof(T), n * plane * sizeof(T));
+
+    // Input planes before the next halo are not needed anymore.
+    const size_t keep = (i0 + n > before) ? i0 + n - before : 0;
+    if (keep > released) {
+      in.release(released * plane * sizeof(T), (keep - released) * plane * sizeof(T));
+      released = keep;
+    }
+  }
+}
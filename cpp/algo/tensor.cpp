@@ -0,0 +1,113 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "tensor.hpp"
+#include "correlate.hpp"
+
+using namespace std;
+
+//---------
+// Storage
+//---------
+
+static atomic<size_t> n_allocations(0);
+
+// Arena of the calling thread, set by ArenaScope.
+static thread_local Arena *current_arena = nullptr;
+
+void *aligned_allocate(const size_t bytes) {
+  // aligned_alloc wants a multiple of the alignment.
+  const size_t size = (bytes + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+  void *p = aligned_alloc(TENSOR_ALIGNMENT, size ? size : TENSOR_ALIGNMENT);
+  if (!p)
+    throw bad_alloc();
+  n_allocations++;
+  return p;
+}
+
+void aligned_free(void *p) {
+  free(p);
+}
+
+size_t aligned_allocations() {
+  return n_allocations;
+}
+
+Arena::~Arena() {
+  clear();
+}
+
+void *Arena::allocate(const size_t bytes, size_t &capacity) {
+  {
+    lock_guard<mutex> lock(m_mux);
+    // Smallest block that fits, if not more than twice as large.
+    const auto it = m_free.lower_bound(bytes);
+    if (it != m_free.end() && it->first <= 2 * bytes) {
+      void *p = it->second;
+      capacity = it->first;
+      m_free.erase(it);
+      m_hits++;
+      return p;
+    }
+    m_misses++;
+  }
+  capacity = bytes;
+  return aligned_allocate(bytes);
+}
+
+void Arena::release(void *p, const size_t capacity) {
+  lock_guard<mutex> lock(m_mux);
+  m_free.emplace(capacity, p);
+}
+
+void Arena::clear() {
+  lock_guard<mutex> lock(m_mux);
+  for (auto &block : m_free)
+    aligned_free(block.second);
+  m_free.clear();
+}
+
+Arena *Arena::current() {
+  return current_arena;
+}
+
+ArenaScope::ArenaScope(Arena &arena) : m_prev(current_arena) {
+  current_arena = &arena;
+}
+
+ArenaScope::~ArenaScope() {
+  current_arena = m_prev;
+}
+
+
+//-------
+// Names
+//-------
+
+const char *to_string(const CorrelatePath path) {
+  switch (path) {
+  case CorrelatePath::Auto: return "auto";
+  case CorrelatePath::Generic: return "generic";
+  case CorrelatePath::Sparse: return "sparse";
+  case CorrelatePath::Box: return "box";
+  case CorrelatePath::Separable: return "separable";
+  case CorrelatePath::Fixed: return "fixed";
+  case CorrelatePath::FFT: return "fft";
+  }
+  return "unknown";
+}
+
+const char *to_string(const Mode mode) {
+  switch (mode) {
+  case Mode::Constant: return "constant";
+  case Mode::Reflect: return "reflect";
+  case Mode::Mirror: return "mirror";
+  case Mode::Nearest: return "nearest";
+  case Mode::Wrap: return "wrap";
+  }
+  return "unknown";
+}
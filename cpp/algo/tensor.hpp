@@ -0,0 +1,381 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <initializer_list>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+/**
+  Shape of a 3-D tensor, outermost axis first.
+ */
+using Shape = std::array<size_t, 3>;
+
+/**
+  Distance between consecutive elements of each axis, in elements.
+ */
+using Strides = std::array<ptrdiff_t, 3>;
+
+/**
+  Alignment of tensor storage, and of rows in the padded layout (one cache
+  line, and the widest SIMD register).
+ */
+const size_t TENSOR_ALIGNMENT = 64;
+
+
+//---------
+// Storage
+//---------
+
+/**
+  64-byte aligned allocation, straight from the system. Counted, see
+  aligned_allocations().
+ */
+void *aligned_allocate(const size_t bytes);
+void aligned_free(void *p);
+
+/**
+  Number of aligned_allocate() calls so far, process-wide.
+ */
+size_t aligned_allocations();
+
+/**
+  Pool of aligned blocks, recycled across tensors. A released block is kept,
+  and handed out again to any request it fits in (up to twice its size), so
+  a pipeline that creates temporaries of the same shapes on every step stops
+  allocating after the first one. Thread-safe.
+ */
+class Arena {
+private:
+  std::mutex m_mux;
+
+  //! Released blocks, by capacity in bytes.
+  std::multimap<size_t, void *> m_free;
+
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+
+public:
+  Arena() = default;
+  ~Arena();
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /**
+    Get a block of at least bytes.
+    \param bytes Requested size.
+    \param capacity Actual size of the block.
+   */
+  void *allocate(const size_t bytes, size_t &capacity);
+
+  //! Give a block back, for reuse.
+  void release(void *p, const size_t capacity);
+
+  //! Free all the blocks not in use.
+  void clear();
+
+  //! Requests served from released blocks, and from the system.
+  size_t hits() const { return m_hits; }
+  size_t misses() const { return m_misses; }
+
+  /**
+    Arena tensors allocated by the calling thread come from (nullptr: system).
+   */
+  static Arena *current();
+
+  friend class ArenaScope;
+};
+
+/**
+  Make an arena current on the calling thread, until the end of the scope.
+  Tensors allocated meanwhile give their storage back to the arena when
+  destroyed: it must outlive them.
+ */
+class ArenaScope {
+private:
+  Arena *m_prev;
+
+public:
+  explicit ArenaScope(Arena &arena);
+  ~ArenaScope();
+  ArenaScope(const ArenaScope &) = delete;
+  ArenaScope &operator=(const ArenaScope &) = delete;
+};
+
+
+//--------
+// Region
+//--------
+
+/**
+  Box of voxels: [lo, hi) on each axis.
+ */
+struct Region {
+  Shape lo = {0, 0, 0}, hi = {0, 0, 0};
+
+  Region() = default;
+  Region(const Shape &lo, const Shape &hi) : lo(lo), hi(hi) {}
+
+  //! Whole tensor.
+  explicit Region(const Shape &shape) : hi(shape) {}
+
+  bool empty() const { return hi[0] <= lo[0] || hi[1] <= lo[1] || hi[2] <= lo[2]; }
+  size_t size() const { return empty() ? 0 : (hi[0] - lo[0]) * (hi[1] - lo[1]) * (hi[2] - lo[2]); }
+
+  Region clip(const Region &other) const {
+    Region r;
+    for (int a = 0; a < 3; a++) {
+      r.lo[a] = std::max(lo[a], other.lo[a]);
+      r.hi[a] = std::max(r.lo[a], std::min(hi[a], other.hi[a]));
+    }
+    return r;
+  }
+};
+
+
+//-------
+// Views
+//-------
+
+/**
+  Non-owning, strided view of a 3-D tensor. Like a numpy view: slicing,
+  transposing and extracting a sub-volume never copy. Constness is shallow,
+  as for std::span.
+ */
+template <typename T>
+class TensorView {
+protected:
+  T *m_data = nullptr;
+  Shape m_shape = {0, 0, 0};
+  Strides m_strides = {0, 0, 0};
+
+public:
+  using value_type = T;
+
+  TensorView() = default;
+  TensorView(T *data, const Shape &shape, const Strides &strides)
+    : m_data(data), m_shape(shape), m_strides(strides) {}
+
+  //! Packed, row-major view.
+  TensorView(T *data, const Shape &shape)
+    : TensorView(data, shape, {ptrdiff_t(shape[1] * shape[2]), ptrdiff_t(shape[2]), 1}) {}
+
+  const Shape &shape() const { return m_shape; }
+  size_t dim(const int axis) const { return m_shape[axis]; }
+  size_t size() const { return m_shape[0] * m_shape[1] * m_shape[2]; }
+
+  const Strides &strides() const { return m_strides; }
+  ptrdiff_t stride(const int axis) const { return m_strides[axis]; }
+  ptrdiff_t stride0() const { return m_strides[0]; }
+  ptrdiff_t stride1() const { return m_strides[1]; }
+  ptrdiff_t stride2() const { return m_strides[2]; }
+
+  //! First element.
+  T *data() const { return m_data; }
+
+  T &operator()(const size_t i, const size_t j, const size_t l) const {
+    return m_data[ptrdiff_t(i) * m_strides[0] + ptrdiff_t(j) * m_strides[1] + ptrdiff_t(l) * m_strides[2]];
+  }
+
+  //! True if elements are packed in row-major order, without gaps.
+  bool contiguous() const {
+    return m_strides[2] == 1 && m_strides[1] == ptrdiff_t(m_shape[2]) &&
+           m_strides[0] == ptrdiff_t(m_shape[1] * m_shape[2]);
+  }
+
+  //! Sub-volume.
+  TensorView sub(const Region &r) const {
+    const Region c = r.clip(Region(m_shape));
+    return TensorView(&(*this)(c.lo[0], c.lo[1], c.lo[2]),
+                      {c.hi[0] - c.lo[0], c.hi[1] - c.lo[1], c.hi[2] - c.lo[2]}, m_strides);
+  }
+
+  //! Elements start, start + step, ... (before stop) of one axis.
+  TensorView slice(const int axis, const size_t start, size_t stop, const size_t step = 1) const {
+    if (step == 0)
+      throw std::invalid_argument("TensorView::slice: zero step");
+    stop = std::min(stop, m_shape[axis]);
+    TensorView v = *this;
+    v.m_shape[axis] = (stop > start) ? (stop - start + step - 1) / step : 0;
+    v.m_strides[axis] = m_strides[axis] * ptrdiff_t(step);
+    if (v.m_shape[axis])
+      v.m_data += ptrdiff_t(start) * m_strides[axis];
+    return v;
+  }
+
+  //! Permute axes: axis a of the result is axis (a0, a1, a2)[a] of this view.
+  TensorView transpose(const int a0, const int a1, const int a2) const {
+    if (a0 == a1 || a1 == a2 || a0 == a2)
+      throw std::invalid_argument("TensorView::transpose: not a permutation");
+    return TensorView(m_data, {m_shape[a0], m_shape[a1], m_shape[a2]},
+                      {m_strides[a0], m_strides[a1], m_strides[a2]});
+  }
+
+  friend bool operator==(const TensorView &x, const TensorView &y) {
+    if (x.m_shape != y.m_shape)
+      return false;
+    for (size_t i = 0; i < x.m_shape[0]; i++)
+      for (size_t j = 0; j < x.m_shape[1]; j++)
+        for (size_t l = 0; l < x.m_shape[2]; l++)
+          if (!(x(i, j, l) == y(i, j, l)))
+            return false;
+    return true;
+  }
+  friend bool operator!=(const TensorView &x, const TensorView &y) { return !(x == y); }
+};
+
+/**
+  Copy elements between views of the same shape.
+ */
+template <typename T>
+void copy(const TensorView<T> &src, const TensorView<T> &dst) {
+  if (src.shape() != dst.shape())
+    throw std::invalid_argument("copy: shape mismatch");
+  for (size_t i = 0; i < src.dim(0); i++)
+    for (size_t j = 0; j < src.dim(1); j++)
+      for (size_t l = 0; l < src.dim(2); l++)
+        dst(i, j, l) = src(i, j, l);
+}
+
+
+//---------
+// Tensors
+//---------
+
+/**
+  Memory layout of a tensor.
+ */
+enum class Layout {
+  Packed,  //!< Row-major, no gaps (same as numpy).
+  Padded   //!< Row-major, each row starts on a TENSOR_ALIGNMENT boundary.
+};
+
+/**
+  3-D tensor owning its storage: 64-byte aligned, taken from the current
+  arena if any (see ArenaScope), from the system otherwise.
+ */
+template <typename T>
+class Tensor : public TensorView<T> {
+private:
+  using TensorView<T>::m_data;
+  using TensorView<T>::m_shape;
+  using TensorView<T>::m_strides;
+
+  Layout m_layout = Layout::Packed;
+  Arena *m_arena = nullptr;
+  size_t m_capacity = 0;
+
+  void allocate(const Shape &shape, const Layout layout) {
+    m_shape = shape;
+    m_layout = layout;
+    size_t row = shape[2];
+    if (layout == Layout::Padded && TENSOR_ALIGNMENT % sizeof(T) == 0) {
+      const size_t per_line = TENSOR_ALIGNMENT / sizeof(T);
+      row = (row + per_line - 1) / per_line * per_line;
+    }
+    m_strides = {ptrdiff_t(shape[1] * row), ptrdiff_t(row), 1};
+    const size_t bytes = shape[0] * shape[1] * row * sizeof(T);
+    m_arena = Arena::current();
+    if (bytes == 0)
+      m_data = nullptr;
+    else if (m_arena)
+      m_data = static_cast<T *>(m_arena->allocate(bytes, m_capacity));
+    else
+      m_data = static_cast<T *>(aligned_allocate(m_capacity = bytes));
+  }
+
+  void release() {
+    if (m_data && m_arena)
+      m_arena->release(m_data, m_capacity);
+    else if (m_data)
+      aligned_free(m_data);
+    m_data = nullptr;
+  }
+
+  void fill(const T value) {
+    std::fill(m_data, m_data + m_shape[0] * m_strides[0], value);
+  }
+
+public:
+  Tensor() = default;
+
+  /**
+    Allocate a tensor, filling all its elements with the same value.
+    \param d0 Outermost extent.
+    \param d1 Middle extent.
+    \param d2 Innermost extent.
+    \param fill Initial value.
+   */
+  Tensor(const size_t d0, const size_t d1, const size_t d2, const T fill = T())
+    : Tensor(Shape{d0, d1, d2}, Layout::Packed, fill) {}
+
+  explicit Tensor(const Shape &shape, const T fill = T())
+    : Tensor(shape, Layout::Packed, fill) {}
+
+  Tensor(const Shape &shape, const Layout layout, const T fill = T()) {
+    allocate(shape, layout);
+    this->fill(fill);
+  }
+
+  /**
+    Build from nested lists, e.g. Tensor<int>{{{1, 2}, {3, 4}}}.
+    Inner lists are expected to have the same length.
+   */
+  Tensor(std::initializer_list<std::initializer_list<std::initializer_list<T>>> values) {
+    const size_t d0 = values.size();
+    const size_t d1 = d0 ? values.begin()->size() : 0;
+    const size_t d2 = d1 ? values.begin()->begin()->size() : 0;
+    allocate({d0, d1, d2}, Layout::Packed);
+    T *p = m_data;
+    for (const auto &plane : values)
+      for (const auto &row : plane)
+        p = std::copy(row.begin(), row.end(), p);
+  }
+
+  //! Copy of the elements of any view.
+  explicit Tensor(const TensorView<T> &view, const Layout layout = Layout::Packed) {
+    allocate(view.shape(), layout);
+    copy(view, *this);
+  }
+
+  Tensor(const Tensor &other) : Tensor(static_cast<const TensorView<T> &>(other), other.m_layout) {}
+
+  Tensor(Tensor &&other) noexcept { swap(other); }
+
+  Tensor &operator=(Tensor other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  ~Tensor() { release(); }
+
+  void swap(Tensor &other) noexcept {
+    std::swap(m_data, other.m_data);
+    std::swap(m_shape, other.m_shape);
+    std::swap(m_strides, other.m_strides);
+    std::swap(m_layout, other.m_layout);
+    std::swap(m_arena, other.m_arena);
+    std::swap(m_capacity, other.m_capacity);
+  }
+
+  Layout layout() const { return m_layout; }
+
+  //! View of the whole tensor.
+  TensorView<T> view() const { return *this; }
+
+  T *data() { return m_data; }
+  const T *data() const { return m_data; }
+
+  T &operator()(const size_t i, const size_t j, const size_t l) {
+    return TensorView<T>::operator()(i, j, l);
+  }
+  const T &operator()(const size_t i, const size_t j, const size_t l) const {
+    return TensorView<T>::operator()(i, j, l);
+  }
+};
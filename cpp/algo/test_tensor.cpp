@@ -0,0 +1,711 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include "tensor.hpp"
+#include "correlate.hpp"
+#include "pool.hpp"
+#include "fft.hpp"
+#include "stream.hpp"
+#include "bank.hpp"
+#include "batch.hpp"
+#include "expr.hpp"
+#include "capi.h"
+
+using namespace std;
+
+#define TEST_AND_CHECK(function) cout << #function << " "; \
+  if (!function()) { cout << "FAILED" << endl; failed++; } else cout << "SUCCEEDED" << endl;
+
+// Same input and kernel as test_tensor.py
+static const Tensor<int> a = {
+  {{29, 54,  3}, {54,  7, 49}, {47, 59, 28}, {23,  6, 47}},
+  {{41, 20,  9}, {40, 52, 19}, {24, 50, 56}, {45, 38,  8}},
+  {{30,  3, 15}, {48, 60, 58}, {24, 30, 52}, {29, 25,  0}},
+  {{17, 12,  0}, {45, 37,  6}, {33, 17, 28}, {45, 60, 19}},
+  {{ 5, 23, 11}, { 0, 10, 49}, { 9, 40, 54}, {26, 27, 55}}};
+
+static const Tensor<int> k = {
+  {{0, 0, 0}, {0, 1, 0}, {0, 0, 0}},
+  {{0, 1, 0}, {1, 1, 1}, {0, 1, 0}},
+  {{0, 0, 0}, {0, 1, 0}, {0, 0, 0}}};
+
+// ndimage.correlate(a, k, mode='constant', cval=0.0)
+static const Tensor<int> expected = {
+  {{178, 113, 115}, {177, 275, 106}, {207, 197, 239}, {121, 173,  89}},
+  {{160, 179,  66}, {259, 248, 243}, {230, 309, 213}, {159, 172, 149}},
+  {{139, 140,  85}, {247, 288, 210}, {188, 258, 224}, {168, 182, 104}},
+  {{109,  92,  44}, {180, 187, 178}, {173, 245, 176}, {193, 193, 162}},
+  {{ 45,  61,  83}, { 69, 159, 130}, {108, 157, 226}, {107, 208, 155}}};
+
+static mt19937 rng(42);
+
+template <typename T>
+static Tensor<T> random_tensor(const Shape &shape, const int lo, const int hi) {
+  uniform_int_distribution<int> dist(lo, hi);
+  Tensor<T> t(shape);
+  for (size_t i = 0; i < t.size(); i++)
+    t.data()[i] = T(dist(rng));
+  return t;
+}
+
+template <typename T>
+static bool all_close(const Tensor<T> &x, const Tensor<T> &y, const double tol) {
+  if (x.shape() != y.shape())
+    return false;
+  for (size_t i = 0; i < x.size(); i++)
+    if (abs(double(x.data()[i]) - double(y.data()[i])) > tol * (1.0 + abs(double(y.data()[i]))))
+      return false;
+  return true;
+}
+
+template <typename O, typename T>
+static Tensor<O> convert(const Tensor<T> &t, O (*fn)(T) = [](T v) { return O(v); }) {
+  Tensor<O> r(t.shape());
+  for (size_t i = 0; i < t.size(); i++)
+    r.data()[i] = fn(t.data()[i]);
+  return r;
+}
+
+// Test cases
+
+// Every path that supports the cross kernel must match scipy.
+bool test_reference(void) {
+  for (CorrelatePath p : {CorrelatePath::Auto, CorrelatePath::Generic,
+                          CorrelatePath::Sparse, CorrelatePath::Fixed})
+    if (correlate(a, k, Mode::Constant, 0, p) != expected)
+      return false;
+  return true;
+}
+
+bool test_kernel_analysis(void) {
+  KernelInfo<int> info = analyze_kernel(k);
+  if (info.nnz != 7 || info.box || info.separable || info.best != CorrelatePath::Sparse)
+    return false;
+  info = analyze_kernel(Tensor<int>(3, 3, 3, 2));
+  if (!info.box || info.box_value != 2 || info.best != CorrelatePath::Box)
+    return false;
+  Tensor<int> sep(5, 5, 5);
+  for (size_t i = 0; i < 5; i++)
+    for (size_t j = 0; j < 5; j++)
+      for (size_t l = 0; l < 5; l++)
+        sep(i, j, l) = int((i + 1) * (2 * j + 1) * (5 - l));
+  info = analyze_kernel(sep);
+  if (info.box || !info.separable || info.best != CorrelatePath::Separable)
+    return false;
+  info = analyze_kernel(random_tensor<int>({3, 3, 3}, 1, 9));
+  return info.best == CorrelatePath::Fixed;
+}
+
+// All paths must agree with the generic one, with and without cval.
+bool test_paths_agree(void) {
+  const Tensor<int> in = random_tensor<int>({13, 9, 17}, -50, 50);
+  Tensor<int> sep(5, 3, 5);
+  for (size_t i = 0; i < 5; i++)
+    for (size_t j = 0; j < 3; j++)
+      for (size_t l = 0; l < 5; l++)
+        sep(i, j, l) = int((i + 1) * (j + 2) * (l % 2 ? -1 : 3));
+  const Tensor<int> kernels[] = {k, Tensor<int>(3, 3, 3, 1), Tensor<int>(4, 2, 5, -3), sep,
+                                 random_tensor<int>({3, 3, 3}, -4, 4),
+                                 random_tensor<int>({5, 5, 5}, -4, 4)};
+  for (const Tensor<int> &kern : kernels) {
+    const KernelInfo<int> info = analyze_kernel(kern);
+    for (const int cval : {0, 7}) {
+      const Tensor<int> ref = correlate(in, kern, Mode::Constant, cval, CorrelatePath::Generic);
+      if (correlate(in, kern, Mode::Constant, cval, CorrelatePath::Sparse) != ref)
+        return false;
+      if (correlate(in, kern, Mode::Constant, cval) != ref)
+        return false;
+      if (info.separable && correlate(in, kern, Mode::Constant, cval, CorrelatePath::Separable) != ref)
+        return false;
+      if (info.box && correlate(in, kern, Mode::Constant, cval, CorrelatePath::Box) != ref)
+        return false;
+    }
+  }
+  return true;
+}
+
+bool test_float_paths(void) {
+  const Tensor<float> in = random_tensor<float>({11, 12, 10}, 0, 60);
+  Tensor<float> gauss(5, 5, 5);
+  const float g[5] = {0.06f, 0.24f, 0.4f, 0.24f, 0.06f};
+  for (size_t i = 0; i < 5; i++)
+    for (size_t j = 0; j < 5; j++)
+      for (size_t l = 0; l < 5; l++)
+        gauss(i, j, l) = g[i] * g[j] * g[l];
+  if (analyze_kernel(gauss).best != CorrelatePath::Separable)
+    return false;
+  for (const float cval : {0.0f, 1.5f}) {
+    const Tensor<float> ref = correlate(in, gauss, Mode::Constant, cval, CorrelatePath::Generic);
+    if (!all_close(correlate(in, gauss, Mode::Constant, cval, CorrelatePath::Separable), ref, 1e-5))
+      return false;
+    if (!all_close(correlate(in, gauss, Mode::Constant, cval, CorrelatePath::Fixed), ref, 1e-5))
+      return false;
+    const Tensor<float> box(3, 3, 3, 1.0f / 27);
+    if (!all_close(correlate(in, box, Mode::Constant, cval, CorrelatePath::Box),
+                   correlate(in, box, Mode::Constant, cval, CorrelatePath::Generic), 1e-5))
+      return false;
+  }
+  return true;
+}
+
+// Box sums on a large dynamic range: a huge plane must not leak into the
+// small values along the lines that cross it.
+bool test_box_dynamic_range(void) {
+  Tensor<float> in = random_tensor<float>({8, 8, 512}, 0, 1);
+  for (size_t i = 0; i < 8; i++)
+    for (size_t j = 0; j < 8; j++)
+      in(i, j, 100) = 3e7f;
+  const Tensor<float> box(3, 3, 3, 1.0f / 27);
+  return all_close(correlate(in, box, Mode::Reflect, 0.0f, CorrelatePath::Box),
+                   correlate(in, box, Mode::Reflect, 0.0f, CorrelatePath::Sparse), 1e-5);
+}
+
+// Kernels larger than the input: no interior at all.
+bool test_small_input(void) {
+  const Tensor<int> in = random_tensor<int>({2, 1, 3}, 0, 9);
+  const Tensor<int> kern = random_tensor<int>({5, 5, 5}, -2, 2);
+  const Tensor<int> ref = correlate(in, kern, Mode::Constant, 1, CorrelatePath::Generic);
+  return correlate(in, kern, Mode::Constant, 1, CorrelatePath::Fixed) == ref &&
+         correlate(in, kern, Mode::Constant, 1, CorrelatePath::Sparse) == ref;
+}
+
+// Tiled, multi-threaded runs must match the single-threaded one bit by bit.
+bool test_threads_deterministic(void) {
+  const Tensor<float> in = random_tensor<float>({40, 70, 600}, -60, 60);
+  Tensor<float> kern = random_tensor<float>({3, 5, 3}, -9, 9);
+  for (size_t i = 0; i < kern.size(); i++)
+    kern.data()[i] /= 7;
+  for (CorrelatePath p : {CorrelatePath::Generic, CorrelatePath::Sparse}) {
+    const Tensor<float> ref = correlate(in, kern, Mode::Constant, 0.5f, p, 1);
+    for (const unsigned th : {2u, 3u, 8u, 0u})
+      if (correlate(in, kern, Mode::Constant, 0.5f, p, th) != ref)
+        return false;
+  }
+  const Tensor<float> dense = random_tensor<float>({5, 5, 5}, 1, 9);
+  const Tensor<float> ref = correlate(in, dense, Mode::Constant, 0.0f, CorrelatePath::Fixed, 1);
+  if (correlate(in, dense, Mode::Constant, 0.0f, CorrelatePath::Fixed, 4) != ref)
+    return false;
+  const Tensor<float> box(3, 5, 7, 0.25f);
+  return correlate(in, box, Mode::Constant, 0.0f, CorrelatePath::Box, 1) ==
+         correlate(in, box, Mode::Constant, 0.0f, CorrelatePath::Box, 4);
+}
+
+// Every task runs exactly once, whatever the number of threads.
+bool test_worker_pool(void) {
+  WorkerPool pool(4);
+  for (const unsigned th : {1u, 2u, 5u, 0u}) {
+    vector<atomic<int>> hits(1000);
+    for (int round = 0; round < 20; round++)
+      pool.run(hits.size(), [&](size_t i) { hits[i]++; }, th);
+    for (const auto &h : hits)
+      if (h != 20)
+        return false;
+  }
+  return true;
+}
+
+// FFT against a naive DFT, on lengths with small and large prime factors.
+bool test_fft(void) {
+  for (size_t n : {1, 2, 3, 5, 6, 7, 12, 25, 30, 49, 64, 97, 250}) {
+    vector<cpx> x(n), y(n), back(n);
+    for (size_t i = 0; i < n; i++)
+      x[i] = cpx(double(rng() % 100) - 50, double(rng() % 100) - 50);
+    const FFTPlan plan(n);
+    plan.forward(x.data(), y.data());
+    for (size_t f = 0; f < n; f++) {
+      cpx ref = 0;
+      for (size_t i = 0; i < n; i++)
+        ref += x[i] * polar(1.0, -2.0 * M_PI * double(f * i % n) / double(n));
+      if (abs(ref - y[f]) > 1e-9 * n * 100)
+        return false;
+    }
+    plan.inverse(y.data(), back.data());
+    for (size_t i = 0; i < n; i++)
+      if (abs(back[i] / double(n) - x[i]) > 1e-9)
+        return false;
+  }
+  return fft_good_size(97) == 100 && fft_good_size(1) == 1 && fft_good_size(121) == 125;
+}
+
+bool test_fft_path(void) {
+  if (correlate(a, k, Mode::Constant, 0, CorrelatePath::FFT) != expected)
+    return false;
+  const Tensor<int> in = random_tensor<int>({13, 9, 17}, -50, 50);
+  const Tensor<int> kern = random_tensor<int>({5, 4, 7}, -4, 4);
+  if (correlate(in, kern, Mode::Constant, 3, CorrelatePath::FFT) != correlate(in, kern, Mode::Constant, 3, CorrelatePath::Generic))
+    return false;
+  const Tensor<double> fin = random_tensor<double>({20, 11, 15}, 0, 60);
+  Tensor<double> fk = random_tensor<double>({9, 9, 9}, 0, 10);
+  for (size_t i = 0; i < fk.size(); i++)
+    fk.data()[i] /= 729;
+  return all_close(correlate(fin, fk, Mode::Constant, 2.5, CorrelatePath::FFT),
+                   correlate(fin, fk, Mode::Constant, 2.5, CorrelatePath::Generic), 1e-9);
+}
+
+// Large kernels on large volumes go to FFT, small ones stay direct. Wide
+// integers never go to FFT: sums past 2^53 would not round back exactly.
+bool test_cost_model(void) {
+  const Tensor<float> k3 = random_tensor<float>({3, 3, 3}, 1, 9);
+  const Tensor<float> k15 = random_tensor<float>({15, 15, 15}, 1, 9);
+  const Tensor<int16_t> k15s = random_tensor<int16_t>({15, 15, 15}, 1, 9);
+  const Tensor<int> k15i = random_tensor<int>({15, 15, 15}, 1, 9);
+  const Tensor<int64_t> k15l = random_tensor<int64_t>({15, 15, 15}, 1, 9);
+  const Shape big = {256, 256, 256};
+  if (select_path(analyze_kernel(k3), big, k3.shape()) != CorrelatePath::Fixed ||
+      select_path(analyze_kernel(k15), big, k15.shape()) != CorrelatePath::FFT ||
+      select_path(analyze_kernel(k15s), big, k15s.shape()) != CorrelatePath::FFT ||
+      select_path(analyze_kernel(k15i), big, k15i.shape()) == CorrelatePath::FFT ||
+      select_path(analyze_kernel(k15l), big, k15l.shape()) == CorrelatePath::FFT)
+    return false;
+
+  // Small float boxes are cheaper unrolled; integer ones keep their running sums
+  if (analyze_kernel(Tensor<float>(3, 3, 3, 1.0f / 27)).best != CorrelatePath::Fixed ||
+      analyze_kernel(Tensor<float>(5, 5, 5, 1.0f / 125)).best != CorrelatePath::Box ||
+      analyze_kernel(Tensor<uint8_t>(3, 3, 3, 1)).best != CorrelatePath::Box)
+    return false;
+
+  // Past 2^53, FFT is off by some units; direct paths are exact
+  Tensor<int64_t> in(Shape{4, 4, 4}), kern(Shape{3, 3, 3});
+  for (size_t i = 0; i < in.size(); i++)
+    in.data()[i] = (int64_t(1) << 55) + int64_t(i);
+  for (size_t i = 0; i < kern.size(); i++)
+    kern.data()[i] = (i % 2) ? 1 : -1;
+  const Tensor<int64_t> exact = correlate(in, kern, Mode::Nearest, int64_t(0), CorrelatePath::Generic);
+  return correlate(in, kern, Mode::Nearest, int64_t(0), CorrelatePath::FFT) != exact &&
+         correlate(in, kern, Mode::Nearest, int64_t(0)) == exact;
+}
+
+// Volume files round trip, and streaming matches the in-memory result.
+bool test_stream(void) {
+  const string in_path = "/tmp/test_tensor_in.vol", out_path = "/tmp/test_tensor_out.vol";
+  const Tensor<float> in = random_tensor<float>({23, 17, 31}, -60, 60);
+  write_volume(in_path, in);
+  if (read_volume<float>(in_path) != in)
+    return false;
+  bool ok = true;
+  try {
+    read_volume<int>(in_path);
+    ok = false;
+  }
+  catch (const runtime_error &) {
+  }
+  const Tensor<float> kernels[] = {random_tensor<float>({5, 3, 3}, -3, 3),
+                                   random_tensor<float>({2, 4, 1}, -3, 3)};
+  for (const Tensor<float> &kern : kernels) {
+    const Tensor<float> ref = correlate(in, kern, Mode::Constant, 1.5f, CorrelatePath::Sparse, 1);
+    for (const size_t slab : {1, 2, 7, 23, 100}) {
+      correlate_stream(in_path, out_path, kern, Mode::Constant, 1.5f, slab, CorrelatePath::Sparse, 1);
+      ok = ok && read_volume<float>(out_path) == ref;
+    }
+    const Tensor<float> mirrored = correlate(in, kern, Mode::Mirror, 0.0f, CorrelatePath::Sparse, 1);
+    correlate_stream(in_path, out_path, kern, Mode::Mirror, 0.0f, 3, CorrelatePath::Sparse, 1);
+    ok = ok && read_volume<float>(out_path) == mirrored;
+  }
+  remove(in_path.c_str());
+  remove(out_path.c_str());
+  return ok;
+}
+
+// Every mode and path against scipy (see gen_fixtures.py).
+bool test_modes_fixtures(void) {
+  const string dir = FIXTURE_DIR;
+  const Mode modes[] = {Mode::Constant, Mode::Reflect, Mode::Mirror, Mode::Nearest, Mode::Wrap};
+  for (const char *iname : {"a", "b"}) {
+    const Tensor<double> in = read_volume<double>(dir + "/" + iname + ".vol");
+    for (const char *kname : {"cross", "asym", "even", "big"}) {
+      const Tensor<double> kern = read_volume<double>(dir + "/" + kname + ".vol");
+      const KernelInfo<double> info = analyze_kernel(kern);
+      for (const Mode mode : modes) {
+        const Tensor<double> ref = read_volume<double>(dir + "/" + iname + "_" + kname + "_" +
+                                                       to_string(mode) + ".vol");
+        vector<CorrelatePath> paths = {CorrelatePath::Auto, CorrelatePath::Generic,
+                                       CorrelatePath::Sparse, CorrelatePath::FFT};
+        if (kern.dim(0) == kern.dim(1) && kern.dim(1) == kern.dim(2))
+          paths.push_back(CorrelatePath::Fixed);
+        if (info.separable)
+          paths.push_back(CorrelatePath::Separable);
+        for (const CorrelatePath p : paths)
+          if (!all_close(correlate(in, kern, mode, 2.5, p), ref, 1e-9)) {
+            cout << "[" << iname << " " << kname << " " << to_string(mode) << " "
+                 << to_string(p) << "] ";
+            return false;
+          }
+      }
+    }
+  }
+  return true;
+}
+
+// One element type, every mode and path against scipy: outputs of the five
+// modes are stacked along axis 0 (see write_dtype_fixtures() in gen_fixtures.py).
+template <typename T>
+static bool check_dtype_fixtures(const string &dtype) {
+  const string dir = FIXTURE_DIR;
+  const Mode modes[] = {Mode::Constant, Mode::Reflect, Mode::Mirror, Mode::Nearest, Mode::Wrap};
+  const Tensor<T> in = read_volume<T>(dir + "/q_" + dtype + ".vol");
+  const size_t d0 = in.dim(0);
+  for (const char *kname : {"cross", "ones", "signed"}) {
+    if (is_unsigned<T>::value && string(kname) == "signed")
+      continue;
+    const Tensor<T> kern = read_volume<T>(dir + "/" + kname + "_" + dtype + ".vol");
+    const Tensor<T> ref = read_volume<T>(dir + "/q_" + kname + "_" + dtype + ".vol");
+    const KernelInfo<T> info = analyze_kernel(kern);
+    vector<CorrelatePath> paths = {CorrelatePath::Auto, CorrelatePath::Generic,
+                                   CorrelatePath::Sparse, CorrelatePath::FFT};
+    if (kern.dim(0) == kern.dim(1) && kern.dim(1) == kern.dim(2))
+      paths.push_back(CorrelatePath::Fixed);
+    if (info.separable)
+      paths.push_back(CorrelatePath::Separable);
+    for (const CorrelatePath p : paths) {
+      Tensor<T> out(ref.shape());
+      for (size_t m = 0; m < 5; m++)
+        correlate(in, kern, out.slice(0, m * d0, (m + 1) * d0), modes[m], T(3), p);
+      if (!all_close(out, ref, 1e-6)) {
+        cout << "[" << dtype << " " << kname << " " << to_string(p) << "] ";
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool test_dtypes_fixtures(void) {
+  return check_dtype_fixtures<uint8_t>("uint8") && check_dtype_fixtures<int8_t>("int8") &&
+         check_dtype_fixtures<uint16_t>("uint16") && check_dtype_fixtures<int16_t>("int16") &&
+         check_dtype_fixtures<int32_t>("int32") && check_dtype_fixtures<int64_t>("int64") &&
+         check_dtype_fixtures<float>("float32") && check_dtype_fixtures<double>("float64");
+}
+
+// Separable and box paths, in every mode, against the generic one.
+bool test_modes_separable(void) {
+  const Tensor<int> in = random_tensor<int>({6, 9, 4}, -50, 50);
+  Tensor<int> sep(5, 3, 7);
+  for (size_t i = 0; i < 5; i++)
+    for (size_t j = 0; j < 3; j++)
+      for (size_t l = 0; l < 7; l++)
+        sep(i, j, l) = int((i + 1) * (j + 2) * (l % 2 ? -1 : 3));
+  for (const Mode mode : {Mode::Constant, Mode::Reflect, Mode::Mirror, Mode::Nearest, Mode::Wrap}) {
+    if (correlate(in, sep, mode, 3, CorrelatePath::Separable) !=
+        correlate(in, sep, mode, 3, CorrelatePath::Generic))
+      return false;
+    const Tensor<int> box(3, 7, 5, 2);
+    if (correlate(in, box, mode, 3, CorrelatePath::Box) !=
+        correlate(in, box, mode, 3, CorrelatePath::Generic))
+      return false;
+  }
+  return true;
+}
+
+// Tiles must cover the output exactly once.
+bool test_tiles(void) {
+  const Shape shape = {37, 301, 1029};
+  const vector<Region> tiles = make_tiles(shape, {5, 5, 5}, sizeof(float));
+  size_t covered = 0;
+  for (const Region &r : tiles)
+    covered += r.size();
+  return tiles.size() > 1 && covered == shape[0] * shape[1] * shape[2];
+}
+
+// Correlating a view (sub-volume, step slice, transposed, padded rows) must
+// give the same result as correlating a packed copy of it.
+bool test_views(void) {
+  const Tensor<int> big = random_tensor<int>({12, 15, 17}, -20, 20);
+  const Tensor<int> dense = random_tensor<int>({3, 3, 3}, -5, 5);
+  const Tensor<int> k5 = random_tensor<int>({5, 5, 5}, -5, 5);
+  const TensorView<int> views[] = {
+    big.sub(Region({2, 3, 1}, {10, 14, 16})),
+    big.slice(2, 1, 17, 2),
+    big.transpose(2, 0, 1),
+    big.transpose(1, 2, 0).slice(0, 3, 12, 3),
+  };
+  for (const TensorView<int> &v : views) {
+    const Tensor<int> packed(v);
+    if (packed != v)
+      return false;
+    for (const Tensor<int> *kern : {&k, &dense, &k5})
+      for (CorrelatePath p : {CorrelatePath::Generic, CorrelatePath::Sparse, CorrelatePath::Fixed,
+                              CorrelatePath::FFT})
+        if (correlate(v, *kern, Mode::Reflect, 0, p) != correlate(packed, *kern, Mode::Reflect, 0, p))
+          return false;
+    // Write into a transposed view of the output.
+    Tensor<int> out(packed.dim(2), packed.dim(1), packed.dim(0));
+    correlate(v, dense, out.transpose(2, 1, 0), Mode::Wrap);
+    if (out.transpose(2, 1, 0) != correlate(packed, dense, Mode::Wrap))
+      return false;
+  }
+  const Tensor<int> box(3, 3, 3, 1);
+  if (correlate(views[2], box, Mode::Nearest) != correlate(Tensor<int>(views[2]), box, Mode::Nearest))
+    return false;
+
+  Tensor<float> padded({7, 5, 19}, Layout::Padded);
+  for (size_t i = 0; i < 7; i++)
+    for (size_t j = 0; j < 5; j++)
+      for (size_t l = 0; l < 19; l++)
+        padded(i, j, l) = float(big(i, j, l));
+  if (padded.stride1() != 32 || reinterpret_cast<uintptr_t>(&padded(3, 2, 0)) % TENSOR_ALIGNMENT)
+    return false;
+  const Tensor<float> kf = random_tensor<float>({3, 3, 3}, -5, 5);
+  const Tensor<float> packed(padded.view());
+  return correlate(padded, kf) == correlate(packed, kf) && Tensor<float>(padded) == packed;
+}
+
+// Temporaries of a pipeline come from the arena after the first round.
+bool test_arena(void) {
+  const Tensor<float> in = random_tensor<float>({20, 20, 20}, 0, 9);
+  const Tensor<float> box(3, 3, 3, 1.0f / 27);
+  Arena arena;
+  {
+    ArenaScope scope(arena);
+    if (Arena::current() != &arena)
+      return false;
+    Tensor<float> x = in;
+    size_t before = 0;
+    for (int r = 0; r < 5; r++) {
+      x = correlate(correlate(x, box), box);
+      if (r == 0)
+        before = aligned_allocations();
+    }
+    if (aligned_allocations() != before || arena.hits() == 0)
+      return false;
+    if (reinterpret_cast<uintptr_t>(x.data()) % TENSOR_ALIGNMENT)
+      return false;
+  }
+  return Arena::current() == nullptr;
+}
+
+// 8 and 16-bit data: exact accumulation on every path, then saturation,
+// wrap-around and requantization of the result.
+bool test_quantized(void) {
+  const Tensor<uint8_t> a8 = convert<uint8_t>(a), k8 = convert<uint8_t>(k);
+  for (CorrelatePath p : {CorrelatePath::Auto, CorrelatePath::Generic, CorrelatePath::Sparse,
+                          CorrelatePath::Fixed, CorrelatePath::FFT}) {
+    Tensor<int16_t> out(a.shape());
+    correlate(a8, k8, out, Requantize(), Mode::Constant, 0, p);
+    if (out != convert<int16_t>(expected))
+      return false;
+  }
+  // Saturated, wrapped and scaled back to 8 bits: max(expected) is 309.
+  Tensor<uint8_t> out8(a.shape());
+  correlate(a8, k8, out8, Requantize());
+  if (out8 != convert<uint8_t>(expected, +[](int v) { return uint8_t(min(v, 255)); }))
+    return false;
+  correlate(a8, k8, out8, Requantize{1, 0, 0, false});
+  if (out8 != convert<uint8_t>(expected))
+    return false;
+  correlate(a8, k8, out8, Requantize{1, 1, -10});
+  if (out8 != convert<uint8_t>(expected, +[](int v) { return uint8_t(max(0, (v + 1) / 2 - 10)); }))
+    return false;
+
+  // Signed 8-bit, separable and box kernels too, against 32-bit data.
+  const Tensor<int8_t> in8 = random_tensor<int8_t>({9, 11, 13}, -128, 127);
+  Tensor<int8_t> sep(3, 5, 3);
+  for (size_t i = 0; i < 3; i++)
+    for (size_t j = 0; j < 5; j++)
+      for (size_t l = 0; l < 3; l++)
+        sep(i, j, l) = int8_t((i + 1) * (j % 2 ? -2 : 3) * (l + 2));
+  const Tensor<int8_t> kernels[] = {random_tensor<int8_t>({3, 3, 3}, -128, 127), sep,
+                                    Tensor<int8_t>(5, 3, 3, -7), random_tensor<int8_t>({5, 5, 5}, -9, 9)};
+  for (const Tensor<int8_t> &kern : kernels)
+    for (const Mode mode : {Mode::Constant, Mode::Reflect, Mode::Wrap})
+      for (CorrelatePath p : {CorrelatePath::Auto, CorrelatePath::Generic, CorrelatePath::Sparse,
+                              CorrelatePath::Separable, CorrelatePath::Box, CorrelatePath::Fixed}) {
+        const KernelInfo<int8_t> info = analyze_kernel(kern);
+        if ((p == CorrelatePath::Separable && !info.separable) || (p == CorrelatePath::Box && !info.box) ||
+            (p == CorrelatePath::Fixed && kern.shape() != Shape{3, 3, 3} && kern.shape() != Shape{5, 5, 5}))
+          continue;
+        Tensor<int32_t> out(in8.shape());
+        correlate(in8, kern, out, Requantize(), mode, -3, p);
+        if (out != correlate(convert<int32_t>(in8), convert<int32_t>(kern), mode, -3, CorrelatePath::Generic))
+          return false;
+      }
+  if (!analyze_kernel(sep).separable)
+    return false;
+
+  // 16-bit data, full range.
+  const Tensor<int16_t> in16 = random_tensor<int16_t>({8, 7, 9}, -32768, 32767);
+  const Tensor<int16_t> k16 = random_tensor<int16_t>({3, 3, 3}, -32768, 32767);
+  Tensor<int64_t> out64(in16.shape());
+  correlate(in16, k16, out64, Requantize(), Mode::Mirror);
+  return out64 == correlate(convert<int64_t>(in16), convert<int64_t>(k16), Mode::Mirror);
+}
+
+// A filter bank gives the same responses as one sparse correlation per
+// kernel, in both layouts and on strided inputs.
+bool test_bank(void) {
+  const Tensor<int> in = random_tensor<int>({9, 14, 11}, -20, 20);
+  vector<Tensor<int>> kernels = {k};
+  for (int f = 0; f < 7; f++)
+    kernels.push_back(random_tensor<int>({3, 3, 3}, -3, 3));
+  for (const TensorView<int> &v : {in.view(), in.transpose(2, 0, 1)})
+    for (const BankLayout layout : {BankLayout::Planar, BankLayout::Interleaved})
+      for (const Mode mode : {Mode::Constant, Mode::Mirror}) {
+        const Tensor<int> bank = correlate_bank(v, kernels, layout, mode, 4);
+        for (size_t f = 0; f < kernels.size(); f++)
+          if (bank_slice(bank.view(), f, kernels.size(), layout) !=
+              correlate(v, kernels[f], mode, 4, CorrelatePath::Sparse))
+            return false;
+      }
+  try {
+    correlate_bank(in, {k, Tensor<int>(5, 5, 5, 1)}, BankLayout::Planar);
+    return false;
+  }
+  catch (const invalid_argument &) {
+  }
+  return true;
+}
+
+// Both batch strategies give, for every volume, the same result as a single
+// correlation: tiny volumes in a batch that is not a multiple of the lanes,
+// every other volume of a batch, and larger float volumes.
+bool test_batch(void) {
+  Batch<int> in(37, a.shape());
+  for (size_t b = 0; b < in.batch(); b++)
+    copy(random_tensor<int>(a.shape(), -60, 60).view(), in[b]);
+  copy(a.view(), in[0]);
+  const BatchView<int> odd(in[1].data(), in.batch() / 2, in.shape(), 2 * in.batch_stride(), in.strides());
+  const Tensor<int> kern = random_tensor<int>({3, 2, 3}, -3, 3);
+  for (const BatchView<int> &v : {in.view(), odd})
+    for (const Mode mode : {Mode::Constant, Mode::Reflect, Mode::Mirror, Mode::Nearest, Mode::Wrap})
+      for (const BatchStrategy st : {BatchStrategy::Interleaved, BatchStrategy::PerVolume})
+        for (const TensorView<int> &kv : {k.view(), kern.view()}) {
+          const Batch<int> out = correlate_batch(v, kv, mode, 3, st);
+          for (size_t b = 0; b < v.batch(); b++)
+            if (out[b] != correlate(v[b], kv, mode, 3, CorrelatePath::Generic))
+              return false;
+        }
+  if (correlate_batch(in.view(), k)[0] != expected)
+    return false;
+
+  Batch<float> big(5, {20, 17, 33});
+  for (size_t b = 0; b < big.batch(); b++)
+    copy(random_tensor<float>(big.shape(), 0, 9).view(), big[b]);
+  const Tensor<float> kf = random_tensor<float>({3, 3, 3}, -2, 2);
+  for (const BatchStrategy st : {BatchStrategy::Interleaved, BatchStrategy::PerVolume}) {
+    const Batch<float> out = correlate_batch(big.view(), kf, Mode::Reflect, 0.0f, st);
+    for (size_t b = 0; b < big.batch(); b++)
+      if (!all_close(Tensor<float>(out[b]), correlate(big[b], kf, Mode::Reflect), 1e-5))
+        return false;
+  }
+  try {
+    correlate_batch(in.view(), k, Batch<int>(36, a.shape()));
+    return false;
+  }
+  catch (const invalid_argument &) {
+  }
+  return true;
+}
+
+// A fused expression gives the same values as its operations evaluated one
+// at a time, whatever path computes its correlation.
+bool test_expr(void) {
+  const Tensor<int> scaled = evaluate(clamp(correlation(a, k) * 2 - a, 100, 500));
+  for (size_t i = 0; i < a.size(); i++)
+    if (scaled.data()[i] != min(max(expected.data()[i] * 2 - a.data()[i], 100), 500))
+      return false;
+
+  const Tensor<float> in = random_tensor<float>({12, 13, 14}, 0, 60);
+  const Tensor<float> bias = random_tensor<float>({12, 13, 14}, -100, 100);
+  const Tensor<float> box(3, 3, 3, 1.0f / 27);
+  for (const CorrelatePath p : {CorrelatePath::Auto, CorrelatePath::Sparse, CorrelatePath::Fixed,
+                                CorrelatePath::Separable, CorrelatePath::FFT}) {
+    const Tensor<float> c = correlate(in, box, Mode::Reflect, 0.0f, p);
+    const Tensor<float> t1 = evaluate(c * 1.5f);
+    const Tensor<float> t2 = evaluate(t1 + bias);
+    const Tensor<float> t3 = evaluate(clamp(t2, 0, 50));
+    const Tensor<float> unfused = evaluate(threshold(t3, 20.0f));
+    const Tensor<float> fused =
+        evaluate(threshold(clamp(correlation(in, box, Mode::Reflect, 0.0f, p) * 1.5f + bias, 0, 50), 20.0f));
+    if (fused != unfused || !all_close(t3, evaluate(clamp(correlation(in, box, Mode::Reflect, 0.0f, p) *
+                                                          1.5f + bias, 0, 50)), 1e-6))
+      return false;
+  }
+
+  // Floating-point scalars promote integer expressions, as in numpy
+  const Tensor<double> seventh = evaluate(correlation(a, k) * (1.0 / 7));
+  static_assert(std::is_same<decltype(evaluate(a * 2))::value_type, int>::value, "int scalar keeps int");
+  for (size_t i = 0; i < a.size(); i++)
+    if (seventh.data()[i] != expected.data()[i] * (1.0 / 7))
+      return false;
+
+  // Temporaries are kept by the expression, outputs can be operands.
+  const auto twice = Tensor<int>(a) * 2;
+  Tensor<int> x(a);
+  evaluate(-x + x * 3, x);
+  if (evaluate(twice) != x || evaluate(2 * a - a / 1) != a)
+    return false;
+  Tensor<uint8_t> bytes(a.shape());
+  evaluate(threshold(a, 30, 0, 255), bytes);
+  for (size_t i = 0; i < a.size(); i++)
+    if (bytes.data()[i] != (a.data()[i] < 30 ? 0 : 255))
+      return false;
+  try {
+    evaluate(a + in);
+    return false;
+  }
+  catch (const invalid_argument &) {
+  }
+  return true;
+}
+
+// The C interface reads arrays in place, with byte strides, and reports
+// errors as codes.
+bool test_capi(void) {
+  const Tensor<float> in = random_tensor<float>({10, 12, 14}, 0, 9);
+  const Tensor<float> kern = random_tensor<float>({3, 3, 3}, -2, 2);
+  const TensorView<float> v = in.slice(2, 1, 14, 2).transpose(1, 0, 2);
+  Tensor<float> out(v.shape());
+  const auto array = [](const TensorView<float> &t) {
+    tensor_array r = {t.data(), TENSOR_FLOAT32, {t.dim(0), t.dim(1), t.dim(2)}, {}};
+    for (int a = 0; a < 3; a++)
+      r.strides[a] = t.stride(a) * int64_t(sizeof(float));
+    return r;
+  };
+  const tensor_array ta = array(v), tk = array(kern), to = array(out);
+  if (tensor_correlate(&ta, &tk, &to, TENSOR_MODE_MIRROR, 0, TENSOR_PATH_AUTO, 0) != TENSOR_OK ||
+      out != correlate(v, kern, Mode::Mirror) ||
+      string(tensor_path_name(tensor_auto_path(&ta, &tk))) != "fixed")
+    return false;
+  tensor_array bad = ta;
+  bad.strides[2] = 2;
+  if (tensor_correlate(&bad, &tk, &to, TENSOR_MODE_MIRROR, 0, TENSOR_PATH_AUTO, 0) != TENSOR_EINVAL ||
+      string(tensor_error()).find("stride") == string::npos)
+    return false;
+  bad = tk;
+  bad.dtype = TENSOR_INT32;
+  return tensor_correlate(&ta, &bad, &to, TENSOR_MODE_MIRROR, 0, TENSOR_PATH_AUTO, 0) == TENSOR_EINVAL &&
+         tensor_correlate(&ta, &tk, &to, 7, 0, TENSOR_PATH_AUTO, 0) == TENSOR_EINVAL;
+}
+
+int main(int argc, char *argv[]) {
+  int failed = 0;
+  TEST_AND_CHECK(test_reference);
+  TEST_AND_CHECK(test_kernel_analysis);
+  TEST_AND_CHECK(test_paths_agree);
+  TEST_AND_CHECK(test_float_paths);
+  TEST_AND_CHECK(test_box_dynamic_range);
+  TEST_AND_CHECK(test_small_input);
+  TEST_AND_CHECK(test_threads_deterministic);
+  TEST_AND_CHECK(test_worker_pool);
+  TEST_AND_CHECK(test_tiles);
+  TEST_AND_CHECK(test_fft);
+  TEST_AND_CHECK(test_fft_path);
+  TEST_AND_CHECK(test_cost_model);
+  TEST_AND_CHECK(test_stream);
+  TEST_AND_CHECK(test_modes_fixtures);
+  TEST_AND_CHECK(test_dtypes_fixtures);
+  TEST_AND_CHECK(test_modes_separable);
+  TEST_AND_CHECK(test_views);
+  TEST_AND_CHECK(test_arena);
+  TEST_AND_CHECK(test_quantized);
+  TEST_AND_CHECK(test_bank);
+  TEST_AND_CHECK(test_batch);
+  TEST_AND_CHECK(test_expr);
+  TEST_AND_CHECK(test_capi);
+  return failed ? 1 : 0;
+}
@@ -2,6 +2,10 @@
 # Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
 # This code is licensed under MIT license (see LICENSE.txt for details)
 #
+import ctypes
+import os
+import sys
+import time
 import numpy as np
 from scipy import ndimage
 
@@ -22,3 +26,103 @@ k = np.array([[[0, 0, 0], [0, 1, 0], [0, 0, 0]],
 print(a.shape)
 print(a)
 print(ndimage.correlate(a, k, mode='constant', cval=0.0))
+
+
+# Native engine (libtensor.so, see capi.h), through ctypes: arrays are passed
+# in place, as pointer, shape and strides.
+
+DTYPES = {np.dtype(np.uint8): 1, np.dtype(np.int8): 2, np.dtype(np.uint16): 3,
+          np.dtype(np.int16): 4, np.dtype(np.int32): 5, np.dtype(np.int64): 6,
+          np.dtype(np.float32): 7, np.dtype(np.float64): 8}
+MODES = ['constant', 'reflect', 'mirror', 'nearest', 'wrap']
+PATHS = ['auto', 'generic', 'sparse', 'box', 'separable', 'fixed', 'fft']
+
+
+class TensorArray(ctypes.Structure):
+    _fields_ = [('data', ctypes.c_void_p), ('dtype', ctypes.c_int32),
+                ('shape', ctypes.c_uint64 * 3), ('strides', ctypes.c_int64 * 3)]
+
+
+def load_library():
+    """libtensor.so next to this script, in the build directory, or $LIBTENSOR."""
+    here = os.path.dirname(os.path.abspath(__file__))
+    for path in [os.environ.get('LIBTENSOR', ''), os.path.join(here, 'libtensor.so'),
+                 os.path.join(here, '..', 'libtensor.so'), os.path.join(os.getcwd(), 'libtensor.so')]:
+        if path and os.path.exists(path):
+            lib = ctypes.CDLL(path)
+            args = [ctypes.POINTER(TensorArray)] * 2
+            lib.tensor_correlate.argtypes = args + [ctypes.POINTER(TensorArray), ctypes.c_int,
+                                                    ctypes.c_double, ctypes.c_int, ctypes.c_uint]
+            lib.tensor_auto_path.argtypes = args
+            lib.tensor_path_name.restype = ctypes.c_char_p
+            lib.tensor_error.restype = ctypes.c_char_p
+            return lib
+    return None
+
+
+def as_tensor(x):
+    """Describe a 3-D numpy array (any strides) without copying it."""
+    return TensorArray(x.ctypes.data, DTYPES[x.dtype], (ctypes.c_uint64 * 3)(*x.shape),
+                       (ctypes.c_int64 * 3)(*x.strides))
+
+
+def correlate(lib, x, w, output=None, mode='constant', cval=0.0, path='auto', threads=0):
+    """Same as ndimage.correlate(x, w, output, mode, cval), on the native engine."""
+    w = np.asarray(w, dtype=x.dtype)
+    if output is None:
+        output = np.empty_like(x)
+    err = lib.tensor_correlate(as_tensor(x), as_tensor(w), as_tensor(output), MODES.index(mode),
+                               cval, PATHS.index(path), threads)
+    if err != 0:
+        raise ValueError(lib.tensor_error().decode())
+    return output
+
+
+def best_time(fn, reps=3):
+    best = float('inf')
+    for _ in range(reps):
+        start = time.perf_counter()
+        fn()
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+lib = load_library()
+if lib is None:
+    print('libtensor.so not found (make libtensor.so, or set LIBTENSOR): native engine skipped')
+    sys.exit(0)
+
+# Integer results are exact, as long as they fit the dtype. Floats are
+# accumulated in their own precision, scipy's in double.
+failed = 0
+rng = np.random.default_rng(0)
+x = rng.integers(0, 60, size=(20, 21, 22))
+for dtype in [np.int16, np.int32, np.int64, np.float32, np.float64]:
+    for w in [k, rng.integers(-3, 4, size=(3, 2, 5))]:
+        for mode in MODES:
+            for view in [x.astype(dtype), x.astype(dtype)[::2, :, ::-3].transpose(1, 0, 2)]:
+                expected = ndimage.correlate(view, w.astype(dtype), mode=mode, cval=2)
+                result = correlate(lib, view, w, mode=mode, cval=2)
+                if not np.allclose(result, expected, rtol=1e-5, atol=1e-3):
+                    print('MISMATCH', np.dtype(dtype).name, w.shape, mode, view.shape)
+                    failed += 1
+print('native vs ndimage.correlate:', 'FAILED' if failed else 'SUCCEEDED')
+
+# Timings, single thread and all cores.
+print('%-28s %-10s %10s %10s %10s %9s' % ('case', 'path', 'ndimage', 'native', 'native MT', 'speed-up'))
+n = 128
+volume = rng.random((n, n, n), dtype=np.float32) * 60
+cases = [('cross 3x3x3', k.astype(np.float32)),
+         ('dense 3x3x3', rng.random((3, 3, 3), dtype=np.float32)),
+         ('box 5x5x5', np.full((5, 5, 5), 1 / 125, dtype=np.float32)),
+         ('dense 7x7x7', rng.random((7, 7, 7), dtype=np.float32))]
+for name, w in cases:
+    for label, view in [('%d^3' % n, volume), ('%d^3 [:, ::2]' % n, volume[:, ::2])]:
+        path = lib.tensor_path_name(lib.tensor_auto_path(as_tensor(view), as_tensor(w))).decode()
+        out = np.empty_like(view)
+        t_scipy = best_time(lambda: ndimage.correlate(view, w, output=out, mode='reflect'))
+        t_native = best_time(lambda: correlate(lib, view, w, output=out, mode='reflect', threads=1))
+        t_mt = best_time(lambda: correlate(lib, view, w, output=out, mode='reflect'))
+        print('%-28s %-10s %8.1fms %8.1fms %8.1fms %8.1fx' % (name + ', ' + label, path, t_scipy * 1e3,
+                                                                t_native * 1e3, t_mt * 1e3, t_scipy / t_native))
+sys.exit(1 if failed else 0)
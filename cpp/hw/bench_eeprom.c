@@ -0,0 +1,922 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "eeprom.h"
+#include "eeprom_kv.h"
+
+#define BENCH_TEXT_NAME   "bench_eeprom.txt"
+#define BENCH_IMAGE_NAME  "bench_eeprom.img"
+#define BENCH_FLUSH_NAME  "bench_eeprom_flush.img"
+#define BENCH_TRACE_NAME  "bench_eeprom.trace"
+#define BENCH_SNAP_TEXT   "bench_eeprom_snap.txt"
+#define BENCH_SNAP_IMAGE  "bench_eeprom_snap.img"
+
+/**
+	Monotonic time, in microseconds.
+ */
+static double now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+	Average time of one call, in microseconds.
+	\param[in] fn Function to time.
+	\param[in] file_name Its argument.
+	\param[in] reps Number of calls.
+ */
+static double time_file_op(uint32_t (*fn)(const char *), const char *file_name, const int reps) {
+	const double start = now_us();
+	for (int r = 0; r < reps; r++)
+		if (fn(file_name) != EEPROM_SZ) {
+			fprintf(stderr, "I/O error on %s\n", file_name);
+			return 0;
+		}
+	return (now_us() - start) / reps;
+}
+
+/**
+	Same as time_file_op(), on an instance.
+ */
+static double time_file_op_dev(eeprom_t *e, uint32_t (*fn)(eeprom_t *, const char *),
+			const char *file_name, const int reps) {
+	const double start = now_us();
+	for (int r = 0; r < reps; r++)
+		if (fn(e, file_name) != eeprom_dev_size(e)) {
+			fprintf(stderr, "I/O error on %s\n", file_name);
+			return 0;
+		}
+	return (now_us() - start) / reps;
+}
+
+/**
+	Load and save, text format against binary image.
+ */
+static void bench_files(void) {
+	const int reps = 200;
+	for (uint32_t i = 0; i < EEPROM_SZ; i++)
+		eeprom_write_byte(i, rand() % 0x100);
+	printf("Load and save, %u bytes (us per call)\n", EEPROM_SZ);
+	printf("  %-8s %10s %10s\n", "format", "save", "load");
+	const double text_save = time_file_op(eeprom_to_file, BENCH_TEXT_NAME, reps);
+	const double text_load = time_file_op(eeprom_from_file, BENCH_TEXT_NAME, reps);
+	const double image_save = time_file_op(eeprom_to_image, BENCH_IMAGE_NAME, reps);
+	const double image_load = time_file_op(eeprom_from_image, BENCH_IMAGE_NAME, reps);
+	printf("  %-8s %10.1f %10.1f\n", "text", text_save, text_load);
+	printf("  %-8s %10.1f %10.1f\n", "image", image_save, image_load);
+	printf("  %-8s %9.1fx %9.1fx\n", "speed-up", text_save / image_save, text_load / image_load);
+	remove(BENCH_TEXT_NAME);
+	remove(BENCH_IMAGE_NAME);
+}
+
+/**
+	Work item of a benchmark thread: iters calls of op.
+ */
+typedef struct {
+	void (*op)(const uint32_t i);
+	uint32_t iters;
+} bench_job;
+
+static void *bench_worker(void *arg) {
+	const bench_job *job = (const bench_job *)arg;
+	for (uint32_t i = 0; i < job->iters; i++)
+		job->op(i);
+	return NULL;
+}
+
+/**
+	Run calls of op on several threads at once.
+	\param[in] op Operation; its argument is the call number, per thread.
+	\param[in] threads Number of threads.
+	\param[in] iters Number of calls of each thread.
+	\return Wall time, in microseconds.
+ */
+static double run_threads(void (*op)(const uint32_t), const uint32_t threads, const uint32_t iters) {
+	pthread_t *tids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+	bench_job job = {op, iters};
+	const double start = now_us();
+	for (uint32_t t = 0; t < threads; t++)
+		pthread_create(&tids[t], NULL, bench_worker, &job);
+	for (uint32_t t = 0; t < threads; t++)
+		pthread_join(tids[t], NULL);
+	const double elapsed = now_us() - start;
+	free(tids);
+	return elapsed;
+}
+
+/**
+	How eeprom_read() and eeprom_write() used to split a request: words up
+	to a page boundary, then whole pages, then the remaining words, each one
+	locking the buffer on its own.
+ */
+static uint32_t split_io(const uint32_t addr, uint8_t *data, const uint32_t len, const bool write) {
+	uint32_t done = 0, curr = addr;
+	while (done < len && (eeprom_addr_to_page_off(curr) != 0 || len - done < EEPROM_PAGE_SZ)) {
+		done += write ? eeprom_write_word(curr, data + done) : eeprom_read_word(curr, data + done);
+		curr += 1;
+	}
+	while (len - done >= EEPROM_PAGE_SZ) {
+		const uint32_t page = eeprom_addr_to_page(curr);
+		done += write ? eeprom_write_page(page, data + done) : eeprom_read_page(page, data + done);
+		curr += EEPROM_PAGE_SZ / EEPROM_WORD_SZ;
+	}
+	while (done < len) {
+		done += write ? eeprom_write_word(curr, data + done) : eeprom_read_word(curr, data + done);
+		curr += 1;
+	}
+	return done;
+}
+
+// Whole EEPROM, per call
+static void split_read_all(const uint32_t i) {
+	uint8_t buf[EEPROM_SZ];
+	split_io(0, buf, EEPROM_SZ, false);
+}
+
+static void bulk_read_all(const uint32_t i) {
+	uint8_t buf[EEPROM_SZ];
+	eeprom_read(0, buf, EEPROM_SZ);
+}
+
+// Four scattered 64-byte records, per call
+#define N_RECORDS   4
+#define RECORD_SZ   64
+
+static void split_write_records(const uint32_t i) {
+	uint8_t buf[N_RECORDS][RECORD_SZ];
+	memset(buf, i, sizeof(buf));
+	for (uint32_t r = 0; r < N_RECORDS; r++)
+		split_io((i * 7 + r * 1031) % (EEPROM_N_WORDS - RECORD_SZ), buf[r], RECORD_SZ, true);
+}
+
+static void bulk_writev_records(const uint32_t i) {
+	uint8_t buf[N_RECORDS][RECORD_SZ];
+	eeprom_iovec iov[N_RECORDS];
+	memset(buf, i, sizeof(buf));
+	for (uint32_t r = 0; r < N_RECORDS; r++) {
+		iov[r].addr = (i * 7 + r * 1031) % (EEPROM_N_WORDS - RECORD_SZ);
+		iov[r].data = buf[r];
+		iov[r].len = RECORD_SZ;
+	}
+	eeprom_writev(iov, N_RECORDS);
+}
+
+/**
+	Bulk reads and writes, against the same requests split into words and
+	pages, from 1 to 64 threads.
+ */
+static void bench_bulk(void) {
+	const uint32_t iters = 256;
+	printf("Bulk access, %u calls per thread (MB/s, all threads)\n", iters);
+	printf("  %7s %12s %12s %9s %12s %12s %9s\n", "threads", "read split", "read bulk", "speed-up",
+				 "write split", "writev", "speed-up");
+	for (uint32_t threads = 1; threads <= 64; threads *= 2) {
+		const double calls = (double)iters * threads;
+		const double rs = calls * EEPROM_SZ / run_threads(split_read_all, threads, iters);
+		const double rb = calls * EEPROM_SZ / run_threads(bulk_read_all, threads, iters);
+		const double ws = calls * N_RECORDS * RECORD_SZ / run_threads(split_write_records, threads, iters);
+		const double wb = calls * N_RECORDS * RECORD_SZ / run_threads(bulk_writev_records, threads, iters);
+		printf("  %7u %12.1f %12.1f %8.1fx %12.1f %12.1f %8.1fx\n", threads, rs, rb, rb / rs, ws, wb, wb / ws);
+	}
+}
+
+// One 64-byte record per call; one call in 20 writes, or none.
+static void mixed_access(const uint32_t i) {
+	uint8_t rec[RECORD_SZ];
+	const uint32_t addr = (i * 97) % (EEPROM_N_WORDS - RECORD_SZ);
+	if (i % 20 == 0) {
+		memset(rec, i, RECORD_SZ);
+		eeprom_write(addr, rec, RECORD_SZ);
+	}
+	else
+		eeprom_read(addr, rec, RECORD_SZ);
+}
+
+static void read_only_access(const uint32_t i) {
+	uint8_t rec[RECORD_SZ];
+	eeprom_read((i * 97) % (EEPROM_N_WORDS - RECORD_SZ), rec, RECORD_SZ);
+}
+
+/**
+	Mutex against seqlock readers, on read-only and 95% read workloads, from
+	1 to 64 threads.
+ */
+static void bench_readers(void) {
+	const uint32_t iters = 100000;
+	printf("Concurrent readers, 64-byte records, %u calls per thread (M calls/s, all threads)\n", iters);
+	printf("  %7s %10s %10s %9s %10s %10s %9s\n", "threads", "RO mutex", "RO seqlock", "speed-up",
+				 "95% mutex", "95% seqlock", "speed-up");
+	for (uint32_t threads = 1; threads <= 64; threads *= 2) {
+		const double calls = (double)iters * threads;
+		double rate[2][2];
+		for (int m = 0; m < 2; m++) {
+			eeprom_set_lock_mode(m ? EEPROM_LOCK_SEQLOCK : EEPROM_LOCK_MUTEX);
+			rate[m][0] = calls / run_threads(read_only_access, threads, iters);
+			rate[m][1] = calls / run_threads(mixed_access, threads, iters);
+		}
+		printf("  %7u %10.2f %10.2f %8.1fx %10.2f %10.2f %8.1fx\n", threads, rate[0][0], rate[1][0],
+					 rate[1][0] / rate[0][0], rate[0][1], rate[1][1], rate[1][1] / rate[0][1]);
+	}
+	eeprom_set_lock_mode(EEPROM_LOCK_MUTEX);
+}
+
+/**
+	Resident memory of the process, in bytes.
+ */
+static double resident_bytes(void) {
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+// Instances of the threads, one each
+#define MAX_THREADS  64
+static eeprom_t *thread_devs[MAX_THREADS];
+static uint32_t next_dev;
+static __thread eeprom_t *own_dev;
+
+// Same as mixed_access(), on the default instance or on one per thread.
+static void instance_access(eeprom_t *e, const uint32_t i) {
+	uint8_t rec[RECORD_SZ];
+	const uint32_t addr = (i * 97) % (EEPROM_N_WORDS - RECORD_SZ);
+	if (i % 20 == 0) {
+		memset(rec, i, RECORD_SZ);
+		eeprom_dev_write(e, addr, rec, RECORD_SZ);
+	}
+	else
+		eeprom_dev_read(e, addr, rec, RECORD_SZ);
+}
+
+static void shared_instance_access(const uint32_t i) {
+	instance_access(eeprom_default(), i);
+}
+
+static void own_instance_access(const uint32_t i) {
+	if (!own_dev)
+		own_dev = thread_devs[__atomic_fetch_add(&next_dev, 1, __ATOMIC_RELAXED)];
+	instance_access(own_dev, i);
+}
+
+/**
+	Memory per instance, then 95% read throughput with all threads on the
+	default instance against one instance per thread.
+ */
+static void bench_instances(void) {
+	const uint32_t n = 10000;
+	eeprom_t **devs = (eeprom_t **)malloc(n * sizeof(eeprom_t *));
+	printf("Memory per instance, %u instances (bytes)\n", n);
+	const uint32_t sizes[3] = {64, 1024, 8192};
+	for (int s = 0; s < 3; s++) {
+		const eeprom_geometry geo = {sizes[s], 1, 4};
+		const double before = resident_bytes();
+		for (uint32_t i = 0; i < n; i++)
+			devs[i] = eeprom_open(&geo);
+		const double after = resident_bytes();
+		for (uint32_t i = 0; i < n; i++)
+			eeprom_close(devs[i]);
+		printf("  %5u-byte EEPROM %10.0f (%.0f overhead)\n", sizes[s], (after - before) / n,
+					 (after - before) / n - sizes[s]);
+	}
+	free(devs);
+
+	const uint32_t iters = 100000;
+	const eeprom_geometry geo = {EEPROM_N_WORDS, EEPROM_WORD_SZ, EEPROM_PAGE_SZ};
+	printf("Instances, 64-byte records, 95%% reads, %u calls per thread (M calls/s, all threads)\n", iters);
+	printf("  %7s %10s %12s %9s\n", "threads", "shared", "one each", "speed-up");
+	for (uint32_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		for (uint32_t t = 0; t < threads; t++)
+			thread_devs[t] = eeprom_open(&geo);
+		next_dev = 0;
+		const double calls = (double)iters * threads;
+		const double shared = calls / run_threads(shared_instance_access, threads, iters);
+		const double own = calls / run_threads(own_instance_access, threads, iters);
+		printf("  %7u %10.2f %12.2f %8.1fx\n", threads, shared, own, own / shared);
+		for (uint32_t t = 0; t < threads; t++)
+			eeprom_close(thread_devs[t]);
+	}
+}
+
+/**
+	Incremental flush of sparse updates, against a full rewrite of the image.
+ */
+static void bench_flush(void) {
+	const int reps = 50;
+	const eeprom_geometry geos[2] = {{EEPROM_N_WORDS, EEPROM_WORD_SZ, EEPROM_PAGE_SZ}, {4 << 20, 1, 64}};
+	const uint32_t updates[3] = {1, 16, 256};
+	printf("Flush after N single-byte writes (us per flush, bytes written)\n");
+	printf("  %-20s %5s %10s %12s %12s %12s %9s\n", "geometry", "N", "bytes", "flush",
+				 "flush+sync", "rewrite", "speed-up");
+	for (int g = 0; g < 2; g++) {
+		eeprom_t *e = eeprom_open(&geos[g]);
+		const uint32_t size = eeprom_dev_size(e);
+		if (!eeprom_dev_attach(e, BENCH_FLUSH_NAME)) {
+			fprintf(stderr, "Cannot attach %s\n", BENCH_FLUSH_NAME);
+			eeprom_close(e);
+			return;
+		}
+		const double rewrite = time_file_op_dev(e, eeprom_dev_to_image, BENCH_IMAGE_NAME, reps);
+		for (int u = 0; u < 3; u++) {
+			double t[2] = {0, 0};
+			uint32_t bytes = 0;
+			for (int sync = 0; sync < 2; sync++)
+				for (int r = 0; r < reps; r++) {
+					for (uint32_t i = 0; i < updates[u]; i++)
+						eeprom_dev_write_byte(e, rand() % size, rand() % 0x100);
+					const double start = now_us();
+					bytes = eeprom_dev_flush(e, sync);
+					t[sync] += now_us() - start;
+				}
+			char name[32];
+			snprintf(name, sizeof(name), "%u B, %u B pages", size, geos[g].page_sz);
+			printf("  %-20s %5u %10u %12.1f %12.1f %12.1f %8.1fx\n", name, updates[u], bytes,
+						 t[0] / reps, t[1] / reps, rewrite, rewrite / (t[0] / reps));
+		}
+		eeprom_close(e);
+	}
+	remove(BENCH_FLUSH_NAME);
+	remove(BENCH_IMAGE_NAME);
+}
+
+static int compare_floats(const void *a, const void *b) {
+	const float x = *(const float *)a, y = *(const float *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+	Latency of eeprom_write_page() under sustained writes, with the file kept
+	up to date by the caller (synced flush every few writes), or by the
+	background flusher.
+ */
+static void bench_flusher(void) {
+	const uint32_t writes = 200000, flush_every = 1000;
+	const eeprom_geometry geo = {1 << 20, 1, 64};
+	const struct {
+		const char *name;
+		bool attach;
+		eeprom_flusher_config cfg;  // No flusher if both 0
+	} cases[] = {
+		{"memory only", false, {0, 0, false}},
+		{"caller flush+sync", true, {0, 0, false}},
+		{"flusher 10 ms", true, {10, 0, false}},
+		{"flusher 10 ms+sync", true, {10, 0, true}},
+		{"flusher 256 pages+sync", true, {0, 256, true}}
+	};
+	float *lat = (float *)malloc(writes * sizeof(float));
+	uint8_t page[64];
+	printf("eeprom_write_page() under sustained writes, %u B, %u writes (us per write)\n",
+				 geo.n_words, writes);
+	printf("  %-24s %10s %8s %8s %8s %8s %8s\n", "persistence", "writes/s", "p50", "p99",
+				 "p99.9", "max", "sync");
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		eeprom_t *e = eeprom_open(&geo);
+		const bool flusher = cases[c].cfg.interval_ms > 0 || cases[c].cfg.dirty_pages > 0;
+		if ((cases[c].attach && !eeprom_dev_attach(e, BENCH_FLUSH_NAME)) ||
+				(flusher && !eeprom_dev_start_flusher(e, &cases[c].cfg))) {
+			fprintf(stderr, "Cannot attach %s\n", BENCH_FLUSH_NAME);
+			eeprom_close(e);
+			break;
+		}
+		const uint32_t n_pages = eeprom_dev_n_pages(e);
+		const double start = now_us();
+		for (uint32_t i = 0; i < writes; i++) {
+			memset(page, i, sizeof(page));
+			const double t = now_us();
+			eeprom_dev_write_page(e, rand() % n_pages, page);
+			if (cases[c].attach && !flusher && i % flush_every == flush_every - 1)
+				eeprom_dev_flush(e, true);
+			lat[i] = (float)(now_us() - t);
+		}
+		const double elapsed = now_us() - start;
+		const double sync_start = now_us();
+		if (flusher)
+			eeprom_dev_stop_flusher(e);
+		else if (cases[c].attach)
+			eeprom_dev_sync(e);
+		const double sync = now_us() - sync_start;
+		qsort(lat, writes, sizeof(float), compare_floats);
+		printf("  %-24s %10.0f %8.2f %8.2f %8.2f %8.0f %8.0f\n", cases[c].name, writes / elapsed * 1e6,
+					 lat[writes / 2], lat[writes / 100 * 99], lat[writes / 1000 * 999], lat[writes - 1],
+					 cases[c].attach ? sync : 0);
+		eeprom_close(e);
+	}
+	free(lat);
+	remove(BENCH_FLUSH_NAME);
+}
+
+/**
+	Average time of one access, in nanoseconds, over random offsets.
+	\param[in] e Instance.
+	\param[in] len Bytes per access: a page (page_sz), or a range.
+	\param[in] write Write instead of read.
+ */
+static double time_access(eeprom_t *e, const uint32_t len, const bool write) {
+	const uint32_t size = eeprom_dev_size(e), page_sz = eeprom_dev_geometry(e).page_sz;
+	const uint32_t reps = 50000000 / (len + 64);
+	uint8_t *data = (uint8_t *)malloc(len);
+	memset(data, 0x5a, len);
+	const double start = now_us();
+	for (uint32_t r = 0; r < reps; r++) {
+		const uint32_t addr = (r * 2654435761u) % (size - len + 1);
+		if (len == page_sz)
+			write ? eeprom_dev_write_page(e, addr / page_sz, data) : eeprom_dev_read_page(e, addr / page_sz, data);
+		else
+			write ? eeprom_dev_write(e, addr, data, len) : eeprom_dev_read(e, addr, data, len);
+	}
+	const double t = (now_us() - start) * 1e3 / reps;
+	free(data);
+	return t;
+}
+
+/**
+	CRC32C throughput, and cost of the per-page CRCs: checked on reads
+	(optional), updated on writes (always).
+ */
+static void bench_integrity(void) {
+	const uint32_t sizes[3] = {4, 64, 1 << 20};
+	uint8_t *buf = (uint8_t *)malloc(sizes[2]);
+	for (uint32_t i = 0; i < sizes[2]; i++)
+		buf[i] = rand();
+	printf("CRC32C (GB/s)\n");
+	for (int s = 0; s < 3; s++) {
+		const uint32_t reps = (256 << 20) / sizes[s];
+		uint32_t crc = 0;
+		const double start = now_us();
+		for (uint32_t r = 0; r < reps; r++)
+			crc = eeprom_crc32c(crc, buf, sizes[s]);
+		const double t = now_us() - start;
+		printf("  %8u B %8.2f  (%08x)\n", sizes[s], (double)reps * sizes[s] / t / 1e3, crc);
+	}
+	free(buf);
+
+	const eeprom_geometry geos[2] = {{EEPROM_N_WORDS, EEPROM_WORD_SZ, EEPROM_PAGE_SZ}, {1 << 20, 1, 64}};
+	printf("Reads with CRC check (ns per call)\n");
+	printf("  %-20s %-10s %10s %10s %9s\n", "geometry", "access", "unchecked", "checked", "overhead");
+	for (int g = 0; g < 2; g++) {
+		eeprom_t *e = eeprom_open(&geos[g]);
+		char name[32];
+		snprintf(name, sizeof(name), "%u B, %u B pages", eeprom_dev_size(e), geos[g].page_sz);
+		const uint32_t lens[3] = {geos[g].page_sz, 256, 4096};
+		for (int l = 0; l < 3; l++) {
+			eeprom_dev_set_verify(e, false);
+			const double off = time_access(e, lens[l], false);
+			eeprom_dev_set_verify(e, true);
+			const double on = time_access(e, lens[l], false);
+			char access[16];
+			snprintf(access, sizeof(access), l == 0 ? "page" : "%u B", lens[l]);
+			printf("  %-20s %-10s %10.1f %10.1f %8.1f%%\n", name, access, off, on, (on / off - 1) * 100);
+		}
+		eeprom_close(e);
+	}
+	printf("Writes, CRC updated (ns per call)\n");
+	for (int g = 0; g < 2; g++) {
+		eeprom_t *e = eeprom_open(&geos[g]);
+		printf("  %u B, %u B pages: page %.1f, 256 B %.1f, 4096 B %.1f\n", eeprom_dev_size(e),
+					 geos[g].page_sz, time_access(e, geos[g].page_sz, true), time_access(e, 256, true),
+					 time_access(e, 4096, true));
+		eeprom_close(e);
+	}
+}
+
+/**
+	Simulated time of a record stored or loaded with different access
+	patterns, on a 24C256-like device (64-byte pages, 5 ms write cycle,
+	400 kHz bus), and the host cost of simulating it.
+ */
+static void bench_timing(void) {
+	const eeprom_geometry geo = {32768, 1, 64};
+	const eeprom_timing timing = {5000, 400000, 2};
+	const uint32_t len = 256;
+	eeprom_t *e = eeprom_open(&geo);
+	uint8_t rec[256];
+	memset(rec, 0x5a, sizeof(rec));
+	printf("Simulated time of a %u B record, %u B pages, tWR %u us, %u Hz bus (ms)\n", len,
+				 geo.page_sz, timing.t_wr_us, timing.bus_hz);
+	printf("  %-32s %10s %10s %12s %12s\n", "pattern", "time", "waiting", "transactions", "write cycles");
+	eeprom_dev_set_timing(e, &timing);
+	for (int pattern = 0; pattern < 7; pattern++) {
+		const char *name = "";
+		eeprom_dev_reset_timing_stats(e);
+		switch (pattern) {
+		case 0:
+			name = "write_byte, unaligned";
+			for (uint32_t i = 0; i < len; i++)
+				eeprom_dev_write_byte(e, 100 + i, rec[i]);
+			break;
+		case 1:
+			name = "write, unaligned";
+			eeprom_dev_write(e, 100, rec, len);
+			break;
+		case 2:
+			name = "write, page aligned";
+			eeprom_dev_write(e, 128, rec, len);
+			break;
+		case 3:
+			name = "write_page x 4";
+			for (uint32_t p = 0; p < len / geo.page_sz; p++)
+				eeprom_dev_write_page(e, 2 + p, rec + p * geo.page_sz);
+			break;
+		case 4:
+			name = "read_byte";
+			for (uint32_t i = 0; i < len; i++)
+				eeprom_dev_read_byte(e, 100 + i, rec + i);
+			break;
+		case 5:
+			name = "read_page x 4";
+			for (uint32_t p = 0; p < len / geo.page_sz; p++)
+				eeprom_dev_read_page(e, 2 + p, rec + p * geo.page_sz);
+			break;
+		case 6:
+			name = "read";
+			eeprom_dev_read(e, 100, rec, len);
+			break;
+		}
+		const eeprom_timing_stats st = eeprom_dev_timing_stats(e);
+		printf("  %-32s %10.2f %10.2f %12llu %12llu\n", name, st.time_ns / 1e6, st.wait_ns / 1e6,
+					 (unsigned long long)st.transactions, (unsigned long long)st.write_cycles);
+	}
+
+	// Host cost: memory accesses still complete at once
+	double t[2];
+	for (int on = 0; on < 2; on++) {
+		eeprom_dev_set_timing(e, on ? &timing : NULL);
+		const uint32_t reps = 2000000;
+		const double start = now_us();
+		for (uint32_t r = 0; r < reps; r++)
+			eeprom_dev_write_page(e, r % 512, rec);
+		t[on] = (now_us() - start) * 1e3 / reps;
+	}
+	printf("  host time of write_page: %.1f ns, %.1f ns timed\n", t[0], t[1]);
+	eeprom_close(e);
+}
+
+// Fixed slots, the baseline of the store: key and value rewritten in place,
+// lookups scanning the keys
+#define KV_BENCH_KEYS  256
+#define KV_KEY_SZ      8
+#define KV_VALUE_SZ    32
+#define KV_SLOT_SZ     (KV_KEY_SZ + KV_VALUE_SZ)
+static uint64_t slot_written;
+
+static bool slot_find(eeprom_t *e, const char *key, uint32_t *slot) {
+	char stored[KV_KEY_SZ];
+	for (uint32_t s = 0; s < KV_BENCH_KEYS; s++) {
+		eeprom_dev_read(e, s * KV_SLOT_SZ, (uint8_t *)stored, KV_KEY_SZ);
+		if (stored[0] == (char)0xff || !memcmp(stored, key, KV_KEY_SZ)) {
+			*slot = s;
+			return stored[0] != (char)0xff;
+		}
+	}
+	return false;
+}
+
+static void slot_put(eeprom_t *e, const char *key, const uint8_t *val) {
+	uint8_t rec[KV_SLOT_SZ];
+	uint32_t s;
+	if (slot_find(e, key, &s)) {
+		slot_written += eeprom_dev_write(e, s * KV_SLOT_SZ + KV_KEY_SZ, val, KV_VALUE_SZ);
+		return;
+	}
+	memcpy(rec, key, KV_KEY_SZ);
+	memcpy(rec + KV_KEY_SZ, val, KV_VALUE_SZ);
+	slot_written += eeprom_dev_write(e, s * KV_SLOT_SZ, rec, KV_SLOT_SZ);
+}
+
+static bool slot_get(eeprom_t *e, const char *key, uint8_t *val) {
+	uint32_t s;
+	return slot_find(e, key, &s) && eeprom_dev_read(e, s * KV_SLOT_SZ + KV_KEY_SZ, val, KV_VALUE_SZ);
+}
+
+static void bench_kv(void) {
+	const eeprom_geometry geo = {32768, 1, 64};
+	const eeprom_timing timing = {5000, 400000, 2};
+	const uint32_t ops = 50000;
+	printf("Key-value, %u keys of %u B, %u B values, 1 get per put, %u B EEPROM, %u B pages, tWR %u us, "
+				 "%u Hz bus\n", KV_BENCH_KEYS, KV_KEY_SZ, KV_VALUE_SZ, geo.n_words, geo.page_sz, timing.t_wr_us,
+				 timing.bus_hz);
+	printf("  %-18s %9s %9s %12s %12s %10s %12s\n", "store", "put (ns)", "get (ns)", "put (us sim)",
+				 "get (us sim)", "write amp", "cycles/put");
+	for (int store = 0; store < 3; store++) {
+		eeprom_t *e = eeprom_open(&geo);
+		eeprom_kv_t *kv = store ? eeprom_kv_mount(e, store == 1 ? 1024 : 4096) : NULL;
+		uint8_t val[KV_VALUE_SZ];
+		char key[KV_KEY_SZ + 1];
+		double host[2] = {0, 0}, sim[2] = {0, 0};
+		uint64_t cycles = 0;
+		memset(val, 0x5a, sizeof(val));
+		srand(46);
+		for (int pass = 0; pass < 2; pass++) {  // Fill untimed, then measure
+			const uint32_t n = pass ? ops : KV_BENCH_KEYS;
+			for (int get = 0; get < 2; get++) {
+				eeprom_dev_set_timing(e, pass ? &timing : NULL);
+				slot_written = get ? slot_written : 0;
+				srand(pass + 46);
+				const double start = now_us();
+				for (uint32_t i = 0; i < n; i++) {
+					const uint32_t k = pass ? (uint32_t)rand() % KV_BENCH_KEYS : i;
+					uint16_t len = sizeof(val);
+					snprintf(key, sizeof(key), "k%07u", k);
+					if (get && store)
+						eeprom_kv_get(kv, key, KV_KEY_SZ, val, &len);
+					else if (get)
+						slot_get(e, key, val);
+					else if (store)
+						eeprom_kv_put(kv, key, KV_KEY_SZ, val, sizeof(val));
+					else
+						slot_put(e, key, val);
+				}
+				const eeprom_timing_stats st = eeprom_dev_timing_stats(e);
+				host[get] = (now_us() - start) * 1e3 / n;
+				sim[get] = st.time_ns / 1e3 / n;
+				if (!get)
+					cycles = st.write_cycles;
+				eeprom_dev_reset_timing_stats(e);
+			}
+		}
+		// Written over put bytes: the slots rewrite the value only
+		const eeprom_kv_stats st = store ? eeprom_kv_get_stats(kv) : (eeprom_kv_stats){0};
+		const double amp = store ? (double)st.written_bytes / st.user_bytes :
+					(double)slot_written / (ops * (KV_KEY_SZ + KV_VALUE_SZ));
+		char name[32];
+		snprintf(name, sizeof(name), store ? "log, %u B segments" : "fixed slots", store == 1 ? 1024 : 4096);
+		printf("  %-18s %9.0f %9.0f %12.0f %12.0f %10.2f %12.2f\n", name, host[0], host[1], sim[0], sim[1], amp,
+					 (double)cycles / ops);
+		eeprom_kv_unmount(kv);
+		eeprom_close(e);
+	}
+}
+
+/**
+	Print the cycles of the physical pages, 64 per line, shaded against the
+	most worn one; then their histogram.
+ */
+static void print_wear(eeprom_t *e) {
+	const char shades[] = " .:-=+*#%@";
+	const eeprom_wear_stats st = eeprom_dev_wear_stats(e);
+	const uint32_t n_pages = eeprom_dev_n_pages(e);
+	uint32_t bins[8];
+	for (uint32_t p = 0; p < n_pages; p++) {
+		const uint64_t c = eeprom_dev_page_wear(e, p);
+		if (p % 64 == 0)
+			printf("  %5u |", p);
+		putchar(shades[c * 9 / (st.max_cycles ? st.max_cycles : 1)]);
+		if (p % 64 == 63 || p == n_pages - 1)
+			printf("|\n");
+	}
+	const uint32_t width = eeprom_dev_wear_histogram(e, bins, 8);
+	for (uint32_t b = 0; b < 8; b++)
+		printf("  %7u-%-7u %5u pages\n", b * width, (b + 1) * width - 1, bins[b]);
+}
+
+static void bench_wear(void) {
+	const eeprom_geometry geo = {32768, 1, 64};
+	const uint32_t writes = 2000000, thresholds[] = {0, 16, 256};
+	uint8_t rec[16];
+	memset(rec, 0x5a, sizeof(rec));
+	printf("Wear, %u page writes, %u B EEPROM, %u B pages\n", writes, geo.n_words, geo.page_sz);
+	printf("  %-34s %9s %9s %9s %9s %9s %9s\n", "trace", "leveling", "max", "min", "max/mean", "remaps",
+				 "ns/op");
+	for (int trace = 0; trace < 2; trace++) {
+		for (uint32_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++) {
+			eeprom_t *e = eeprom_open(&geo);
+			eeprom_kv_t *kv = trace ? eeprom_kv_mount(e, 1024) : NULL;
+			eeprom_dev_reset_wear(e);
+			eeprom_dev_set_wear_leveling(e, thresholds[t]);
+			srand(47);
+			const double start = now_us();
+			uint32_t ops = 0;
+			for (uint32_t i = 0; trace == 0 && i < writes; i++, ops++) {
+				// Counters: two hot pages, and 16 B settings on 56 more
+				const int r = rand() % 100;
+				const uint32_t addr = (r < 95) ? (uint32_t)(r % 2) * geo.page_sz :
+							(8 + rand() % 56) * geo.page_sz + (rand() % 4) * 16;
+				eeprom_dev_write(e, addr, rec, sizeof(rec));
+			}
+			for (; kv && (ops % 1024 != 0 || eeprom_dev_wear_stats(e).writes < writes); ops++) {
+				char key[16];
+				snprintf(key, sizeof(key), "k%u", (uint32_t)rand() % 256);
+				eeprom_kv_put(kv, key, strlen(key), rec, sizeof(rec));
+			}
+			const double elapsed = now_us() - start;
+			const eeprom_wear_stats st = eeprom_dev_wear_stats(e);
+			const double mean = (double)(st.writes + st.erases) / eeprom_dev_n_pages(e);
+			char level[16];
+			snprintf(level, sizeof(level), thresholds[t] ? "%u" : "off", thresholds[t]);
+			printf("  %-34s %9s %9u %9u %9.1f %9llu %9.0f\n",
+						 trace ? "key-value store, 256 keys" : "counters: 95% on 2 pages", level, st.max_cycles,
+						 st.min_cycles, st.max_cycles / mean, (unsigned long long)st.swaps,
+						 elapsed * 1e3 / ops);
+			if (trace == 0 && t < 2)
+				print_wear(e);
+			eeprom_kv_unmount(kv);
+			eeprom_close(e);
+		}
+	}
+}
+
+// Byte, word and range accesses, 3 in 4 on the first 4 pages; one in 20 writes
+static void hot_spot_access(const uint32_t i) {
+	uint8_t rec[RECORD_SZ] = {0};
+	const uint32_t span = (i % 4) ? 4 * EEPROM_PAGE_SZ : EEPROM_N_WORDS - RECORD_SZ;
+	const uint32_t addr = (i * 97) % span;
+	switch (i % 5) {
+	case 0:
+		if (i % 20 == 0)
+			eeprom_write_word(addr, rec);
+		else
+			eeprom_read_word(addr, rec);
+		break;
+	case 1:
+		eeprom_read_page(addr / EEPROM_PAGE_SZ, rec);
+		break;
+	default:
+		eeprom_read(addr, rec, 1 + i % RECORD_SZ);
+	}
+}
+
+/**
+	Cost of tracing, off and on, then a trace for trace_eeprom.
+ */
+static void bench_trace(void) {
+	const uint32_t iters = 500000;
+	printf("Tracing, %u calls per thread (M calls/s, all threads, best of 3)\n", iters);
+	printf("  %7s %-10s %10s %10s %9s\n", "threads", "workload", "off", "on", "overhead");
+	for (uint32_t threads = 1; threads <= 4; threads *= 4) {
+		for (int w = 0; w < 2; w++) {
+			double rate[2] = {0, 0};
+			for (int rep = 0; rep < 3; rep++) {
+				for (int on = 0; on < 2; on++) {
+					if (on)
+						eeprom_trace_start();
+					const double r = (double)iters * threads / run_threads(w ? hot_spot_access : mixed_access,
+								threads, iters);
+					eeprom_trace_stop();
+					rate[on] = (r > rate[on]) ? r : rate[on];
+				}
+			}
+			printf("  %7u %-10s %10.2f %10.2f %8.1f%%\n", threads, w ? "hot spot" : "mixed", rate[0], rate[1],
+						 100.0 * (rate[0] / rate[1] - 1));
+		}
+	}
+	eeprom_trace_start();
+	run_threads(hot_spot_access, 4, 4000);
+	eeprom_trace_stop();
+	printf("  %u events written to %s: see trace_eeprom\n", eeprom_trace_dump(BENCH_TRACE_NAME),
+				 BENCH_TRACE_NAME);
+}
+
+/**
+	Scenario r: writes to pages pages (up to 256 bytes each), spread.
+ */
+static void run_scenario(eeprom_t *e, const uint32_t pages, const uint32_t r) {
+	const uint32_t n_pages = eeprom_dev_n_pages(e);
+	uint8_t data[256];
+	memset(data, (uint8_t)r, sizeof(data));
+	for (uint32_t p = 0; p < pages; p++)
+		eeprom_dev_write_page(e, (p * 2654435761u + r) % n_pages, data);
+}
+
+/**
+	Average time of a scenario and of the state reset after it, in
+	microseconds: the copies on write of snapshots are part of the reset.
+	\param[in] how 0: text file reload, 1: image reload, 2: restore of a
+				snapshot, 3: new snapshot each time (taken, restored, released),
+				4: no reset.
+ */
+static double time_reset(eeprom_t *e, const int how, const uint32_t pages, const uint32_t reps) {
+	eeprom_snapshot_t *s = (how == 2) ? eeprom_dev_snapshot(e) : NULL;
+	const double start = now_us();
+	for (uint32_t r = 0; r < reps; r++) {
+		if (how == 3)
+			s = eeprom_dev_snapshot(e);
+		run_scenario(e, pages, r);
+		switch (how) {
+		case 0:
+			eeprom_dev_from_file(e, BENCH_SNAP_TEXT);
+			break;
+		case 1:
+			eeprom_dev_from_image(e, BENCH_SNAP_IMAGE);
+			break;
+		case 2:
+		case 3:
+			eeprom_restore(s);
+			break;
+		}
+		if (how == 3)
+			eeprom_snapshot_release(s);
+	}
+	const double t = (now_us() - start) / reps;
+	if (how == 2)
+		eeprom_snapshot_release(s);
+	return t;
+}
+
+/**
+	Resetting the state between scenarios: reload from a file, against
+	restore of a snapshot, by number of pages the scenario writes.
+ */
+static void bench_snapshot(void) {
+	const eeprom_geometry geos[2] = {{EEPROM_N_WORDS, EEPROM_WORD_SZ, EEPROM_PAGE_SZ}, {1 << 20, 1, 64}};
+	const uint32_t pages[3] = {1, 16, 256};
+	const char *methods[5] = {"text reload", "image reload", "restore", "snapshot+restore", "(scenario only)"};
+	printf("Scenario, then state reset (us per scenario)\n");
+	for (int g = 0; g < 2; g++) {
+		eeprom_t *e = eeprom_open(&geos[g]);
+		for (uint32_t i = 0; i < eeprom_dev_size(e); i++)
+			eeprom_dev_write_byte(e, i, rand() % 0x100);
+		eeprom_dev_to_file(e, BENCH_SNAP_TEXT);
+		eeprom_dev_to_image(e, BENCH_SNAP_IMAGE);
+		printf("  %u B, %u B pages\n", eeprom_dev_size(e), geos[g].page_sz);
+		printf("    %-18s %10s %10s %10s\n", "pages written", "1", "16", "256");
+		for (int how = 0; how < 5; how++) {
+			printf("    %-18s", methods[how]);
+			for (int p = 0; p < 3; p++) {
+				const uint32_t reps = (how == 0) ? 20000000 / eeprom_dev_size(e) + 2 :
+							(how == 1) ? 100000000 / eeprom_dev_size(e) + 2 : 10000;
+				printf(" %10.2f", time_reset(e, how, pages[p], reps));
+			}
+			printf("\n");
+		}
+		eeprom_close(e);
+	}
+	remove(BENCH_SNAP_TEXT);
+	remove(BENCH_SNAP_IMAGE);
+}
+
+/**
+	Text loads of large images: parsing speed, in bytes of text and of
+	content per second.
+ */
+static void bench_text(void) {
+	const uint32_t sizes[3] = {1 << 20, 4 << 20, 16 << 20};
+	printf("Text load, 64 B pages (best of 3)\n");
+	printf("  %10s %10s %10s %12s %14s\n", "content", "text", "ms", "text MB/s", "content MB/s");
+	for (int i = 0; i < 3; i++) {
+		const eeprom_geometry geo = {sizes[i], 1, 64};
+		eeprom_t *e = eeprom_open(&geo);
+		uint8_t *data = (uint8_t *)malloc(sizes[i]);
+		for (uint32_t b = 0; b < sizes[i]; b++)
+			data[b] = rand();
+		eeprom_dev_write(e, 0, data, sizes[i]);
+		eeprom_dev_to_file(e, BENCH_TEXT_NAME);
+		struct stat st;
+		stat(BENCH_TEXT_NAME, &st);
+		double best = 1e30;
+		for (int r = 0; r < 3; r++) {
+			const double start = now_us();
+			if (eeprom_dev_from_file(e, BENCH_TEXT_NAME) != sizes[i])
+				fprintf(stderr, "I/O error on %s\n", BENCH_TEXT_NAME);
+			const double t = now_us() - start;
+			best = (t < best) ? t : best;
+		}
+		printf("  %8u K %8lu K %10.2f %12.1f %14.1f\n", sizes[i] >> 10, (unsigned long)st.st_size >> 10,
+					 best / 1e3, st.st_size / best, sizes[i] / best);
+		free(data);
+		eeprom_close(e);
+	}
+	remove(BENCH_TEXT_NAME);
+}
+
+int main(int argc, char *argv[]) {
+	const char *what = (argc > 1) ? argv[1] : "all";
+	if (!strcmp(what, "all") || !strcmp(what, "files"))
+		bench_files();
+	if (!strcmp(what, "all") || !strcmp(what, "bulk"))
+		bench_bulk();
+	if (!strcmp(what, "all") || !strcmp(what, "readers"))
+		bench_readers();
+	if (!strcmp(what, "all") || !strcmp(what, "instances"))
+		bench_instances();
+	if (!strcmp(what, "all") || !strcmp(what, "flush"))
+		bench_flush();
+	if (!strcmp(what, "all") || !strcmp(what, "flusher"))
+		bench_flusher();
+	if (!strcmp(what, "all") || !strcmp(what, "integrity"))
+		bench_integrity();
+	if (!strcmp(what, "all") || !strcmp(what, "timing"))
+		bench_timing();
+	if (!strcmp(what, "all") || !strcmp(what, "kv"))
+		bench_kv();
+	if (!strcmp(what, "all") || !strcmp(what, "wear"))
+		bench_wear();
+	if (!strcmp(what, "all") || !strcmp(what, "trace"))
+		bench_trace();
+	if (!strcmp(what, "all") || !strcmp(what, "snapshot"))
+		bench_snapshot();
+	if (!strcmp(what, "all") || !strcmp(what, "text"))
+		bench_text();
+	return 0;
+}
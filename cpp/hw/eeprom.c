@@ -5,245 +5,2150 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
 #include "eeprom.h"
 
-// Check EEPROM offset
-#define CHECK_OFFSET(offset) if (offset < 0 || offset >= EEPROM_SZ) return 0;
+// Check word address
+#define CHECK_WORD_ADDR(e, addr) if (addr >= e->geo.n_words) return 0;
+
+// Check page address
+#define CHECK_PAGE_ADDR(e, addr) if (addr >= e->n_pages) return 0;
+
+/**
+ EEPROM instance.
+ */
+struct eeprom {
+	eeprom_geometry geo;
+	uint32_t id;                  // Instance number in traces, 0 for the default one
+	uint32_t size;                // Bytes
+	uint32_t n_pages;
+	pthread_mutex_t mutex;        // Lock to protect the buffer
+	uint32_t seq;                 // Version of the content: odd while a write is in progress
+	eeprom_lock_mode lock_mode;   // How readers synchronize with writers
+	uint8_t *buf;                 // Memory buffer
+	uint64_t *dirty;              // Pages written since the last flush, one bit each
+	uint32_t n_dirty;             // Bits set in dirty
+	uint32_t *crc;                // CRC32C of each page
+	bool verify;                  // Check the CRCs on reads
+	uint32_t crc_errors;          // CRC mismatches found
+
+	// Backing image file, see eeprom_dev_attach()
+	pthread_mutex_t flush_mutex;  // Serializes flushes
+	int fd;
+	uint8_t *shadow;              // Content of the file
+	uint32_t checksum;            // Adler-32 of shadow
+	uint64_t *flushing;           // Pages being flushed
+
+	// Background flusher, see eeprom_dev_start_flusher(). Shares the buffer
+	// lock with writers, which wake it up when there are enough dirty pages.
+	pthread_t flusher;
+	pthread_cond_t flusher_cond;
+	eeprom_flusher_config flusher_cfg;
+	bool flusher_on;
+
+	// Timing model, see eeprom_dev_set_timing()
+	pthread_mutex_t timing_mutex;
+	bool timed;
+	eeprom_timing timing;
+	eeprom_timing_stats timing_stats;  // time_ns: when the bus is free
+	uint64_t busy_until_ns;            // End of the last write cycle
+
+	// Wear, see eeprom_dev_wear_stats(): cycles of each physical page, and
+	// optional leveling remap. Writers only.
+	uint32_t *cycles;             // Writes and erases, per physical page
+	uint32_t *erases;             // Erases, per physical page
+	uint32_t min_cycles;          // Writes and erases of the least worn pages, while leveling
+	uint32_t n_at_min;            // How many they are
+	uint32_t *to_phys;            // Logical to physical page, NULL if never leveled
+	uint32_t *to_logical;         // Physical to logical page
+	uint32_t *landed;             // Cycles of each physical page when its logical page came
+	uint32_t level_threshold;     // 0: leveling off
+	uint32_t cold_cursor;         // Where to look for a least worn page next
+	uint64_t swaps;
+
+	// Snapshots, see eeprom_dev_snapshot(): writers save the pages they
+	// change to the newest one
+	eeprom_snapshot_t *snap;      // Newest snapshot, NULL if none
+};
+
+// Number of 64-bit words of a bitmap of n bits
+#define BITMAP_WORDS(n)  (((n) + 63) / 64)
+
+// Default instance, used by the functions without a handle
+static uint8_t default_buf[EEPROM_SZ];
+static uint64_t default_dirty[BITMAP_WORDS(EEPROM_N_PAGES)];
+static uint32_t default_crc[EEPROM_N_PAGES];  // Set by crc32c_init()
+static uint32_t default_cycles[EEPROM_N_PAGES];
+static uint32_t default_erases[EEPROM_N_PAGES];
+static eeprom_t default_dev = {
+	.geo = {EEPROM_N_WORDS, EEPROM_WORD_SZ, EEPROM_PAGE_SZ},
+	.id = 0,
+	.size = EEPROM_SZ,
+	.n_pages = EEPROM_N_PAGES,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.seq = 0,
+	.lock_mode = EEPROM_LOCK_MUTEX,
+	.buf = default_buf,
+	.dirty = default_dirty,
+	.n_dirty = 0,
+	.crc = default_crc,
+	.verify = false,
+	.crc_errors = 0,
+	.flush_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+	.flusher_on = false,
+	.timing_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.timed = false,
+	.cycles = default_cycles,
+	.erases = default_erases,
+	.min_cycles = 0,
+	.n_at_min = EEPROM_N_PAGES,
+	.to_phys = NULL,
+	.level_threshold = 0,
+	.snap = NULL
+};
+
+//--------
+// CRC32C
+//--------
+
+// CRC32C (Castagnoli), reflected polynomial
+#define CRC32C_POLY  0x82f63b78
+
+// Slicing-by-8 tables: crc_table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t crc_table[8][256];
+
+/**
+ CRC32C, 8 bytes per step with the slicing-by-8 tables.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, uint32_t len) {
+	crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; len >= 8; data += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, data, 8);
+		v ^= crc;
+		crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff] ^
+				crc_table[5][(v >> 16) & 0xff] ^ crc_table[4][(v >> 24) & 0xff] ^
+				crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff] ^
+				crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+	}
+#endif
+	for (; len > 0; data++, len--)
+		crc = crc_table[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/**
+ CRC32C of consecutive pages, one by one.
+ \param[in] data First page.
+ \param[in] page_sz Bytes per page.
+ \param[in] n Number of pages.
+ \param[out] crc CRC of each page.
+ */
+static void crc32c_pages_sw(const uint8_t *data, const uint32_t page_sz, const uint32_t n, uint32_t *crc) {
+	for (uint32_t p = 0; p < n; p++, data += page_sz)
+		crc[p] = crc32c_sw(0, data, page_sz);
+}
+
+#if defined(__x86_64__) && !defined(EEPROM_CRC_SOFTWARE)
+/**
+ CRC32C with the SSE4.2 crc32 instruction, 8 bytes per step.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, uint32_t len) {
+	uint64_t c = ~crc;
+	for (; len >= 8; data += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, data, 8);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = (uint32_t)c;
+	if (len >= 4) {
+		uint32_t v;
+		memcpy(&v, data, 4);
+		crc = __builtin_ia32_crc32si(crc, v);
+		data += 4;
+		len -= 4;
+	}
+	for (; len > 0; data++, len--)
+		crc = __builtin_ia32_crc32qi(crc, *data);
+	return ~crc;
+}
+
+/**
+ Same as crc32c_pages_sw(), with the crc32 instruction. Its latency is three
+ times its throughput: four pages at a time, four independent CRCs in
+ flight. This matters most for small pages.
+ */
+__attribute__((target("sse4.2")))
+static void crc32c_pages_hw(const uint8_t *data, const uint32_t page_sz, uint32_t n, uint32_t *crc) {
+	for (; n >= 4; n -= 4, data += 4 * page_sz, crc += 4) {
+		const uint8_t *d0 = data, *d1 = d0 + page_sz, *d2 = d1 + page_sz, *d3 = d2 + page_sz;
+		uint64_t c0 = ~0ULL, c1 = ~0ULL, c2 = ~0ULL, c3 = ~0ULL, v0, v1, v2, v3;
+		uint32_t off = 0;
+		for (; off + 8 <= page_sz; off += 8) {
+			memcpy(&v0, d0 + off, 8);
+			memcpy(&v1, d1 + off, 8);
+			memcpy(&v2, d2 + off, 8);
+			memcpy(&v3, d3 + off, 8);
+			c0 = __builtin_ia32_crc32di(c0, v0);
+			c1 = __builtin_ia32_crc32di(c1, v1);
+			c2 = __builtin_ia32_crc32di(c2, v2);
+			c3 = __builtin_ia32_crc32di(c3, v3);
+		}
+		uint32_t e0 = (uint32_t)c0, e1 = (uint32_t)c1, e2 = (uint32_t)c2, e3 = (uint32_t)c3, w0, w1, w2, w3;
+		if (off + 4 <= page_sz) {
+			memcpy(&w0, d0 + off, 4);
+			memcpy(&w1, d1 + off, 4);
+			memcpy(&w2, d2 + off, 4);
+			memcpy(&w3, d3 + off, 4);
+			e0 = __builtin_ia32_crc32si(e0, w0);
+			e1 = __builtin_ia32_crc32si(e1, w1);
+			e2 = __builtin_ia32_crc32si(e2, w2);
+			e3 = __builtin_ia32_crc32si(e3, w3);
+			off += 4;
+		}
+		for (; off < page_sz; off++) {
+			e0 = __builtin_ia32_crc32qi(e0, d0[off]);
+			e1 = __builtin_ia32_crc32qi(e1, d1[off]);
+			e2 = __builtin_ia32_crc32qi(e2, d2[off]);
+			e3 = __builtin_ia32_crc32qi(e3, d3[off]);
+		}
+		crc[0] = ~e0;
+		crc[1] = ~e1;
+		crc[2] = ~e2;
+		crc[3] = ~e3;
+	}
+	for (; n > 0; n--, data += page_sz, crc++)
+		*crc = crc32c_hw(0, data, page_sz);
+}
+#endif
+
+// Fastest implementations available, see crc32c_init()
+static uint32_t (*crc32c)(uint32_t, const uint8_t *, uint32_t) = crc32c_sw;
+static void (*crc32c_pages)(const uint8_t *, uint32_t, uint32_t, uint32_t *) = crc32c_pages_sw;
+
+/**
+ Build the tables, pick the implementation, and set the CRCs of the default
+ instance, before main().
+ */
+__attribute__((constructor))
+static void crc32c_init(void) {
+	for (uint32_t b = 0; b < 256; b++) {
+		uint32_t c = b;
+		for (int k = 0; k < 8; k++)
+			c = (c >> 1) ^ (CRC32C_POLY & (0 - (c & 1)));
+		crc_table[0][b] = c;
+	}
+	for (uint32_t b = 0; b < 256; b++)
+		for (int k = 1; k < 8; k++)
+			crc_table[k][b] = (crc_table[k - 1][b] >> 8) ^ crc_table[0][crc_table[k - 1][b] & 0xff];
+#if defined(__x86_64__) && !defined(EEPROM_CRC_SOFTWARE)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c = crc32c_hw;
+		crc32c_pages = crc32c_pages_hw;
+	}
+#endif
+	const uint32_t crc = crc32c(0, default_buf, EEPROM_PAGE_SZ);
+	for (uint32_t p = 0; p < EEPROM_N_PAGES; p++)
+		default_crc[p] = crc;
+}
+
+uint32_t eeprom_crc32c(const uint32_t crc, const void *data, const uint32_t len) {
+	return crc32c(crc, (const uint8_t *)data, len);
+}
+
+static inline uint32_t page_crc(const eeprom_t *e, const uint32_t page) {
+	return crc32c(0, e->buf + page * e->geo.page_sz, e->geo.page_sz);
+}
+
+//---------
+// Tracing
+//---------
+
+#ifndef EEPROM_TRACE_EVENTS
+#define EEPROM_TRACE_EVENTS  16384  // Per thread, a power of 2
+#endif
+
+/**
+ Events of a thread, the latest EEPROM_TRACE_EVENTS. Written by its thread
+ only, which also clears it on its first event of a new trace; times in
+ ticks until collected.
+ */
+typedef struct trace_ring {
+	eeprom_trace_event events[EEPROM_TRACE_EVENTS];
+	uint64_t n;                // Events recorded since the start of trace gen
+	uint32_t gen;              // Trace of the events
+	uint16_t thread;
+	bool free;                 // Its thread exited: the next new thread takes it
+	struct trace_ring *next;
+} trace_ring;
+
+/**
+ Lock timestamps of the access in progress, in ticks: t0 before the lock,
+ t1 once taken (or the last seqlock attempt started), t2 when released.
+ */
+typedef struct {
+	uint64_t t0, t1, t2;
+	bool done;     // Released for good: the next lock starts a new access
+	uint32_t gen;  // Trace it belongs to: an access may see tracing stop
+} trace_span;
+
+static bool tracing;  // Read (relaxed) on every access
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *trace_rings;  // Never freed: those of exited threads are reused
+static pthread_key_t trace_key;  // Frees the ring of a thread when it exits
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static uint16_t trace_threads;
+static uint64_t trace_start_ticks, trace_start_ns;
+static uint32_t trace_gen;  // Bumped at each start
+static uint32_t trace_next_id;
+static __thread trace_ring *own_ring;
+static __thread trace_span span;
+
+static inline bool trace_on(void) {
+	return __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t trace_ticks(void) {
+#if defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint64_t trace_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void release_ring(void *r) {
+	__atomic_store_n(&((trace_ring *)r)->free, true, __ATOMIC_RELEASE);
+}
+
+static void trace_key_init(void) {
+	pthread_key_create(&trace_key, release_ring);
+}
+
+/**
+ Ring of the calling thread: a free one, or a new one.
+ \return Ring, NULL on allocation failure.
+ */
+static trace_ring *take_ring(void) {
+	pthread_once(&trace_once, trace_key_init);
+	pthread_mutex_lock(&trace_mutex);
+	trace_ring *r = trace_rings;
+	while (r && !__atomic_load_n(&r->free, __ATOMIC_ACQUIRE))
+		r = r->next;
+	if (!r && (r = (trace_ring *)calloc(1, sizeof(trace_ring))) != NULL) {
+		r->next = trace_rings;
+		trace_rings = r;
+	}
+	if (r) {
+		r->free = false;
+		r->thread = trace_threads++;
+		pthread_setspecific(trace_key, r);
+	}
+	pthread_mutex_unlock(&trace_mutex);
+	return own_ring = r;
+}
+
+/**
+ Record an access, with the lock times of its span (consumed: the next
+ events of a vector access get none).
+ \param[in] off First byte.
+ \param[in] len Number of bytes.
+ */
+static void trace(const eeprom_t *e, const eeprom_op op, const uint32_t off, const uint32_t len) {
+	trace_ring *r = own_ring ? own_ring : take_ring();
+	if (!r)
+		return;
+	const uint32_t gen = __atomic_load_n(&trace_gen, __ATOMIC_ACQUIRE);
+	const uint64_t n = (r->gen == gen) ? r->n : 0;  // Events of an older trace dropped
+	__atomic_store_n(&r->gen, gen, __ATOMIC_RELAXED);
+	eeprom_trace_event *ev = &r->events[n % EEPROM_TRACE_EVENTS];
+	const bool timed = span.t0 != 0 && span.t1 >= span.t0 && span.t2 >= span.t1;
+	ev->t_ns = span.t0 ? span.t0 : trace_ticks();
+	ev->wait_ns = timed ? (uint32_t)(span.t1 - span.t0) : 0;
+	ev->hold_ns = timed ? (uint32_t)(span.t2 - span.t1) : 0;
+	ev->off = off;
+	ev->len = len;
+	ev->page_sz = e->geo.page_sz;
+	ev->dev = e->id;
+	ev->thread = r->thread;
+	ev->op = (uint8_t)op;
+	span.t0 = 0;
+	__atomic_store_n(&r->n, n + 1, __ATOMIC_RELEASE);
+}
+
+static inline void traced(const eeprom_t *e, const eeprom_op op, const uint32_t off, const uint32_t len) {
+	if (__builtin_expect(trace_on(), false))
+		trace(e, op, off, len);
+}
+
+// Span hooks, around the buffer lock. Taking it at once costs no timestamp.
+static inline void span_begin(void) {
+	if (__builtin_expect(trace_on(), false)) {
+		const uint64_t now = trace_ticks();
+		const uint32_t gen = __atomic_load_n(&trace_gen, __ATOMIC_RELAXED);
+		if (span.done || span.t0 == 0 || span.gen != gen) {
+			span.t0 = now;
+			span.done = false;
+			span.gen = gen;
+		}
+		span.t1 = now;  // Seqlock retries: waiting until the last attempt
+	}
+}
+
+static inline void span_locked(void) {
+	if (__builtin_expect(trace_on(), false))
+		span.t1 = trace_ticks();
+}
+
+static inline void span_end(const bool done) {
+	if (__builtin_expect(trace_on(), false)) {
+		span.t2 = trace_ticks();
+		span.done = done;
+	}
+}
+
+// Rings are not cleared here, while their threads may be recording: each
+// thread clears its own when it sees the new generation, and the rings still
+// of an older one are skipped when collecting.
+void eeprom_trace_start(void) {
+	pthread_mutex_lock(&trace_mutex);
+	trace_start_ticks = trace_ticks();
+	trace_start_ns = trace_ns();
+	__atomic_add_fetch(&trace_gen, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&tracing, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void eeprom_trace_stop(void) {
+	__atomic_store_n(&tracing, false, __ATOMIC_RELEASE);
+}
+
+bool eeprom_tracing(void) {
+	return __atomic_load_n(&tracing, __ATOMIC_ACQUIRE);
+}
+
+static int compare_events(const void *a, const void *b) {
+	const uint64_t x = ((const eeprom_trace_event *)a)->t_ns, y = ((const eeprom_trace_event *)b)->t_ns;
+	return (x > y) - (x < y);
+}
+
+uint32_t eeprom_trace_collect(eeprom_trace_event *events, const uint32_t max) {
+	pthread_mutex_lock(&trace_mutex);
+
+	// Ticks to nanoseconds since the start, over the whole trace
+	const uint64_t ticks = trace_ticks() - trace_start_ticks, ns = trace_ns() - trace_start_ns;
+	const double ns_per_tick = ticks ? (double)ns / ticks : 1.0;
+	uint32_t count = 0;
+	for (trace_ring *r = trace_rings; r; r = r->next) {
+		const uint64_t n = __atomic_load_n(&r->n, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->gen, __ATOMIC_RELAXED) != trace_gen)
+			continue;
+		for (uint64_t i = (n > EEPROM_TRACE_EVENTS) ? n - EEPROM_TRACE_EVENTS : 0; i < n && count < max; i++) {
+			eeprom_trace_event *ev = &events[count++];
+			*ev = r->events[i % EEPROM_TRACE_EVENTS];
+			ev->t_ns = (ev->t_ns > trace_start_ticks) ? (uint64_t)((ev->t_ns - trace_start_ticks) * ns_per_tick) : 0;
+			ev->wait_ns = (uint32_t)(ev->wait_ns * ns_per_tick);
+			ev->hold_ns = (uint32_t)(ev->hold_ns * ns_per_tick);
+		}
+	}
+	pthread_mutex_unlock(&trace_mutex);
+	qsort(events, count, sizeof(eeprom_trace_event), compare_events);
+	return count;
+}
+
+uint32_t eeprom_trace_dump(const char *file_name) {
+	uint32_t threads = 0;
+	pthread_mutex_lock(&trace_mutex);
+	for (trace_ring *r = trace_rings; r; r = r->next)
+		threads++;
+	pthread_mutex_unlock(&trace_mutex);
+	eeprom_trace_event *events = (eeprom_trace_event *)malloc((size_t)threads * EEPROM_TRACE_EVENTS *
+				sizeof(eeprom_trace_event) + 1);
+	FILE *f = events ? fopen(file_name, "wb") : NULL;
+	uint32_t n = 0;
+	if (f) {
+		n = eeprom_trace_collect(events, threads * EEPROM_TRACE_EVENTS);
+		const eeprom_trace_header h = {EEPROM_TRACE_MAGIC, EEPROM_TRACE_VERSION, n, sizeof(eeprom_trace_event)};
+		if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(events, sizeof(eeprom_trace_event), n, f) != n)
+			n = 0;
+		if (fclose(f) != 0)
+			n = 0;
+	}
+	free(events);
+	return n;
+}
+
+/**
+ Start writing the buffer. Writers always exclude each other, and bump the
+ version so that seqlock readers know they must retry.
+ */
+static inline void write_begin(eeprom_t *e) {
+	span_begin();
+	if (pthread_mutex_trylock(&e->mutex) != 0) {
+		pthread_mutex_lock(&e->mutex);
+		span_locked();
+	}
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_end(eeprom_t *e) {
+	__atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+	span_end(true);
+	pthread_mutex_unlock(&e->mutex);
+}
+
+/**
+ Wake the flusher up if the dirty pages just reached its threshold.
+ \param[in] before Number of dirty pages before the write.
+ */
+static inline void check_flusher(eeprom_t *e, const uint32_t before) {
+	const uint32_t threshold = e->flusher_cfg.dirty_pages;
+	if (e->flusher_on && threshold > 0 && before < threshold && e->n_dirty >= threshold)
+		pthread_cond_signal(&e->flusher_cond);
+}
+
+/**
+ Mark the pages of a range of bytes as dirty, a bitmap word at a time.
+ Writers only.
+ */
+static inline void mark_dirty(eeprom_t *e, const uint32_t off, const uint32_t len) {
+	const uint32_t before = e->n_dirty, first = off / e->geo.page_sz;
+	const uint32_t last = (off + len - 1) / e->geo.page_sz;
+	for (uint32_t w = first / 64; w <= last / 64; w++) {
+		uint64_t bits = ~0ULL;
+		if (w == first / 64)
+			bits &= ~0ULL << (first % 64);
+		if (w == last / 64)
+			bits &= ~0ULL >> (63 - last % 64);
+		e->n_dirty += __builtin_popcountll(bits & ~e->dirty[w]);
+		e->dirty[w] |= bits;
+	}
+	check_flusher(e, before);
+}
+
+/**
+ Mark the pages of a range of bytes as written: new CRC, and dirty. Writers only.
+ */
+static inline void mark_written(eeprom_t *e, const uint32_t off, const uint32_t len) {
+	const uint32_t page_sz = e->geo.page_sz, first = off / page_sz, last = (off + len - 1) / page_sz;
+	if (first == last)
+		e->crc[first] = crc32c(0, e->buf + first * page_sz, page_sz);
+	else
+		crc32c_pages(e->buf + first * page_sz, page_sz, last - first + 1, e->crc + first);
+	mark_dirty(e, off, len);
+}
+
+/**
+ Check the CRCs of the pages of a range of bytes. Readers only.
+ \return False if a page does not match its CRC.
+ */
+static bool pages_match(const eeprom_t *e, const uint32_t off, const uint32_t len) {
+	const uint32_t page_sz = e->geo.page_sz, last = (off + len - 1) / page_sz;
+	uint32_t crc[64];
+	for (uint32_t p = off / page_sz; p <= last; p += 64) {
+		const uint32_t n = (last - p + 1 < 64) ? last - p + 1 : 64;
+		crc32c_pages(e->buf + p * page_sz, page_sz, n, crc);
+		if (memcmp(crc, e->crc + p, n * sizeof(uint32_t)) != 0)
+			return false;
+	}
+	return true;
+}
+
+/**
+ Check the CRCs of the pages of a range of bytes, if reads are verified.
+ Readers only.
+ \return False if a page does not match its CRC.
+ */
+static inline bool verified(const eeprom_t *e, const uint32_t off, const uint32_t len) {
+	return !e->verify || pages_match(e, off, len);
+}
+
+/**
+ Count a CRC mismatch.
+ \return 0, for a failed read.
+ */
+static uint32_t crc_error(eeprom_t *e) {
+	__atomic_add_fetch(&e->crc_errors, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ Start reading the buffer.
+ \return Version to pass to read_retry().
+ */
+static inline uint32_t read_begin(eeprom_t *e) {
+	span_begin();
+	if (e->lock_mode == EEPROM_LOCK_MUTEX) {
+		if (pthread_mutex_trylock(&e->mutex) != 0) {
+			pthread_mutex_lock(&e->mutex);
+			span_locked();
+		}
+		return 0;
+	}
+	uint32_t seq;
+	bool spun = false;
+	while ((seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)) & 1) {
+		sched_yield();
+		spun = true;
+	}
+	if (spun)
+		span_locked();
+	return seq;
+}
+
+/**
+ End reading the buffer.
+ \param[in] seq Value returned by read_begin().
+ \return True if a write overlapped the read: data is torn, read again.
+ */
+static inline bool read_retry(eeprom_t *e, const uint32_t seq) {
+	if (e->lock_mode == EEPROM_LOCK_MUTEX) {
+		span_end(true);
+		pthread_mutex_unlock(&e->mutex);
+		return false;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	const bool retry = __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq;
+	span_end(!retry);
+	return retry;
+}
+
+//-----------
+// Snapshots
+//-----------
+
+/**
+ Snapshot: the pages changed since it was taken, as they were then; the
+ others are still those of the buffer. The snapshots of an instance form a
+ stack, and writers only save to the newest one: the pages changed after
+ it was taken, an older snapshot finds them there.
+ */
+struct eeprom_snapshot {
+	eeprom_t *e;
+	eeprom_snapshot_t *older;     // NULL if the oldest
+	eeprom_snapshot_t *newer;     // NULL if the newest
+	uint64_t *saved;              // Pages saved, one bit each
+	uint32_t *pages;              // Pages saved, in order
+	uint32_t n_saved;
+	uint32_t *crc;                // CRC32C of each page, if saved
+	uint8_t *data;                // Content of each page, if saved, at its offset
+};
+
+/**
+ Save a page to a snapshot, unless already saved. Buffer lock held.
+ */
+static inline void save_page(eeprom_snapshot_t *s, const uint32_t page, const uint8_t *data,
+			const uint32_t crc) {
+	const uint64_t bit = 1ULL << (page % 64);
+	if (s->saved[page / 64] & bit)
+		return;
+	s->saved[page / 64] |= bit;
+	s->pages[s->n_saved++] = page;
+	s->crc[page] = crc;
+	memcpy(s->data + (size_t)page * s->e->geo.page_sz, data, s->e->geo.page_sz);
+}
+
+static void save_pages(eeprom_t *e, const uint32_t off, const uint32_t len) {
+	const uint32_t page_sz = e->geo.page_sz, last = (off + len - 1) / page_sz;
+	for (uint32_t p = off / page_sz; p <= last; p++)
+		save_page(e->snap, p, e->buf + (size_t)p * page_sz, e->crc[p]);
+}
+
+/**
+ Copy on write: save the pages of a range of bytes to the newest snapshot,
+ before their first change since it was taken. Writers only.
+ */
+static inline void cow(eeprom_t *e, const uint32_t off, const uint32_t len) {
+	if (e->snap)
+		save_pages(e, off, len);
+}
+
+/**
+ Release a snapshot. Its pages were changed after the older snapshot was
+ taken too: they move there. Buffer lock held.
+ */
+static void drop(eeprom_snapshot_t *s) {
+	const uint32_t page_sz = s->e->geo.page_sz;
+	for (uint32_t i = 0; s->older && i < s->n_saved; i++) {
+		const uint32_t p = s->pages[i];
+		save_page(s->older, p, s->data + (size_t)p * page_sz, s->crc[p]);
+	}
+	if (s->older)
+		s->older->newer = s->newer;
+	if (s->newer)
+		s->newer->older = s->older;
+	else
+		s->e->snap = s->older;
+	free(s);
+}
+
+eeprom_snapshot_t *eeprom_dev_snapshot(eeprom_t *e) {
+	// One allocation, zeroed: the content area is only touched by the pages
+	// saved
+	const size_t bitmap_sz = BITMAP_WORDS(e->n_pages) * sizeof(uint64_t);
+	const size_t pages_sz = e->n_pages * sizeof(uint32_t);
+	eeprom_snapshot_t *s = (eeprom_snapshot_t *)calloc(1, sizeof(eeprom_snapshot_t) + bitmap_sz +
+				2 * pages_sz + e->size);
+	if (!s)
+		return NULL;
+	s->e = e;
+	s->saved = (uint64_t *)(s + 1);
+	s->pages = (uint32_t *)((uint8_t *)s->saved + bitmap_sz);
+	s->crc = s->pages + e->n_pages;
+	s->data = (uint8_t *)(s->crc + e->n_pages);
+	pthread_mutex_lock(&e->mutex);
+	s->older = e->snap;
+	if (e->snap)
+		e->snap->newer = s;
+	e->snap = s;
+	pthread_mutex_unlock(&e->mutex);
+	return s;
+}
+
+uint32_t eeprom_restore(eeprom_snapshot_t *s) {
+	eeprom_t *e = s->e;
+	const uint32_t page_sz = e->geo.page_sz;
+	write_begin(e);
+	while (e->snap != s)
+		drop(e->snap);
+	for (uint32_t i = 0; i < s->n_saved; i++) {
+		const uint32_t p = s->pages[i];
+		memcpy(e->buf + (size_t)p * page_sz, s->data + (size_t)p * page_sz, page_sz);
+		e->crc[p] = s->crc[p];
+		mark_dirty(e, p * page_sz, page_sz);
+		s->saved[p / 64] = 0;
+	}
+	const uint32_t restored = s->n_saved;
+	s->n_saved = 0;
+	write_end(e);
+	return restored;
+}
+
+void eeprom_snapshot_release(eeprom_snapshot_t *s) {
+	if (!s)
+		return;
+	eeprom_t *e = s->e;
+	pthread_mutex_lock(&e->mutex);
+	drop(s);
+	pthread_mutex_unlock(&e->mutex);
+}
+
+//-----------
+// Instances
+//-----------
+
+eeprom_t *eeprom_default(void) {
+	return &default_dev;
+}
+
+eeprom_t *eeprom_open(const eeprom_geometry *geo) {
+	if (!geo || geo->n_words == 0 || geo->word_sz == 0 || geo->page_sz == 0 ||
+			geo->page_sz % geo->word_sz != 0)
+		return NULL;
+	const uint64_t size = (uint64_t)geo->n_words * geo->word_sz;
+	if (size > UINT32_MAX || size % geo->page_sz != 0)
+		return NULL;
+
+	// Dirty bitmap, CRCs, wear counters and buffer right after the instance:
+	// one allocation
+	const uint32_t n_pages = (uint32_t)(size / geo->page_sz);
+	const size_t bitmap_sz = BITMAP_WORDS(n_pages) * sizeof(uint64_t);
+	const size_t crc_sz = n_pages * sizeof(uint32_t);
+	eeprom_t *e = (eeprom_t *)malloc(sizeof(eeprom_t) + bitmap_sz + 3 * crc_sz + size);
+	if (!e)
+		return NULL;
+	e->geo = *geo;
+	e->id = __atomic_add_fetch(&trace_next_id, 1, __ATOMIC_RELAXED);
+	e->size = (uint32_t)size;
+	e->n_pages = n_pages;
+	pthread_mutex_init(&e->mutex, NULL);
+	e->seq = 0;
+	e->lock_mode = EEPROM_LOCK_MUTEX;
+	e->dirty = (uint64_t *)(e + 1);
+	e->crc = (uint32_t *)((uint8_t *)e->dirty + bitmap_sz);
+	e->cycles = e->crc + n_pages;
+	e->erases = e->cycles + n_pages;
+	e->buf = (uint8_t *)(e->erases + n_pages);
+	memset(e->dirty, 0, bitmap_sz);
+	e->n_dirty = 0;
+	memset(e->buf, EEPROM_ERASE_STATE, size);
+	const uint32_t crc = page_crc(e, 0);
+	for (uint32_t p = 0; p < n_pages; p++)
+		e->crc[p] = crc;
+	e->verify = false;
+	e->crc_errors = 0;
+	pthread_mutex_init(&e->flush_mutex, NULL);
+	e->fd = -1;
+	e->shadow = NULL;
+	e->flushing = NULL;
+	e->flusher_on = false;
+	pthread_mutex_init(&e->timing_mutex, NULL);
+	e->timed = false;
+	memset(e->cycles, 0, 2 * crc_sz);
+	e->min_cycles = 0;
+	e->n_at_min = n_pages;
+	e->to_phys = e->to_logical = e->landed = NULL;
+	e->level_threshold = 0;
+	e->cold_cursor = 0;
+	e->swaps = 0;
+	e->snap = NULL;
+	return e;
+}
+
+void eeprom_close(eeprom_t *e) {
+	if (!e || e == &default_dev)
+		return;
+	eeprom_dev_detach(e);
+	free(e->to_phys);
+	free(e->to_logical);
+	free(e->landed);
+	for (eeprom_snapshot_t *s = e->snap, *older; s; s = older) {
+		older = s->older;
+		free(s);
+	}
+	pthread_mutex_destroy(&e->timing_mutex);
+	pthread_mutex_destroy(&e->flush_mutex);
+	pthread_mutex_destroy(&e->mutex);
+	free(e);
+}
+
+eeprom_geometry eeprom_dev_geometry(const eeprom_t *e) {
+	return e->geo;
+}
+
+uint32_t eeprom_dev_size(const eeprom_t *e) {
+	return e->size;
+}
+
+uint32_t eeprom_dev_n_pages(const eeprom_t *e) {
+	return e->n_pages;
+}
+
+void eeprom_dev_set_lock_mode(eeprom_t *e, const eeprom_lock_mode mode) {
+	e->lock_mode = mode;
+}
+
+eeprom_lock_mode eeprom_dev_get_lock_mode(const eeprom_t *e) {
+	return e->lock_mode;
+}
+
+void eeprom_dev_set_verify(eeprom_t *e, const bool verify) {
+	e->verify = verify;
+}
+
+bool eeprom_dev_get_verify(const eeprom_t *e) {
+	return e->verify;
+}
+
+uint32_t eeprom_dev_crc_errors(const eeprom_t *e) {
+	return __atomic_load_n(&e->crc_errors, __ATOMIC_RELAXED);
+}
+
+uint32_t eeprom_dev_check(eeprom_t *e) {
+	uint32_t bad = 0;
+	pthread_mutex_lock(&e->mutex);
+	for (uint32_t p = 0; p < e->n_pages; p++)
+		bad += (page_crc(e, p) != e->crc[p]);
+	pthread_mutex_unlock(&e->mutex);
+	__atomic_add_fetch(&e->crc_errors, bad, __ATOMIC_RELAXED);
+	return bad;
+}
+
+void eeprom_dev_flip_bits(eeprom_t *e, const uint32_t offset, const uint8_t mask) {
+	if (offset >= e->size)
+		return;
+	write_begin(e);
+	cow(e, offset, 1);
+	e->buf[offset] ^= mask;
+	write_end(e);
+}
+
+//-------
+// Files
+//-------
+
+// Binary image header (see eeprom_from_image()), followed by the content
+#define IMAGE_MAGIC    "EEPR"
+#define IMAGE_VERSION  1
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_words;
+	uint32_t word_sz;
+	uint32_t page_sz;
+	uint32_t data_off;  // Offset of the content, from the beginning of the file
+	uint32_t checksum;  // Adler-32 of the content
+	uint8_t reserved[36];
+} image_header;
+
+_Static_assert(sizeof(image_header) == 64, "Image header is 64 bytes");
+
+static void fill_header(const eeprom_t *e, image_header *h, const uint32_t checksum) {
+	memset(h, 0, sizeof(image_header));
+	memcpy(h->magic, IMAGE_MAGIC, 4);
+	h->version = IMAGE_VERSION;
+	h->n_words = e->geo.n_words;
+	h->word_sz = e->geo.word_sz;
+	h->page_sz = e->geo.page_sz;
+	h->data_off = sizeof(image_header);
+	h->checksum = checksum;
+}
+
+/**
+ Lock the entire file.
+ Blocker version.
+ \param[in] fno File descriptor, previously opened.
+ \param[in] type l_type value for flock (e.g., F_RDLCK or F_WRLCK).
+ \return True on success, false otherwise.
+ */
+static bool lock_fd(const int fno, const unsigned short type) {
+	if (fno < 0)
+		return false;
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	return (fcntl(fno, F_SETLKW, &fl) != -1);
+}
+
+// Text format: value of each hex digit plus one, 0 for the other characters
+static const uint8_t hex_digit[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8,
+	['8'] = 9, ['9'] = 10, ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+// Text format: separators
+static const bool text_sep[256] = {[' '] = true, [','] = true, ['\r'] = true, ['\n'] = true};
+
+/**
+ Next token of a line of text.
+ \param[in,out] p Where to start; on return, right after the token.
+ \param[in] eol End of the line.
+ \param[out] len Token length.
+ \return Token, NULL if none.
+ */
+static inline const uint8_t *next_token(const uint8_t **p, const uint8_t *eol, uint32_t *len) {
+	const uint8_t *c = *p;
+	while (c < eol && text_sep[*c])
+		c++;
+	const uint8_t *tok = c;
+	while (c < eol && !text_sep[*c])
+		c++;
+	*p = c;
+	*len = (uint32_t)(c - tok);
+	return (c > tok) ? tok : NULL;
+}
+
+/**
+ Parse the text format into a staging copy, as eeprom_dev_from_file() used
+ to with strtok() and sscanf(): parsing stops at an empty line or at an
+ invalid page number; a page with an invalid byte or CRC is left erased.
+ \param[in] text File content.
+ \param[out] stage Content, erased beforehand.
+ \param[out] crc CRC32C of each page, those of erased pages beforehand.
+ \return Number of bytes read.
+ */
+static uint32_t parse_text(eeprom_t *e, const uint8_t *text, const size_t text_sz, uint8_t *stage,
+			uint32_t *crc) {
+	const uint8_t *p = text, *end = text + text_sz;
+	const uint32_t page_sz = e->geo.page_sz;
+	const uint32_t erased_crc = crc[0];
+	uint32_t read = 0, len;
+	while (p < end) {
+		const uint8_t *eol = (const uint8_t *)memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		const uint8_t *tok = next_token(&p, eol, &len);
+		if (!tok)
+			break;
+
+		// Page number, decimal (leading digits, as atoi())
+		uint32_t page_addr = 0;
+		for (uint32_t i = 0; i < len && tok[i] >= '0' && tok[i] <= '9' && page_addr < e->n_pages; i++)
+			page_addr = 10 * page_addr + (tok[i] - '0');
+		if (page_addr >= e->n_pages || !(tok = next_token(&p, eol, &len)))
+			break;
+
+		// Bytes: one or two hex digits each. Fast path for those written by
+		// eeprom_dev_to_file(), two digits and a comma.
+		uint8_t *page = stage + (size_t)page_addr * page_sz;
+		uint32_t s = 0;
+		uint8_t bad = 0;
+		const uint8_t *c = tok;
+		while (s < page_sz && eol - c >= 3 && c[2] == ',' && !text_sep[c[0]] && !text_sep[c[1]]) {
+			const uint8_t hi = hex_digit[c[0]], lo = hex_digit[c[1]];
+			bad |= (hi == 0) | (lo == 0);
+			page[s++] = (uint8_t)((hi - 1) << 4 | (lo - 1));
+			c += 3;
+		}
+		if (c != tok) {
+			p = c;
+			tok = next_token(&p, eol, &len);
+		}
+		for (; s < page_sz && tok && len <= 2; s++, tok = next_token(&p, eol, &len)) {
+			const uint8_t hi = hex_digit[tok[0]], lo = (len == 2) ? hex_digit[tok[1]] : 1;
+			bad |= (hi == 0) | (lo == 0);
+			page[s] = (len == 2) ? (uint8_t)((hi - 1) << 4 | (lo - 1)) : (uint8_t)(hi - 1);
+		}
+
+		// Optional CRC (older files have none), longer than a byte: a corrupted
+		// page is left erased
+		crc[page_addr] = crc32c(0, page, page_sz);
+		if (tok) {
+			uint64_t file_crc = 0;
+			for (uint32_t i = 0; i < len && i < 16; i++) {
+				bad |= (hex_digit[tok[i]] == 0);
+				file_crc = file_crc << 4 | (uint8_t)(hex_digit[tok[i]] - 1);
+			}
+			bad |= (len > 16) | (file_crc != crc[page_addr]) | (s < page_sz);
+		}
+		p = eol + 1;
+		if (bad) {
+			memset(page, EEPROM_ERASE_STATE, page_sz);
+			crc[page_addr] = erased_crc;
+			crc_error(e);
+			continue;
+		}
+		read += s;
+	}
+	return read;
+}
+
+// Format: <page_id> <byte_0>,<byte_1>,...,<byte_$(page_sz - 1)>, <crc>
+// The file is mapped and parsed into a staging copy, without the buffer lock:
+// the lock is only held to copy it in, and readers never see a partial load.
+// Pages missing from the file are erased.
+uint32_t eeprom_dev_from_file(eeprom_t *e, const char *file_name) {
+	const size_t crc_off = (e->size + 3) & ~(size_t)3;
+	uint8_t *stage = (uint8_t *)malloc(crc_off + e->n_pages * sizeof(uint32_t));
+	if (!stage)
+		return 0;
+	uint32_t *crc = (uint32_t *)(stage + crc_off);
+	memset(stage, EEPROM_ERASE_STATE, e->size);
+	const uint32_t erased_crc = crc32c(0, stage, e->geo.page_sz);
+	for (uint32_t p = 0; p < e->n_pages; p++)
+		crc[p] = erased_crc;
+
+	uint32_t read = 0;
+	const int fd = open(file_name, O_RDONLY);
+	struct stat st;
+	if (fd >= 0 && lock_fd(fd, F_RDLCK) && fstat(fd, &st) == 0 && st.st_size > 0) {
+		const uint8_t *text = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (text != MAP_FAILED) {
+			madvise((void *)text, st.st_size, MADV_SEQUENTIAL);
+			read = parse_text(e, text, st.st_size, stage, crc);
+			munmap((void *)text, st.st_size);
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+
+	write_begin(e);
+	cow(e, 0, e->size);
+	memcpy(e->buf, stage, e->size);
+	memcpy(e->crc, crc, e->n_pages * sizeof(uint32_t));
+	mark_dirty(e, 0, e->size);
+	write_end(e);
+	free(stage);
+	return read;
+}
+
+// Format: <page_id> <byte_0>,<byte_1>,...,<byte_$(page_sz - 1)>, <crc>
+uint32_t eeprom_dev_to_file(eeprom_t *e, const char *file_name) {
+	FILE *fp = NULL;
+	fp = fopen(file_name, "w+");
+	if (!fp)
+		return 0;
+	if (!lock_fd(fileno(fp), F_WRLCK)) {
+		fclose(fp);
+		return 0;
+	}
+
+	// Write one page per line, then its CRC, as stored: corruption in memory
+	// is detected when the file is loaded back
+	const uint32_t page_sz = e->geo.page_sz;
+	uint32_t i = 0, s = 0, written = 0, crc = 0, seq;
+	uint8_t *page = (uint8_t *)malloc(page_sz);
+	if (!page) {
+		fclose(fp);
+		return 0;
+	}
+	for (i = 0; i < e->n_pages; i++) {
+		do {
+			seq = read_begin(e);
+			memcpy(page, e->buf + i * page_sz, page_sz);
+			crc = e->crc[i];
+		} while (read_retry(e, seq));
+		fprintf(fp, "%d ", i);
+		for (s = 0; s < page_sz; s++) {
+			fprintf(fp, "%02x,", page[s]);
+			written++;
+		}
+		fprintf(fp, " %08x\n", crc);
+	}
+	free(page);
+	fclose(fp);
+	return written;
+}
+
+/**
+ Adler-32 checksum (RFC 1950), sums reduced once every 5552 bytes.
+ */
+static uint32_t adler32(const uint8_t *data, uint32_t len) {
+	uint32_t a = 1, b = 0;
+	while (len > 0) {
+		uint32_t n = (len < 5552) ? len : 5552;
+		len -= n;
+		while (n--) {
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+// Format: image_header, then the content. Native byte order.
+uint32_t eeprom_dev_from_image(eeprom_t *e, const char *file_name) {
+	const size_t image_sz = sizeof(image_header) + e->size;
+	const int fd = open(file_name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (!lock_fd(fd, F_RDLCK) || fstat(fd, &st) != 0 || st.st_size != (off_t)image_sz) {
+		close(fd);
+		return 0;
+	}
+	const uint8_t *map = (const uint8_t *)mmap(NULL, image_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	// Check the whole image before touching the buffer
+	const image_header *h = (const image_header *)map;
+	const uint8_t *content = map + sizeof(image_header);
+	uint32_t read = 0;
+	if (memcmp(h->magic, IMAGE_MAGIC, 4) == 0 && h->version == IMAGE_VERSION &&
+			h->n_words == e->geo.n_words && h->word_sz == e->geo.word_sz &&
+			h->page_sz == e->geo.page_sz && h->data_off == sizeof(image_header) &&
+			h->checksum == adler32(content, e->size)) {
+		write_begin(e);
+		cow(e, 0, e->size);
+		memcpy(e->buf, content, e->size);
+		mark_written(e, 0, e->size);
+		write_end(e);
+		read = e->size;
+	}
+	munmap((void *)map, image_sz);
+	return read;
+}
+
+uint32_t eeprom_dev_to_image(eeprom_t *e, const char *file_name) {
+	const size_t image_sz = sizeof(image_header) + e->size;
+	const int fd = open(file_name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return 0;
+	if (!lock_fd(fd, F_WRLCK) || ftruncate(fd, image_sz) != 0) {
+		close(fd);
+		return 0;
+	}
+	uint8_t *map = (uint8_t *)mmap(NULL, image_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	image_header *h = (image_header *)map;
+	uint8_t *content = map + sizeof(image_header);
+	uint32_t seq;
+	do {
+		seq = read_begin(e);
+		memcpy(content, e->buf, e->size);
+	} while (read_retry(e, seq));
+	fill_header(e, h, adler32(content, e->size));
+	munmap(map, image_sz);
+	return e->size;
+}
+
+//-----------------
+// Dirty pages
+//-----------------
+
+#define ADLER_MOD  65521
+
+/**
+ Update the Adler-32 of a content for a change of some of its bytes:
+ A = 1 + sum(d[j]), B = sum((n - j) * d[j]) + n, so each changed byte adds
+ its difference to A, and n - j times it to B.
+ \param[in] sum Adler-32 before the change.
+ \param[in] n Content size.
+ \param[in] off Offset of the changed range.
+ \param[in] before Range before the change.
+ \param[in] after Range after the change.
+ \param[in] len Range size.
+ \return Adler-32 after the change.
+ */
+static uint32_t adler32_update(const uint32_t sum, const uint32_t n, const uint32_t off,
+			const uint8_t *before, const uint8_t *after, const uint32_t len) {
+	int64_t da = 0, db = 0;
+	for (uint32_t j = 0; j < len; j++) {
+		const int64_t d = (int64_t)after[j] - before[j];
+		da += d;
+		db += (int64_t)((n - off - j) % ADLER_MOD) * d;
+	}
+	const int64_t a = ((int64_t)(sum & 0xffff) + da % ADLER_MOD + ADLER_MOD) % ADLER_MOD;
+	const int64_t b = ((int64_t)(sum >> 16) + db % ADLER_MOD + ADLER_MOD) % ADLER_MOD;
+	return (uint32_t)((b << 16) | a);
+}
+
+/**
+ Write all of a buffer at an offset, retrying on short writes.
+ */
+static bool pwrite_all(const int fd, const uint8_t *data, size_t len, off_t off) {
+	while (len > 0) {
+		const ssize_t n = pwrite(fd, data, len, off);
+		if (n <= 0)
+			return false;
+		data += n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+static bool stop_flusher(eeprom_t *e);
+
+// Largest gap between two runs of dirty pages a flush writes over, in bytes
+#define FLUSH_GAP  512
 
-// Check word address
-#define CHECK_WORD_ADDR(addr) CHECK_OFFSET(addr * EEPROM_WORD_SZ)
+/**
+ Find the next set (or clear) bit of a bitmap.
+ \param[in] bits Bitmap.
+ \param[in] n Number of bits.
+ \param[in] from First bit to look at.
+ \param[in] set Look for a set bit if true, a clear one otherwise.
+ \return Bit number, n if none.
+ */
+static uint32_t next_bit(const uint64_t *bits, const uint32_t n, uint32_t from, const bool set) {
+	while (from < n) {
+		const uint64_t w = (set ? bits[from / 64] : ~bits[from / 64]) & (~0ULL << (from % 64));
+		if (w) {
+			const uint32_t b = (from / 64) * 64 + __builtin_ctzll(w);
+			return b < n ? b : n;
+		}
+		from = (from / 64 + 1) * 64;
+	}
+	return n;
+}
 
-// Check page address
-#define CHECK_PAGE_ADDR(addr) CHECK_OFFSET(addr * EEPROM_PAGE_SZ)
+bool eeprom_dev_attach(eeprom_t *e, const char *file_name) {
+	eeprom_dev_detach(e);
+	const int fd = open(file_name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+	const size_t bitmap_sz = BITMAP_WORDS(e->n_pages) * sizeof(uint64_t);
+	uint8_t *shadow = (uint8_t *)malloc(e->size);
+	uint64_t *flushing = (uint64_t *)malloc(bitmap_sz);
+	bool ok = shadow && flushing;
 
-// EEPROM memory buffer
-static uint8_t eeprom[EEPROM_SZ];
+	// Write the whole image: the file starts clean
+	if (ok) {
+		pthread_mutex_lock(&e->mutex);
+		memcpy(shadow, e->buf, e->size);
+		memset(e->dirty, 0, bitmap_sz);
+		e->n_dirty = 0;
+		pthread_mutex_unlock(&e->mutex);
+	}
+	const uint32_t checksum = ok ? adler32(shadow, e->size) : 0;
+	image_header h;
+	fill_header(e, &h, checksum);
+	ok = ok && lock_fd(fd, F_WRLCK) && ftruncate(fd, sizeof(h) + e->size) == 0 &&
+			pwrite_all(fd, (const uint8_t *)&h, sizeof(h), 0) &&
+			pwrite_all(fd, shadow, e->size, sizeof(h)) && lock_fd(fd, F_UNLCK);
+	if (!ok) {
+		pthread_mutex_lock(&e->mutex);
+		mark_dirty(e, 0, e->size);  // Nothing persisted
+		pthread_mutex_unlock(&e->mutex);
+		free(shadow);
+		free(flushing);
+		close(fd);
+		return false;
+	}
+	pthread_mutex_lock(&e->flush_mutex);
+	e->fd = fd;
+	e->shadow = shadow;
+	e->checksum = checksum;
+	e->flushing = flushing;
+	pthread_mutex_unlock(&e->flush_mutex);
+	return true;
+}
+
+void eeprom_dev_detach(eeprom_t *e) {
+	stop_flusher(e);
+	pthread_mutex_lock(&e->flush_mutex);
+	if (e->fd >= 0) {
+		close(e->fd);
+		free(e->shadow);
+		free(e->flushing);
+		e->fd = -1;
+		e->shadow = NULL;
+		e->flushing = NULL;
+	}
+	pthread_mutex_unlock(&e->flush_mutex);
+}
 
-// Lock to protect the buffer
-static pthread_mutex_t buf_mutex;
+uint32_t eeprom_dev_dirty_pages(eeprom_t *e) {
+	pthread_mutex_lock(&e->mutex);
+	const uint32_t n = e->n_dirty;
+	pthread_mutex_unlock(&e->mutex);
+	return n;
+}
 
 /**
- Lock the entire file.
- Blocker version.
- \param[in] fd File descriptor, previously opened.
- \param[in] type l_type value for flock (e.g., F_RDLCK or F_WRLCK).
- \return True on success, false otherwise.
+ Write the dirty pages to the attached file, see eeprom_dev_flush().
+ Dirty pages are copied to the shadow under the buffer lock, then written
+ from there: writers only wait for the copy, not for the disk.
+ \param[out] success True if the file is up to date (and synced, if asked).
+ \return Number of content bytes written.
+ */
+static uint32_t flush(eeprom_t *e, const bool sync, bool *success) {
+	pthread_mutex_lock(&e->flush_mutex);
+	if (e->fd < 0) {
+		pthread_mutex_unlock(&e->flush_mutex);
+		*success = false;
+		return 0;
+	}
+	const uint32_t page_sz = e->geo.page_sz, words = BITMAP_WORDS(e->n_pages);
+	uint32_t checksum = e->checksum, pages = 0, written = 0;
+	pthread_mutex_lock(&e->mutex);
+	for (uint32_t w = 0; w < words; w++) {
+		uint64_t bits = e->flushing[w] = e->dirty[w];
+		e->dirty[w] = 0;
+		for (; bits; bits &= bits - 1) {
+			const uint32_t off = (w * 64 + __builtin_ctzll(bits)) * page_sz;
+			checksum = adler32_update(checksum, e->size, off, e->shadow + off, e->buf + off, page_sz);
+			memcpy(e->shadow + off, e->buf + off, page_sz);
+			pages++;
+		}
+	}
+	e->n_dirty = 0;
+	pthread_mutex_unlock(&e->mutex);
+
+	// Runs of dirty pages, one pwrite each, then the checksum. Runs closer than
+	// FLUSH_GAP bytes are merged: rewriting a few clean bytes (from the
+	// shadow, same as the file) is cheaper than another system call.
+	const uint32_t n = e->n_pages;
+	bool ok = lock_fd(e->fd, F_WRLCK);
+	uint32_t p = next_bit(e->flushing, n, 0, true);
+	while (ok && p < n) {
+		uint32_t q = next_bit(e->flushing, n, p, false), r;
+		while ((r = next_bit(e->flushing, n, q, true)) < n && (r - q) * page_sz <= FLUSH_GAP)
+			q = next_bit(e->flushing, n, r, false);
+		ok = pwrite_all(e->fd, e->shadow + p * page_sz, (q - p) * page_sz,
+				sizeof(image_header) + p * page_sz);
+		written += (q - p) * page_sz;
+		p = r;
+	}
+	if (pages > 0)
+		ok = ok && pwrite_all(e->fd, (const uint8_t *)&checksum, sizeof(checksum),
+				offsetof(image_header, checksum));
+	if (sync)
+		ok = ok && fdatasync(e->fd) == 0;
+	lock_fd(e->fd, F_UNLCK);
+	if (ok)
+		e->checksum = checksum;
+	else {
+		// The shadow is ahead of the file: flush those pages again next time
+		pthread_mutex_lock(&e->mutex);
+		e->n_dirty = 0;
+		for (uint32_t w = 0; w < words; w++)
+			e->n_dirty += __builtin_popcountll(e->dirty[w] |= e->flushing[w]);
+		pthread_mutex_unlock(&e->mutex);
+		e->checksum = checksum;
+		written = 0;
+	}
+	pthread_mutex_unlock(&e->flush_mutex);
+	*success = ok;
+	return written;
+}
+
+uint32_t eeprom_dev_flush(eeprom_t *e, const bool sync) {
+	bool ok;
+	return flush(e, sync, &ok);
+}
+
+bool eeprom_dev_sync(eeprom_t *e) {
+	bool ok;
+	flush(e, true, &ok);
+	return ok;
+}
+
+//---------
+// Flusher
+//---------
+
+// Wait before retrying a failed flush, if there is no interval, in ms
+#define FLUSHER_RETRY_MS  1000
+
+/**
+ Flusher thread: flush every interval, or as soon as there are enough dirty
+ pages, until stopped. Writes made meanwhile are coalesced: a page written
+ many times is flushed once.
+ */
+static void *flusher_main(void *arg) {
+	eeprom_t *e = (eeprom_t *)arg;
+	const eeprom_flusher_config cfg = e->flusher_cfg;
+	bool failed = false;
+	pthread_mutex_lock(&e->mutex);
+	while (e->flusher_on) {
+		// After a failure (pages still dirty), wait the full interval
+		const uint32_t ms = (failed && cfg.interval_ms == 0) ? FLUSHER_RETRY_MS : cfg.interval_ms;
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += ms / 1000;
+		deadline.tv_nsec += (ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (e->flusher_on && (failed || cfg.dirty_pages == 0 || e->n_dirty < cfg.dirty_pages)) {
+			if (ms == 0)
+				pthread_cond_wait(&e->flusher_cond, &e->mutex);
+			else if (pthread_cond_timedwait(&e->flusher_cond, &e->mutex, &deadline) == ETIMEDOUT)
+				break;
+		}
+		if (!e->flusher_on || e->n_dirty == 0)
+			continue;
+		pthread_mutex_unlock(&e->mutex);
+		bool ok;
+		flush(e, cfg.sync, &ok);
+		failed = !ok;
+		pthread_mutex_lock(&e->mutex);
+	}
+	pthread_mutex_unlock(&e->mutex);
+	return NULL;
+}
+
+/**
+ Stop the flusher thread, if running, without a last flush.
+ \return True if it was running.
  */
-static bool lock_fd(FILE *fd, const unsigned short type) {
-	if (!fd)
+static bool stop_flusher(eeprom_t *e) {
+	pthread_mutex_lock(&e->mutex);
+	const bool on = e->flusher_on;
+	e->flusher_on = false;
+	if (on)
+		pthread_cond_signal(&e->flusher_cond);
+	pthread_mutex_unlock(&e->mutex);
+	if (on) {
+		pthread_join(e->flusher, NULL);
+		pthread_cond_destroy(&e->flusher_cond);
+	}
+	return on;
+}
+
+bool eeprom_dev_start_flusher(eeprom_t *e, const eeprom_flusher_config *cfg) {
+	if (!cfg || (cfg->interval_ms == 0 && cfg->dirty_pages == 0))
 		return false;
-	int fno = fileno(fd);
-	struct flock fl;
-	memset(&fl, 0, sizeof(fl));
-	fl.l_type = type;
-	fl.l_whence = SEEK_SET;
-	return (fcntl(fno, F_SETLKW, &fl) != -1);
+	stop_flusher(e);
+	pthread_mutex_lock(&e->flush_mutex);
+	const bool attached = (e->fd >= 0);
+	pthread_mutex_unlock(&e->flush_mutex);
+	if (!attached)
+		return false;
+
+	// Deadlines on the monotonic clock: immune to wall clock changes
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&e->flusher_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_lock(&e->mutex);
+	e->flusher_cfg = *cfg;
+	e->flusher_on = true;
+	pthread_mutex_unlock(&e->mutex);
+	if (pthread_create(&e->flusher, NULL, flusher_main, e) != 0) {
+		pthread_mutex_lock(&e->mutex);
+		e->flusher_on = false;
+		pthread_mutex_unlock(&e->mutex);
+		pthread_cond_destroy(&e->flusher_cond);
+		return false;
+	}
+	return true;
 }
 
-// Format: <page_id> <byte_0><byte_1>...<byte_$(EEPROM_PAGE_SZ - 1)>
-uint32_t eeprom_from_file(const char *file_name) {
-	if (!eeprom_erase())
-		return 0;
+bool eeprom_dev_stop_flusher(eeprom_t *e) {
+	return stop_flusher(e) && eeprom_dev_sync(e);
+}
 
-	// Parse file, line by line.
-	FILE *fp = NULL;
-	fp = fopen(file_name, "r");
-	if (!fp)
-		return 0;
-	if (!lock_fd(fp, F_RDLCK)) {
-		fclose(fp);
-		return 0;
+//--------------
+// Timing model
+//--------------
+
+/**
+ Wait for the device to end its write cycle, if any: it does not acknowledge
+ until then (acknowledge polling). Timing lock held.
+ */
+static void wait_write_cycle(eeprom_t *e) {
+	eeprom_timing_stats *st = &e->timing_stats;
+	if (st->time_ns < e->busy_until_ns) {
+		st->wait_ns += e->busy_until_ns - st->time_ns;
+		st->time_ns = e->busy_until_ns;
 	}
-	char * line = NULL;
-	size_t len = 0;
-	ssize_t read = 0;
-	pthread_mutex_lock(&buf_mutex);
-	while (getline(&line, &len, fp) != -1) {
-		char *token = strtok(line, " ,");
-		if (!token)
-			break;
+}
 
-		// Parse page number
-		uint32_t page_addr = atoi(token);
-		CHECK_PAGE_ADDR(page_addr);
-		token = strtok(NULL, " ,");
-		if (!token)
-			break;
-		uint32_t s = 0;
-		for (s = 0; s < EEPROM_PAGE_SZ && token != NULL; s++, token = strtok(NULL, " ,")) {
-			sscanf(token, "%2hhx", &eeprom[page_addr * EEPROM_PAGE_SZ + s])	;
-			read++;
+/**
+ One bus transaction: start, device address, memory address, data, stop,
+ each byte 9 bits (8, then the acknowledge). A read sets the address, then
+ restarts and sends the device address again. Timing lock held.
+ */
+static void transfer(eeprom_t *e, const uint32_t len, const bool read) {
+	eeprom_timing_stats *st = &e->timing_stats;
+	const uint64_t bytes = 1 + e->timing.addr_bytes + len + (read ? 1 : 0);
+	const uint64_t bits = 9 * bytes + (read ? 3 : 2);
+	st->time_ns += bits * 1000000000ULL / e->timing.bus_hz;
+	st->bus_bytes += bytes;
+	st->transactions++;
+}
+
+/**
+ Advance the virtual clock for an access. Sequential reads cross pages
+ freely; writes go through the page buffer: one transaction, then one
+ write cycle, per page touched.
+ \param[in] off First byte.
+ \param[in] len Number of bytes.
+ \param[in] write Write instead of read.
+ */
+static void account(eeprom_t *e, const uint32_t off, const uint32_t len, const bool write) {
+	pthread_mutex_lock(&e->timing_mutex);
+	if (!write) {
+		wait_write_cycle(e);
+		transfer(e, len, true);
+	}
+	const uint32_t page_sz = e->geo.page_sz;
+	for (uint32_t a = off; write && a < off + len; ) {
+		const uint32_t n = (page_sz - a % page_sz < off + len - a) ? page_sz - a % page_sz : off + len - a;
+		wait_write_cycle(e);
+		transfer(e, n, false);
+		e->busy_until_ns = e->timing_stats.time_ns + e->timing.t_wr_us * 1000ULL;
+		e->timing_stats.write_cycles++;
+		a += n;
+	}
+	pthread_mutex_unlock(&e->timing_mutex);
+}
+
+static inline void timed(eeprom_t *e, const uint32_t off, const uint32_t len, const bool write) {
+	if (e->timed)
+		account(e, off, len, write);
+}
+
+bool eeprom_dev_set_timing(eeprom_t *e, const eeprom_timing *timing) {
+	if (timing && timing->bus_hz == 0)
+		return false;
+	pthread_mutex_lock(&e->timing_mutex);
+	e->timed = (timing != NULL);
+	if (timing)
+		e->timing = *timing;
+	memset(&e->timing_stats, 0, sizeof(e->timing_stats));
+	e->busy_until_ns = 0;
+	pthread_mutex_unlock(&e->timing_mutex);
+	return true;
+}
+
+eeprom_timing_stats eeprom_dev_timing_stats(eeprom_t *e) {
+	pthread_mutex_lock(&e->timing_mutex);
+	eeprom_timing_stats st = e->timing_stats;
+	if (st.time_ns < e->busy_until_ns)
+		st.time_ns = e->busy_until_ns;
+	pthread_mutex_unlock(&e->timing_mutex);
+	return st;
+}
+
+void eeprom_dev_reset_timing_stats(eeprom_t *e) {
+	pthread_mutex_lock(&e->timing_mutex);
+	memset(&e->timing_stats, 0, sizeof(e->timing_stats));
+	e->busy_until_ns = 0;
+	pthread_mutex_unlock(&e->timing_mutex);
+}
+
+//------
+// Wear
+//------
+
+static inline uint32_t cycles(const eeprom_t *e, const uint32_t phys) {
+	return e->cycles[phys];
+}
+
+/**
+ Find the least worn pages.
+ */
+static void find_min(eeprom_t *e) {
+	const uint32_t *c = e->cycles;
+	uint32_t min = UINT32_MAX, n = 0;
+	for (uint32_t p = 0; p < e->n_pages; p++) {
+		if (c[p] < min) {
+			min = c[p];
+			n = 0;
 		}
+		n += (c[p] == min);
 	}
-	pthread_mutex_unlock(&buf_mutex);
-	fclose(fp);
-	return read;
+	e->min_cycles = min;
+	e->n_at_min = n;
 }
-// Format: <page_id> <byte_0><byte_1>...<byte_$(EEPROM_PAGE_SZ - 1)>
-uint32_t eeprom_to_file(const char *file_name) {
-	FILE *fp = NULL;
-	fp = fopen(file_name, "w+");
-	if (!fp)
+
+/**
+ Count a cycle of a physical page, keeping track of the least worn pages:
+ when the last one is worn, all of them are one cycle ahead.
+ */
+static inline void count_cycle(eeprom_t *e, const uint32_t phys, const bool erase) {
+	const bool at_min = (e->cycles[phys]++ == e->min_cycles);
+	e->erases[phys] += erase;
+	if (at_min && --e->n_at_min == 0)
+		find_min(e);
+}
+
+/**
+ Level the wear after a cycle of a logical page: once its physical page is
+ threshold cycles ahead of the least worn ones, and the page itself wrote
+ that many there (hot data, not just a worn page), swap it with one of
+ them. The logical page there, likely static, moves to the worn page. Both
+ physical pages are rewritten.
+ */
+static void level(eeprom_t *e, const uint32_t page) {
+	const uint32_t hot = e->to_phys[page], threshold = e->level_threshold;
+	if (cycles(e, hot) < e->min_cycles + threshold || cycles(e, hot) - e->landed[hot] < threshold)
+		return;
+	uint32_t cold = e->cold_cursor;
+	while (cycles(e, cold) != e->min_cycles)
+		cold = (cold + 1 == e->n_pages) ? 0 : cold + 1;
+	e->cold_cursor = (cold + 1 == e->n_pages) ? 0 : cold + 1;
+	const uint32_t other = e->to_logical[cold];
+	e->to_phys[page] = cold;
+	e->to_logical[cold] = page;
+	e->to_phys[other] = hot;
+	e->to_logical[hot] = other;
+	count_cycle(e, cold, false);
+	count_cycle(e, hot, false);
+	e->landed[cold] = cycles(e, cold);
+	e->landed[hot] = cycles(e, hot);
+	e->swaps++;
+}
+
+/**
+ Count the cycles of the pages of a range of bytes. Writers only.
+ \param[in] erase Erase instead of write.
+ */
+static void wear(eeprom_t *e, const uint32_t off, const uint32_t len, const bool erase) {
+	const uint32_t first = off / e->geo.page_sz, last = (off + len - 1) / e->geo.page_sz;
+	if (e->level_threshold > 0) {
+		for (uint32_t p = first; p <= last; p++) {
+			count_cycle(e, e->to_phys[p], erase);
+			level(e, p);
+		}
+		return;
+	}
+
+	// Not leveling: counters only
+	uint32_t *c = e->cycles, *erases = e->erases;
+	if (!e->to_phys) {
+		for (uint32_t p = first; p <= last; p++)
+			c[p]++;
+		for (uint32_t p = first; erase && p <= last; p++)
+			erases[p]++;
+		return;
+	}
+	for (uint32_t p = first; p <= last; p++) {
+		c[e->to_phys[p]]++;
+		erases[e->to_phys[p]] += erase;
+	}
+}
+
+bool eeprom_dev_set_wear_leveling(eeprom_t *e, const uint32_t threshold) {
+	bool ok = true;
+	pthread_mutex_lock(&e->mutex);
+	if (threshold > 0 && !e->to_phys) {
+		e->to_phys = (uint32_t *)malloc(e->n_pages * sizeof(uint32_t));
+		e->to_logical = (uint32_t *)malloc(e->n_pages * sizeof(uint32_t));
+		e->landed = (uint32_t *)malloc(e->n_pages * sizeof(uint32_t));
+		ok = e->to_phys && e->to_logical && e->landed;
+		for (uint32_t p = 0; ok && p < e->n_pages; p++) {
+			e->to_phys[p] = e->to_logical[p] = p;
+			e->landed[p] = cycles(e, p);
+		}
+		if (!ok) {
+			free(e->to_phys);
+			free(e->to_logical);
+			free(e->landed);
+			e->to_phys = e->to_logical = e->landed = NULL;
+		}
+	}
+	if (ok)
+		e->level_threshold = threshold;
+	if (ok && threshold > 0)
+		find_min(e);
+	pthread_mutex_unlock(&e->mutex);
+	return ok;
+}
+
+uint32_t eeprom_dev_physical_page(eeprom_t *e, const uint32_t page) {
+	pthread_mutex_lock(&e->mutex);
+	const uint32_t phys = (page < e->n_pages && e->to_phys) ? e->to_phys[page] : page;
+	pthread_mutex_unlock(&e->mutex);
+	return phys;
+}
+
+uint32_t eeprom_dev_page_wear(eeprom_t *e, const uint32_t phys) {
+	pthread_mutex_lock(&e->mutex);
+	const uint32_t n = (phys < e->n_pages) ? cycles(e, phys) : 0;
+	pthread_mutex_unlock(&e->mutex);
+	return n;
+}
+
+eeprom_wear_stats eeprom_dev_wear_stats(eeprom_t *e) {
+	eeprom_wear_stats st = {0, 0, 0, 0, 0, 0};
+	pthread_mutex_lock(&e->mutex);
+	for (uint32_t p = 0; p < e->n_pages; p++) {
+		st.writes += e->cycles[p] - e->erases[p];
+		st.erases += e->erases[p];
+		if (cycles(e, p) > st.max_cycles) {
+			st.max_cycles = cycles(e, p);
+			st.max_page = p;
+		}
+	}
+	find_min(e);
+	st.min_cycles = e->min_cycles;
+	st.swaps = e->swaps;
+	pthread_mutex_unlock(&e->mutex);
+	return st;
+}
+
+uint32_t eeprom_dev_wear_histogram(eeprom_t *e, uint32_t *bins, const uint32_t n_bins) {
+	if (n_bins == 0)
 		return 0;
-	if (!lock_fd(fp, F_WRLCK)) {
-		fclose(fp);
+	pthread_mutex_lock(&e->mutex);
+	uint32_t max = 0;
+	for (uint32_t p = 0; p < e->n_pages; p++)
+		max = (cycles(e, p) > max) ? cycles(e, p) : max;
+	const uint32_t width = max / n_bins + 1;
+	memset(bins, 0, n_bins * sizeof(uint32_t));
+	for (uint32_t p = 0; p < e->n_pages; p++)
+		bins[cycles(e, p) / width]++;
+	pthread_mutex_unlock(&e->mutex);
+	return width;
+}
+
+void eeprom_dev_reset_wear(eeprom_t *e) {
+	pthread_mutex_lock(&e->mutex);
+	memset(e->cycles, 0, e->n_pages * sizeof(uint32_t));
+	memset(e->erases, 0, e->n_pages * sizeof(uint32_t));
+	e->min_cycles = 0;
+	e->n_at_min = e->n_pages;
+	e->swaps = 0;
+	if (e->landed)
+		memset(e->landed, 0, e->n_pages * sizeof(uint32_t));
+	pthread_mutex_unlock(&e->mutex);
+}
+
+//--------------
+// Words, pages
+//--------------
+
+uint32_t eeprom_dev_read_word(eeprom_t *e, const uint32_t offset, uint8_t *data) {
+	CHECK_WORD_ADDR(e, offset);
+	const uint32_t word_sz = e->geo.word_sz;
+	uint32_t seq;
+	bool ok;
+	do {
+		seq = read_begin(e);
+		if ((ok = verified(e, word_sz * offset, word_sz)))
+			memcpy(data, e->buf + (word_sz * offset), word_sz);
+	} while (read_retry(e, seq));
+	timed(e, word_sz * offset, word_sz, false);
+	traced(e, EEPROM_OP_READ_WORD, word_sz * offset, word_sz);
+	return ok ? word_sz : crc_error(e);
+}
+
+uint32_t eeprom_dev_write_word(eeprom_t *e, const uint32_t offset, const uint8_t *data) {
+	CHECK_WORD_ADDR(e, offset);
+	const uint32_t word_sz = e->geo.word_sz;
+	write_begin(e);
+	cow(e, word_sz * offset, word_sz);
+	memcpy(e->buf + (word_sz * offset), data, word_sz);
+	mark_written(e, word_sz * offset, word_sz);
+	wear(e, word_sz * offset, word_sz, false);
+	write_end(e);
+	timed(e, word_sz * offset, word_sz, true);
+	traced(e, EEPROM_OP_WRITE_WORD, word_sz * offset, word_sz);
+	return word_sz;
+}
+
+uint32_t eeprom_dev_read_page(eeprom_t *e, const uint32_t page, uint8_t *data) {
+	CHECK_PAGE_ADDR(e, page);
+	const uint32_t page_sz = e->geo.page_sz;
+	uint32_t seq;
+	bool ok;
+	do {
+		seq = read_begin(e);
+		if ((ok = verified(e, page_sz * page, page_sz)))
+			memcpy(data, e->buf + (page_sz * page), page_sz);
+	} while (read_retry(e, seq));
+	timed(e, page_sz * page, page_sz, false);
+	traced(e, EEPROM_OP_READ_PAGE, page_sz * page, page_sz);
+	return ok ? page_sz : crc_error(e);
+}
+
+uint32_t eeprom_dev_write_page(eeprom_t *e, const uint32_t page, const uint8_t *data) {
+	CHECK_PAGE_ADDR(e, page);
+	const uint32_t page_sz = e->geo.page_sz;
+	write_begin(e);
+	cow(e, page_sz * page, page_sz);
+	memcpy(e->buf + (page_sz * page), data, page_sz);
+	mark_written(e, page_sz * page, page_sz);
+	wear(e, page_sz * page, page_sz, false);
+	write_end(e);
+	timed(e, page_sz * page, page_sz, true);
+	traced(e, EEPROM_OP_WRITE_PAGE, page_sz * page, page_sz);
+	return page_sz;
+}
+
+uint32_t eeprom_dev_erase(eeprom_t *e) {
+	write_begin(e);
+	cow(e, 0, e->size);
+	memset(e->buf, EEPROM_ERASE_STATE, e->size);
+	const uint32_t crc = page_crc(e, 0);  // Same for every page
+	for (uint32_t p = 0; p < e->n_pages; p++)
+		e->crc[p] = crc;
+	mark_dirty(e, 0, e->size);
+	wear(e, 0, e->size, true);
+	write_end(e);
+	timed(e, 0, e->size, true);  // No chip erase: every page written
+	traced(e, EEPROM_OP_ERASE, 0, e->size);
+	return e->size;
+}
+
+uint32_t eeprom_dev_erase_page(eeprom_t *e, const uint32_t page) {
+	CHECK_PAGE_ADDR(e, page);
+	const uint32_t page_sz = e->geo.page_sz;
+	write_begin(e);
+	cow(e, page_sz * page, page_sz);
+	memset(e->buf + (page_sz * page), EEPROM_ERASE_STATE, page_sz);
+	mark_written(e, page_sz * page, page_sz);
+	wear(e, page_sz * page, page_sz, true);
+	write_end(e);
+	timed(e, page_sz * page, page_sz, true);
+	traced(e, EEPROM_OP_ERASE_PAGE, page_sz * page, page_sz);
+	return page_sz;
+}
+
+//--------
+// Ranges
+//--------
+
+/**
+ Check a range of words.
+ \param[in] addr Zero-based EEPROM offset (word number).
+ \param[in] len Number of bytes.
+ \return True if not empty, and within the EEPROM.
+ */
+static inline bool range_ok(const eeprom_t *e, const uint32_t addr, const uint32_t len) {
+	return len > 0 && addr < e->geo.n_words && len <= e->size - addr * e->geo.word_sz;
+}
+
+// The buffer is contiguous: one copy per range, no matter pages and words.
+uint32_t eeprom_dev_read(eeprom_t *e, const uint32_t addr, uint8_t *data, const uint32_t len) {
+	if (!range_ok(e, addr, len))
+		return 0;
+	uint32_t seq;
+	bool ok;
+	do {
+		seq = read_begin(e);
+		if ((ok = verified(e, addr * e->geo.word_sz, len)))
+			memcpy(data, e->buf + addr * e->geo.word_sz, len);
+	} while (read_retry(e, seq));
+	timed(e, addr * e->geo.word_sz, len, false);
+	traced(e, EEPROM_OP_READ, addr * e->geo.word_sz, len);
+	return ok ? len : crc_error(e);
+}
+
+uint32_t eeprom_dev_write(eeprom_t *e, const uint32_t addr, const uint8_t *data, const uint32_t len) {
+	if (!range_ok(e, addr, len))
 		return 0;
+	write_begin(e);
+	cow(e, addr * e->geo.word_sz, len);
+	memcpy(e->buf + addr * e->geo.word_sz, data, len);
+	mark_written(e, addr * e->geo.word_sz, len);
+	wear(e, addr * e->geo.word_sz, len, false);
+	write_end(e);
+	timed(e, addr * e->geo.word_sz, len, true);
+	traced(e, EEPROM_OP_WRITE, addr * e->geo.word_sz, len);
+	return len;
+}
+
+/**
+ Check all the ranges of a vector.
+ \return Total number of bytes, 0 if any range is invalid.
+ */
+static uint32_t iov_len(const eeprom_t *e, const eeprom_iovec *iov, const uint32_t iovcnt) {
+	uint32_t tot = 0;
+	for (uint32_t i = 0; i < iovcnt; i++) {
+		if (!range_ok(e, iov[i].addr, iov[i].len) || iov[i].len > UINT32_MAX - tot)
+			return 0;
+		tot += iov[i].len;
 	}
+	return tot;
+}
 
-	// Write one page per line
-	uint32_t i = 0, s = 0, written = 0;
-	uint8_t page[EEPROM_PAGE_SZ];
-	for (i = 0; i < EEPROM_N_PAGES; i++) {
-		if (eeprom_read_page(i, page) != EEPROM_PAGE_SZ)
-			break;
-		fprintf(fp, "%d ", i);
-		for (s = 0; s < EEPROM_PAGE_SZ; s++) {
-			fprintf(fp, "%02x,", page[s]);
-			written++;
-		}
-		fprintf(fp, "\n");
+uint32_t eeprom_dev_readv(eeprom_t *e, const eeprom_iovec *iov, const uint32_t iovcnt) {
+	const uint32_t tot = iov_len(e, iov, iovcnt);
+	if (tot == 0)
+		return 0;
+	uint32_t seq;
+	bool ok;
+	do {
+		seq = read_begin(e);
+		ok = true;
+		for (uint32_t i = 0; ok && i < iovcnt; i++)
+			ok = verified(e, iov[i].addr * e->geo.word_sz, iov[i].len);
+		for (uint32_t i = 0; ok && i < iovcnt; i++)
+			memcpy(iov[i].data, e->buf + iov[i].addr * e->geo.word_sz, iov[i].len);
+	} while (read_retry(e, seq));
+	for (uint32_t i = 0; i < iovcnt; i++) {
+		timed(e, iov[i].addr * e->geo.word_sz, iov[i].len, false);
+		traced(e, EEPROM_OP_READV, iov[i].addr * e->geo.word_sz, iov[i].len);
 	}
-	fclose(fp);
-	return written;
+	return ok ? tot : crc_error(e);
+}
+
+uint32_t eeprom_dev_writev(eeprom_t *e, const eeprom_iovec *iov, const uint32_t iovcnt) {
+	const uint32_t tot = iov_len(e, iov, iovcnt);
+	if (tot == 0)
+		return 0;
+	write_begin(e);
+	for (uint32_t i = 0; i < iovcnt; i++) {
+		cow(e, iov[i].addr * e->geo.word_sz, iov[i].len);
+		memcpy(e->buf + iov[i].addr * e->geo.word_sz, iov[i].data, iov[i].len);
+		mark_written(e, iov[i].addr * e->geo.word_sz, iov[i].len);
+		wear(e, iov[i].addr * e->geo.word_sz, iov[i].len, false);
+	}
+	write_end(e);
+	for (uint32_t i = 0; i < iovcnt; i++) {
+		timed(e, iov[i].addr * e->geo.word_sz, iov[i].len, true);
+		traced(e, EEPROM_OP_WRITEV, iov[i].addr * e->geo.word_sz, iov[i].len);
+	}
+	return tot;
+}
+
+bool eeprom_dev_read_byte(eeprom_t *e, const uint32_t offset, uint8_t *data) {
+	if (offset >= e->size)
+		return false;
+	uint32_t seq;
+	bool ok;
+	do {
+		seq = read_begin(e);
+		if ((ok = verified(e, offset, 1)))
+			*data = e->buf[offset];
+	} while (read_retry(e, seq));
+	timed(e, offset, 1, false);
+	traced(e, EEPROM_OP_READ_BYTE, offset, 1);
+	return ok || crc_error(e);
+}
+
+bool eeprom_dev_write_byte(eeprom_t *e, const uint32_t offset, const uint8_t data) {
+	if (offset >= e->size)
+		return false;
+	write_begin(e);
+	cow(e, offset, 1);
+	e->buf[offset] = data;
+	mark_written(e, offset, 1);
+	wear(e, offset, 1, false);
+	write_end(e);
+	timed(e, offset, 1, true);
+	traced(e, EEPROM_OP_WRITE_BYTE, offset, 1);
+	return true;
+}
+
+//------------------
+// Default instance
+//------------------
+
+void eeprom_set_lock_mode(const eeprom_lock_mode mode) {
+	eeprom_dev_set_lock_mode(&default_dev, mode);
+}
+
+eeprom_lock_mode eeprom_get_lock_mode(void) {
+	return eeprom_dev_get_lock_mode(&default_dev);
+}
+
+uint32_t eeprom_from_file(const char *file_name) {
+	return eeprom_dev_from_file(&default_dev, file_name);
+}
+
+uint32_t eeprom_to_file(const char *file_name) {
+	return eeprom_dev_to_file(&default_dev, file_name);
+}
+
+uint32_t eeprom_from_image(const char *file_name) {
+	return eeprom_dev_from_image(&default_dev, file_name);
+}
+
+uint32_t eeprom_to_image(const char *file_name) {
+	return eeprom_dev_to_image(&default_dev, file_name);
 }
 
 uint32_t eeprom_read_word(const uint32_t offset, uint8_t *data) {
-	CHECK_WORD_ADDR(offset);
-	pthread_mutex_lock(&buf_mutex);
-	memcpy(data, eeprom + (EEPROM_WORD_SZ * offset), EEPROM_WORD_SZ);
-	pthread_mutex_unlock(&buf_mutex);
-	return EEPROM_WORD_SZ;
+	return eeprom_dev_read_word(&default_dev, offset, data);
 }
 
 uint32_t eeprom_write_word(const uint32_t offset, const uint8_t *data) {
-	CHECK_WORD_ADDR(offset);
-	pthread_mutex_lock(&buf_mutex);
-	memcpy(eeprom + (EEPROM_WORD_SZ * offset), data, EEPROM_WORD_SZ);
-	pthread_mutex_unlock(&buf_mutex);
-	return EEPROM_WORD_SZ;
+	return eeprom_dev_write_word(&default_dev, offset, data);
 }
 
 uint32_t eeprom_read_page(const uint32_t page, uint8_t *data) {
-	CHECK_PAGE_ADDR(page);
-	pthread_mutex_lock(&buf_mutex);
-	memcpy(data, eeprom + (EEPROM_PAGE_SZ * page), EEPROM_PAGE_SZ);
-	pthread_mutex_unlock(&buf_mutex);
-	return EEPROM_PAGE_SZ;
+	return eeprom_dev_read_page(&default_dev, page, data);
 }
 
 uint32_t eeprom_write_page(const uint32_t page, const uint8_t *data) {
-	CHECK_PAGE_ADDR(page);
-	pthread_mutex_lock(&buf_mutex);
-	memcpy(eeprom + (EEPROM_PAGE_SZ * page), data, EEPROM_PAGE_SZ);
-	pthread_mutex_unlock(&buf_mutex);
-	return EEPROM_PAGE_SZ;
+	return eeprom_dev_write_page(&default_dev, page, data);
 }
 
 uint32_t eeprom_erase(void) {
-	pthread_mutex_lock(&buf_mutex);
-	memset(eeprom, EEPROM_ERASE_STATE, EEPROM_SZ);
-	pthread_mutex_unlock(&buf_mutex);
-	return EEPROM_SZ;
+	return eeprom_dev_erase(&default_dev);
 }
 
 uint32_t eeprom_erase_page(const uint32_t page) {
-	CHECK_PAGE_ADDR(page);
-	pthread_mutex_lock(&buf_mutex);
-	memset(eeprom + (EEPROM_PAGE_SZ * page), EEPROM_ERASE_STATE, EEPROM_PAGE_SZ);
-	pthread_mutex_unlock(&buf_mutex);
-	return EEPROM_PAGE_SZ;
+	return eeprom_dev_erase_page(&default_dev, page);
 }
 
 uint32_t eeprom_read(const uint32_t addr, uint8_t *data, const uint32_t len) {
-	CHECK_OFFSET(addr + len - 1);
+	return eeprom_dev_read(&default_dev, addr, data, len);
+}
 
-	// Read first words, getting to the beginning of the next page
-	uint32_t bytes_left = len, tot_read = 0, curr_addr = addr;
-	uint32_t next_page = eeprom_addr_to_page(addr) + 1;
-	const uint32_t next_page_addr = eeprom_page_to_addr(next_page);
-	while (bytes_left > 0 && curr_addr < next_page_addr) {
-		uint32_t bytes_read = eeprom_read_word(curr_addr++, data + tot_read);
-		if (bytes_read != EEPROM_WORD_SZ)
-			return tot_read + bytes_read;
-		tot_read += bytes_read;
-		bytes_left -= bytes_read;
-	}
+uint32_t eeprom_write(const uint32_t addr, const uint8_t *data, const uint32_t len) {
+	return eeprom_dev_write(&default_dev, addr, data, len);
+}
 
-	// Read entire pages
-	while (bytes_left >= EEPROM_PAGE_SZ) {
-		uint32_t bytes_read = eeprom_read_page(next_page++, data + tot_read);
-		tot_read += bytes_read;
-		if (bytes_read != EEPROM_PAGE_SZ)
-			return tot_read;
-		bytes_left -= bytes_read;
-	}
+uint32_t eeprom_readv(const eeprom_iovec *iov, const uint32_t iovcnt) {
+	return eeprom_dev_readv(&default_dev, iov, iovcnt);
+}
 
-	// Read reamaining words
-	curr_addr = eeprom_page_to_addr(next_page);
-	while (bytes_left > 0) {
-		uint32_t bytes_read = eeprom_read_word(curr_addr++, data + tot_read);
-		tot_read += bytes_read;
-		if (bytes_read != EEPROM_WORD_SZ)
-			return tot_read;
-		bytes_left -= bytes_read;
-	}
-	return tot_read;
+uint32_t eeprom_writev(const eeprom_iovec *iov, const uint32_t iovcnt) {
+	return eeprom_dev_writev(&default_dev, iov, iovcnt);
 }
 
-uint32_t eeprom_write(const uint32_t addr, const uint8_t *data, const uint32_t len) {
-	CHECK_OFFSET(addr + len - 1);
+bool eeprom_attach(const char *file_name) {
+	return eeprom_dev_attach(&default_dev, file_name);
+}
 
-	// Read first words, getting to the beginning of the next page
-	uint32_t bytes_left = len, tot_written = 0, curr_addr = addr;
-	uint32_t next_page = eeprom_addr_to_page(addr) + 1;
-	const uint32_t next_page_addr = eeprom_page_to_addr(next_page);
-	while (bytes_left > 0 && curr_addr < next_page_addr) {
-		uint32_t bytes_read = eeprom_write_word(curr_addr++, data + tot_written);
-		if (bytes_read != EEPROM_WORD_SZ)
-			return tot_written + bytes_read;
-		tot_written += bytes_read;
-		bytes_left -= bytes_read;
-	}
+void eeprom_detach(void) {
+	eeprom_dev_detach(&default_dev);
+}
 
-	// Read entire pages
-	while (bytes_left >= EEPROM_PAGE_SZ) {
-		uint32_t bytes_read = eeprom_write_page(next_page++, data + tot_written);
-		tot_written += bytes_read;
-		if (bytes_read != EEPROM_PAGE_SZ)
-			return tot_written;
-		bytes_left -= bytes_read;
-	}
+uint32_t eeprom_dirty_pages(void) {
+	return eeprom_dev_dirty_pages(&default_dev);
+}
 
-	// Read reamaining words
-	curr_addr = eeprom_page_to_addr(next_page);
-	while (bytes_left > 0) {
-		uint32_t bytes_read = eeprom_write_word(curr_addr++, data + tot_written);
-		tot_written += bytes_read;
-		if (bytes_read != EEPROM_WORD_SZ)
-			return tot_written;
-		bytes_left -= bytes_read;
-	}
-	return tot_written;
+uint32_t eeprom_flush(const bool sync) {
+	return eeprom_dev_flush(&default_dev, sync);
+}
+
+bool eeprom_sync(void) {
+	return eeprom_dev_sync(&default_dev);
+}
+
+bool eeprom_start_flusher(const eeprom_flusher_config *cfg) {
+	return eeprom_dev_start_flusher(&default_dev, cfg);
+}
+
+bool eeprom_stop_flusher(void) {
+	return eeprom_dev_stop_flusher(&default_dev);
+}
+
+void eeprom_set_verify(const bool verify) {
+	eeprom_dev_set_verify(&default_dev, verify);
+}
+
+bool eeprom_get_verify(void) {
+	return eeprom_dev_get_verify(&default_dev);
+}
+
+uint32_t eeprom_crc_errors(void) {
+	return eeprom_dev_crc_errors(&default_dev);
+}
+
+uint32_t eeprom_check(void) {
+	return eeprom_dev_check(&default_dev);
+}
+
+void eeprom_flip_bits(const uint32_t offset, const uint8_t mask) {
+	eeprom_dev_flip_bits(&default_dev, offset, mask);
+}
+
+bool eeprom_set_timing(const eeprom_timing *timing) {
+	return eeprom_dev_set_timing(&default_dev, timing);
+}
+
+eeprom_timing_stats eeprom_get_timing_stats(void) {
+	return eeprom_dev_timing_stats(&default_dev);
+}
+
+void eeprom_reset_timing_stats(void) {
+	eeprom_dev_reset_timing_stats(&default_dev);
+}
+
+bool eeprom_set_wear_leveling(const uint32_t threshold) {
+	return eeprom_dev_set_wear_leveling(&default_dev, threshold);
+}
+
+uint32_t eeprom_physical_page(const uint32_t page) {
+	return eeprom_dev_physical_page(&default_dev, page);
+}
+
+uint32_t eeprom_page_wear(const uint32_t phys) {
+	return eeprom_dev_page_wear(&default_dev, phys);
+}
+
+eeprom_wear_stats eeprom_get_wear_stats(void) {
+	return eeprom_dev_wear_stats(&default_dev);
+}
+
+uint32_t eeprom_wear_histogram(uint32_t *bins, const uint32_t n_bins) {
+	return eeprom_dev_wear_histogram(&default_dev, bins, n_bins);
+}
+
+void eeprom_reset_wear(void) {
+	eeprom_dev_reset_wear(&default_dev);
+}
+
+eeprom_snapshot_t *eeprom_snapshot(void) {
+	return eeprom_dev_snapshot(&default_dev);
 }
 
 #if (EEPROM_WORD_SZ == 1)
 bool eeprom_read_byte(const uint32_t offset, uint8_t *data) {
-	if (offset >= EEPROM_SZ)
-		return false;
-	pthread_mutex_lock(&buf_mutex);
-	*data = eeprom[offset];
-	pthread_mutex_unlock(&buf_mutex);
-	return true;
+	return eeprom_dev_read_byte(&default_dev, offset, data);
 }
 
 bool eeprom_write_byte(const uint32_t offset, const uint8_t data) {
-	if (offset >= EEPROM_SZ)
-		return false;
-	pthread_mutex_lock(&buf_mutex);
-	eeprom[offset] = data;
-	pthread_mutex_unlock(&buf_mutex);
-	return true;
+	return eeprom_dev_write_byte(&default_dev, offset, data);
 }
 #endif
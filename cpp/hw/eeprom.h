@@ -15,21 +15,71 @@
 #define EEPROM_N_PAGES      (EEPROM_SZ / EEPROM_PAGE_SZ)
 #define EEPROM_ERASE_STATE  0xff
 
+/**
+	How readers synchronize with writers. Writers always exclude each other,
+	and every call is atomic either way.
+ */
+typedef enum {
+	EEPROM_LOCK_MUTEX,   // Readers take the buffer lock, as writers (default).
+	EEPROM_LOCK_SEQLOCK  // Readers take no lock, and never block each other: they
+	                     // copy, then retry if a write overlapped. For read-mostly
+	                     // workloads; frequent writes can make readers retry often.
+} eeprom_lock_mode;
+
+/**
+	Set how readers synchronize with writers. Must not be called while other
+	threads access the EEPROM.
+	\param[in] mode New mode.
+ */
+void eeprom_set_lock_mode(const eeprom_lock_mode mode);
 
 /**
-	Load EEPROM content from file to memory.
+	\return How readers currently synchronize with writers.
+ */
+eeprom_lock_mode eeprom_get_lock_mode(void);
+
+/**
+	Load EEPROM content from text file to memory (import). One page per line:
+	page number, its bytes in hex, then their CRC32C in hex (optional, for
+	older files), e.g. "12 ff,00,1a,ff, 488df203". A page whose bytes do not
+	match its CRC, or cannot be parsed, is left erased and counted as a CRC
+	error, see eeprom_crc_errors(). Pages missing from the file are erased.
+	The file is parsed aside, then copied in at once: readers see the old
+	content or the new one.
 	\param[in] file_name Input EEPROM file name.
 	\return Number of bytes read (EEPROM_SZ on success).
  */
 uint32_t eeprom_from_file(const char *file_name);
 
 /**
-	Write memory content to EEPROM file.
+	Write memory content to EEPROM text file (export), see eeprom_from_file().
+	Pages are written with the CRC stored in memory, not a new one: a page
+	corrupted in memory is detected when loaded back.
 	\param[in] file_name Output EEPROM file name.
 	\return Number of bytes written (EEPROM_SZ on success).
  */
 uint32_t eeprom_to_file(const char *file_name);
 
+/**
+	Load EEPROM content from a binary image file to memory, with a single copy
+	from the mapped file. The image must have the same geometry, and a valid
+	checksum: if not, memory is left untouched.
+	Format: 64-byte header (magic "EEPR", version, number of words, word and
+	page sizes, content offset, Adler-32 of the content), then the content, as
+	is. Integers in native byte order.
+	\param[in] file_name Input image file name.
+	\return Number of bytes read (EEPROM_SZ on success, 0 otherwise).
+ */
+uint32_t eeprom_from_image(const char *file_name);
+
+/**
+	Write memory content to a binary image file (see eeprom_from_image()), with
+	a single copy to the mapped file.
+	\param[in] file_name Output image file name.
+	\return Number of bytes written (EEPROM_SZ on success, 0 otherwise).
+ */
+uint32_t eeprom_to_image(const char *file_name);
+
 /**
 	Read one byte from EEPROM (memory buffer).
 	\param[in] offset Zero-based EEPROM offset (word number), in [0, EEPROM_N_WORDS - 1].
@@ -122,7 +172,7 @@ static inline uint32_t eeprom_write_word_from_page(
 }
 
 /**
-	Read EEPROM (memory buffer).
+	Read EEPROM (memory buffer), atomically.
 	\param[in] addr Zero-based EEPROM offset (word number), in [0, EEPROM_N_WORDS - 1].
 	\param[out] data Output buffer to write to.
 	\param[in] len Number of bytes to read. If the number of bytes exceeds the boundary,
@@ -132,7 +182,7 @@ static inline uint32_t eeprom_write_word_from_page(
 uint32_t eeprom_read(const uint32_t addr, uint8_t *data, const uint32_t len);
 
 /**
-	Write to EEPROM (memory buffer).
+	Write to EEPROM (memory buffer), atomically.
 	\param[in] addr Zero-based EEPROM offset (word number), in [0, EEPROM_N_WORDS - 1].
 	\param[in] data Input buffer to write.
 	\param[in] len Number of bytes to write. If the number of bytes exceeds the boundary,
@@ -141,6 +191,360 @@ uint32_t eeprom_read(const uint32_t addr, uint8_t *data, const uint32_t len);
  */
 uint32_t eeprom_write(const uint32_t addr, const uint8_t *data, const uint32_t len);
 
+/**
+	One range of a scatter/gather request, like struct iovec.
+ */
+typedef struct {
+	uint32_t addr;  // Zero-based EEPROM offset (word number)
+	void *data;     // Buffer to read to, or to write from
+	uint32_t len;   // Number of bytes
+} eeprom_iovec;
+
+/**
+	Read several ranges of EEPROM (memory buffer), all at once: no write can
+	happen in between.
+	\param[in] iov Ranges to read, and where to.
+	\param[in] iovcnt Number of ranges.
+	\return Total number of bytes read. If any range is empty or exceeds the
+					boundary, the function returns 0 without reading any value.
+ */
+uint32_t eeprom_readv(const eeprom_iovec *iov, const uint32_t iovcnt);
+
+/**
+	Write several ranges of EEPROM (memory buffer), all at once: readers see
+	either none or all of them. Ranges are written in order, so the last wins
+	where they overlap.
+	\param[in] iov Ranges to write, and what.
+	\param[in] iovcnt Number of ranges.
+	\return Total number of bytes written. If any range is empty or exceeds
+					the boundary, the function returns 0 without writing any value.
+ */
+uint32_t eeprom_writev(const eeprom_iovec *iov, const uint32_t iovcnt);
+
+/**
+	Attach an image file (see eeprom_from_image()) to the EEPROM, for
+	incremental flushes: the whole content is written to it now, then only
+	the pages written since the previous flush, see eeprom_flush(). Replaces
+	any previously attached file.
+	\param[in] file_name Image file name, created if needed.
+	\return True on success, false otherwise.
+ */
+bool eeprom_attach(const char *file_name);
+
+/**
+	Detach the image file, if any, without flushing. Stops the background
+	flusher, if running.
+ */
+void eeprom_detach(void);
+
+/**
+	\return Number of pages written since the last flush (or attach).
+ */
+uint32_t eeprom_dirty_pages(void);
+
+/**
+	Write the dirty pages to the attached image file, in place (one pwrite
+	per run of dirty pages, runs a few clean bytes apart merged, then the
+	header checksum), and mark them clean. Writers are only blocked while
+	the dirty pages are copied, not during I/O.
+	\param[in] sync Also wait for the data to reach the disk (fdatasync).
+	\return Number of content bytes written: 0 if no page was dirty, if no
+					file is attached, or on failure (pages then stay dirty).
+ */
+uint32_t eeprom_flush(const bool sync);
+
+/**
+	Durability barrier: flush the dirty pages and wait for the attached file
+	to reach the disk, including the pages a background flush (see
+	eeprom_start_flusher()) wrote without syncing.
+	\return True if everything written before the call is on disk, false if no
+					file is attached or on failure.
+ */
+bool eeprom_sync(void);
+
+/**
+	Background flusher settings. A flush happens every interval_ms, or as
+	soon as dirty_pages pages are dirty, whichever comes first (0 disables
+	either, not both).
+ */
+typedef struct {
+	uint32_t interval_ms;  // Longest time a write stays only in memory
+	uint32_t dirty_pages;  // Dirty pages that trigger an early flush
+	bool sync;             // Sync the file after every flush (fdatasync)
+} eeprom_flusher_config;
+
+/**
+	Start a thread flushing the attached file in the background, see
+	eeprom_flush(): writers no longer wait for the disk, and pages written
+	several times between two flushes are written to the file once. A failed
+	flush is retried after the interval (or a second). Replaces a running
+	flusher. Detaching the file stops it, without flushing.
+	\param[in] cfg Flusher settings.
+	\return True on success, false if the settings are invalid, no file is
+					attached, or the thread cannot be created.
+ */
+bool eeprom_start_flusher(const eeprom_flusher_config *cfg);
+
+/**
+	Stop the background flusher, if running, then flush and sync what is left
+	(clean shutdown, see eeprom_sync()).
+	\return True if a flusher was running and everything is on disk.
+ */
+bool eeprom_stop_flusher(void);
+
+/**
+	CRC32C (Castagnoli) of a buffer, as stored for each page: SSE4.2 crc32
+	instruction if available, slicing-by-8 tables otherwise (or if built with
+	EEPROM_CRC_SOFTWARE).
+	\param[in] crc CRC of the preceding data, 0 if none.
+	\param[in] data Buffer.
+	\param[in] len Buffer size in bytes.
+	\return CRC of the preceding data and the buffer.
+ */
+uint32_t eeprom_crc32c(const uint32_t crc, const void *data, const uint32_t len);
+
+/**
+	Check the CRC of every page on reads, or not (default). The CRCs are
+	always kept up to date by writes, and checked on loads from text files.
+	A read of a page not matching its CRC fails, see eeprom_crc_errors().
+	\param[in] verify Check the CRCs on reads.
+ */
+void eeprom_set_verify(const bool verify);
+
+/**
+	\return Whether reads check the CRCs.
+ */
+bool eeprom_get_verify(void);
+
+/**
+	\return Number of CRC mismatches found so far: pages rejected by loads, reads
+					refused, and pages found by eeprom_check().
+ */
+uint32_t eeprom_crc_errors(void);
+
+/**
+	Check the CRC of every page (scrub).
+	\return Number of pages not matching their CRC.
+ */
+uint32_t eeprom_check(void);
+
+/**
+	Flip bits of a byte in memory without updating its page CRC, as a fault
+	would (e.g. a worn cell): for testing integrity checks.
+	\param[in] offset EEPROM byte number, in [0, EEPROM_SZ - 1].
+	\param[in] mask Bits to flip.
+ */
+void eeprom_flip_bits(const uint32_t offset, const uint8_t mask);
+
+/**
+	Timing of a serial (I2C) EEPROM, e.g. {5000, 400000, 2} for a 24C256 at
+	400 kHz. Each byte takes 9 bits on the bus (8, then the acknowledge).
+	Writes go through the page buffer: a write touching n pages takes n
+	transactions, and n write cycles, even for a single byte per page. The
+	device answers nothing during a write cycle: the next access waits for it.
+	Sequential reads cross pages freely.
+ */
+typedef struct {
+	uint32_t t_wr_us;     // Write cycle time (tWR), after each page write
+	uint32_t bus_hz;      // Bus bit rate
+	uint32_t addr_bytes;  // Memory address bytes, after the device address
+} eeprom_timing;
+
+/**
+	What the accesses since the timing model was set (or reset) would take on
+	the device.
+ */
+typedef struct {
+	uint64_t time_ns;       // Simulated time, up to the end of the last write cycle
+	uint64_t wait_ns;       // Of which waiting for write cycles
+	uint64_t bus_bytes;     // Bytes on the bus, addresses included
+	uint64_t transactions;  // Bus transactions
+	uint64_t write_cycles;  // Page writes
+} eeprom_timing_stats;
+
+/**
+	Simulate the timing of accesses (word, page, range and byte reads and
+	writes, erases) on a virtual clock, to profile access patterns: memory
+	accesses still complete at once. File operations are not timed. Must not
+	be called while other threads access the EEPROM.
+	\param[in] timing Device timing, NULL to stop simulating (default).
+	\return True on success, false if the timing is invalid (bus_hz == 0).
+ */
+bool eeprom_set_timing(const eeprom_timing *timing);
+
+/**
+	\return Simulated time and traffic since the timing was set or reset.
+ */
+eeprom_timing_stats eeprom_get_timing_stats(void);
+
+/**
+	Reset the virtual clock and the counters, e.g. before an access sequence.
+ */
+void eeprom_reset_timing_stats(void);
+
+/**
+	Wear of the pages since the start (or reset). Every page a write touches
+	counts one write cycle, whatever the number of bytes; file loads do not
+	count. Cycles are those of physical pages: see eeprom_set_wear_leveling().
+ */
+typedef struct {
+	uint64_t writes;      // Page writes
+	uint64_t erases;      // Page erases
+	uint32_t max_cycles;  // Writes and erases of the most worn page
+	uint32_t max_page;    // Most worn physical page
+	uint32_t min_cycles;  // Writes and erases of the least worn pages
+	uint64_t swaps;       // Leveling remaps, 2 page writes each
+} eeprom_wear_stats;
+
+/**
+	Wear leveling: logical pages (those of the API) are mapped to physical
+	pages. When the physical page of a logical page gets threshold cycles
+	ahead of the least worn pages, and the logical page wrote as many there,
+	it is swapped with one of them, counting a write of both. The content is
+	not moved in memory, nor in files: the mapping only tells where the
+	cycles land. Remaps are not timed.
+	\param[in] threshold Cycles ahead before a remap, 0 to stop remapping
+						(default; the current mapping is kept).
+	\return True on success, false on allocation failure.
+ */
+bool eeprom_set_wear_leveling(const uint32_t threshold);
+
+/**
+	\param[in] page Logical page.
+	\return Physical page it is mapped to.
+ */
+uint32_t eeprom_physical_page(const uint32_t page);
+
+/**
+	\param[in] phys Physical page.
+	\return Writes and erases of the page, 0 if out of range.
+ */
+uint32_t eeprom_page_wear(const uint32_t phys);
+
+eeprom_wear_stats eeprom_get_wear_stats(void);
+
+/**
+	Histogram of the cycles of the physical pages, from 0 to the maximum.
+	\param[out] bins Number of pages per bin.
+	\param[in] n_bins Number of bins.
+	\return Cycles per bin: bin i counts the pages with i * width to
+			(i + 1) * width - 1 cycles.
+ */
+uint32_t eeprom_wear_histogram(uint32_t *bins, const uint32_t n_bins);
+
+/**
+	Reset the cycles of all pages (the mapping is kept).
+ */
+void eeprom_reset_wear(void);
+
+/**
+	Traced operations.
+ */
+typedef enum {
+	EEPROM_OP_READ_WORD,
+	EEPROM_OP_WRITE_WORD,
+	EEPROM_OP_READ_PAGE,
+	EEPROM_OP_WRITE_PAGE,
+	EEPROM_OP_ERASE,
+	EEPROM_OP_ERASE_PAGE,
+	EEPROM_OP_READ,
+	EEPROM_OP_WRITE,
+	EEPROM_OP_READV,   // One event per vector element: the first one gets the lock times
+	EEPROM_OP_WRITEV,
+	EEPROM_OP_READ_BYTE,
+	EEPROM_OP_WRITE_BYTE,
+	EEPROM_N_OPS
+} eeprom_op;
+
+/**
+	Traced access. Seqlock readers take no lock: their wait is the time
+	spent before the attempt that succeeded, their hold the copy.
+ */
+typedef struct {
+	uint64_t t_ns;      // Start, since eeprom_trace_start()
+	uint32_t wait_ns;   // Waiting for the buffer lock
+	uint32_t hold_ns;   // Holding it
+	uint32_t off;       // First byte
+	uint32_t len;       // Bytes
+	uint32_t page_sz;   // Of the instance
+	uint32_t dev;       // Instance: 0 for the default one, then in order of creation
+	uint16_t thread;    // In order of first traced access
+	uint8_t op;         // eeprom_op
+} eeprom_trace_event;
+
+// Trace file (eeprom_trace_dump()): header, then the events in time order
+#define EEPROM_TRACE_MAGIC    0x52544545  // "EETR"
+#define EEPROM_TRACE_VERSION  1
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_events;
+	uint32_t event_sz;  // sizeof(eeprom_trace_event)
+} eeprom_trace_header;
+
+/**
+	Start tracing the accesses of all instances (word, page, range, vector
+	and byte reads and writes, erases), clearing the previous trace. Each
+	thread records its latest EEPROM_TRACE_EVENTS events in its own ring,
+	without locks. Off by default; when off, an access only checks a flag.
+ */
+void eeprom_trace_start(void);
+
+/**
+	Stop tracing: the trace stays until the next start.
+ */
+void eeprom_trace_stop(void);
+
+bool eeprom_tracing(void);
+
+/**
+	Events of all threads, in time order. Stop tracing first: the events
+	being recorded while collecting may be torn.
+	\param[out] events Events.
+	\param[in] max Size of events.
+	\return Number of events.
+ */
+uint32_t eeprom_trace_collect(eeprom_trace_event *events, const uint32_t max);
+
+/**
+	Write the trace to a file, for trace_eeprom to aggregate (hot pages,
+	access sizes, lock contention). Stop tracing first.
+	\param[in] file_name Output file.
+	\return Number of events written, 0 on failure (or empty trace).
+ */
+uint32_t eeprom_trace_dump(const char *file_name);
+
+/**
+	Snapshot of the content of an instance, to roll it back (e.g. between test
+	scenarios) without reloading a file.
+ */
+typedef struct eeprom_snapshot eeprom_snapshot_t;
+
+/**
+	Take a snapshot: nothing is copied. Pages are copied to the newest
+	snapshot on their first change after it was taken, so that snapshots cost
+	the pages changed, in memory and on restore. Snapshots nest: any of them
+	can be restored.
+	\return Snapshot, NULL on allocation failure.
+ */
+eeprom_snapshot_t *eeprom_snapshot(void);
+
+/**
+	Roll the content (and CRCs) back to a snapshot, copying the pages changed
+	since. The pages restored are dirty, not counted as wear, nor timed, nor
+	traced. The newer snapshots are released; this one stays, taken again.
+	\param[in] s Snapshot.
+	\return Number of pages restored.
+ */
+uint32_t eeprom_restore(eeprom_snapshot_t *s);
+
+/**
+	Release a snapshot: the content stays as it is. Snapshots not released
+	are released when their instance is closed.
+	\param[in] s Snapshot (NULL is ignored).
+ */
+void eeprom_snapshot_release(eeprom_snapshot_t *s);
+
 #if (EEPROM_WORD_SZ == 1)
 /**
 	Read single byte from EEPROM (same as reading a single byte word).
@@ -181,4 +585,98 @@ static inline bool eeprom_write_uint(const uint32_t offset, const uint32_t data)
 }
 #endif
 
+//-----------
+// Instances
+//-----------
+
+/**
+	Geometry of an EEPROM instance.
+ */
+typedef struct {
+	uint32_t n_words;  // Number of words
+	uint32_t word_sz;  // Bytes per word
+	uint32_t page_sz;  // Bytes per page, a multiple of word_sz, dividing n_words * word_sz
+} eeprom_geometry;
+
+/**
+	EEPROM instance, with its own buffer and lock. The functions above work on
+	a default instance, of geometry EEPROM_N_WORDS, EEPROM_WORD_SZ,
+	EEPROM_PAGE_SZ; each eeprom_dev_xxx(e, ...) is eeprom_xxx(...) on
+	instance e, with addresses and sizes in its own geometry.
+ */
+typedef struct eeprom eeprom_t;
+
+/**
+	Create an EEPROM instance, erased.
+	\param[in] geometry Instance geometry.
+	\return New instance, NULL if the geometry is invalid or on allocation failure.
+ */
+eeprom_t *eeprom_open(const eeprom_geometry *geometry);
+
+/**
+	Destroy an EEPROM instance, detaching its file (without flushing, and
+	stopping its flusher). No other thread may be using it.
+	The default instance is left untouched.
+	\param[in] e Instance, from eeprom_open() (NULL is ignored).
+ */
+void eeprom_close(eeprom_t *e);
+
+/**
+	\return Default instance, the one of the functions without a handle.
+ */
+eeprom_t *eeprom_default(void);
+
+eeprom_geometry eeprom_dev_geometry(const eeprom_t *e);
+
+//! Size in bytes.
+uint32_t eeprom_dev_size(const eeprom_t *e);
+
+uint32_t eeprom_dev_n_pages(const eeprom_t *e);
+
+void eeprom_dev_set_lock_mode(eeprom_t *e, const eeprom_lock_mode mode);
+eeprom_lock_mode eeprom_dev_get_lock_mode(const eeprom_t *e);
+uint32_t eeprom_dev_from_file(eeprom_t *e, const char *file_name);
+uint32_t eeprom_dev_to_file(eeprom_t *e, const char *file_name);
+uint32_t eeprom_dev_from_image(eeprom_t *e, const char *file_name);
+uint32_t eeprom_dev_to_image(eeprom_t *e, const char *file_name);
+uint32_t eeprom_dev_read_word(eeprom_t *e, const uint32_t offset, uint8_t *data);
+uint32_t eeprom_dev_write_word(eeprom_t *e, const uint32_t offset, const uint8_t *data);
+uint32_t eeprom_dev_read_page(eeprom_t *e, const uint32_t page, uint8_t *data);
+uint32_t eeprom_dev_write_page(eeprom_t *e, const uint32_t page, const uint8_t *data);
+uint32_t eeprom_dev_erase(eeprom_t *e);
+uint32_t eeprom_dev_erase_page(eeprom_t *e, const uint32_t page);
+uint32_t eeprom_dev_read(eeprom_t *e, const uint32_t addr, uint8_t *data, const uint32_t len);
+uint32_t eeprom_dev_write(eeprom_t *e, const uint32_t addr, const uint8_t *data, const uint32_t len);
+uint32_t eeprom_dev_readv(eeprom_t *e, const eeprom_iovec *iov, const uint32_t iovcnt);
+uint32_t eeprom_dev_writev(eeprom_t *e, const eeprom_iovec *iov, const uint32_t iovcnt);
+bool eeprom_dev_attach(eeprom_t *e, const char *file_name);
+void eeprom_dev_detach(eeprom_t *e);
+uint32_t eeprom_dev_dirty_pages(eeprom_t *e);
+uint32_t eeprom_dev_flush(eeprom_t *e, const bool sync);
+bool eeprom_dev_sync(eeprom_t *e);
+bool eeprom_dev_start_flusher(eeprom_t *e, const eeprom_flusher_config *cfg);
+bool eeprom_dev_stop_flusher(eeprom_t *e);
+void eeprom_dev_set_verify(eeprom_t *e, const bool verify);
+bool eeprom_dev_get_verify(const eeprom_t *e);
+uint32_t eeprom_dev_crc_errors(const eeprom_t *e);
+uint32_t eeprom_dev_check(eeprom_t *e);
+void eeprom_dev_flip_bits(eeprom_t *e, const uint32_t offset, const uint8_t mask);
+bool eeprom_dev_set_timing(eeprom_t *e, const eeprom_timing *timing);
+eeprom_timing_stats eeprom_dev_timing_stats(eeprom_t *e);
+void eeprom_dev_reset_timing_stats(eeprom_t *e);
+bool eeprom_dev_set_wear_leveling(eeprom_t *e, const uint32_t threshold);
+uint32_t eeprom_dev_physical_page(eeprom_t *e, const uint32_t page);
+uint32_t eeprom_dev_page_wear(eeprom_t *e, const uint32_t phys);
+eeprom_wear_stats eeprom_dev_wear_stats(eeprom_t *e);
+uint32_t eeprom_dev_wear_histogram(eeprom_t *e, uint32_t *bins, const uint32_t n_bins);
+void eeprom_dev_reset_wear(eeprom_t *e);
+eeprom_snapshot_t *eeprom_dev_snapshot(eeprom_t *e);
+
+/**
+	Byte access, whatever the word size.
+	\param[in] offset Byte number, in [0, eeprom_dev_size(e) - 1].
+ */
+bool eeprom_dev_read_byte(eeprom_t *e, const uint32_t offset, uint8_t *data);
+bool eeprom_dev_write_byte(eeprom_t *e, const uint32_t offset, const uint8_t data);
+
 #endif // _EEPROM_H
@@ -0,0 +1,491 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "eeprom_kv.h"
+
+// Segment header: magic, then sequence number (the newest segment has the
+// highest). A segment is free if its magic is not there.
+#define SEG_MAGIC   0x3153564b  // "KVS1"
+#define SEG_HDR_SZ  8
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;
+} seg_header;
+
+// Record header, then the key, then the value. The CRC covers the sequence
+// number of the segment, the rest of the header, the key and the value: the
+// records left over from a previous use of the segment do not match it.
+#define REC_HDR_SZ     8
+#define REC_TOMBSTONE  0x01  // Key removed
+#define KEY_FREE       0xff  // Erased: no more records in the segment
+typedef struct {
+	uint8_t key_len;
+	uint8_t flags;
+	uint16_t val_len;
+	uint32_t crc;
+} rec_header;
+
+// Index entry: where the latest record of a key is
+#define NO_RECORD  UINT32_MAX  // Empty slot
+typedef struct {
+	uint32_t hash;
+	uint32_t off;  // Record offset in the EEPROM
+	uint16_t val_len;
+	uint8_t key_len;
+} entry;
+
+/**
+ Key-value store.
+ */
+struct eeprom_kv {
+	eeprom_t *e;
+	pthread_mutex_t mutex;
+	uint32_t seg_sz, n_segs, page_sz, word_sz;
+	uint32_t *seq;       // Sequence number of each segment, 0 if free
+	uint32_t *live;      // Bytes of live records, per segment
+	uint32_t used;       // Segments in use
+	uint32_t head;       // Segment appended to
+	uint32_t head_pos;   // Append position in it
+	uint32_t last_seq;   // Highest sequence number so far
+	entry *index;        // Open addressing, linear probing
+	uint32_t capacity;   // Index slots, a power of 2
+	uint8_t *scratch;    // Record being read, or written: one segment
+	uint32_t capacity_bytes;  // Live bytes allowed
+	eeprom_kv_stats stats;
+};
+
+// Records start on a word: the instance is addressed by word
+static inline uint32_t rec_size(const eeprom_kv_t *kv, const uint32_t key_len, const uint32_t val_len) {
+	return (REC_HDR_SZ + key_len + val_len + kv->word_sz - 1) / kv->word_sz * kv->word_sz;
+}
+
+static inline uint32_t read_at(eeprom_kv_t *kv, const uint32_t off, void *data, const uint32_t len) {
+	return eeprom_dev_read(kv->e, off / kv->word_sz, (uint8_t *)data, len);
+}
+
+static inline uint32_t write_at(eeprom_kv_t *kv, const uint32_t off, const void *data, const uint32_t len) {
+	return eeprom_dev_write(kv->e, off / kv->word_sz, (const uint8_t *)data, len);
+}
+
+static inline uint32_t seg_of(const eeprom_kv_t *kv, const uint32_t off) {
+	return off / kv->seg_sz;
+}
+
+static uint32_t rec_crc(const uint32_t seq, const rec_header *h, const uint8_t *key, const uint8_t *val) {
+	uint32_t crc = eeprom_crc32c(0, &seq, sizeof(seq));
+	crc = eeprom_crc32c(crc, h, offsetof(rec_header, crc));
+	crc = eeprom_crc32c(crc, key, h->key_len);
+	return eeprom_crc32c(crc, val, h->val_len);
+}
+
+/**
+ Read a record: header, then key and value into the scratch buffer.
+ \return True if there is a valid record at off.
+ */
+static bool read_record(eeprom_kv_t *kv, const uint32_t off, rec_header *h) {
+	const uint32_t end = (seg_of(kv, off) + 1) * kv->seg_sz;
+	if (off + REC_HDR_SZ > end || read_at(kv, off, h, REC_HDR_SZ) != REC_HDR_SZ)
+		return false;
+	const uint32_t len = h->key_len + h->val_len;
+	if (h->key_len == 0 || h->key_len == KEY_FREE || off + REC_HDR_SZ + len > end)
+		return false;
+	if (len > 0 && read_at(kv, off + REC_HDR_SZ, kv->scratch, len) != len)
+		return false;
+	return h->crc == rec_crc(kv->seq[seg_of(kv, off)], h, kv->scratch, kv->scratch + h->key_len);
+}
+
+//-------
+// Index
+//-------
+
+/**
+ Find the slot of a key, reading the keys of the records with the same hash
+ from the EEPROM to compare them.
+ \return Slot of the key, or empty slot where it would go.
+ */
+static uint32_t find(eeprom_kv_t *kv, const uint8_t *key, const uint8_t key_len, const uint32_t hash) {
+	const uint32_t mask = kv->capacity - 1;
+	uint8_t stored[EEPROM_KV_MAX_KEY];
+	uint32_t i = hash & mask;
+	for (; kv->index[i].off != NO_RECORD; i = (i + 1) & mask) {
+		const entry *x = &kv->index[i];
+		if (x->hash == hash && x->key_len == key_len &&
+				read_at(kv, x->off + REC_HDR_SZ, stored, key_len) == key_len &&
+				memcmp(stored, key, key_len) == 0)
+			break;
+	}
+	return i;
+}
+
+/**
+ Find the slot of a record, from the hash of its key.
+ \return Slot, NO_RECORD if the record is not the latest of its key.
+ */
+static uint32_t find_record(const eeprom_kv_t *kv, const uint32_t off, const uint32_t hash) {
+	const uint32_t mask = kv->capacity - 1;
+	for (uint32_t i = hash & mask; kv->index[i].off != NO_RECORD; i = (i + 1) & mask)
+		if (kv->index[i].off == off)
+			return i;
+	return NO_RECORD;
+}
+
+/**
+ Empty a slot, moving back the entries after it that would not be found
+ anymore (no tombstones in the index).
+ */
+static void remove_slot(eeprom_kv_t *kv, uint32_t i) {
+	const uint32_t mask = kv->capacity - 1;
+	kv->index[i].off = NO_RECORD;
+	for (uint32_t j = (i + 1) & mask; kv->index[j].off != NO_RECORD; j = (j + 1) & mask) {
+		const uint32_t k = kv->index[j].hash & mask;  // Where it belongs
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			kv->index[i] = kv->index[j];
+			kv->index[j].off = NO_RECORD;
+			i = j;
+		}
+	}
+	kv->stats.keys--;
+}
+
+/**
+ Make room for one more key, at most 70% of the slots used.
+ \return False on allocation failure.
+ */
+static bool reserve_slot(eeprom_kv_t *kv) {
+	if ((uint64_t)(kv->stats.keys + 1) * 10 <= (uint64_t)kv->capacity * 7)
+		return true;
+	const uint32_t capacity = kv->capacity * 2;
+	entry *index = (entry *)malloc(capacity * sizeof(entry));
+	if (!index)
+		return false;
+	for (uint32_t i = 0; i < capacity; i++)
+		index[i].off = NO_RECORD;
+	for (uint32_t i = 0; i < kv->capacity; i++) {
+		if (kv->index[i].off == NO_RECORD)
+			continue;
+		uint32_t j = kv->index[i].hash & (capacity - 1);
+		while (index[j].off != NO_RECORD)
+			j = (j + 1) & (capacity - 1);
+		index[j] = kv->index[i];
+	}
+	free(kv->index);
+	kv->index = index;
+	kv->capacity = capacity;
+	return true;
+}
+
+/**
+ Point a key to a new record (or a removed key nowhere), keeping the live
+ bytes of the segments.
+ \param[in] slot From find().
+ \param[in] off New record, NO_RECORD to remove the key.
+ */
+static void set_key(eeprom_kv_t *kv, const uint32_t slot, const uint32_t hash, const uint32_t off,
+			const uint8_t key_len, const uint16_t val_len) {
+	entry *x = &kv->index[slot];
+	if (x->off != NO_RECORD) {
+		kv->live[seg_of(kv, x->off)] -= rec_size(kv, x->key_len, x->val_len);
+		kv->stats.live_bytes -= rec_size(kv, x->key_len, x->val_len);
+	}
+	if (off == NO_RECORD) {
+		if (x->off != NO_RECORD)
+			remove_slot(kv, slot);
+		return;
+	}
+	if (x->off == NO_RECORD)
+		kv->stats.keys++;
+	x->hash = hash;
+	x->off = off;
+	x->key_len = key_len;
+	x->val_len = val_len;
+	kv->live[seg_of(kv, off)] += rec_size(kv, key_len, val_len);
+	kv->stats.live_bytes += rec_size(kv, key_len, val_len);
+}
+
+//-----
+// Log
+//-----
+
+/**
+ Start appending to a free segment.
+ */
+static void open_segment(eeprom_kv_t *kv, const uint32_t s) {
+	const seg_header h = {SEG_MAGIC, ++kv->last_seq};
+	write_at(kv, s * kv->seg_sz, &h, SEG_HDR_SZ);
+	kv->stats.written_bytes += SEG_HDR_SZ;
+	kv->seq[s] = h.seq;
+	kv->live[s] = 0;
+	kv->used++;
+	kv->head = s;
+	kv->head_pos = SEG_HDR_SZ;
+}
+
+/**
+ Next free segment after the head, in circular order: segments are used in
+ turn, so is the wear.
+ \return Segment, n_segs if none.
+ */
+static uint32_t next_free(const eeprom_kv_t *kv) {
+	for (uint32_t i = 1; i <= kv->n_segs; i++) {
+		const uint32_t s = (kv->head + i) % kv->n_segs;
+		if (kv->seq[s] == 0)
+			return s;
+	}
+	return kv->n_segs;
+}
+
+/**
+ Append a record to the head segment, which must have room for it, with a
+ single EEPROM write.
+ \return Record offset.
+ */
+static uint32_t append(eeprom_kv_t *kv, const uint8_t flags, const uint8_t *key, const uint8_t key_len,
+			const uint8_t *val, const uint16_t val_len) {
+	uint8_t *rec = kv->scratch;
+	rec_header h = {key_len, flags, val_len, 0};
+	if (val_len)  // Tombstones have no value
+		memmove(rec + REC_HDR_SZ + key_len, val, val_len);  // May be in scratch already
+	memmove(rec + REC_HDR_SZ, key, key_len);
+	h.crc = rec_crc(kv->seq[kv->head], &h, rec + REC_HDR_SZ, rec + REC_HDR_SZ + key_len);
+	memcpy(rec, &h, REC_HDR_SZ);
+	const uint32_t off = kv->head * kv->seg_sz + kv->head_pos, size = rec_size(kv, key_len, val_len);
+	write_at(kv, off, rec, size);
+	kv->head_pos += size;
+	kv->stats.written_bytes += size;
+	return off;
+}
+
+/**
+ Free the oldest segment: copy its live records to the head, then erase its
+ first page (header), the rest is left as is.
+ \return False if there is nothing older than the head, or no room to copy.
+ */
+static bool compact(eeprom_kv_t *kv) {
+	uint32_t tail = kv->n_segs;
+	for (uint32_t s = 0; s < kv->n_segs; s++)
+		if (kv->seq[s] != 0 && (tail == kv->n_segs || kv->seq[s] < kv->seq[tail]))
+			tail = s;
+	if (tail == kv->head)
+		return false;
+	rec_header h;
+	for (uint32_t pos = SEG_HDR_SZ; read_record(kv, tail * kv->seg_sz + pos, &h); ) {
+		const uint32_t off = tail * kv->seg_sz + pos, size = rec_size(kv, h.key_len, h.val_len);
+		pos += size;
+
+		// Tombstones go: nothing older than the tail to hide
+		const uint32_t hash = eeprom_crc32c(0, kv->scratch, h.key_len);
+		const uint32_t slot = (h.flags & REC_TOMBSTONE) ? NO_RECORD : find_record(kv, off, hash);
+		if (slot == NO_RECORD)
+			continue;
+		if (kv->head_pos + size > kv->seg_sz) {
+			const uint32_t s = next_free(kv);
+			if (s == kv->n_segs)
+				return false;
+			open_segment(kv, s);
+		}
+		const uint32_t copy = append(kv, h.flags, kv->scratch, h.key_len, kv->scratch + h.key_len, h.val_len);
+		set_key(kv, slot, hash, copy, h.key_len, h.val_len);
+	}
+	eeprom_dev_erase_page(kv->e, tail * kv->seg_sz / kv->page_sz);
+	kv->stats.erased_pages++;
+	kv->stats.written_bytes += kv->page_sz;
+	kv->stats.compactions++;
+	kv->seq[tail] = 0;
+	kv->used--;
+	return true;
+}
+
+/**
+ Make room for a record in the head segment, moving to the next segment if
+ needed. One free segment is kept in reserve, for compaction to copy to.
+ \return False if the store is full.
+ */
+static bool make_room(eeprom_kv_t *kv, const uint32_t size) {
+	for (uint32_t tries = 0; kv->head_pos + size > kv->seg_sz; ) {
+		while (kv->n_segs - kv->used <= 1)
+			if (tries++ >= kv->n_segs || !compact(kv))
+				return false;
+		if (kv->head_pos + size > kv->seg_sz)
+			open_segment(kv, next_free(kv));
+	}
+	return true;
+}
+
+//-------
+// Mount
+//-------
+
+/**
+ Apply the records of a segment to the index, in order.
+ \return Position after the last valid record.
+ */
+static uint32_t replay(eeprom_kv_t *kv, const uint32_t s) {
+	uint32_t pos = SEG_HDR_SZ;
+	rec_header h;
+	while (read_record(kv, s * kv->seg_sz + pos, &h)) {
+		const uint32_t hash = eeprom_crc32c(0, kv->scratch, h.key_len);
+		if (!reserve_slot(kv))
+			break;
+		const uint32_t slot = find(kv, kv->scratch, h.key_len, hash);
+		const bool removed = h.flags & REC_TOMBSTONE;
+		set_key(kv, slot, hash, removed ? NO_RECORD : s * kv->seg_sz + pos, h.key_len, h.val_len);
+		pos += rec_size(kv, h.key_len, h.val_len);
+	}
+	return pos;
+}
+
+eeprom_kv_t *eeprom_kv_mount(eeprom_t *e, const uint32_t seg_sz) {
+	const eeprom_geometry geo = eeprom_dev_geometry(e);
+	const uint32_t size = eeprom_dev_size(e);
+	if (REC_HDR_SZ % geo.word_sz != 0 || seg_sz < SEG_HDR_SZ + REC_HDR_SZ + geo.word_sz ||
+			seg_sz % geo.page_sz != 0 || size % seg_sz != 0 || size / seg_sz < 3)
+		return NULL;
+	eeprom_kv_t *kv = (eeprom_kv_t *)calloc(1, sizeof(eeprom_kv_t));
+	if (!kv)
+		return NULL;
+	kv->e = e;
+	kv->seg_sz = seg_sz;
+	kv->n_segs = size / seg_sz;
+	kv->page_sz = geo.page_sz;
+	kv->word_sz = geo.word_sz;
+
+	// Room for the live records in all segments but the reserve and one more:
+	// the slack for partly filled segments and tombstones, so that a full
+	// store can still remove keys
+	kv->capacity_bytes = (kv->n_segs - 2) * (seg_sz - SEG_HDR_SZ);
+	kv->seq = (uint32_t *)calloc(kv->n_segs, sizeof(uint32_t));
+	kv->live = (uint32_t *)calloc(kv->n_segs, sizeof(uint32_t));
+	kv->capacity = 64;
+	kv->index = (entry *)malloc(kv->capacity * sizeof(entry));
+	kv->scratch = (uint8_t *)malloc(seg_sz);
+	uint32_t *order = (uint32_t *)malloc(kv->n_segs * sizeof(uint32_t));
+	if (!kv->seq || !kv->live || !kv->index || !kv->scratch || !order) {
+		free(order);
+		eeprom_kv_unmount(kv);
+		return NULL;
+	}
+	pthread_mutex_init(&kv->mutex, NULL);
+	for (uint32_t i = 0; i < kv->capacity; i++)
+		kv->index[i].off = NO_RECORD;
+
+	// Segments in use, oldest first
+	for (uint32_t s = 0; s < kv->n_segs; s++) {
+		seg_header h;
+		if (read_at(kv, s * seg_sz, &h, SEG_HDR_SZ) == SEG_HDR_SZ &&
+				h.magic == SEG_MAGIC && h.seq != 0) {
+			kv->seq[s] = h.seq;
+			order[kv->used++] = s;
+		}
+	}
+	for (uint32_t i = 1; i < kv->used; i++)  // Few segments: insertion sort
+		for (uint32_t j = i; j > 0 && kv->seq[order[j - 1]] > kv->seq[order[j]]; j--) {
+			const uint32_t s = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = s;
+		}
+
+	// Replay them: the newest record of a key wins
+	for (uint32_t i = 0; i < kv->used; i++) {
+		const uint32_t pos = replay(kv, order[i]);
+		kv->head = order[i];
+		kv->head_pos = pos;
+		kv->last_seq = kv->seq[order[i]];
+	}
+	if (kv->used == 0) {
+		kv->head = kv->n_segs - 1;
+		open_segment(kv, 0);
+	}
+	free(order);
+	kv->stats.written_bytes = 0;
+	return kv;
+}
+
+void eeprom_kv_unmount(eeprom_kv_t *kv) {
+	if (!kv)
+		return;
+	if (kv->index)
+		pthread_mutex_destroy(&kv->mutex);
+	free(kv->seq);
+	free(kv->live);
+	free(kv->index);
+	free(kv->scratch);
+	free(kv);
+}
+
+//------------
+// Operations
+//------------
+
+bool eeprom_kv_put(eeprom_kv_t *kv, const void *key, const uint8_t key_len, const void *val,
+			const uint16_t val_len) {
+	const uint32_t size = rec_size(kv, key_len, val_len);
+	if (key_len == 0 || key_len > EEPROM_KV_MAX_KEY || val_len > EEPROM_KV_MAX_VALUE ||
+			size > kv->seg_sz - SEG_HDR_SZ)
+		return false;
+	const uint32_t hash = eeprom_crc32c(0, key, key_len);
+	pthread_mutex_lock(&kv->mutex);
+	const uint32_t slot = find(kv, (const uint8_t *)key, key_len, hash);
+	const uint32_t old = (kv->index[slot].off == NO_RECORD) ? 0 :
+			rec_size(kv, kv->index[slot].key_len, kv->index[slot].val_len);
+	bool ok = kv->stats.live_bytes - old + size <= kv->capacity_bytes && reserve_slot(kv) && make_room(kv, size);
+	if (ok) {
+		const uint32_t off = append(kv, 0, (const uint8_t *)key, key_len, (const uint8_t *)val, val_len);
+		set_key(kv, find(kv, (const uint8_t *)key, key_len, hash), hash, off, key_len, val_len);
+		kv->stats.user_bytes += key_len + val_len;
+	}
+	pthread_mutex_unlock(&kv->mutex);
+	return ok;
+}
+
+bool eeprom_kv_get(eeprom_kv_t *kv, const void *key, const uint8_t key_len, void *val,
+			uint16_t *val_len) {
+	const uint32_t hash = eeprom_crc32c(0, key, key_len);
+	bool found = false, ok = false;
+	pthread_mutex_lock(&kv->mutex);
+	const uint32_t mask = kv->capacity - 1;
+
+	// Key and value in one read, the key compared from there
+	for (uint32_t i = hash & mask; !found && kv->index[i].off != NO_RECORD; i = (i + 1) & mask) {
+		const entry *x = &kv->index[i];
+		const uint32_t len = x->key_len + x->val_len;
+		if (x->hash != hash || x->key_len != key_len ||
+				read_at(kv, x->off + REC_HDR_SZ, kv->scratch, len) != len ||
+				memcmp(kv->scratch, key, key_len) != 0)
+			continue;
+		found = true;
+		ok = (x->val_len <= *val_len);
+		if (ok)
+			memcpy(val, kv->scratch + key_len, x->val_len);
+		*val_len = x->val_len;
+	}
+	pthread_mutex_unlock(&kv->mutex);
+	return ok;
+}
+
+bool eeprom_kv_del(eeprom_kv_t *kv, const void *key, const uint8_t key_len) {
+	if (key_len == 0 || key_len > EEPROM_KV_MAX_KEY)
+		return false;
+	const uint32_t hash = eeprom_crc32c(0, key, key_len);
+	pthread_mutex_lock(&kv->mutex);
+	bool ok = kv->index[find(kv, (const uint8_t *)key, key_len, hash)].off != NO_RECORD &&
+			make_room(kv, rec_size(kv, key_len, 0));
+	if (ok) {
+		append(kv, REC_TOMBSTONE, (const uint8_t *)key, key_len, NULL, 0);
+		set_key(kv, find(kv, (const uint8_t *)key, key_len, hash), hash, NO_RECORD, key_len, 0);
+	}
+	pthread_mutex_unlock(&kv->mutex);
+	return ok;
+}
+
+eeprom_kv_stats eeprom_kv_get_stats(eeprom_kv_t *kv) {
+	pthread_mutex_lock(&kv->mutex);
+	eeprom_kv_stats st = kv->stats;
+	st.free_bytes = kv->capacity_bytes - kv->stats.live_bytes;
+	pthread_mutex_unlock(&kv->mutex);
+	return st;
+}
@@ -0,0 +1,83 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#ifndef _EEPROM_KV_H
+#define _EEPROM_KV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eeprom.h"
+
+/*
+	Log-structured key-value store on an EEPROM instance.
+	The EEPROM is split in segments, used as a circular log: records are only
+	appended, at the head, and a RAM hash index maps each key to its latest
+	record. When space runs low, the live records of the oldest segment are
+	copied to the head, and the segment is freed by erasing its first page
+	only. Records and segment headers carry CRCs: the index is rebuilt at
+	mount, and a torn write loses the last record only.
+ */
+
+#define EEPROM_KV_MAX_KEY    254    // Bytes
+#define EEPROM_KV_MAX_VALUE  65534  // Bytes, also bounded by the segment size
+
+typedef struct eeprom_kv eeprom_kv_t;
+
+/**
+	Store counters, since mount.
+ */
+typedef struct {
+	uint32_t keys;
+	uint32_t live_bytes;     // Records of the keys, headers included
+	uint32_t free_bytes;     // Room left for live records: two segments are kept as slack
+	uint64_t user_bytes;     // Keys and values put
+	uint64_t written_bytes;  // Bytes written to the EEPROM: records, copies, headers
+	uint64_t compactions;    // Segments freed
+	uint64_t erased_pages;
+} eeprom_kv_stats;
+
+/**
+	Mount the store of an EEPROM instance: rebuild the index from its
+	segments, or start an empty store if there is none.
+	\param[in] e EEPROM instance, only accessed through the store until unmounted.
+	\param[in] seg_sz Segment size in bytes: a multiple of the page size,
+					dividing the EEPROM size, at least 3 segments.
+	\return Store, NULL if the segment size is invalid or on allocation failure.
+ */
+eeprom_kv_t *eeprom_kv_mount(eeprom_t *e, const uint32_t seg_sz);
+
+/**
+	Release the index. Nothing to flush: every put is already in the EEPROM.
+	\param[in] kv Store (NULL is ignored).
+ */
+void eeprom_kv_unmount(eeprom_kv_t *kv);
+
+/**
+	Set the value of a key: one record appended.
+	\param[in] key Key, 1 to EEPROM_KV_MAX_KEY bytes.
+	\param[in] val Value, up to EEPROM_KV_MAX_VALUE bytes, and to a segment
+					minus the headers.
+	\return True on success, false if the sizes are invalid or the store is full.
+ */
+bool eeprom_kv_put(eeprom_kv_t *kv, const void *key, const uint8_t key_len, const void *val,
+			const uint16_t val_len);
+
+/**
+	Get the value of a key: one EEPROM read.
+	\param[out] val Value (on success only).
+	\param[in,out] val_len Size of val in bytes; value size on return (if found).
+	\return True on success, false if not found, or if val is too small.
+ */
+bool eeprom_kv_get(eeprom_kv_t *kv, const void *key, const uint8_t key_len, void *val,
+			uint16_t *val_len);
+
+/**
+	Remove a key: one (tombstone) record appended.
+	\return True if the key was found and removed.
+ */
+bool eeprom_kv_del(eeprom_kv_t *kv, const void *key, const uint8_t key_len);
+
+eeprom_kv_stats eeprom_kv_get_stats(eeprom_kv_t *kv);
+
+#endif // _EEPROM_KV_H
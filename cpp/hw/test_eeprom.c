@@ -5,11 +5,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "eeprom.h"
+#include "eeprom_kv.h"
 
 #define TEST_AND_CHECK(function) printf("%s ", #function); \
 	if (!function()) { printf("FAILED\n"); return false; } printf("SUCCEEDED\n");
 #define TEST_FILE_NAME  "eeprom.txt"
+#define TEST_IMAGE_NAME "eeprom.img"
+#define TMP_FILE_NAME   "test_eeprom.tmp"
 
 // Test cases
 bool test_erase_eeprom(void);
@@ -18,6 +23,19 @@ bool test_read_write_pages(void);
 bool test_erase_page(void);
 bool test_addr_conversion(void);
 bool test_read_write(void);
+bool test_text_file(void);
+bool test_image_file(void);
+bool test_readv_writev(void);
+bool test_concurrent_readers(void);
+bool test_instances(void);
+bool test_flush(void);
+bool test_flusher(void);
+bool test_integrity(void);
+bool test_timing(void);
+bool test_kv(void);
+bool test_wear(void);
+bool test_trace(void);
+bool test_snapshot(void);
 
 // Test entry point
 bool test_eeprom(void) {
@@ -26,13 +44,29 @@ bool test_eeprom(void) {
 	TEST_AND_CHECK(test_read_write_words);
 	TEST_AND_CHECK(test_addr_conversion);
 	TEST_AND_CHECK(test_read_write);
+	TEST_AND_CHECK(test_text_file);
+	TEST_AND_CHECK(test_image_file);
+	TEST_AND_CHECK(test_readv_writev);
+	TEST_AND_CHECK(test_concurrent_readers);
+	TEST_AND_CHECK(test_instances);
+	TEST_AND_CHECK(test_flush);
+	TEST_AND_CHECK(test_flusher);
+	TEST_AND_CHECK(test_integrity);
+	TEST_AND_CHECK(test_timing);
+	TEST_AND_CHECK(test_kv);
+	TEST_AND_CHECK(test_wear);
+	TEST_AND_CHECK(test_trace);
+	TEST_AND_CHECK(test_snapshot);
 	return true;
 }
 
 int main(int argc, char *argv[]) {
-	printf("Reading file %s\n", TEST_FILE_NAME);
-	if (eeprom_from_file(TEST_FILE_NAME) != EEPROM_SZ)
-		fprintf(stderr, "Cannot read file, starting from blank EEPROM\n");
+	printf("Reading file %s\n", TEST_IMAGE_NAME);
+	if (eeprom_from_image(TEST_IMAGE_NAME) != EEPROM_SZ) {
+		printf("Importing file %s\n", TEST_FILE_NAME);
+		if (eeprom_from_file(TEST_FILE_NAME) != EEPROM_SZ)
+			fprintf(stderr, "Cannot read file, starting from blank EEPROM\n");
+	}
 
 	// REPL
 	char option = 0;
@@ -41,11 +75,13 @@ int main(int argc, char *argv[]) {
 	do {
 		printf("------------------------------------------\n");
 		printf(" e. Erase EEPROM or specific page (`e [0|page_no]`)\n");
-		printf(" l. Load EEPROM from file.\n");
+		printf(" l. Load EEPROM from image file.\n");
+		printf(" i. Import EEPROM from text file.\n");
 		printf(" p. Print entire EEPROM content\n");
 		printf(" t. Run unit tests (will erase EEPROM).\n");
 		printf(" q. Save and quit.\n");
-		printf(" s. Save EEPROM content to file.\n");
+		printf(" s. Save EEPROM content to image file.\n");
+		printf(" x. Export EEPROM content to text file.\n");
 		printf(" r. Read page or word from a given offset (`r [p|w|a] <off|len>`).\n");
 		printf(" w. Write page or word to a given offset (`w [p|w|a] <off|len> <hex>`).\n");
 		printf("Enter an option: ");
@@ -87,6 +123,11 @@ int main(int argc, char *argv[]) {
 			break;
 
 		case 'l':
+			if (eeprom_from_image(TEST_IMAGE_NAME) != EEPROM_SZ)
+				fprintf(stderr, "Cannot read EEPROM image %s", TEST_IMAGE_NAME);
+			break;
+
+		case 'i':
 			if (eeprom_from_file(TEST_FILE_NAME) != EEPROM_SZ)
 				fprintf(stderr, "Cannot read EEPROM file %s", TEST_FILE_NAME);
 			break;
@@ -177,6 +218,11 @@ int main(int argc, char *argv[]) {
 			break;
 
 		case 's':
+			if (eeprom_to_image(TEST_IMAGE_NAME) != EEPROM_SZ)
+				fprintf(stderr, "Cannot write EEPROM image %s", TEST_IMAGE_NAME);
+			break;
+
+		case 'x':
 			if (eeprom_to_file(TEST_FILE_NAME) != EEPROM_SZ)
 				fprintf(stderr, "Cannot write EEPROM file %s", TEST_FILE_NAME);
 			break;
@@ -196,9 +242,9 @@ int main(int argc, char *argv[]) {
 	} while (option != 'q');
 
 	// Save before closing
-	printf("Writing file %s\n", TEST_FILE_NAME);
-	if (eeprom_to_file(TEST_FILE_NAME) != EEPROM_SZ) {
-		fprintf(stderr, "Cannot write EEPROM file!");
+	printf("Writing file %s\n", TEST_IMAGE_NAME);
+	if (eeprom_to_image(TEST_IMAGE_NAME) != EEPROM_SZ) {
+		fprintf(stderr, "Cannot write EEPROM image!");
 		return -1;
 	}
 	return 0;
@@ -423,3 +469,689 @@ bool test_read_write(void) {
 	free(buf);
 	return true;
 }
+
+// Fill the EEPROM with random bytes, keeping a copy.
+static bool fill_random(uint8_t *copy) {
+	for (uint32_t i = 0; i < EEPROM_SZ; i++)
+		copy[i] = rand() % 0x100;
+	return eeprom_write(0, copy, EEPROM_SZ) == EEPROM_SZ;
+}
+
+// Check the EEPROM content against a copy.
+static bool check_content(const uint8_t *copy) {
+	uint8_t *buf = (uint8_t *)malloc(EEPROM_SZ);
+	bool ok = (eeprom_read(0, buf, EEPROM_SZ) == EEPROM_SZ) && memcmp(buf, copy, EEPROM_SZ) == 0;
+	free(buf);
+	return ok;
+}
+
+// Export to text file, erase and import back.
+bool test_text_file(void) {
+	uint8_t *copy = (uint8_t *)malloc(EEPROM_SZ);
+	bool ok = fill_random(copy) && eeprom_to_file(TMP_FILE_NAME) == EEPROM_SZ &&
+			eeprom_erase() == EEPROM_SZ && eeprom_from_file(TMP_FILE_NAME) == EEPROM_SZ &&
+			check_content(copy);
+	free(copy);
+
+	// Upper case and single digits, CRLF, short page without CRC; pages not
+	// in the file or with a bad digit are erased, and parsing stops at an
+	// empty line
+	const eeprom_geometry geo = {64, 1, 16};
+	eeprom_t *e = eeprom_open(&geo);
+	uint8_t page[16], full[16];
+	FILE *fp = fopen(TMP_FILE_NAME, "w");
+	ok = ok && e && fp;
+	if (fp) {
+		fprintf(fp, "0 00,0g,\n1 A,b,FF,0,7\r\n2");
+		for (int i = 0; i < 16; i++) {
+			full[i] = (uint8_t)(i * 17);
+			fprintf(fp, " %02X,", full[i]);
+		}
+		fprintf(fp, " %08X\r\n\n3 00\n", eeprom_crc32c(0, full, 16));
+		fclose(fp);
+	}
+	memset(page, 0x5a, 16);
+	ok = ok && eeprom_dev_write_page(e, 3, page) == 16 && eeprom_dev_from_file(e, TMP_FILE_NAME) == 21;
+	ok = ok && eeprom_dev_read_page(e, 1, page) == 16 && page[0] == 0x0a && page[1] == 0x0b;
+	ok = ok && page[2] == 0xff && page[3] == 0 && page[4] == 7 && page[5] == EEPROM_ERASE_STATE;
+	ok = ok && eeprom_dev_read_page(e, 2, page) == 16 && !memcmp(page, full, 16);
+	ok = ok && eeprom_dev_read_page(e, 3, page) == 16 && page[0] == EEPROM_ERASE_STATE;
+	ok = ok && eeprom_dev_read_page(e, 0, page) == 16 && page[0] == EEPROM_ERASE_STATE;
+	ok = ok && eeprom_dev_check(e) == 0 && eeprom_dev_crc_errors(e) == 1;
+	eeprom_close(e);
+	remove(TMP_FILE_NAME);
+	return ok;
+}
+
+// Save to image file, erase and load back. Corrupted, truncated or missing
+// images must be rejected, leaving the EEPROM untouched.
+bool test_image_file(void) {
+	uint8_t *copy = (uint8_t *)malloc(EEPROM_SZ);
+	bool ok = fill_random(copy) && eeprom_to_image(TMP_FILE_NAME) == EEPROM_SZ &&
+			eeprom_erase() == EEPROM_SZ && eeprom_from_image(TMP_FILE_NAME) == EEPROM_SZ &&
+			check_content(copy);
+
+	// Flip one content byte
+	FILE *fp = fopen(TMP_FILE_NAME, "r+b");
+	if (ok && fp) {
+		uint8_t b = 0;
+		fseek(fp, -1, SEEK_END);
+		ok = fread(&b, 1, 1, fp) == 1;
+		b ^= 0x01;
+		fseek(fp, -1, SEEK_END);
+		ok = ok && fwrite(&b, 1, 1, fp) == 1;
+	}
+	if (fp)
+		fclose(fp);
+	ok = ok && eeprom_from_image(TMP_FILE_NAME) == 0 && check_content(copy);
+
+	// Truncate it
+	ok = ok && truncate(TMP_FILE_NAME, EEPROM_SZ) == 0;
+	ok = ok && eeprom_from_image(TMP_FILE_NAME) == 0 && check_content(copy);
+	remove(TMP_FILE_NAME);
+	ok = ok && eeprom_from_image(TMP_FILE_NAME) == 0 && check_content(copy);
+	free(copy);
+	return ok;
+}
+
+// Scatter/gather: all ranges or none.
+bool test_readv_writev(void) {
+	uint8_t *copy = (uint8_t *)malloc(EEPROM_SZ);
+	uint8_t a[5] = {1, 2, 3, 4, 5}, b[EEPROM_PAGE_SZ + 3], c[1] = {0xaa};
+	memset(b, 0x5a, sizeof(b));
+	eeprom_iovec w[3] = {{0, a, sizeof(a)}, {EEPROM_N_WORDS / 2 + 1, b, sizeof(b)},
+												{EEPROM_N_WORDS - 1, c, sizeof(c)}};
+	bool ok = fill_random(copy) && eeprom_writev(w, 3) == sizeof(a) + sizeof(b) + sizeof(c);
+	memcpy(copy, a, sizeof(a));
+	memcpy(copy + (EEPROM_N_WORDS / 2 + 1) * EEPROM_WORD_SZ, b, sizeof(b));
+	memcpy(copy + EEPROM_SZ - sizeof(c), c, sizeof(c));
+	ok = ok && check_content(copy);
+
+	// One bad range, nothing written (or read)
+	eeprom_iovec bad[2] = {{0, c, sizeof(c)}, {EEPROM_N_WORDS - 1, b, 2}};
+	ok = ok && eeprom_writev(bad, 2) == 0 && check_content(copy);
+	bad[1].len = 0;
+	ok = ok && eeprom_writev(bad, 2) == 0 && check_content(copy);
+	uint8_t r[sizeof(b)];
+	memset(r, 0, sizeof(r));
+	ok = ok && eeprom_readv(bad, 2) == 0 && c[0] == 0xaa;
+
+	// Read back
+	eeprom_iovec rv[2] = {{EEPROM_N_WORDS / 2 + 1, r, sizeof(r)}, {0, c, sizeof(c)}};
+	ok = ok && eeprom_readv(rv, 2) == sizeof(r) + sizeof(c);
+	ok = ok && memcmp(r, b, sizeof(b)) == 0 && c[0] == a[0];
+	free(copy);
+	return ok;
+}
+
+// Writer: the whole EEPROM, always filled with a single value.
+static void *uniform_writer(void *arg) {
+	uint8_t *buf = (uint8_t *)malloc(EEPROM_SZ);
+	for (uint32_t i = 0; i < 2000; i++) {
+		memset(buf, i % 0x100, EEPROM_SZ);
+		eeprom_write(0, buf, EEPROM_SZ);
+	}
+	free(buf);
+	return NULL;
+}
+
+// Reader: must never see two different values.
+static void *uniform_reader(void *arg) {
+	uint8_t *buf = (uint8_t *)malloc(EEPROM_SZ);
+	uint8_t head[1], tail[1];
+	eeprom_iovec iov[2] = {{0, head, 1}, {EEPROM_N_WORDS - 1, tail, 1}};
+	bool ok = true;
+	for (uint32_t i = 0; i < 2000 && ok; i++) {
+		ok = eeprom_read(0, buf, EEPROM_SZ) == EEPROM_SZ && buf[0] == buf[EEPROM_SZ / 2] &&
+				buf[0] == buf[EEPROM_SZ - 1] && eeprom_readv(iov, 2) == 2 && head[0] == tail[0];
+		for (uint32_t b = 0; ok && b < EEPROM_SZ; b++)
+			ok = buf[b] == buf[0];
+	}
+	free(buf);
+	*(bool *)arg = ok;
+	return NULL;
+}
+
+// Readers racing with a writer, in both lock modes: no torn read.
+bool test_concurrent_readers(void) {
+	const eeprom_lock_mode modes[2] = {EEPROM_LOCK_MUTEX, EEPROM_LOCK_SEQLOCK};
+	bool ok = true;
+	for (int m = 0; m < 2 && ok; m++) {
+		eeprom_set_lock_mode(modes[m]);
+		ok = eeprom_get_lock_mode() == modes[m] && eeprom_erase() == EEPROM_SZ;
+		pthread_t writer, readers[3];
+		bool reader_ok[3] = {false, false, false};
+		pthread_create(&writer, NULL, uniform_writer, NULL);
+		for (int r = 0; r < 3; r++)
+			pthread_create(&readers[r], NULL, uniform_reader, &reader_ok[r]);
+		pthread_join(writer, NULL);
+		for (int r = 0; r < 3; r++) {
+			pthread_join(readers[r], NULL);
+			ok = ok && reader_ok[r];
+		}
+	}
+	eeprom_set_lock_mode(EEPROM_LOCK_MUTEX);
+	return ok;
+}
+
+// Instances of different geometries: independent buffers, own bounds, and
+// images only loaded by instances of the same geometry.
+bool test_instances(void) {
+	const eeprom_geometry invalid[4] = {{0, 1, 4}, {100, 2, 3}, {100, 1, 8}, {0x80000000u, 4, 4}};
+	for (int i = 0; i < 4; i++)
+		if (eeprom_open(&invalid[i]) != NULL)
+			return false;
+	const eeprom_geometry ga = {1000, 2, 8}, gb = {300, 1, 3};
+	eeprom_t *a = eeprom_open(&ga), *b = eeprom_open(&gb), *c = eeprom_open(&ga);
+	bool ok = a && b && c && eeprom_dev_size(a) == 2000 && eeprom_dev_n_pages(a) == 250 &&
+			eeprom_dev_size(b) == 300 && eeprom_dev_n_pages(b) == 100 &&
+			eeprom_dev_geometry(b).page_sz == 3 && eeprom_default() != a;
+	ok = ok && eeprom_erase() == EEPROM_SZ;
+
+	// Words of 2 bytes, pages of 8 bytes
+	uint8_t word[2] = {0x12, 0x34}, page[8], back[8];
+	for (int i = 0; i < 8; i++)
+		page[i] = i;
+	ok = ok && eeprom_dev_write_word(a, 999, word) == 2 && eeprom_dev_write_word(a, 1000, word) == 0;
+	ok = ok && eeprom_dev_write_page(a, 3, page) == 8 && eeprom_dev_write_page(a, 250, page) == 0;
+	ok = ok && eeprom_dev_read(a, 12, back, 8) == 8 && memcmp(back, page, 8) == 0;
+	ok = ok && eeprom_dev_read(a, 999, back, 2) == 2 && memcmp(back, word, 2) == 0;
+	ok = ok && eeprom_dev_read(a, 999, back, 3) == 0;
+
+	// Other instances untouched
+	uint8_t byte = 0;
+	ok = ok && eeprom_dev_read_byte(b, 24, &byte) && byte == EEPROM_ERASE_STATE;
+	ok = ok && eeprom_dev_read_byte(c, 24, &byte) && byte == EEPROM_ERASE_STATE;
+	ok = ok && eeprom_read_byte(24, &byte) && byte == EEPROM_ERASE_STATE;
+	ok = ok && eeprom_dev_write_page(b, 99, page) == 3 && eeprom_dev_read_page(b, 99, back) == 3 &&
+			memcmp(back, page, 3) == 0 && eeprom_dev_read_byte(b, 300, &byte) == false;
+
+	// Images and text files, per geometry
+	ok = ok && eeprom_dev_to_image(a, TMP_FILE_NAME) == 2000;
+	ok = ok && eeprom_dev_from_image(b, TMP_FILE_NAME) == 0;
+	ok = ok && eeprom_dev_from_image(c, TMP_FILE_NAME) == 2000;
+	ok = ok && eeprom_dev_read_page(c, 3, back) == 8 && memcmp(back, page, 8) == 0;
+	ok = ok && eeprom_dev_to_file(b, TMP_FILE_NAME) == 300 && eeprom_dev_erase(b) == 300;
+	ok = ok && eeprom_dev_from_file(b, TMP_FILE_NAME) == 300;
+	ok = ok && eeprom_dev_read_page(b, 99, back) == 3 && memcmp(back, page, 3) == 0;
+	remove(TMP_FILE_NAME);
+	eeprom_close(a);
+	eeprom_close(b);
+	eeprom_close(c);
+	eeprom_close(eeprom_default());
+	return ok && eeprom_read_byte(24, &byte);
+}
+
+// Same content in two instances.
+static bool same_content(eeprom_t *a, eeprom_t *b) {
+	const uint32_t size = eeprom_dev_size(a);
+	uint8_t *x = (uint8_t *)malloc(size), *y = (uint8_t *)malloc(size);
+	bool ok = eeprom_dev_read(a, 0, x, size) == size && eeprom_dev_read(b, 0, y, size) == size &&
+			memcmp(x, y, size) == 0;
+	free(x);
+	free(y);
+	return ok;
+}
+
+// Incremental flushes: only dirty pages written, and the file always a valid
+// image of the content.
+bool test_flush(void) {
+	const eeprom_geometry geo = {4096, 1, 16};
+	eeprom_t *a = eeprom_open(&geo), *b = eeprom_open(&geo);
+	uint8_t buf[4096];
+	for (uint32_t i = 0; i < sizeof(buf); i++)
+		buf[i] = rand() % 0x100;
+	bool ok = a && b && eeprom_dev_flush(a, false) == 0 && eeprom_dev_write(a, 0, buf, 4096) == 4096;
+	ok = ok && eeprom_dev_dirty_pages(a) == 256 && eeprom_dev_attach(a, TMP_FILE_NAME);
+	ok = ok && eeprom_dev_dirty_pages(a) == 0 && eeprom_dev_flush(a, false) == 0;
+	ok = ok && eeprom_dev_from_image(b, TMP_FILE_NAME) == 4096 && same_content(a, b);
+
+	// Three pages: two bytes in page 0, one in page 100, page 255
+	ok = ok && eeprom_dev_write_byte(a, 1, 0x11) && eeprom_dev_write_byte(a, 15, 0x22);
+	ok = ok && eeprom_dev_write_word(a, 1605, buf) == 1 && eeprom_dev_erase_page(a, 255) == 16;
+	ok = ok && eeprom_dev_dirty_pages(a) == 3 && eeprom_dev_flush(a, true) == 3 * 16;
+	ok = ok && eeprom_dev_dirty_pages(a) == 0 && eeprom_dev_flush(a, false) == 0;
+	ok = ok && eeprom_dev_from_image(b, TMP_FILE_NAME) == 4096 && same_content(a, b);
+
+	// Random ranges, possibly across pages
+	for (int round = 0; ok && round < 50; round++) {
+		for (int w = 0; w < 5; w++) {
+			const uint32_t addr = rand() % 4000, len = 1 + rand() % 64;
+			ok = ok && eeprom_dev_write(a, addr, buf + rand() % 4000, len) == len;
+		}
+		ok = ok && eeprom_dev_flush(a, false) > 0;
+		ok = ok && eeprom_dev_from_image(b, TMP_FILE_NAME) == 4096 && same_content(a, b);
+	}
+
+	// Nothing more once detached
+	eeprom_dev_detach(a);
+	ok = ok && eeprom_dev_write_byte(a, 0, 0) && eeprom_dev_flush(a, false) == 0;
+	ok = ok && eeprom_dev_dirty_pages(a) == 1;
+	remove(TMP_FILE_NAME);
+	eeprom_close(a);
+	eeprom_close(b);
+	return ok;
+}
+
+// Wait up to a second for the flusher to write every dirty page.
+static bool flushed(eeprom_t *e) {
+	for (int i = 0; i < 1000 && eeprom_dev_dirty_pages(e) > 0; i++)
+		usleep(1000);
+	return eeprom_dev_dirty_pages(e) == 0;
+}
+
+// Background flusher: woken up by the dirty pages threshold, or by the
+// interval; sync barrier; clean shutdown.
+bool test_flusher(void) {
+	const eeprom_geometry geo = {4096, 1, 16};
+	eeprom_t *a = eeprom_open(&geo), *b = eeprom_open(&geo);
+	eeprom_flusher_config threshold = {0, 8, false}, interval = {10, 0, true}, none = {0, 0, false};
+	uint8_t buf[4096];
+	for (uint32_t i = 0; i < sizeof(buf); i++)
+		buf[i] = rand() % 0x100;
+	bool ok = a && b && !eeprom_dev_start_flusher(a, &threshold) && !eeprom_dev_sync(a);
+	ok = ok && eeprom_dev_attach(a, TMP_FILE_NAME) && !eeprom_dev_start_flusher(a, &none);
+
+	// Threshold only: 7 dirty pages stay in memory, the 8th triggers a flush
+	ok = ok && eeprom_dev_start_flusher(a, &threshold);
+	for (uint32_t p = 0; ok && p < 7; p++)
+		ok = eeprom_dev_write_page(a, p * 3, buf + p * 16) == 16;
+	usleep(20000);
+	ok = ok && eeprom_dev_dirty_pages(a) == 7 && eeprom_dev_write(a, 1000, buf, 10) == 10;
+	ok = ok && flushed(a) && eeprom_dev_from_image(b, TMP_FILE_NAME) == 4096 && same_content(a, b);
+
+	// Interval only, replacing the running flusher
+	ok = ok && eeprom_dev_start_flusher(a, &interval);
+	for (int round = 0; ok && round < 5; round++) {
+		ok = eeprom_dev_write_byte(a, rand() % 4096, rand() % 0x100) && flushed(a);
+		ok = ok && eeprom_dev_from_image(b, TMP_FILE_NAME) == 4096 && same_content(a, b);
+	}
+
+	// Sync barrier, while the flusher runs
+	for (int w = 0; ok && w < 100; w++) {
+		const uint32_t addr = rand() % 4000, len = 1 + rand() % 64;
+		ok = eeprom_dev_write(a, addr, buf + rand() % 4000, len) == len;
+	}
+	ok = ok && eeprom_dev_sync(a) && eeprom_dev_dirty_pages(a) == 0;
+	ok = ok && eeprom_dev_from_image(b, TMP_FILE_NAME) == 4096 && same_content(a, b);
+
+	// Clean shutdown: nothing left behind, even before the interval
+	const eeprom_flusher_config slow = {60000, 0, false};
+	ok = ok && eeprom_dev_start_flusher(a, &slow) && eeprom_dev_write(a, 0, buf, 4096) == 4096;
+	ok = ok && eeprom_dev_stop_flusher(a) && eeprom_dev_dirty_pages(a) == 0;
+	ok = ok && eeprom_dev_from_image(b, TMP_FILE_NAME) == 4096 && same_content(a, b);
+	ok = ok && !eeprom_dev_stop_flusher(a);
+
+	// Detaching stops the flusher
+	ok = ok && eeprom_dev_start_flusher(a, &interval);
+	eeprom_dev_detach(a);
+	ok = ok && eeprom_dev_write_byte(a, 0, 0) && !flushed(a);
+	remove(TMP_FILE_NAME);
+	eeprom_close(a);
+	eeprom_close(b);
+	return ok;
+}
+
+// Per-page CRCs: kept by writes, checked by scrubs, verified reads, and text
+// file loads.
+bool test_integrity(void) {
+	const eeprom_geometry geo = {4096, 1, 16};
+	eeprom_t *a = eeprom_open(&geo), *b = eeprom_open(&geo);
+	uint8_t buf[4096], page[16];
+	for (uint32_t i = 0; i < sizeof(buf); i++)
+		buf[i] = rand() % 0x100;
+	const char *check = "123456789";  // Check value of CRC32C: e3069283
+	bool ok = a && b && eeprom_crc32c(0, check, 9) == 0xe3069283;
+	ok = ok && eeprom_crc32c(eeprom_crc32c(0, check, 2), check + 2, 7) == 0xe3069283;
+	ok = ok && eeprom_dev_write(a, 0, buf, 4096) == 4096 && eeprom_dev_check(a) == 0;
+
+	// Fault in page 6: found by scrubs, and by reads if verified only
+	eeprom_dev_flip_bits(a, 100, 0x10);
+	ok = ok && eeprom_dev_check(a) == 1 && eeprom_dev_crc_errors(a) == 1;
+	ok = ok && eeprom_dev_read_page(a, 6, page) == 16 && page[4] == (buf[100] ^ 0x10);
+	eeprom_dev_set_verify(a, true);
+	uint8_t byte;
+	eeprom_iovec iov[2] = {{0, page, 16}, {90, page, 16}};
+	ok = ok && eeprom_dev_read_page(a, 6, page) == 0 && !eeprom_dev_read_byte(a, 100, &byte);
+	ok = ok && eeprom_dev_read(a, 90, page, 16) == 0 && eeprom_dev_readv(a, iov, 2) == 0;
+	ok = ok && eeprom_dev_read_page(a, 5, page) == 16 && eeprom_dev_read_byte(a, 95, &byte);
+	ok = ok && eeprom_dev_crc_errors(a) == 5;
+
+	// Saved with its stored CRC: the fault is found when loaded back
+	ok = ok && eeprom_dev_to_file(a, TMP_FILE_NAME) == 4096;
+	ok = ok && eeprom_dev_from_file(b, TMP_FILE_NAME) == 4096 - 16 && eeprom_dev_crc_errors(b) == 1;
+	ok = ok && eeprom_dev_read_page(b, 6, page) == 16 && page[0] == EEPROM_ERASE_STATE;
+
+	// Rewriting the page fixes it
+	ok = ok && eeprom_dev_write_page(a, 6, buf + 96) == 16 && eeprom_dev_check(a) == 0;
+	ok = ok && eeprom_dev_read_page(a, 6, page) == 16 && memcmp(page, buf + 96, 16) == 0;
+	ok = ok && eeprom_dev_to_file(a, TMP_FILE_NAME) == 4096;
+	ok = ok && eeprom_dev_from_file(b, TMP_FILE_NAME) == 4096 && same_content(a, b);
+
+	// Damaged text: a digit of page 10, a truncated page 20, no CRC for page 30
+	FILE *fp = fopen(TMP_FILE_NAME, "a");
+	ok = ok && fp;
+	if (fp) {
+		fprintf(fp, "10 %02x,%s\n", buf[160] ^ 1, "00, 12345678");
+		fprintf(fp, "20 00,01, %08x\n", eeprom_crc32c(0, "\x00\x01", 2));
+		fprintf(fp, "30");
+		for (int i = 0; i < 16; i++)
+			fprintf(fp, " %02x,", i);
+		fprintf(fp, "\n");
+		fclose(fp);
+	}
+	const uint32_t errors = eeprom_dev_crc_errors(b);
+	ok = ok && eeprom_dev_from_file(b, TMP_FILE_NAME) == 4096 + 16;
+	ok = ok && eeprom_dev_crc_errors(b) == errors + 2 && eeprom_dev_check(b) == 0;
+	ok = ok && eeprom_dev_read_page(b, 10, page) == 16 && page[0] == EEPROM_ERASE_STATE;
+	ok = ok && eeprom_dev_read_page(b, 20, page) == 16 && page[0] == EEPROM_ERASE_STATE;
+	ok = ok && eeprom_dev_read_page(b, 30, page) == 16 && page[15] == 15;
+
+	// Images carry no CRC, but their checksum: CRCs recomputed on load
+	ok = ok && eeprom_dev_to_image(a, TMP_FILE_NAME) == 4096;
+	ok = ok && eeprom_dev_from_image(b, TMP_FILE_NAME) == 4096 && eeprom_dev_check(b) == 0;
+	ok = ok && eeprom_dev_erase(a) == 4096 && eeprom_dev_check(a) == 0;
+	remove(TMP_FILE_NAME);
+	eeprom_close(a);
+	eeprom_close(b);
+	return ok;
+}
+
+// Timing model, on a bus at 100 kHz (10 us per bit), with 1-byte addresses:
+// a write of n bytes within a page is 9 * (2 + n) + 2 bits, then tWR.
+bool test_timing(void) {
+	const eeprom_geometry geo = {256, 1, 16};
+	const eeprom_timing timing = {5000, 100000, 1}, bad = {5000, 0, 1};
+	eeprom_t *e = eeprom_open(&geo);
+	uint8_t buf[32] = {0};
+	bool ok = e && !eeprom_dev_set_timing(e, &bad) && eeprom_dev_set_timing(e, &timing);
+
+	// Byte at a time: the second write waits for the write cycle of the first
+	ok = ok && eeprom_dev_write_byte(e, 3, 1) && eeprom_dev_write_byte(e, 4, 2);
+	eeprom_timing_stats st = eeprom_dev_timing_stats(e);
+	ok = ok && st.time_ns == 2 * (290000 + 5000000) && st.wait_ns == 5000000;
+	ok = ok && st.transactions == 2 && st.write_cycles == 2 && st.bus_bytes == 6;
+
+	// 32 bytes across 3 pages (8 + 16 + 8): 3 transactions, 3 write cycles
+	eeprom_dev_reset_timing_stats(e);
+	ok = ok && eeprom_dev_write(e, 8, buf, 32) == 32;
+	st = eeprom_dev_timing_stats(e);
+	ok = ok && st.transactions == 3 && st.write_cycles == 3 && st.bus_bytes == 32 + 3 * 2;
+	ok = ok && st.time_ns == (920000 + 1640000 + 920000) + 3 * 5000000ULL;
+
+	// Sequential read of the same bytes: one transaction, after the last write
+	// cycle; address, restart, device address again, then data
+	eeprom_dev_reset_timing_stats(e);
+	ok = ok && eeprom_dev_write_page(e, 0, buf) == 16 && eeprom_dev_read(e, 8, buf, 32) == 32;
+	st = eeprom_dev_timing_stats(e);
+	ok = ok && st.transactions == 2 && st.wait_ns == 5000000;
+	ok = ok && st.time_ns == 1640000 + 5000000 + (9 * 35 + 3) * 10000;
+
+	// A page, byte by byte, against a page write
+	eeprom_dev_reset_timing_stats(e);
+	for (uint32_t i = 0; ok && i < 16; i++)
+		ok = eeprom_dev_write_byte(e, 32 + i, i);
+	const uint64_t bytewise = eeprom_dev_timing_stats(e).time_ns;
+	eeprom_dev_reset_timing_stats(e);
+	ok = ok && eeprom_dev_write_page(e, 2, buf) == 16;
+	ok = ok && bytewise == 16 * 5290000ULL && eeprom_dev_timing_stats(e).time_ns == 6640000;
+
+	// Disabled: nothing counted
+	ok = ok && eeprom_dev_set_timing(e, NULL) && eeprom_dev_write_page(e, 2, buf) == 16;
+	ok = ok && eeprom_dev_timing_stats(e).time_ns == 0 && eeprom_dev_timing_stats(e).transactions == 0;
+	eeprom_close(e);
+	return ok;
+}
+
+// Values of the keys of the store, in RAM: -1 if removed
+#define KV_KEYS  24
+static bool kv_matches(eeprom_kv_t *kv, const int *values) {
+	bool ok = true;
+	for (int k = 0; ok && k < KV_KEYS; k++) {
+		char key[16];
+		int val = 0;
+		uint16_t len = sizeof(val);
+		snprintf(key, sizeof(key), "key%d", k);
+		const bool found = eeprom_kv_get(kv, key, strlen(key), &val, &len);
+		ok = (values[k] < 0) ? !found : (found && len == sizeof(val) && val == values[k]);
+	}
+	return ok;
+}
+
+bool test_kv(void) {
+	const eeprom_geometry geo = {4096, 1, 64};
+	eeprom_t *e = eeprom_open(&geo);
+	int values[KV_KEYS], val = 0;
+	uint16_t len = sizeof(val);
+	uint8_t before[4096], after[4096];
+	bool ok = e && !eeprom_kv_mount(e, 100) && !eeprom_kv_mount(e, 2048);
+	eeprom_kv_t *kv = eeprom_kv_mount(e, 512);
+	ok = ok && kv && eeprom_kv_get_stats(kv).keys == 0;
+
+	// Put, overwrite, get, remove
+	for (int k = 0; k < KV_KEYS; k++)
+		values[k] = -1;
+	ok = ok && eeprom_kv_put(kv, "key0", 4, &val, sizeof(val)) && !eeprom_kv_put(kv, "", 0, &val, 4);
+	values[0] = 0;
+	val = 7;
+	ok = ok && eeprom_kv_put(kv, "key1", 4, &val, sizeof(val));
+	values[1] = 7;
+	ok = ok && kv_matches(kv, values) && eeprom_kv_del(kv, "key0", 4) && !eeprom_kv_del(kv, "key0", 4);
+	values[0] = -1;
+	ok = ok && kv_matches(kv, values) && eeprom_kv_get_stats(kv).keys == 1;
+	len = 2;
+	ok = ok && !eeprom_kv_get(kv, "key1", 4, &val, &len) && len == sizeof(val);
+
+	// Churn: the oldest segments are compacted, the values stay
+	srand(46);
+	for (int i = 0; ok && i < 3000; i++) {
+		const int k = rand() % KV_KEYS;
+		char key[16];
+		snprintf(key, sizeof(key), "key%d", k);
+		if (rand() % 8 == 0) {
+			ok = (eeprom_kv_del(kv, key, strlen(key)) == (values[k] >= 0));
+			values[k] = -1;
+		} else {
+			val = i;
+			ok = eeprom_kv_put(kv, key, strlen(key), &val, sizeof(val));
+			values[k] = i;
+		}
+	}
+	eeprom_kv_stats st = eeprom_kv_get_stats(kv);
+	ok = ok && kv_matches(kv, values) && st.compactions > 0 && st.erased_pages == st.compactions;
+	ok = ok && st.written_bytes > st.user_bytes;
+
+	// Remount: the index is rebuilt from the segments
+	eeprom_kv_unmount(kv);
+	kv = eeprom_kv_mount(e, 512);
+	ok = ok && kv && kv_matches(kv, values) && eeprom_kv_get_stats(kv).keys == st.keys;
+	ok = ok && eeprom_kv_get_stats(kv).live_bytes == st.live_bytes;
+
+	// Torn write: the last record loses its last byte, the key its last value
+	values[2] = 1000;
+	ok = ok && eeprom_kv_put(kv, "key2", 4, &values[2], sizeof(val));
+	ok = ok && eeprom_dev_read(e, 0, before, sizeof(before)) == sizeof(before);
+	val = 2000;
+	ok = ok && eeprom_kv_put(kv, "key2", 4, &val, sizeof(val));
+	ok = ok && eeprom_dev_read(e, 0, after, sizeof(after)) == sizeof(after);
+	uint32_t last = sizeof(after);
+	while (last > 0 && before[last - 1] == after[last - 1])
+		last--;
+	ok = ok && last > 0 && eeprom_dev_write(e, last - 1, &before[last - 1], 1) == 1;
+	eeprom_kv_unmount(kv);
+	kv = eeprom_kv_mount(e, 512);
+	ok = ok && kv && kv_matches(kv, values);
+	val = 3000;
+	values[2] = 3000;
+	ok = ok && eeprom_kv_put(kv, "key2", 4, &val, sizeof(val)) && kv_matches(kv, values);
+
+	// Full store: puts fail, removing a key makes room again
+	uint8_t big[200] = {0};
+	int n = 0;
+	for (char key[16]; ok; n++) {
+		snprintf(key, sizeof(key), "big%d", n);
+		if (!eeprom_kv_put(kv, key, strlen(key), big, sizeof(big)))
+			break;
+	}
+	st = eeprom_kv_get_stats(kv);
+	ok = ok && n > 5 && st.free_bytes < 8 + 5 + sizeof(big) && kv_matches(kv, values);
+	ok = ok && !eeprom_kv_put(kv, "big", 3, big, sizeof(big)) && eeprom_kv_del(kv, "big0", 4);
+	ok = ok && eeprom_kv_put(kv, "big", 3, big, sizeof(big)) && kv_matches(kv, values);
+	len = sizeof(big);
+	ok = ok && eeprom_kv_get(kv, "big1", 4, big, &len) && len == sizeof(big);
+	eeprom_kv_unmount(kv);
+	eeprom_close(e);
+	return ok;
+}
+
+bool test_wear(void) {
+	const eeprom_geometry geo = {1024, 1, 64};  // 16 pages
+	eeprom_t *e = eeprom_open(&geo);
+	uint8_t page[64] = {0}, copy[64];
+	uint32_t bins[4];
+	bool ok = (e != NULL);
+
+	// A cycle per page touched, whatever the size
+	for (int i = 0; ok && i < 10; i++)
+		ok = eeprom_dev_write_page(e, 3, page) == 64;
+	ok = ok && eeprom_dev_write_byte(e, 4 * 64 + 5, 1) && eeprom_dev_write(e, 5 * 64 + 60, page, 8) == 8;
+	ok = ok && eeprom_dev_erase_page(e, 7) == 64 && eeprom_dev_erase(e) == 1024;
+	eeprom_wear_stats st = eeprom_dev_wear_stats(e);
+	ok = ok && st.writes == 13 && st.erases == 17 && st.max_page == 3 && st.max_cycles == 11;
+	ok = ok && st.min_cycles == 1 && st.swaps == 0;
+	ok = ok && eeprom_dev_page_wear(e, 6) == 2 && eeprom_dev_page_wear(e, 7) == 2 && eeprom_dev_page_wear(e, 8) == 1;
+	ok = ok && eeprom_dev_wear_histogram(e, bins, 4) == 3 && bins[0] == 15 && bins[1] == 0 && bins[3] == 1;
+
+	// Leveling: a single hot page wears them all evenly, its content stays
+	eeprom_dev_reset_wear(e);
+	ok = ok && eeprom_dev_set_wear_leveling(e, 8) && eeprom_dev_write_page(e, 0, page) == 64;
+	for (int i = 0; ok && i < 1000; i++) {
+		page[0] = (uint8_t)i;
+		ok = eeprom_dev_write_page(e, 0, page) == 64;
+	}
+	st = eeprom_dev_wear_stats(e);
+	ok = ok && st.swaps > 0 && st.max_cycles <= st.min_cycles + 8 + 1 && st.min_cycles > 50;
+	ok = ok && st.writes == 1001 + 2 * st.swaps && eeprom_dev_physical_page(e, 0) != 0;
+	ok = ok && eeprom_dev_read_page(e, 0, copy) == 64 && !memcmp(copy, page, 64);
+
+	// Off: the mapping stays, no more remaps
+	const uint32_t phys = eeprom_dev_physical_page(e, 0);
+	ok = ok && eeprom_dev_set_wear_leveling(e, 0);
+	for (int i = 0; ok && i < 100; i++)
+		ok = eeprom_dev_write_page(e, 0, page) == 64;
+	ok = ok && eeprom_dev_wear_stats(e).swaps == st.swaps && eeprom_dev_physical_page(e, 0) == phys;
+	ok = ok && eeprom_dev_page_wear(e, phys) >= 100;
+	eeprom_close(e);
+	return ok;
+}
+
+static void *word_reader(void *arg) {
+	uint8_t word[1];
+	for (uint32_t i = 0; i < 100; i++)
+		eeprom_dev_read_word((eeprom_t *)arg, 512 + i, word);
+	return NULL;
+}
+
+bool test_trace(void) {
+	const eeprom_geometry geo = {1024, 1, 64};
+	eeprom_t *e = eeprom_open(&geo);
+	uint8_t buf[100] = {0};
+	eeprom_iovec iov[2] = {{700, buf, 10}, {900, buf, 20}};
+	eeprom_trace_event ev[256];
+	pthread_t reader;
+	bool ok = e && !eeprom_tracing();
+
+	// Two threads, vector accesses split
+	eeprom_trace_start();
+	ok = ok && eeprom_tracing() && eeprom_dev_write_page(e, 2, buf) == 64;
+	ok = ok && eeprom_dev_read(e, 10, buf, 100) == 100 && eeprom_dev_writev(e, iov, 2) == 30;
+	ok = ok && eeprom_dev_read_byte(e, 5, buf);
+	ok = ok && pthread_create(&reader, NULL, word_reader, e) == 0 && pthread_join(reader, NULL) == 0;
+	eeprom_trace_stop();
+	ok = ok && !eeprom_tracing() && eeprom_dev_write_page(e, 3, buf) == 64;  // Not traced
+	const uint32_t n = eeprom_trace_collect(ev, 256);
+	uint32_t words = 0, writev = 0;
+	for (uint32_t i = 0; ok && i < n; i++) {
+		ok = ev[i].dev != 0 && ev[i].page_sz == 64 && (i == 0 || ev[i].t_ns >= ev[i - 1].t_ns);
+		words += (ev[i].op == EEPROM_OP_READ_WORD && ev[i].len == 1 && ev[i].off >= 512);
+		writev += (ev[i].op == EEPROM_OP_WRITEV);
+		if (ev[i].op == EEPROM_OP_WRITE_PAGE)
+			ok = ev[i].off == 128 && ev[i].len == 64 && ev[i].thread != ev[n - 1].thread;
+		if (ev[i].op == EEPROM_OP_WRITEV && ev[i].off == 900)
+			ok = ev[i].len == 20 && ev[i].wait_ns == 0 && ev[i].hold_ns == 0;
+	}
+	ok = ok && n == 105 && words == 100 && writev == 2;
+
+	// File for trace_eeprom
+	eeprom_trace_header h = {0, 0, 0, 0};
+	FILE *f = NULL;
+	ok = ok && eeprom_trace_dump(TMP_FILE_NAME) == 105 && (f = fopen(TMP_FILE_NAME, "rb")) != NULL;
+	ok = ok && fread(&h, sizeof(h), 1, f) == 1 && h.magic == EEPROM_TRACE_MAGIC && h.n_events == 105;
+	if (f)
+		fclose(f);
+	remove(TMP_FILE_NAME);
+
+	// Restart: cleared, by each thread on its next event
+	eeprom_trace_start();
+	eeprom_trace_stop();
+	ok = ok && eeprom_trace_collect(ev, 256) == 0;
+	eeprom_trace_start();
+	ok = ok && eeprom_dev_read_byte(e, 5, buf);
+	eeprom_trace_stop();
+	ok = ok && eeprom_trace_collect(ev, 256) == 1 && ev[0].op == EEPROM_OP_READ_BYTE;
+	eeprom_close(e);
+	return ok;
+}
+
+static bool same_as(eeprom_t *e, const uint8_t *content) {
+	uint8_t buf[1024];
+	return eeprom_dev_read(e, 0, buf, 1024) == 1024 && !memcmp(buf, content, 1024);
+}
+
+bool test_snapshot(void) {
+	const eeprom_geometry geo = {1024, 1, 64};  // 16 pages
+	eeprom_t *e = eeprom_open(&geo);
+	uint8_t content[1024], page[64];
+	memset(page, 0x5a, 64);
+	for (int i = 0; i < 1024; i++)
+		content[i] = (uint8_t)(i * 7);
+	bool ok = e && eeprom_dev_write(e, 0, content, 1024) == 1024;
+	eeprom_dev_set_verify(e, true);
+
+	// Changed pages only, whatever the number of changes
+	eeprom_snapshot_t *s = eeprom_dev_snapshot(e), *s2 = NULL;
+	ok = ok && s && eeprom_restore(s) == 0;
+	ok = ok && eeprom_dev_write_page(e, 2, page) == 64 && eeprom_dev_write_byte(e, 5 * 64 + 3, 1);
+	ok = ok && eeprom_dev_write_byte(e, 5 * 64 + 4, 2) && eeprom_dev_write_page(e, 2, content) == 64;
+	const uint32_t dirty = eeprom_dev_dirty_pages(e);
+	ok = ok && eeprom_restore(s) == 2 && same_as(e, content) && eeprom_dev_dirty_pages(e) == dirty;
+	ok = ok && eeprom_dev_check(e) == 0 && eeprom_dev_crc_errors(e) == 0;
+
+	// Taken again on restore; faults rolled back too
+	eeprom_dev_flip_bits(e, 100, 0x10);
+	ok = ok && eeprom_dev_write_page(e, 3, page) == 64 && eeprom_restore(s) == 2 && same_as(e, content);
+
+	// Nested: restoring the older one releases the newer one
+	ok = ok && eeprom_dev_write_page(e, 1, page) == 64 && (s2 = eeprom_dev_snapshot(e)) != NULL;
+	ok = ok && eeprom_dev_write_page(e, 1, content) == 64 && eeprom_dev_write_page(e, 4, page) == 64;
+	ok = ok && eeprom_restore(s2) == 2 && eeprom_dev_write_page(e, 6, page) == 64;
+	ok = ok && eeprom_restore(s) == 2 && same_as(e, content);
+
+	// Releasing the newer one: its pages go to the older one
+	ok = ok && eeprom_dev_write_page(e, 0, page) == 64 && (s2 = eeprom_dev_snapshot(e)) != NULL;
+	ok = ok && eeprom_dev_write_page(e, 0, content) == 64 && eeprom_dev_write_page(e, 7, page) == 64;
+	eeprom_snapshot_release(s2);
+	ok = ok && eeprom_restore(s) == 2 && same_as(e, content);
+
+	// Erase, file loads
+	ok = ok && eeprom_dev_to_file(e, TMP_FILE_NAME) == 1024 && eeprom_dev_erase(e) == 1024;
+	ok = ok && eeprom_restore(s) == 16 && same_as(e, content);
+	ok = ok && eeprom_dev_write_page(e, 9, page) == 64 && eeprom_dev_from_file(e, TMP_FILE_NAME) == 1024;
+	ok = ok && eeprom_restore(s) == 16 && same_as(e, content);
+	remove(TMP_FILE_NAME);
+
+	// Closing releases the rest
+	ok = ok && eeprom_dev_snapshot(e) != NULL && eeprom_dev_write_page(e, 9, page) == 64;
+	eeprom_close(e);
+	return ok;
+}
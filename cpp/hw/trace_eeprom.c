@@ -0,0 +1,192 @@
+/*
+* Copyright (C) 2019 Giuliano Pasqualotto (github.com/giulianopa)
+* This code is licensed under MIT license (see LICENSE.txt for details)
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "eeprom.h"
+
+/*
+	Aggregate a trace written by eeprom_trace_dump(): hot pages, access sizes,
+	lock contention.
+	Usage: trace_eeprom <trace file> [number of hot pages to show]
+ */
+
+static const char *op_names[EEPROM_N_OPS] = {
+	"read_word", "write_word", "read_page", "write_page", "erase", "erase_page",
+	"read", "write", "readv", "writev", "read_byte", "write_byte"
+};
+
+static bool is_write(const uint8_t op) {
+	return op == EEPROM_OP_WRITE_WORD || op == EEPROM_OP_WRITE_PAGE || op == EEPROM_OP_ERASE ||
+			op == EEPROM_OP_ERASE_PAGE || op == EEPROM_OP_WRITE || op == EEPROM_OP_WRITEV ||
+			op == EEPROM_OP_WRITE_BYTE;
+}
+
+/**
+	Page touched by an access: instance and page in the key, writes in the low bit.
+ */
+static int compare_u64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+typedef struct {
+	uint32_t dev, page;
+	uint64_t reads, writes;
+} page_count;
+
+static int by_accesses(const void *a, const void *b) {
+	const page_count *x = (const page_count *)a, *y = (const page_count *)b;
+	const uint64_t nx = x->reads + x->writes, ny = y->reads + y->writes;
+	return (nx < ny) - (nx > ny);
+}
+
+static void hot_pages(const eeprom_trace_event *ev, const uint32_t n, const uint32_t top) {
+	uint64_t n_keys = 0;
+	for (uint32_t i = 0; i < n; i++)
+		n_keys += (ev[i].off + ev[i].len - 1) / ev[i].page_sz - ev[i].off / ev[i].page_sz + 1;
+	uint64_t *keys = (uint64_t *)malloc(n_keys * sizeof(uint64_t));
+	page_count *pages = (page_count *)malloc(n_keys * sizeof(page_count));
+	if (!keys || !pages) {
+		printf("Out of memory\n");
+		free(keys);
+		free(pages);
+		return;
+	}
+	uint64_t k = 0;
+	for (uint32_t i = 0; i < n; i++)
+		for (uint32_t p = ev[i].off / ev[i].page_sz; p <= (ev[i].off + ev[i].len - 1) / ev[i].page_sz; p++)
+			keys[k++] = ((uint64_t)ev[i].dev << 33) | ((uint64_t)p << 1) | is_write(ev[i].op);
+	qsort(keys, n_keys, sizeof(uint64_t), compare_u64);
+	uint32_t n_pages = 0;
+	for (uint64_t i = 0; i < n_keys; i++) {
+		if (n_pages == 0 || pages[n_pages - 1].dev != (keys[i] >> 33) ||
+				pages[n_pages - 1].page != ((keys[i] >> 1) & 0xffffffff)) {
+			page_count c = {(uint32_t)(keys[i] >> 33), (uint32_t)((keys[i] >> 1) & 0xffffffff), 0, 0};
+			pages[n_pages++] = c;
+		}
+		if (keys[i] & 1)
+			pages[n_pages - 1].writes++;
+		else
+			pages[n_pages - 1].reads++;
+	}
+	qsort(pages, n_pages, sizeof(page_count), by_accesses);
+	printf("\nHot pages (%u touched)\n", n_pages);
+	printf("  %8s %8s %12s %12s %8s\n", "instance", "page", "reads", "writes", "share");
+	for (uint32_t i = 0; i < n_pages && i < top; i++)
+		printf("  %8u %8u %12llu %12llu %7.2f%%\n", pages[i].dev, pages[i].page,
+					 (unsigned long long)pages[i].reads, (unsigned long long)pages[i].writes,
+					 100.0 * (pages[i].reads + pages[i].writes) / n_keys);
+	free(keys);
+	free(pages);
+}
+
+static void access_sizes(const eeprom_trace_event *ev, const uint32_t n) {
+	uint64_t bins[2][33] = {{0}};
+	for (uint32_t i = 0; i < n; i++)
+		bins[is_write(ev[i].op)][32 - __builtin_clz(ev[i].len)]++;  // len in [2^(b-1), 2^b)
+	printf("\nAccess sizes (bytes)\n");
+	printf("  %-16s %12s %12s\n", "size", "reads", "writes");
+	for (int b = 1; b < 33; b++) {
+		if (bins[0][b] == 0 && bins[1][b] == 0)
+			continue;
+		char range[32];
+		snprintf(range, sizeof(range), "%u-%u", 1U << (b - 1), (uint32_t)((1ULL << b) - 1));
+		printf("  %-16s %12llu %12llu\n", range, (unsigned long long)bins[0][b], (unsigned long long)bins[1][b]);
+	}
+}
+
+static int compare_u32(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void lock_contention(const eeprom_trace_event *ev, const uint32_t n) {
+	uint32_t *waits = (uint32_t *)malloc(n * sizeof(uint32_t));
+	uint32_t n_threads = 0;
+	for (uint32_t i = 0; i < n; i++)
+		n_threads = (ev[i].thread >= n_threads) ? (uint32_t)ev[i].thread + 1 : n_threads;
+	uint64_t *thread_ops = (uint64_t *)calloc(n_threads, sizeof(uint64_t));
+	uint64_t *thread_wait = (uint64_t *)calloc(n_threads, sizeof(uint64_t));
+	uint64_t *thread_hold = (uint64_t *)calloc(n_threads, sizeof(uint64_t));
+	if (!waits || !thread_ops || !thread_wait || !thread_hold) {
+		printf("Out of memory\n");
+	} else {
+		uint64_t wait = 0, hold = 0, contended = 0;
+		for (uint32_t i = 0; i < n; i++) {
+			waits[i] = ev[i].wait_ns;
+			wait += ev[i].wait_ns;
+			hold += ev[i].hold_ns;
+			contended += (ev[i].wait_ns >= 1000);
+			thread_ops[ev[i].thread]++;
+			thread_wait[ev[i].thread] += ev[i].wait_ns;
+			thread_hold[ev[i].thread] += ev[i].hold_ns;
+		}
+		qsort(waits, n, sizeof(uint32_t), compare_u32);
+		printf("\nLock: %.3f ms waiting, %.3f ms holding, %.2f%% of the accesses waited 1 us or more\n",
+					 wait / 1e6, hold / 1e6, 100.0 * contended / n);
+		printf("  wait (ns): p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n", waits[n / 2], waits[n * 9 / 10],
+					 waits[(uint32_t)(n * 0.99)], waits[(uint32_t)(n * 0.999)], waits[n - 1]);
+		printf("  %8s %12s %14s %14s\n", "thread", "accesses", "mean wait (ns)", "mean hold (ns)");
+		for (uint32_t t = 0; t < n_threads; t++)
+			if (thread_ops[t] > 0)
+				printf("  %8u %12llu %14.0f %14.0f\n", t, (unsigned long long)thread_ops[t],
+							 (double)thread_wait[t] / thread_ops[t], (double)thread_hold[t] / thread_ops[t]);
+	}
+	free(waits);
+	free(thread_ops);
+	free(thread_wait);
+	free(thread_hold);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s <trace file> [hot pages]\n", argv[0]);
+		return 1;
+	}
+	const uint32_t top = (argc > 2) ? (uint32_t)atoi(argv[2]) : 10;
+	FILE *f = fopen(argv[1], "rb");
+	eeprom_trace_header h;
+	if (!f || fread(&h, sizeof(h), 1, f) != 1 || h.magic != EEPROM_TRACE_MAGIC ||
+			h.version != EEPROM_TRACE_VERSION || h.event_sz != sizeof(eeprom_trace_event)) {
+		printf("Cannot read trace %s\n", argv[1]);
+		if (f)
+			fclose(f);
+		return 1;
+	}
+	eeprom_trace_event *ev = (eeprom_trace_event *)malloc((size_t)h.n_events * sizeof(eeprom_trace_event) + 1);
+	const bool ok = ev && fread(ev, sizeof(eeprom_trace_event), h.n_events, f) == h.n_events;
+	fclose(f);
+	if (!ok || h.n_events == 0) {
+		printf(ok ? "Empty trace\n" : "Truncated trace %s\n", argv[1]);
+		free(ev);
+		return !ok;
+	}
+
+	// Operations
+	const uint32_t n = h.n_events;
+	uint64_t count[EEPROM_N_OPS] = {0}, bytes[EEPROM_N_OPS] = {0}, wait[EEPROM_N_OPS] = {0};
+	for (uint32_t i = 0; i < n; i++) {
+		if (ev[i].op >= EEPROM_N_OPS || ev[i].len == 0 || ev[i].page_sz == 0) {
+			printf("Invalid event %u\n", i);
+			free(ev);
+			return 1;
+		}
+		count[ev[i].op]++;
+		bytes[ev[i].op] += ev[i].len;
+		wait[ev[i].op] += ev[i].wait_ns;
+	}
+	printf("%u events over %.3f ms\n", n, (ev[n - 1].t_ns - ev[0].t_ns) / 1e6);
+	printf("  %-12s %12s %14s %14s\n", "operation", "count", "bytes", "mean wait (ns)");
+	for (int op = 0; op < EEPROM_N_OPS; op++)
+		if (count[op] > 0)
+			printf("  %-12s %12llu %14llu %14.0f\n", op_names[op], (unsigned long long)count[op],
+						 (unsigned long long)bytes[op], (double)wait[op] / count[op]);
+	hot_pages(ev, n, top);
+	access_sizes(ev, n);
+	lock_contention(ev, n);
+	free(ev);
+	return 0;
+}